@@ -181,6 +181,34 @@ async def register_dicom(request) -> JSONResponse:
     return JSONResponse({"ok": ""})
 
 
+@router.post("/register-dicom-batch")
+@requires("authenticated")
+async def register_dicom_batch(request) -> JSONResponse:
+    """Endpoint for registering multiple received DICOM files with one call. Called by the getdcmtags module,
+    which queues the files and sends them in batches. Each entry can carry the time when the file was received
+    (as Unix timestamp), as entries may be delivered with delay if the bookkeeper was not reachable."""
+    payload = await request.json()
+    files = payload.get("files", [])
+    if not isinstance(files, list):
+        return JSONResponse({"error": "invalid payload"}, status_code=400)
+
+    values = []
+    for entry in files:
+        received = entry.get("time")
+        values.append(
+            dict(
+                filename=entry.get("filename", ""),
+                file_uid=entry.get("file_uid", ""),
+                series_uid=entry.get("series_uid", ""),
+                time=datetime.datetime.fromtimestamp(float(received)) if received else datetime.datetime.now(),
+            )
+        )
+    if values:
+        await db.database.execute_many(db.dicom_files.insert(), values)
+    logger.debug(f"Registered {len(values)} files")
+    return JSONResponse({"ok": "", "count": len(values)})
+
+
 async def parse_and_submit_tags(payload) -> None:
     """Helper function that reads series information from the request body."""
     query = db.dicom_series.insert().values(
@@ -21,6 +21,11 @@ class mercure_names:
     RUNNING = ".running"
     ERROR = ".error"
     TAGS = ".tags"
+    INDEX = ".index"
+    INDEX_BINARY = ".index.bin"
+    SERIES_EVENTS = ".series_events"
+    STUDY_ROLLUP = ".study_rollup"
+    ERROR_JOURNAL = ".error_journal"
     HALT = "HALT"
     TASKFILE = "task.json"
     SENDLOG = "sent.txt"
@@ -219,6 +219,23 @@ class ProcessingLogsConfig(BaseModel):
 
 class DicomReceiverConfig(BaseModel):
     additional_tags: Dict[str, str] = {}
+    daemon_mode: bool = False
+    series_index: Literal["off", "additional", "exclusive"] = "off"
+    series_index_format: Literal["json", "binary"] = "json"
+    series_events: bool = False
+    study_rollup: bool = False
+    durability: Literal["none", "file", "directory"] = "none"
+    duplicates: Literal["off", "drop", "replace", "flag"] = "off"
+    embedded_scp: bool = False
+    metrics_port: Optional[int] = None
+    admission_slots: int = 0
+    admission_timeout: int = 30
+    admission_rules: Dict[str, int] = {}
+    pixel_fingerprint: Literal["off", "fast", "sha256"] = "off"
+    transcode: Literal["off", "explicit-little", "implicit-little", "deflated"] = "off"
+    transcode_threads: int = 0
+    transcode_rules: List[str] = []
+    legacy_error_files: bool = False
 
 
 class DicomNodeBase(BaseModel):
@@ -64,6 +64,26 @@ bookkeeper=$(jq -r '.bookkeeper' $config)
 accept_compressed=$(jq -r '.accept_compressed_images' $config)
 bookkeeper_api_key=$(jq -r '.bookkeeper_api_key' $config)
 jq -r ".dicom_receiver.additional_tags // {} | keys_unsorted[]" $config > "./dcm_extra_tags" || (echo "Failed to parse and configure extra DICOM tags to read." && exit 1)
+# Resolve the extra tags once into the binary tag plan that getdcmtags maps for every received file.
+# getdcmtags also rebuilds the plan by itself if the tags do not match anymore.
+$binary --compile-tag-plan "./dcm_extra_tags" "./dcm_extra_tags.plan" || echo "WARNING: Unable to compile the extra DICOM tags into a tag plan."
+daemon_mode=$(jq -r '.dicom_receiver.daemon_mode // false' $config)
+series_index=$(jq -r '.dicom_receiver.series_index // "off"' $config)
+series_index_format=$(jq -r '.dicom_receiver.series_index_format // "json"' $config)
+series_events=$(jq -r '.dicom_receiver.series_events // false' $config)
+study_rollup=$(jq -r '.dicom_receiver.study_rollup // false' $config)
+durability=$(jq -r '.dicom_receiver.durability // "none"' $config)
+duplicates=$(jq -r '.dicom_receiver.duplicates // "off"' $config)
+embedded_scp=$(jq -r '.dicom_receiver.embedded_scp // false' $config)
+metrics_port=$(jq -r '.dicom_receiver.metrics_port // empty' $config)
+admission_slots=$(jq -r '.dicom_receiver.admission_slots // 0' $config)
+admission_timeout=$(jq -r '.dicom_receiver.admission_timeout // 30' $config)
+pixel_fingerprint=$(jq -r '.dicom_receiver.pixel_fingerprint // "off"' $config)
+transcode=$(jq -r '.dicom_receiver.transcode // "off"' $config)
+transcode_threads=$(jq -r '.dicom_receiver.transcode_threads // 0' $config)
+transcode_rules=$(jq -r '.dicom_receiver.transcode_rules // [] | .[] | " --transcode-rule \(.)"' $config | tr -d '\n')
+legacy_error_files=$(jq -r '.dicom_receiver.legacy_error_files // false' $config)
+admission_rules=$(jq -r '.dicom_receiver.admission_rules // {} | to_entries[] | " --admission-rule \(.key):\(.value)"' $config | tr -d '\n')
 
 # Check if incoming folder exists
 if [ ! -d "$incoming" ]; then
@@ -116,13 +136,136 @@ else
     bookkeeper_api_key=" $bookkeeper_api_key"
 fi
 
+# Options for getdcmtags, which are passed after the bookkeeper arguments
+receiver_options=""
+if [ "$series_index" = "additional" ] || [ "$series_index" = "exclusive" ]
+then
+    echo "Writing series index files ($series_index)"
+    receiver_options="$receiver_options --series-index $series_index"
+    if [ "$series_index_format" = "binary" ]
+    then
+        receiver_options="$receiver_options --series-index-format binary"
+    fi
+fi
+if [ "$series_events" = "true" ]
+then
+    echo "Writing series events for the router"
+    receiver_options="$receiver_options --series-events"
+fi
+if [ "$study_rollup" = "true" ]
+then
+    echo "Maintaining study rollup for the router"
+    receiver_options="$receiver_options --study-rollup"
+fi
+if [ "$durability" = "file" ] || [ "$durability" = "directory" ]
+then
+    echo "Flushing received files to disk ($durability)"
+    receiver_options="$receiver_options --durability $durability"
+fi
+if [ "$duplicates" = "drop" ] || [ "$duplicates" = "replace" ] || [ "$duplicates" = "flag" ]
+then
+    echo "Detecting duplicate instances ($duplicates)"
+    receiver_options="$receiver_options --duplicates $duplicates"
+fi
+if [ "$pixel_fingerprint" = "fast" ] || [ "$pixel_fingerprint" = "sha256" ]
+then
+    echo "Computing pixel data fingerprints ($pixel_fingerprint)"
+    receiver_options="$receiver_options --fingerprint $pixel_fingerprint"
+fi
+if [ "$transcode" = "explicit-little" ] || [ "$transcode" = "implicit-little" ] || [ "$transcode" = "deflated" ]
+then
+    echo "Converting received files to transfer syntax $transcode"
+    receiver_options="$receiver_options --transcode $transcode$transcode_rules"
+    if [ "$transcode_threads" -gt 0 ] 2>/dev/null
+    then
+        receiver_options="$receiver_options --transcode-threads $transcode_threads"
+    fi
+fi
+if [ "$legacy_error_files" = "true" ]
+then
+    echo "Writing .error files for failed images"
+    receiver_options="$receiver_options --legacy-error-files"
+fi
+if [ "$admission_slots" -gt 0 ] 2>/dev/null
+then
+    echo "Limiting concurrently placed files to $admission_slots"
+    receiver_options="$receiver_options --admission-slots $admission_slots --admission-timeout $admission_timeout$admission_rules"
+fi
+if [ -n "$receiver_options" ] && [ -z "$bookkeeper" ]
+then
+    # Keep the positions of the arguments if the bookkeeper is not configured
+    bookkeeper=' ""'
+    bookkeeper_api_key=' ""'
+fi
+
+# With the embedded SCP, getdcmtags receives the images itself and writes them straight into the
+# series folders, so that storescp and the per-file process start are not needed
+if [ "$embedded_scp" = "true" ]
+then
+    scp_options=""
+    if [ -n "$transfer_syntax_option" ]
+    then
+        scp_options="$scp_options --accept-compressed"
+    fi
+    if [ $MERCURE_TLS_ENABLED ]
+    then
+        echo "mercure has been configured for DICOM TLS. Starting in TLS mode."
+        scp_options="$scp_options --tls $MERCURE_TLS_KEY $MERCURE_TLS_CERT $MERCURE_TLS_CA_CERT"
+    fi
+    if [ -n "$metrics_port" ]
+    then
+        echo "Serving receiver metrics on port $metrics_port"
+        scp_options="$scp_options --metrics-port $metrics_port"
+    fi
+    if [ -z "$bookkeeper" ]
+    then
+        bookkeeper=' ""'
+        bookkeeper_api_key=' ""'
+    fi
+    echo ""
+    echo "Starting embedded receiver on port $port, folder $incoming, bookkeeper $bookkeeper"
+    # The arguments are evaluated by a shell in the same way as the storescp command below
+    eval exec "$binary --scp $port \"$incoming\"$bookkeeper$bookkeeper_api_key$receiver_options$scp_options $@"
+fi
+
+# In daemon mode, a persistent getdcmtags process handles all received files and storescp only
+# executes the lightweight client for every file
+receive_cmd="$binary"
+client_binary="$(dirname "$binary")/getdcmtags-client"
+if [ $daemon_mode = "true" ]
+then
+    if [[ -f "$client_binary" ]] ; then
+        daemon_socket="${MERCURE_RECEIVER_SOCKET:-/tmp/mercure_getdcmtags.sock}"
+        echo "Starting getdcmtags daemon on socket $daemon_socket"
+        daemon_options=""
+        if [ -n "$metrics_port" ]
+        then
+            echo "Serving receiver metrics on port $metrics_port"
+            daemon_options="--metrics-port $metrics_port"
+        fi
+        $binary --daemon "$daemon_socket" $daemon_options &
+        daemon_pid=$!
+        trap "kill $daemon_pid 2> /dev/null" EXIT
+        for i in $(seq 1 50); do
+            [ -S "$daemon_socket" ] && break
+            sleep 0.1
+        done
+        if [ ! -S "$daemon_socket" ]; then
+            echo "WARNING: getdcmtags daemon did not start. Clients will fall back to direct processing."
+        fi
+        receive_cmd="$client_binary $daemon_socket $binary"
+    else
+        echo "WARNING: Unable to locate getdcmtags client at '$client_binary'. Daemon mode disabled."
+    fi
+fi
+
 echo ""
 echo "Starting receiver process on port $port, folder $incoming, bookkeeper $bookkeeper"
 
 if [ $MERCURE_TLS_ENABLED ]
 then
     echo "mercure has been configured for DICOM TLS. Starting in TLS mode."
-    storescp +tls $MERCURE_TLS_KEY $MERCURE_TLS_CERT +cf $MERCURE_TLS_CA_CERT --fork --promiscuous $transfer_syntax_option -od "$incoming" +uf -xcr "$binary $incoming/#f #r #a #c$bookkeeper$bookkeeper_api_key $@" $port
+    storescp +tls $MERCURE_TLS_KEY $MERCURE_TLS_CERT +cf $MERCURE_TLS_CA_CERT --fork --promiscuous $transfer_syntax_option -od "$incoming" +uf -xcr "$receive_cmd $incoming/#f #r #a #c$bookkeeper$bookkeeper_api_key$receiver_options $@" $port
 else
-    storescp --fork --promiscuous $transfer_syntax_option -od "$incoming" +uf -xcr "$binary $incoming/#f #r #a #c$bookkeeper$bookkeeper_api_key $@" $port
+    storescp --fork --promiscuous $transfer_syntax_option -od "$incoming" +uf -xcr "$receive_cmd $incoming/#f #r #a #c$bookkeeper$bookkeeper_api_key$receiver_options $@" $port
 fi
@@ -0,0 +1,158 @@
+"""
+error_journal.py
+================
+Reader for the error journal that getdcmtags appends to in the incoming folder. Each received file that could not
+be processed is one fixed-size record, which names the file relative to the incoming folder (usually moved into the
+subfolder "error"). See getdcmtags/errorjournal.h for the layout. The router keeps the read position across runs
+and only reads the new records, so that failed files do not need to be found by scanning the incoming folder.
+"""
+
+# Standard python includes
+import os
+import struct
+import time
+from dataclasses import dataclass
+from pathlib import Path
+from typing import List, Optional
+
+# App-specific includes
+import common.config as config
+from common.constants import mercure_names
+
+logger = config.get_logger()
+
+RECORD_MAGIC = b"MERRJNL1"
+# magic, time, pid, flags, file, sender AET, sender address, message
+RECORD = struct.Struct("<8sQII256s24s64s656s")
+RECORD_MOVED = 1
+
+# Size at which the router starts a new journal
+ROTATE_SIZE = 4 * 1024 * 1024
+# The error folder is still scanned in this interval, to pick up error files of the previous format and failed
+# files whose record has been lost during a rotation
+RECONCILE_INTERVAL = 60
+
+
+@dataclass
+class ErrorRecord:
+    # Path of the failed file relative to the incoming folder
+    file: str
+    # Time of the failure (seconds since the epoch)
+    time: float
+    pid: int
+    # Set if getdcmtags has moved the file into the subfolder "error"
+    moved: bool
+    sender_aet: str
+    sender_address: str
+    message: str
+
+
+def _decode(value: bytes) -> str:
+    return value.split(b"\0", 1)[0].decode("utf-8", errors="replace")
+
+
+def _parse(data: bytes) -> List[ErrorRecord]:
+    records = []
+    for start in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        magic, timestamp, pid, flags, file, sender_aet, sender_address, message = RECORD.unpack_from(data, start)
+        if magic != RECORD_MAGIC:
+            logger.warning("Invalid record in error journal")
+            continue
+        records.append(
+            ErrorRecord(
+                _decode(file),
+                timestamp / 1000,
+                pid,
+                bool(flags & RECORD_MOVED),
+                _decode(sender_aet),
+                _decode(sender_address),
+                _decode(message),
+            )
+        )
+    return records
+
+
+class ErrorJournalReader:
+    def __init__(self, incoming_folder: str) -> None:
+        self.incoming_folder = Path(incoming_folder)
+        self.journal_path = self.incoming_folder / mercure_names.ERROR_JOURNAL
+        self.rotated_path = self.incoming_folder / (mercure_names.ERROR_JOURNAL + ".1")
+        self.offset = 0
+        self.last_reconcile = 0.0
+
+    def pending(self) -> bool:
+        """Returns True if records have been written since the last call of read()"""
+        if self.rotated_path.exists():
+            return True
+        try:
+            return self.journal_path.stat().st_size != self.offset
+        except FileNotFoundError:
+            return False
+
+    def read(self) -> List[ErrorRecord]:
+        """
+        Returns the records written since the last call. After a restart of the router, the whole journal is read
+        again, so the records can refer to files that have already been handled.
+        """
+        records: List[ErrorRecord] = []
+        if self.rotated_path.exists():
+            records += self._read_rotated()
+        records += self._read_journal()
+        self._rotate()
+        return records
+
+    def reconcile_due(self) -> bool:
+        """Returns True once per reconciliation interval"""
+        if time.time() - self.last_reconcile < RECONCILE_INTERVAL:
+            return False
+        self.last_reconcile = time.time()
+        return True
+
+    def _read_journal(self) -> List[ErrorRecord]:
+        try:
+            with open(self.journal_path, "rb") as journal:
+                if os.fstat(journal.fileno()).st_size < self.offset:
+                    # The journal has been replaced
+                    self.offset = 0
+                journal.seek(self.offset)
+                data = journal.read()
+        except FileNotFoundError:
+            return []
+        # A record that is still being written is read next time
+        complete = len(data) - len(data) % RECORD.size
+        self.offset += complete
+        return _parse(data[:complete])
+
+    def _rotate(self) -> None:
+        """
+        Starts a new journal once the current one is large. getdcmtags opens the journal for every record, so only
+        records that are written in the moment of the rename can end up in the old journal. These are read on the
+        next call, and files whose record is lost even so are found by the reconciliation scan.
+        """
+        if self.offset < ROTATE_SIZE:
+            return
+        try:
+            os.rename(self.journal_path, self.rotated_path)
+        except OSError:
+            logger.warning(f"Unable to rotate error journal {self.journal_path}")
+
+    def _read_rotated(self) -> List[ErrorRecord]:
+        # The rotated journal is not written anymore, so a trailing partial record will not be completed
+        with open(self.rotated_path, "rb") as journal:
+            journal.seek(self.offset)
+            data = journal.read()
+        if len(data) % RECORD.size:
+            logger.warning("Incomplete record in error journal")
+        self.rotated_path.unlink()
+        self.offset = 0
+        return _parse(data)
+
+
+reader: Optional[ErrorJournalReader] = None
+
+
+def get_reader() -> ErrorJournalReader:
+    global reader
+    if reader is None or reader.incoming_folder != Path(config.mercure.incoming_folder):
+        reader = ErrorJournalReader(config.mercure.incoming_folder)
+    return reader
@@ -8,9 +8,10 @@ import json
 # Standard python includes
 import os
 import shutil
+import time
 import typing
 from pathlib import Path
-from typing import Any, Callable, Dict, List, Tuple, Union
+from typing import Any, Callable, Dict, List, Optional, Tuple, Union
 
 # App-specific includes
 import common.config as config
@@ -21,8 +22,10 @@ import common.notification as notification
 import common.rule_evaluation as rule_evaluation
 from common.constants import mercure_actions, mercure_defs, mercure_events, mercure_names, mercure_options, mercure_rule
 from common.types import Rule
+import routing.error_journal as error_journal
 from routing.common import generate_task_id
 from routing.generate_taskfile import create_series_task, create_study_task, update_study_task
+from routing.series_index import SeriesIndex, has_series_index, read_series_index
 from typing_extensions import Literal
 
 # Create local logger instance
@@ -62,7 +65,20 @@ def route_series(task_id: str, series_UID: str, files: typing.List[Path] = []) -
     fileList = []
     seriesPrefix = series_UID + mercure_defs.SEPARATOR
 
+    # If getdcmtags maintains an index for the series, the files and tags are taken from there
+    index: Optional[SeriesIndex] = None
     if not files:
+        try:
+            index = read_series_index(base_dir, series_UID)
+        except Exception:
+            logger.exception(f"Invalid series index for series {series_UID}", task_id)  # handle_error
+            lock.free()
+            return
+
+    if index is not None:
+        fileList = index.files
+        logger.debug(f"Found files in series index: {len(fileList)}")
+    elif not files:
         # Collect all files belonging to the series
         for entry in os.scandir(base_dir):
             if entry.name.endswith(mercure_names.TAGS) and entry.name.startswith(seriesPrefix) and not entry.is_dir():
@@ -78,28 +94,33 @@ def route_series(task_id: str, series_UID: str, files: typing.List[Path] = []) -
         lock.free()
         return
 
-    # Use the tags file from the first slice for evaluating the routing rules
-    tagsMasterFile = base_dir / (fileList[0] + mercure_names.TAGS)
-    if not tagsMasterFile.exists():
-        logger.error(f"Missing file! {tagsMasterFile.name}", task_id)  # handle_error
-        lock.free()
-        return
-
     tagsList_encoding_error = False
-    try:
-        tagsList: Dict[str, str] = {}
+    tagsList: Dict[str, str] = {}
+    if index is not None:
+        # The header of the index contains the tags of the first received slice
+        tagsList = index.first_tags
+        tagsList_encoding_error = index.encoding_error
+    else:
+        # Use the tags file from the first slice for evaluating the routing rules
+        tagsMasterFile = base_dir / (fileList[0] + mercure_names.TAGS)
+        if not tagsMasterFile.exists():
+            logger.error(f"Missing file! {tagsMasterFile.name}", task_id)  # handle_error
+            lock.free()
+            return
+
         try:
-            with open(tagsMasterFile, "r", encoding="utf-8", errors="strict") as json_file:
-                tagsList = json.load(json_file)
-        except UnicodeDecodeError:
-            with open(tagsMasterFile, "r", encoding="utf-8", errors="surrogateescape") as json_file:
-                tagsList = json.load(json_file)
-                tagsList_encoding_error = True
+            try:
+                with open(tagsMasterFile, "r", encoding="utf-8", errors="strict") as json_file:
+                    tagsList = json.load(json_file)
+            except UnicodeDecodeError:
+                with open(tagsMasterFile, "r", encoding="utf-8", errors="surrogateescape") as json_file:
+                    tagsList = json.load(json_file)
+                    tagsList_encoding_error = True
 
-    except Exception:
-        logger.exception(f"Invalid tag for series {series_UID}", task_id)  # handle_error
-        lock.free()
-        return
+        except Exception:
+            logger.exception(f"Invalid tag for series {series_UID}", task_id)  # handle_error
+            lock.free()
+            return
 
     monitor.send_register_series(tagsList)
 
@@ -546,7 +567,8 @@ def push_serieslevel_outgoing(
         for entry in file_list:
             try:
                 operation(source_folder / (entry + mercure_names.DCM), target_folder / (entry + mercure_names.DCM))
-                operation(source_folder / (entry + mercure_names.TAGS), target_folder / (entry + mercure_names.TAGS))
+                push_tags_file(operation, source_folder / (entry + mercure_names.TAGS),
+                               target_folder / (entry + mercure_names.TAGS))
             except Exception:
                 logger.error(  # handle_error
                     (f"Problem while pushing file to outgoing [{entry}]\n"
@@ -568,6 +590,18 @@ def push_serieslevel_outgoing(
             return
 
 
+def push_tags_file(operation: Callable, source: Path, target: Path) -> None:
+    """
+    Copies or moves the .tags file of an instance. The file does not exist if getdcmtags only writes
+    the series index.
+    """
+    try:
+        operation(source, target)
+    except FileNotFoundError:
+        if not has_series_index(source.parent, source.parent.name):
+            raise
+
+
 def push_files(task_id: str, series_uid: str, file_list: List[str], target_path: str, copy_files: bool) -> bool:
     """
     Copies or moves the given files to the target path. If copy_files is True, files are copied, otherwise moved.
@@ -585,7 +619,8 @@ def push_files(task_id: str, series_uid: str, file_list: List[str], target_path:
     for entry in file_list:
         try:
             operation(source_folder / (entry + mercure_names.DCM), target_folder / (entry + mercure_names.DCM))
-            operation(source_folder / (entry + mercure_names.TAGS), target_folder / (entry + mercure_names.TAGS))
+            push_tags_file(operation, source_folder / (entry + mercure_names.TAGS),
+                           target_folder / (entry + mercure_names.TAGS))
             logger.debug(f"Pushed {source_folder / (entry+mercure_names.DCM)}")
         except Exception:
             logger.error(  # handle_error
@@ -610,7 +645,8 @@ def remove_series(task_id: str, file_list: List[str], series_UID: str) -> bool:
     source_folder = config.mercure.incoming_folder + "/" + series_UID + "/"
     for entry in file_list:
         try:
-            os.remove(source_folder + entry + mercure_names.TAGS)
+            if os.path.exists(source_folder + entry + mercure_names.TAGS):
+                os.remove(source_folder + entry + mercure_names.TAGS)
             os.remove(source_folder + entry + mercure_names.DCM)
         except Exception:
             logger.error(f"Error while removing file {entry}", task_id)  # handle_error
@@ -623,15 +659,62 @@ def remove_series(task_id: str, file_list: List[str], series_UID: str) -> bool:
 
 def route_error_files() -> None:
     """
-    Looks for error files, moves these files and the corresponding DICOM files to the error folder,
-    and sends an alert to the bookkeeper instance.
+    Moves the received files that getdcmtags could not process to the error folder, together with a .error file
+    that describes the problem, and sends an alert to the bookkeeper instance. The failed files are taken from the
+    error journal. Error files of the previous format (option legacy_error_files of the receiver) are still picked
+    up from the subfolder "error". The incoming folder itself is only scanned for them in every run if the option is
+    set, and otherwise in the reconciliation interval of the journal.
+    """
+    error_files_found = 0
+    reader = error_journal.get_reader()
+    for record in reader.read():
+        if route_journal_error(record):
+            error_files_found += 1
+
+    reconcile = reader.reconcile_due()
+    error_files_found += route_legacy_error_files(config.mercure.dicom_receiver.legacy_error_files or reconcile)
+    if reconcile:
+        error_files_found += route_orphaned_error_files()
+
+    if error_files_found > 0:
+        monitor.send_event(
+            monitor.m_events.PROCESSING, monitor.severity.ERROR, f"Error parsing {error_files_found} incoming files"
+        )
+    return
+
+
+def route_journal_error(record: error_journal.ErrorRecord) -> bool:
+    """Moves the file of an error journal record to the error folder. Returns False if the file is gone."""
+    source = Path(config.mercure.incoming_folder) / record.file
+    if not source.is_file():
+        # The file has already been moved, e.g., if the journal is read again after a restart of the router
+        logger.debug(f"File of error record {record.file} not found")
+        return False
+    logger.error(f"Found incoming error file {source.name}")
+    move_to = config.mercure.error_folder + "/" + source.name
+    logger.error(f"Moving {source.name} to {move_to}")
+    shutil.move(str(source), move_to)
+    try:
+        with open(move_to + mercure_names.ERROR, "w") as error_file:
+            error_file.write(f"ERROR: {record.message}\n")
+            error_file.write(f"Sender: {record.sender_aet} ({record.sender_address})\n")
+    except OSError:
+        logger.error(f"Unable to write error information to {move_to}{mercure_names.ERROR}")  # handle_error
+    return True
+
+
+def route_legacy_error_files(scan_incoming: bool) -> int:
+    """
+    Moves the .error files of the previous format and the corresponding DICOM files to the error folder. Returns
+    the number of failed files.
     """
     error_files_found = 0
     errors_folder = Path(config.mercure.incoming_folder) / "error"
     entries: List[os.DirEntry] = []
     if errors_folder.is_dir():
         entries += list(os.scandir(errors_folder))
-    entries += list(os.scandir(config.mercure.incoming_folder))
+    if scan_incoming:
+        entries += list(os.scandir(config.mercure.incoming_folder))
     for entry in entries:
         if not entry.name.endswith(mercure_names.ERROR) or entry.is_dir():
             continue
@@ -667,11 +750,34 @@ def route_error_files() -> None:
 
         lock.free()
 
-    if error_files_found > 0:
-        monitor.send_event(
-            monitor.m_events.PROCESSING, monitor.severity.ERROR, f"Error parsing {error_files_found} incoming files"
+    return error_files_found
+
+
+def route_orphaned_error_files() -> int:
+    """
+    Moves the DICOM files that have been left in the subfolder "error" without error information for the
+    reconciliation interval, e.g., because their record has been lost during a rotation of the journal. Returns
+    the number of moved files.
+    """
+    error_files_found = 0
+    errors_folder = Path(config.mercure.incoming_folder) / "error"
+    if not errors_folder.is_dir():
+        return 0
+    for entry in os.scandir(errors_folder):
+        if not entry.is_file() or entry.name.endswith((mercure_names.ERROR, mercure_names.LOCK)):
+            continue
+        if os.path.exists(entry.path + mercure_names.ERROR) or os.path.exists(
+            os.path.splitext(entry.path)[0] + mercure_names.ERROR
+        ):
+            continue
+        if time.time() - entry.stat().st_ctime < error_journal.RECONCILE_INTERVAL:
+            continue
+        record = error_journal.ErrorRecord(
+            "error/" + entry.name, time.time(), 0, True, "", "", "No error information recorded"
         )
-    return
+        if route_journal_error(record):
+            error_files_found += 1
+    return error_files_found
 
 
 def trigger_serieslevel_notification(
@@ -22,6 +22,8 @@ import common.notification as notification
 import common.rule_evaluation as rule_evaluation
 from common.constants import mercure_actions, mercure_events, mercure_names, mercure_rule
 from common.types import Task, TaskHasStudy, TaskInfo
+from routing.series_index import read_first_tags
+from routing.study_rollup import StudyRollupReader
 
 # Create local logger instance
 logger = config.get_logger()
@@ -149,14 +151,20 @@ def check_study_timeout(task: TaskHasStudy, pending_series: Dict[str, float]) ->
     if datetime.now() > last_receive_time + timedelta(seconds=config.mercure.study_complete_trigger):
         # Check if there is a pending series on this study.
         # If so, we need to wait for it to timeout before we can complete the study
+        rollup = StudyRollupReader(config.mercure.incoming_folder)
+        use_rollup = rollup.exists()
         for series_uid in pending_series.keys():
-            try:
-                example_file = next((Path(config.mercure.incoming_folder) / series_uid).glob(f"{series_uid}*.tags"))
-            except StopIteration:  # No tag file with this series UID was found
-                logger.error(f"No tag file for series UID {series_uid} was found")
-                raise
-            tags_list = json.loads(example_file.read_text())
-            if tags_list["StudyInstanceUID"] == study.study_uid:
+            # The study of the series is taken from the rollup written by the receiver if available, so that
+            # the series folder does not need to be searched for a .tags file
+            study_uid = rollup.study_of_series(series_uid) if use_rollup else None
+            if study_uid is None:
+                try:
+                    tags_list = read_first_tags(Path(config.mercure.incoming_folder) / series_uid, series_uid)
+                except StopIteration:  # No tag file with this series UID was found
+                    logger.error(f"No tag file for series UID {series_uid} was found")
+                    raise
+                study_uid = tags_list["StudyInstanceUID"]
+            if study_uid == study.study_uid:
                 logger.debug(f"Timeout met, but found a pending series ({series_uid}) in study {study.study_uid}")
                 return False
         logger.debug("Timeout met.")
@@ -21,11 +21,13 @@ import common.monitor as monitor
 import common.notification as notification
 import graphyte
 import hupper
+import routing.error_journal as error_journal
 # App-specific includes
 from common.constants import mercure_defs
 from routing.common import SeriesItem, generate_task_id
 from routing.route_series import route_error_files, route_series
 from routing.route_studies import route_studies
+from routing.series_events import SeriesEventConsumer, get_consumer
 
 
 @dataclass
@@ -76,13 +78,29 @@ def run_router() -> None:
         return
 
     r = RouterState()
+    consumer: typing.Optional[SeriesEventConsumer] = None
     error_files_found = False
-    for entry in os.scandir(config.mercure.incoming_folder):
+    if config.mercure.dicom_receiver.series_events:
+        # getdcmtags reports the received images, so the series are known without scanning the folder
+        consumer = get_consumer()
+        consumer.update()
+        for series_uid, state in consumer.series.items():
+            r.series[series_uid] = SeriesItem(state.modification_time)
+        error_files_found = consumer.error_files_found
+        consumer.error_files_found = False
+        entries: typing.Iterable[os.DirEntry] = []
+    else:
+        entries = os.scandir(config.mercure.incoming_folder)
+
+    for entry in entries:
         if entry.name.endswith('.error'):
             error_files_found = True
             continue
         if not entry.is_dir():
             continue
+        # Hidden folders of the receiver (e.g., the bookkeeper spool) do not contain series
+        if entry.name.startswith("."):
+            continue
         if entry.name == "error":
             error_files_found = True
             continue
@@ -114,15 +132,25 @@ def run_router() -> None:
     for series_uid in sorted(r.complete_series):
         task_id = generate_task_id()
         try:
+            if consumer is not None and not os.path.isdir(os.path.join(config.mercure.incoming_folder, series_uid)):
+                # The series has been removed since it was reported
+                consumer.remove(series_uid)
+                continue
             route_series(task_id, series_uid)
             del r.series[series_uid]
             r.complete_series.remove(series_uid)
+            if consumer is not None and not os.path.isdir(os.path.join(config.mercure.incoming_folder, series_uid)):
+                consumer.remove(series_uid)
         except Exception:
             logger.error(f"Problems while routing series {series_uid}", task_id)  # handle_error
         # If termination is requested, stop processing series after the active one has been completed
         if helper.is_terminated():
             return
 
+    # getdcmtags records failed files in the error journal, which is checked without scanning the folder
+    if not error_files_found and error_journal.get_reader().pending():
+        error_files_found = True
+
     if error_files_found:
         logger.warning("Error files found during routing")
         route_error_files()
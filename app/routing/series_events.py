@@ -0,0 +1,154 @@
+"""
+series_events.py
+================
+Consumer for the series event log that getdcmtags appends to in the incoming folder. The router keeps the
+state of the received series across runs and only reads the new events, so that detecting completed series
+does not require scanning the incoming folder and calling stat() on every series folder each second.
+"""
+
+# Standard python includes
+import os
+import time
+from dataclasses import dataclass
+from pathlib import Path
+from typing import Dict, Optional
+
+# App-specific includes
+import common.config as config
+from common.constants import mercure_names
+
+logger = config.get_logger()
+
+# Size at which the router starts a new event log
+ROTATE_SIZE = 4 * 1024 * 1024
+# The incoming folder is still scanned in this interval, to pick up series that have been placed into the
+# folder by other means (e.g., DICOM query results) and events that have been lost during a rotation
+RECONCILE_INTERVAL = 60
+
+
+@dataclass
+class SeriesState:
+    # Time of the last received instance (seconds since the epoch)
+    modification_time: float
+    instance_count: int = 0
+
+
+class SeriesEventConsumer:
+    def __init__(self, incoming_folder: str) -> None:
+        self.incoming_folder = Path(incoming_folder)
+        self.log_path = self.incoming_folder / mercure_names.SERIES_EVENTS
+        self.rotated_path = self.incoming_folder / (mercure_names.SERIES_EVENTS + ".1")
+        self.series: Dict[str, SeriesState] = {}
+        self.error_files_found = False
+        self.offset = 0
+        self.partial_line = b""
+        self.last_scan = 0.0
+
+    def update(self) -> None:
+        """
+        Applies the events written since the last call. On the first call and in the reconciliation interval, the
+        incoming folder is scanned instead.
+        """
+        if self.rotated_path.exists():
+            self._read_rotated()
+        if time.time() - self.last_scan > RECONCILE_INTERVAL:
+            self._scan()
+        else:
+            self._read_events()
+        self._rotate()
+
+    def remove(self, series_uid: str) -> None:
+        """Forgets a series that has been routed. Instances received afterwards create a new entry."""
+        self.series.pop(series_uid, None)
+
+    def _scan(self) -> None:
+        # Events written during the scan are read again next time, which only refreshes the modification time
+        self._read_events()
+        self.error_files_found = False
+        found: Dict[str, float] = {}
+        for entry in os.scandir(self.incoming_folder):
+            if entry.name.endswith(mercure_names.ERROR) or (entry.name == "error" and entry.is_dir()):
+                self.error_files_found = True
+                continue
+            if not entry.is_dir():
+                continue
+            found[entry.name] = entry.stat().st_mtime
+        for series_uid in list(self.series):
+            if series_uid not in found:
+                del self.series[series_uid]
+        for series_uid, mtime in found.items():
+            state = self.series.get(series_uid)
+            if state is None:
+                self.series[series_uid] = SeriesState(mtime)
+            elif mtime > state.modification_time:
+                state.modification_time = mtime
+        self.last_scan = time.time()
+
+    def _read_events(self) -> None:
+        try:
+            with open(self.log_path, "rb") as log:
+                if os.fstat(log.fileno()).st_size < self.offset:
+                    # The log has been replaced
+                    self.offset = 0
+                    self.partial_line = b""
+                log.seek(self.offset)
+                data = log.read()
+        except FileNotFoundError:
+            return
+        self.offset += len(data)
+        lines = (self.partial_line + data).split(b"\n")
+        # The last element is either empty or an event that is still being written
+        self.partial_line = lines.pop()
+        for line in lines:
+            self._apply(line)
+
+    def _apply(self, line: bytes) -> None:
+        try:
+            event_type, timestamp, series_uid = line.decode("utf-8").split(" ")
+            event_time = int(timestamp) / 1000
+        except ValueError:
+            logger.warning(f"Invalid series event {line!r}")
+            return
+        if event_type == "E":
+            self.error_files_found = True
+        elif event_type == "I":
+            state = self.series.get(series_uid)
+            if state is None:
+                state = self.series[series_uid] = SeriesState(event_time)
+            state.modification_time = max(state.modification_time, event_time)
+            state.instance_count += 1
+
+    def _rotate(self) -> None:
+        """
+        Starts a new event log once the current one is large. getdcmtags opens the log for every event, so only
+        events that are written in the moment of the rename can end up in the old log. These are read on the next
+        call, and anything written even later is covered by the reconciliation scan.
+        """
+        if self.offset < ROTATE_SIZE:
+            return
+        try:
+            os.rename(self.log_path, self.rotated_path)
+        except OSError:
+            logger.warning(f"Unable to rotate series event log {self.log_path}")
+
+    def _read_rotated(self) -> None:
+        # The rotated log is not written anymore, so a trailing partial event is complete as well
+        with open(self.rotated_path, "rb") as log:
+            log.seek(self.offset)
+            data = log.read()
+        for line in (self.partial_line + data).split(b"\n"):
+            if line:
+                self._apply(line)
+        self.rotated_path.unlink()
+        self.offset = 0
+        self.partial_line = b""
+
+
+consumer: Optional[SeriesEventConsumer] = None
+
+
+def get_consumer() -> SeriesEventConsumer:
+    global consumer
+    if consumer is None or consumer.incoming_folder != Path(config.mercure.incoming_folder):
+        consumer = SeriesEventConsumer(config.mercure.incoming_folder)
+    return consumer
@@ -0,0 +1,259 @@
+"""
+series_index.py
+===============
+Reader for the per-series index files written by getdcmtags, which allow evaluating a series without
+opening one .tags file per instance. The index is either stored as JSON lines (.index) or in the compact
+binary format (.index.bin), which stores the tags common to the series only once (see
+getdcmtags/binaryindex.h for the layout).
+"""
+
+# Standard python includes
+import json
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Dict, Iterator, List, Optional, Tuple
+
+# App-specific includes
+from common.constants import mercure_names
+
+
+@dataclass
+class SeriesIndex:
+    series_uid: str
+    # Tags of the first received instance of the series
+    first_tags: Dict[str, str]
+    # Names of the received instances, without extension (i.e., "<series UID>#<file>")
+    files: List[str] = field(default_factory=list)
+    # True if the tags of the first instance could not be decoded as UTF-8
+    encoding_error: bool = False
+
+    @property
+    def instance_count(self) -> int:
+        return len(self.files)
+
+
+BINARY_INDEX_MAGIC = b"MTAGIDX\x01"
+BINARY_RECORD_HEADER = 1
+BINARY_RECORD_INSTANCE = 2
+
+
+def get_index_path(series_folder: Path, series_uid: str) -> Path:
+    return Path(series_folder) / (series_uid + mercure_names.INDEX)
+
+
+def get_binary_index_path(series_folder: Path, series_uid: str) -> Path:
+    return Path(series_folder) / (series_uid + mercure_names.INDEX_BINARY)
+
+
+def has_series_index(series_folder: Path, series_uid: str) -> bool:
+    return get_index_path(series_folder, series_uid).exists() or get_binary_index_path(series_folder, series_uid).exists()
+
+
+def _decode_line(line: bytes) -> Tuple[str, bool]:
+    try:
+        return line.decode("utf-8", errors="strict"), False
+    except UnicodeDecodeError:
+        return line.decode("utf-8", errors="surrogateescape"), True
+
+
+def _parse_header(line: bytes) -> Tuple[Dict[str, str], bool]:
+    text, encoding_error = _decode_line(line)
+    header = json.loads(text)
+    if header.get("series_index") != 1 or not isinstance(header.get("tags"), dict):
+        raise ValueError("Unsupported series index header")
+    return header["tags"], encoding_error
+
+
+class _BinaryReader:
+    """Sequential reader for the varint-encoded binary index. Raises EOFError if the data ends early."""
+
+    def __init__(self, data: bytes, pos: int = 0, end: Optional[int] = None) -> None:
+        self.data = data
+        self.pos = pos
+        self.end = len(data) if end is None else end
+
+    def varint(self) -> int:
+        value = 0
+        shift = 0
+        while self.pos < self.end:
+            byte = self.data[self.pos]
+            self.pos += 1
+            value |= (byte & 0x7F) << shift
+            if not byte & 0x80:
+                return value
+            shift += 7
+        raise EOFError()
+
+    def raw(self, length: int) -> bytes:
+        if length > self.end - self.pos:
+            raise EOFError()
+        value = self.data[self.pos : self.pos + length]
+        self.pos += length
+        return value
+
+    def string(self) -> bytes:
+        return self.raw(self.varint())
+
+
+def _decode(value: bytes) -> Tuple[str, bool]:
+    try:
+        return value.decode("utf-8", errors="strict"), False
+    except UnicodeDecodeError:
+        return value.decode("utf-8", errors="surrogateescape"), True
+
+
+def _read_binary_records(data: bytes) -> Iterator[Tuple[int, _BinaryReader]]:
+    if not data.startswith(BINARY_INDEX_MAGIC):
+        raise ValueError("Unsupported binary series index")
+    reader = _BinaryReader(data, len(BINARY_INDEX_MAGIC))
+    while reader.pos < reader.end:
+        try:
+            record_type = reader.raw(1)[0]
+            length = reader.varint()
+            payload = _BinaryReader(data, reader.pos, reader.pos + length)
+            reader.raw(length)
+        except EOFError:
+            # Record that is still being written (or has been truncated)
+            return
+        yield record_type, payload
+
+
+def _parse_binary_header(payload: _BinaryReader) -> Tuple[str, List[Tuple[str, str]], bool]:
+    series_uid = payload.string().decode("utf-8", errors="surrogateescape")
+    tags = []
+    encoding_error = False
+    for _ in range(payload.varint()):
+        name = payload.string().decode("utf-8", errors="surrogateescape")
+        value, value_error = _decode(payload.string())
+        encoding_error = encoding_error or value_error
+        tags.append((name, value))
+    return series_uid, tags, encoding_error
+
+
+def _parse_binary_file_name(payload: _BinaryReader, series_uid: str, header_tags: List[Tuple[str, str]]) -> str:
+    """Returns the name of the instance, decoding only the deltas needed for it."""
+    file_mode = payload.varint()
+    if file_mode == 0:
+        return payload.string().decode("utf-8", errors="surrogateescape")
+    if file_mode == 1:
+        return series_uid + "#" + payload.string().decode("utf-8", errors="surrogateescape")
+    # The name of the instance is given by its Filename tag
+    filename = dict(header_tags).get("Filename", "")
+    for _ in range(payload.varint()):
+        reference = payload.varint()
+        name = payload.string().decode("utf-8", errors="surrogateescape") if reference == 0 else header_tags[reference - 1][0]
+        value_length = payload.varint()
+        if value_length == 0:
+            if name == "Filename":
+                filename = ""
+            continue
+        value = payload.raw(value_length - 1)
+        if name == "Filename":
+            filename = value.decode("utf-8", errors="surrogateescape")
+    return series_uid + "#" + filename
+
+
+def _read_binary_series_index(index_path: Path, series_uid: str) -> Optional["SeriesIndex"]:
+    try:
+        data = index_path.read_bytes()
+    except FileNotFoundError:
+        return None
+    records = _read_binary_records(data)
+    try:
+        record_type, payload = next(records)
+    except StopIteration:
+        return None
+    if record_type != BINARY_RECORD_HEADER:
+        raise ValueError("Unsupported binary series index header")
+    _, header_tags, encoding_error = _parse_binary_header(payload)
+    index = SeriesIndex(series_uid=series_uid, first_tags=dict(header_tags), encoding_error=encoding_error)
+    known_files = set()
+    for record_type, payload in records:
+        if record_type != BINARY_RECORD_INSTANCE:
+            continue
+        try:
+            name = _parse_binary_file_name(payload, series_uid, header_tags)
+        except (EOFError, IndexError):
+            continue
+        if name not in known_files:
+            known_files.add(name)
+            index.files.append(name)
+    return index
+
+
+def read_series_header(series_folder: Path, series_uid: str) -> Optional[Tuple[Dict[str, str], bool]]:
+    """
+    Returns the tags of the first received instance and the encoding error flag, reading only the
+    first line (or the header record) of the index. Returns None if the series has no index.
+    """
+    try:
+        with open(get_binary_index_path(series_folder, series_uid), "rb") as index_file:
+            data = index_file.read(65536)
+            records = _read_binary_records(data)
+            record = next(records, None)
+            if record is None:
+                # Header larger than the first block
+                records = _read_binary_records(data + index_file.read())
+                record = next(records, None)
+        if record is None or record[0] != BINARY_RECORD_HEADER:
+            return None
+        _, header_tags, encoding_error = _parse_binary_header(record[1])
+        return dict(header_tags), encoding_error
+    except FileNotFoundError:
+        pass
+    try:
+        with open(get_index_path(series_folder, series_uid), "rb") as index_file:
+            line = index_file.readline()
+    except FileNotFoundError:
+        return None
+    if not line.endswith(b"\n"):
+        return None
+    return _parse_header(line)
+
+
+def read_series_index(series_folder: Path, series_uid: str) -> Optional[SeriesIndex]:
+    """
+    Reads the index of the series, preferring the binary index. Returns None if the series has no index.
+    Raises an exception if the header of the index is invalid.
+    """
+    binary_index = _read_binary_series_index(get_binary_index_path(series_folder, series_uid), series_uid)
+    if binary_index is not None:
+        return binary_index
+    try:
+        content = get_index_path(series_folder, series_uid).read_bytes()
+    except FileNotFoundError:
+        return None
+
+    lines = content.split(b"\n")
+    # The last element is either empty or a record that is still being written (or has been
+    # truncated), so it is never used
+    lines.pop()
+    if not lines:
+        return None
+
+    first_tags, encoding_error = _parse_header(lines[0])
+    index = SeriesIndex(series_uid=series_uid, first_tags=first_tags, encoding_error=encoding_error)
+    known_files = set()
+    for line in lines[1:]:
+        try:
+            record = json.loads(line.decode("utf-8", errors="surrogateescape"))
+            name = record["file"]
+        except (ValueError, KeyError, TypeError):
+            continue
+        # Instances that have been received twice are listed only once
+        if name not in known_files:
+            known_files.add(name)
+            index.files.append(name)
+    return index
+
+
+def read_first_tags(series_folder: Path, series_uid: str) -> Dict[str, str]:
+    """
+    Returns the tags of one instance of the series, from the index if available or otherwise from one
+    of the .tags files. Raises StopIteration if the series has neither.
+    """
+    header = read_series_header(series_folder, series_uid)
+    if header is not None:
+        return header[0]
+    example_file = next(Path(series_folder).glob(f"{series_uid}*{mercure_names.TAGS}"))
+    return json.loads(example_file.read_text())
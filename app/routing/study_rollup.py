@@ -0,0 +1,194 @@
+"""
+study_rollup.py
+===============
+Reader for the study rollup that getdcmtags maintains in the incoming folder (option study_rollup of the
+receiver). The rollup lists the series of each received study with their modality, instance count and arrival
+times, so that the router can tell which study a series belongs to without opening its .tags files. See
+getdcmtags/studyrollup.h for the layout, which consists of a hash table of the studies and a hash table of the
+series in a shared memory-mapped file. Only the slots along the probe sequence are read.
+"""
+
+# Standard python includes
+import struct
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import BinaryIO, Dict, List, Optional, Tuple
+
+# App-specific includes
+from common.constants import mercure_names
+
+ROLLUP_MAGIC = b"MSTUDYR1"
+HEADER = struct.Struct("<8sQQQQ24x")
+# hash, ready, series head, series count, instances, first arrival, last arrival, UID
+STUDY_SLOT = struct.Struct("<QIII4xQQQ72s8x")
+# hash, ready, next series, study index, instances, first arrival, last arrival, UID, modality
+SERIES_SLOT = struct.Struct("<QIII4xQQQ72s24s16x")
+
+HASH_MASK = (1 << 64) - 1
+
+
+@dataclass
+class SeriesRollup:
+    series_uid: str
+    modality: str
+    # Number of received instances, including instances that have been received more than once
+    instances: int = 0
+    # Arrival of the first and the last instance (seconds since the epoch)
+    first_arrival: float = 0.0
+    last_arrival: float = 0.0
+
+
+@dataclass
+class StudyRollup:
+    study_uid: str
+    instances: int = 0
+    first_arrival: float = 0.0
+    last_arrival: float = 0.0
+    series: Dict[str, SeriesRollup] = field(default_factory=dict)
+
+
+def _hash_uid(value: str) -> int:
+    """FNV-1a followed by the splitmix64 finalizer, must match hashUID() in getdcmtags/studyrollup.cpp"""
+    result = 14695981039346656037
+    for byte in value.encode("utf-8"):
+        result = ((result ^ byte) * 1099511628211) & HASH_MASK
+    result = ((result ^ (result >> 30)) * 0xBF58476D1CE4E5B9) & HASH_MASK
+    result = ((result ^ (result >> 27)) * 0x94D049BB133111EB) & HASH_MASK
+    result ^= result >> 31
+    return result or 1
+
+
+def _decode(value: bytes) -> str:
+    return value.split(b"\0", 1)[0].decode("utf-8", errors="replace")
+
+
+def _min_arrival(a: int, b: int) -> int:
+    return min(a, b) if a and b else a or b
+
+
+class _RollupTable:
+    """One generation of the rollup. Slots are read on demand, so that a lookup touches only a few pages."""
+
+    def __init__(self, file: BinaryIO) -> None:
+        self.file = file
+        magic, self.study_capacity, self.series_capacity, _, _ = HEADER.unpack(file.read(HEADER.size))
+        if magic != ROLLUP_MAGIC or not self.study_capacity or not self.series_capacity:
+            raise ValueError("Unsupported study rollup")
+        self.series_offset = HEADER.size + self.study_capacity * STUDY_SLOT.size
+
+    def _read(self, offset: int, slot: struct.Struct) -> Tuple:
+        self.file.seek(offset)
+        data = self.file.read(slot.size)
+        if len(data) < slot.size:
+            raise ValueError("Truncated study rollup")
+        return slot.unpack(data)
+
+    def study_slot(self, index: int) -> Tuple:
+        return self._read(HEADER.size + index * STUDY_SLOT.size, STUDY_SLOT)
+
+    def series_slot(self, index: int) -> Tuple:
+        return self._read(self.series_offset + index * SERIES_SLOT.size, SERIES_SLOT)
+
+    def _probe(self, uid: str, capacity: int, read_slot) -> Optional[Tuple[int, Tuple]]:
+        uid_hash = _hash_uid(uid)
+        encoded = uid.encode("utf-8")
+        for i in range(capacity):
+            index = (uid_hash + i) % capacity
+            slot = read_slot(index)
+            if slot[0] == 0:
+                return None
+            # Slots that are still being claimed by a receiver are skipped
+            if slot[0] == uid_hash and slot[1] and slot[7].split(b"\0", 1)[0] == encoded:
+                return index, slot
+        return None
+
+    def find_study(self, study_uid: str) -> Optional[Tuple[int, Tuple]]:
+        return self._probe(study_uid, self.study_capacity, self.study_slot)
+
+    def find_series(self, series_uid: str) -> Optional[Tuple[int, Tuple]]:
+        return self._probe(series_uid, self.series_capacity, self.series_slot)
+
+
+class StudyRollupReader:
+    """
+    Reads the current and the previous generation of the rollup. Series that are listed in both generations are
+    merged. Each method opens the files again, as getdcmtags renames the rollup when it starts a new generation.
+    """
+
+    def __init__(self, incoming_folder: str) -> None:
+        self.path = Path(incoming_folder) / mercure_names.STUDY_ROLLUP
+        self.old_path = Path(incoming_folder) / (mercure_names.STUDY_ROLLUP + ".old")
+
+    def exists(self) -> bool:
+        return self.path.exists()
+
+    def _tables(self) -> List[_RollupTable]:
+        tables = []
+        for path in (self.old_path, self.path):
+            try:
+                file = open(path, "rb")
+            except FileNotFoundError:
+                continue
+            try:
+                tables.append(_RollupTable(file))
+            except Exception:
+                file.close()
+                self._close(tables)
+                raise
+        return tables
+
+    def _close(self, tables: List[_RollupTable]) -> None:
+        for table in tables:
+            table.file.close()
+
+    def study_of_series(self, series_uid: str) -> Optional[str]:
+        """Returns the StudyInstanceUID of the series, or None if the series is not in the rollup"""
+        tables = self._tables()
+        try:
+            for table in reversed(tables):
+                found = table.find_series(series_uid)
+                if found is not None:
+                    return _decode(table.study_slot(found[1][3])[7])
+            return None
+        finally:
+            self._close(tables)
+
+    def read_study(self, study_uid: str) -> Optional[StudyRollup]:
+        """Returns the series of the study sorted by their first arrival, or None if the study is not in the rollup"""
+        tables = self._tables()
+        try:
+            study = StudyRollup(study_uid=study_uid)
+            found = False
+            first_arrival = last_arrival = 0
+            series_arrivals: Dict[str, Tuple[int, int]] = {}
+            for table in tables:
+                study_found = table.find_study(study_uid)
+                if study_found is None:
+                    continue
+                found = True
+                _, _, series_head, _, instances, first, last, _ = study_found[1]
+                study.instances += instances
+                first_arrival = _min_arrival(first_arrival, first)
+                last_arrival = max(last_arrival, last)
+                next_series = series_head
+                # The capacity bounds the walk in case the file has been damaged
+                for _ in range(table.series_capacity):
+                    if not next_series or next_series > table.series_capacity:
+                        break
+                    _, _, next_series, _, instances, first, last, uid, modality = table.series_slot(next_series - 1)
+                    series_uid = _decode(uid)
+                    series = study.series.setdefault(series_uid, SeriesRollup(series_uid, _decode(modality)))
+                    series.instances += instances
+                    previous_first, previous_last = series_arrivals.get(series_uid, (0, 0))
+                    series_arrivals[series_uid] = (_min_arrival(previous_first, first), max(previous_last, last))
+            if not found:
+                return None
+            study.first_arrival = first_arrival / 1000.0
+            study.last_arrival = last_arrival / 1000.0
+            for series_uid, (first, last) in series_arrivals.items():
+                study.series[series_uid].first_arrival = first / 1000.0
+                study.series[series_uid].last_arrival = last / 1000.0
+            study.series = dict(sorted(study.series.items(), key=lambda item: item[1].first_arrival))
+            return study
+        finally:
+            self._close(tables)
@@ -25,3 +25,22 @@ def test_bookkeeper_starts(fs, bookkeeper_port, mercure_config):
     print("Shutting down the server...")
     bookkeeper_process.terminate()
     bookkeeper_process.join()
+
+
+def test_bookkeeper_register_dicom_batch(fs, bookkeeper_port, mercure_config):
+    """ Checks if the batched registration endpoint used by getdcmtags accepts multiple files. """
+    bookkeeper_process = multiprocessing.Process(target=bookkeeper.main)
+    bookkeeper_process.start()
+    time.sleep(2)
+    try:
+        files = [
+            {"filename": "1.2.3#file_a", "file_uid": "1.2.3.1", "series_uid": "1.2.3", "time": time.time()},
+            {"filename": "1.2.3#file_b", "file_uid": "1.2.3.2", "series_uid": "1.2.3"},
+        ]
+        response = requests.post(f"http://127.0.0.1:{bookkeeper_port}/register-dicom-batch",
+                                 json={"files": files}, headers={"Authorization": "Token 12345"})
+        assert response.status_code == 200
+        assert response.json() == {"ok": "", "count": 2}
+    finally:
+        bookkeeper_process.terminate()
+        bookkeeper_process.join()
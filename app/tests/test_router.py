@@ -11,12 +11,17 @@ from typing import Tuple
 from unittest.mock import call
 
 import common
+import pytest
 import routing.generate_taskfile
+from common.constants import mercure_names
 from common.monitor import m_events, severity, task_event
 from common.types import Rule, Task, TaskStudy
 from dispatch import dispatcher
 from pyfakefs.fake_filesystem import FakeFilesystem
+import routing.error_journal
 from routing import router
+from routing.error_journal import RECORD, RECORD_MAGIC, RECORD_MOVED, ErrorJournalReader
+from routing.series_events import SeriesEventConsumer
 
 from .testing_common import generate_uid, mock_incoming_uid, mock_task_ids, process_dicom
 
@@ -299,6 +304,101 @@ def test_route_series_success(fs: FakeFilesystem, mercure_config, mocked, fake_p
     # common.monitor.send_event.assert_not_called()
 
 
+def convert_to_series_index(series_folder: Path, series_uid: str) -> None:
+    """Replaces the .tags files of the series with an index, as written by getdcmtags with --series-index exclusive."""
+    lines = []
+    for tags_file in sorted(series_folder.glob("*.tags")):
+        tags = json.loads(tags_file.read_text())
+        if not lines:
+            lines.append(json.dumps({"series_index": 1, "series_uid": series_uid, "tags": tags}))
+        lines.append(json.dumps({"file": tags_file.stem, "tags": tags}))
+        tags_file.unlink()
+    (series_folder / f"{series_uid}.index").write_text("\n".join(lines) + "\n")
+
+
+def encode_varint(value: int) -> bytes:
+    result = bytearray()
+    while value >= 0x80:
+        result.append(0x80 | (value & 0x7F))
+        value >>= 7
+    result.append(value)
+    return bytes(result)
+
+
+def encode_string(value: str) -> bytes:
+    data = value.encode("utf-8")
+    return encode_varint(len(data)) + data
+
+
+def encode_record(record_type: int, payload: bytes) -> bytes:
+    return bytes([record_type]) + encode_varint(len(payload)) + payload
+
+
+def convert_to_binary_series_index(series_folder: Path, series_uid: str) -> None:
+    """Replaces the .tags files of the series with a binary index, as written with --series-index-format binary."""
+    content = b"MTAGIDX\x01"
+    header_tags = None
+    for tags_file in sorted(series_folder.glob("*.tags")):
+        tags = json.loads(tags_file.read_text())
+        if header_tags is None:
+            header_tags = list(tags.items())
+            payload = encode_string(series_uid) + encode_varint(len(header_tags))
+            payload += b"".join(encode_string(k) + encode_string(v) for k, v in header_tags)
+            content += encode_record(1, payload)
+        # Store the file name completely (mode 0) and only the tags that differ from the header
+        header_positions = {k: i for i, (k, _) in enumerate(header_tags)}
+        deltas = []
+        for name, value in tags.items():
+            if name not in header_positions:
+                deltas.append(encode_varint(0) + encode_string(name) + encode_varint(len(value.encode()) + 1) + value.encode())
+            elif header_tags[header_positions[name]][1] != value:
+                deltas.append(encode_varint(header_positions[name] + 1) + encode_varint(len(value.encode()) + 1) + value.encode())
+        for name, i in header_positions.items():
+            if name not in tags:
+                deltas.append(encode_varint(i + 1) + encode_varint(0))
+        payload = encode_varint(0) + encode_string(tags_file.stem) + encode_varint(len(deltas)) + b"".join(deltas)
+        content += encode_record(2, payload)
+        tags_file.unlink()
+    (series_folder / f"{series_uid}.index.bin").write_bytes(content)
+
+
+@pytest.mark.parametrize("index_format", ["json", "binary"])
+def test_route_series_with_index(fs: FakeFilesystem, mercure_config, mocked, fake_process, index_format):
+    config = mercure_config(rules)
+    task_id = "test_task_" + str(uuid.uuid1())
+    series_uid = str(uuid.uuid4())
+    new_task_id = "new-task-" + str(uuid.uuid1())
+
+    tags = {"SeriesDescription": "foo"}
+    mock_incoming_uid(config, fs, series_uid, tags, name="bar")
+    mock_incoming_uid(config, fs, series_uid, tags, name="baz")
+    series_folder = Path(config.incoming_folder) / series_uid
+    # A record that is still being written by getdcmtags must be ignored
+    if index_format == "binary":
+        convert_to_binary_series_index(series_folder, series_uid)
+        with open(series_folder / f"{series_uid}.index.bin", "ab") as index_file:
+            index_file.write(encode_record(2, encode_varint(0) + encode_string("incomplete"))[:-3])
+    else:
+        convert_to_series_index(series_folder, series_uid)
+        with open(series_folder / f"{series_uid}.index", "a") as index_file:
+            index_file.write('{"file": "incompl')
+
+    common.monitor.configure("router", "test", config.bookkeeper)
+    mock_task_ids(mocked, task_id, new_task_id)
+    router.run_router()
+
+    routing.route_series.push_serieslevel_outgoing \
+        .assert_called_once_with(task_id, {"route_series": True},   # type: ignore
+                                 [f"{series_uid}#bar", f"{series_uid}#baz"],
+                                 series_uid,
+                                 unittest.mock.ANY,
+                                 {"test_target": ["route_series"]})
+    assert sorted(["task.json", f"{series_uid}#bar.dcm", f"{series_uid}#baz.dcm"]) == sorted(
+        k.name for k in Path("/var/outgoing").glob("**/*") if k.is_file()
+    )
+    assert not series_folder.exists()
+
+
 def test_route_series_new_rule(fs: FakeFilesystem, mercure_config, mocked, fake_process):
     config = mercure_config(rules)
     # attach_spies(mocker)
@@ -430,6 +530,35 @@ def test_route_series_with_error(fs: FakeFilesystem, mercure_config, mocked):
         m_events.PROCESSING, severity.ERROR, "Error parsing 1 incoming files")
 
 
+def error_record(file: str, message: str) -> bytes:
+    return RECORD.pack(RECORD_MAGIC, 1000, 1, RECORD_MOVED, file.encode(), b"sender_aet", b"10.0.0.1",
+                       message.encode())
+
+
+def test_route_series_with_error_journal(fs: FakeFilesystem, mercure_config, mocked):
+    """Checks if the router moves the files that getdcmtags has recorded in the error journal."""
+    config = mercure_config(rules)
+    routing.error_journal.reader = None
+
+    incoming = Path(config.incoming_folder)
+    fs.create_file(incoming / "error" / "bad_dicom.dcm", contents="not a dicom file")
+    fs.create_file(incoming / mercure_names.ERROR_JOURNAL,
+                   contents=error_record("error/bad_dicom.dcm", "Unable to read DICOM file bad_dicom"))
+    router.run_router()
+    assert not (incoming / "error" / "bad_dicom.dcm").exists()
+    assert (Path(config.error_folder) / "bad_dicom.dcm").exists()
+    error_text = (Path(config.error_folder) / "bad_dicom.dcm.error").read_text()
+    assert "Unable to read DICOM file" in error_text and "sender_aet" in error_text
+    common.monitor.send_event.assert_called_with(  # type: ignore
+        m_events.PROCESSING, severity.ERROR, "Error parsing 1 incoming files")
+
+    # Records are only applied once
+    common.monitor.send_event.reset_mock()  # type: ignore
+    router.run_router()
+    assert call(m_events.PROCESSING, severity.ERROR, "Error parsing 1 incoming files") \
+        not in common.monitor.send_event.call_args_list  # type: ignore
+
+
 def test_route_series_multiple_rules(fs: FakeFilesystem, mercure_config, mocked, fake_process):
     config = mercure_config({
         "rules": {
@@ -455,3 +584,73 @@ def test_route_series_multiple_rules(fs: FakeFilesystem, mercure_config, mocked,
 
     for path in Path(config.outgoing_folder).iterdir():
         assert (path / Path(dcm_file).name).exists()
+
+
+def test_series_events(fs: FakeFilesystem):
+    incoming = Path("/var/incoming")
+    fs.create_dir(incoming / "series_a")
+    log_path = incoming / mercure_names.SERIES_EVENTS
+    consumer = SeriesEventConsumer(str(incoming))
+    # The first update scans the incoming folder
+    consumer.update()
+    assert list(consumer.series) == ["series_a"]
+
+    fs.create_dir(incoming / "series_b")
+    log_path.write_text("I 1000 series_b\nI 2000 series_b\nE 2500 -\nI 30")
+    consumer.update()
+    assert consumer.series["series_b"].instance_count == 2
+    assert consumer.series["series_b"].modification_time == 2.0
+    assert consumer.error_files_found
+    # An event that is still being written is applied once it is complete
+    with open(log_path, "a") as log:
+        log.write("00 series_b\n")
+    consumer.update()
+    assert consumer.series["series_b"].instance_count == 3
+    assert consumer.series["series_b"].modification_time == 3.0
+
+    # Events written into the log after it has been rotated are still applied
+    with unittest.mock.patch("routing.series_events.ROTATE_SIZE", new=1):
+        consumer.update()
+    assert not log_path.exists()
+    with open(incoming / (mercure_names.SERIES_EVENTS + ".1"), "a") as log:
+        log.write("I 4000 series_b\n")
+    log_path.write_text("I 5000 series_c\n")
+    consumer.update()
+    assert consumer.series["series_b"].instance_count == 4
+    assert consumer.series["series_c"].instance_count == 1
+    assert not (incoming / (mercure_names.SERIES_EVENTS + ".1")).exists()
+
+    consumer.remove("series_b")
+    assert "series_b" not in consumer.series
+
+
+def test_error_journal(fs: FakeFilesystem):
+    incoming = Path("/var/incoming")
+    fs.create_dir(incoming)
+    journal_path = incoming / mercure_names.ERROR_JOURNAL
+    reader = ErrorJournalReader(str(incoming))
+    assert not reader.pending()
+    assert reader.read() == []
+
+    second = error_record("error/b.dcm", "Second")
+    journal_path.write_bytes(error_record("error/a.dcm", "First") + second[:100])
+    assert reader.pending()
+    records = reader.read()
+    assert [(r.file, r.moved, r.message, r.sender_aet, r.sender_address) for r in records] == [
+        ("error/a.dcm", True, "First", "sender_aet", "10.0.0.1")]
+    # A record that is still being written is returned once it is complete
+    with open(journal_path, "ab") as journal:
+        journal.write(second[100:])
+    assert [r.message for r in reader.read()] == ["Second"]
+    assert not reader.pending()
+
+    # Records written into the journal after it has been rotated are still returned
+    with unittest.mock.patch("routing.error_journal.ROTATE_SIZE", new=1):
+        assert reader.read() == []
+    assert not journal_path.exists()
+    with open(incoming / (mercure_names.ERROR_JOURNAL + ".1"), "ab") as journal:
+        journal.write(error_record("error/c.dcm", "Third"))
+    journal_path.write_bytes(error_record("error/d.dcm", "Fourth"))
+    assert reader.pending()
+    assert [r.message for r in reader.read()] == ["Third", "Fourth"]
+    assert not (incoming / (mercure_names.ERROR_JOURNAL + ".1")).exists()
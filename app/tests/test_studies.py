@@ -1,10 +1,11 @@
 import asyncio
 import shutil
+import struct
 import unittest
 import uuid
 from datetime import timedelta
 from pathlib import Path
-from typing import Tuple
+from typing import Dict, List, Optional, Tuple
 
 import pytest
 from common import notification
@@ -15,6 +16,8 @@ from nomad.api.job import Job
 from process import processor
 from pyfakefs.fake_filesystem import FakeFilesystem
 from routing import router
+from routing.study_rollup import (HEADER, ROLLUP_MAGIC, SERIES_SLOT, STUDY_SLOT, StudyRollupReader,
+                                  _hash_uid)
 
 from .testing_common import mock_incoming_uid
 
@@ -33,7 +36,71 @@ def create_series(mocked, fs, config, study_uid, series_uid, series_description,
     return image_f, tags_f
 
 
-def test_route_study_pending(fs: FakeFilesystem, mercure_config, mocked):
+def write_study_rollup(path: Path, studies: Dict[str, List[Tuple[str, str, int, int, int]]], capacity: int = 8) -> None:
+    """
+    Writes a study rollup in the layout of getdcmtags/studyrollup.cpp. The series are given as tuples of
+    (series UID, modality, instances, first arrival in ms, last arrival in ms).
+    """
+    study_slots: List[Optional[list]] = [None] * capacity
+    series_slots: List[Optional[list]] = [None] * capacity
+
+    def claim(slots: List[Optional[list]], uid: str) -> int:
+        index = _hash_uid(uid) % capacity
+        while slots[index] is not None:
+            index = (index + 1) % capacity
+        return index
+
+    for study_uid, series_list in studies.items():
+        study_index = claim(study_slots, study_uid)
+        study = [_hash_uid(study_uid), 1, 0, 0, 0, 0, 0, study_uid.encode()]
+        study_slots[study_index] = study
+        for series_uid, modality, instances, first, last in series_list:
+            series_index = claim(series_slots, series_uid)
+            series_slots[series_index] = [_hash_uid(series_uid), 1, study[2], study_index, instances, first, last,
+                                          series_uid.encode(), modality.encode()]
+            study[2] = series_index + 1
+            study[3] += 1
+            study[4] += instances
+            study[5] = min(study[5], first) if study[5] else first
+            study[6] = max(study[6], last)
+
+    content = HEADER.pack(ROLLUP_MAGIC, capacity, capacity, len(studies), 0)
+    content += b"".join(STUDY_SLOT.pack(*slot) if slot else bytes(STUDY_SLOT.size) for slot in study_slots)
+    content += b"".join(SERIES_SLOT.pack(*slot) if slot else bytes(SERIES_SLOT.size) for slot in series_slots)
+    path.write_bytes(content)
+
+
+def test_study_rollup(fs: FakeFilesystem):
+    incoming = Path("/var/incoming")
+    fs.create_dir(incoming)
+    reader = StudyRollupReader(str(incoming))
+    assert not reader.exists()
+    assert reader.study_of_series("series_a") is None
+
+    # The previous generation is merged with the current one
+    write_study_rollup(incoming / (mercure_names.STUDY_ROLLUP + ".old"),
+                       {"study_1": [("series_a", "CT", 10, 1000, 2000)]})
+    write_study_rollup(incoming / mercure_names.STUDY_ROLLUP,
+                       {"study_1": [("series_a", "CT", 5, 3000, 4000), ("series_b", "SR", 1, 2500, 2500)],
+                        "study_2": [("series_c", "MR", 3, 5000, 6000)]})
+    assert reader.exists()
+    assert reader.study_of_series("series_a") == "study_1"
+    assert reader.study_of_series("series_c") == "study_2"
+    assert reader.study_of_series("series_d") is None
+    assert reader.read_study("study_3") is None
+
+    study = reader.read_study("study_1")
+    assert study is not None
+    assert study.instances == 16
+    assert (study.first_arrival, study.last_arrival) == (1.0, 4.0)
+    assert list(study.series) == ["series_a", "series_b"]
+    assert study.series["series_a"].instances == 15
+    assert study.series["series_a"].modality == "CT"
+    assert (study.series["series_a"].first_arrival, study.series["series_a"].last_arrival) == (1.0, 4.0)
+
+
+@pytest.mark.parametrize("study_rollup", [False, True])
+def test_route_study_pending(fs: FakeFilesystem, mercure_config, mocked, study_rollup):
     """
     Test that a study with a pending series is not routed until the pending series itself times out.
     """
@@ -67,6 +134,11 @@ def test_route_study_pending(fs: FakeFilesystem, mercure_config, mocked):
         # A new incomplete series is created
         series_uid_incomplete = "pending-" + str(uuid.uuid4())
         create_series(mocked, fs, config, study_uid, series_uid_incomplete, "test_series_incomplete")
+        if study_rollup:
+            # The study of the pending series is then taken from the rollup instead of its .tags files
+            write_study_rollup(Path(config.incoming_folder) / mercure_names.STUDY_ROLLUP,
+                               {study_uid: [(series_uid, "CT", 1, 1000, 1000), (series_uid_incomplete, "CT", 1, 2000, 2000)]})
+            read_first_tags = mocked.patch("routing.route_studies.read_first_tags")
         frozen_time.tick(delta=timedelta(seconds=7))
         # The new series hasn't completed yet, so the study hasn't timed out yet
         router.run_router()
@@ -81,6 +153,8 @@ def test_route_study_pending(fs: FakeFilesystem, mercure_config, mocked):
         # The study has timed out
         router.run_router()
         assert list(out_path.glob("**/*")) != []
+        if study_rollup:
+            read_first_tags.assert_not_called()
 
 
 @pytest.mark.parametrize("action, force", [("route", True), ("route", False), ("notification", False)])
@@ -3,6 +3,7 @@
 import dataclasses
 import shutil
 import subprocess
+import tempfile
 import time
 import typing
 from dataclasses import dataclass
@@ -88,6 +89,46 @@ def invoke_getdcmtags(file: Path, node: Union[DicomTarget, DicomWebTarget], forc
             raise
 
 
+def invoke_getdcmtags_batch(files: List[Path], node: Union[DicomTarget, DicomWebTarget], force_rule: Optional[str] = None):
+    """
+    Processes all given files with a single getdcmtags call, which parses the files concurrently.
+    """
+    if not files:
+        return
+    is_fake_fs = isinstance(Path, pyfakefs.fake_pathlib.FakePathlibPathModule)
+    if is_fake_fs:  # running a test
+        for file in files:
+            invoke_getdcmtags(file, node, force_rule)
+        return
+
+    if isinstance(node, DicomTarget):
+        sender_address = node.ip
+        sender_aet = node.aet_target
+        receiver_aet = node.aet_source
+    elif isinstance(node, DicomWebTarget):
+        sender_address = node.url
+        sender_aet = "MERCURE-QUERY"
+        receiver_aet = "MERCURE"
+
+    with tempfile.NamedTemporaryFile("w", suffix=".list") as file_list:
+        file_list.write("\n".join(str(f) for f in files) + "\n")
+        file_list.flush()
+        try:
+            invoke_with: list = [config.app_basepath / "bin" / "getdcmtags", "--batch", file_list.name,
+                                 sender_address, sender_aet, receiver_aet,
+                                 config.mercure.bookkeeper, config.mercure.bookkeeper_api_key]
+            if force_rule:
+                invoke_with.extend(["--set-tag", f"mercureForceRule={force_rule}"])
+            subprocess.check_output(invoke_with)
+        except subprocess.CalledProcessError as e:
+            logger.warning(e.output.decode() if e.output else "No stdout")
+            logger.warning(e.stderr.decode() if e.stderr else "No stderr")
+            raise
+        except Exception:
+            logger.warning(invoke_with)
+            raise
+
+
 @dataclass
 class ClassBasedRQTask():
     parent: Optional[str] = None
@@ -149,7 +190,7 @@ class ClassBasedRQTask():
                 dest_name = Path(config.mercure.incoming_folder) / p.name
                 shutil.move(str(p), dest_name)  # Move the file to incoming folder
                 moved_files.append(dest_name)
-                invoke_getdcmtags(Path(config.mercure.incoming_folder) / p.name, node, force_rule)
+            invoke_getdcmtags_batch(moved_files, node, force_rule)
         except Exception:
             for file in moved_files:
                 try:
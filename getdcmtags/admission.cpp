@@ -0,0 +1,411 @@
+#include "admission.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+// Version 1 of the layout
+static const char ADMISSION_MAGIC[8] = {'M', 'A', 'D', 'M', 'I', 'T', 'S', '1'};
+
+// Polling interval while waiting for a slot, doubled up to the maximum
+#define ADMISSION_POLL_MIN_US 100
+#define ADMISSION_POLL_MAX_US 10000
+
+struct AdmissionHeader
+{
+    char magic[8];
+    std::atomic<uint32_t> limit;
+    // Number of waiter entries that have been used, so that the scans stop there
+    std::atomic<uint32_t> waiterHighWater;
+    std::atomic<uint64_t> admitted[ADMISSION_PRIORITIES];
+    std::atomic<uint64_t> timeouts[ADMISSION_PRIORITIES];
+    std::atomic<uint64_t> refused[ADMISSION_PRIORITIES];
+    std::atomic<uint64_t> waitMicroseconds[ADMISSION_PRIORITIES];
+    char reserved[112];
+};
+
+// The slots hold the PID of the process that uses them (0 if free). The waiter entries hold the
+// PID shifted by 8 bits and the priority + 1 in the lowest bits (0 if free).
+struct AdmissionTables
+{
+    std::atomic<int32_t> slots[ADMISSION_MAX_SLOTS];
+    std::atomic<uint64_t> waiters[ADMISSION_MAX_WAITERS];
+};
+
+static_assert(sizeof(AdmissionHeader) == 256, "Unexpected size of the admission header");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared admission state requires lock-free atomics");
+
+struct AdmissionControl::Snapshot
+{
+    uint32_t limit = 0;
+    uint32_t active = 0;
+    uint32_t waiting[ADMISSION_PRIORITIES] = {};
+    uint64_t admitted[ADMISSION_PRIORITIES] = {};
+    uint64_t timeouts[ADMISSION_PRIORITIES] = {};
+    uint64_t refused[ADMISSION_PRIORITIES] = {};
+    uint64_t waitMicroseconds[ADMISSION_PRIORITIES] = {};
+};
+
+static AdmissionHeader *header(void *map)
+{
+    return (AdmissionHeader *)map;
+}
+
+static AdmissionTables *tables(void *map)
+{
+    return (AdmissionTables *)((char *)map + sizeof(AdmissionHeader));
+}
+
+static bool processAlive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+bool parseAdmissionRule(const char *text, AdmissionRule &rule)
+{
+    std::string value(text);
+    size_t equals = value.find('=');
+    size_t colon = value.rfind(':');
+    if (equals == std::string::npos || equals == 0 || colon == std::string::npos || colon < equals)
+    {
+        return false;
+    }
+    char *end = nullptr;
+    long priority = strtol(value.c_str() + colon + 1, &end, 10);
+    if (end == value.c_str() + colon + 1 || *end != 0 || priority < 0 || priority >= ADMISSION_PRIORITIES)
+    {
+        return false;
+    }
+    rule.name = value.substr(0, equals);
+    rule.value = value.substr(equals + 1, colon - equals - 1);
+    rule.priority = (int)priority;
+    return true;
+}
+
+AdmissionControl::~AdmissionControl()
+{
+    if (map != nullptr)
+    {
+        munmap(map, mapSize);
+    }
+}
+
+bool AdmissionControl::open(const std::string &folder, int slots)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t limit = (uint32_t)std::min(slots, ADMISSION_MAX_SLOTS);
+    std::string name = folder + ADMISSION_FILE;
+    if (map != nullptr && name == filename)
+    {
+        if (limit > 0)
+        {
+            header(map)->limit.store(limit, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to open admission state " << name << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    // The lock is only needed while a new file is initialized
+    flock(fd, LOCK_EX);
+    size_t size = sizeof(AdmissionHeader) + sizeof(AdmissionTables);
+    struct stat info;
+    bool success = fstat(fd, &info) == 0;
+    if (success && info.st_size == 0)
+    {
+        char initial[sizeof(AdmissionHeader)] = {};
+        memcpy(initial, ADMISSION_MAGIC, sizeof(ADMISSION_MAGIC));
+        success = ftruncate(fd, size) == 0 && pwrite(fd, initial, sizeof(initial), 0) == (ssize_t)sizeof(initial)
+                  && fstat(fd, &info) == 0;
+    }
+    char magic[sizeof(ADMISSION_MAGIC)];
+    success = success && pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)
+              && memcmp(magic, ADMISSION_MAGIC, sizeof(ADMISSION_MAGIC)) == 0 && (size_t)info.st_size == size;
+    flock(fd, LOCK_UN);
+    if (!success)
+    {
+        std::cout << "ERROR: Invalid admission state " << name << std::endl;
+        close(fd);
+        return false;
+    }
+    void *newMap = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (newMap == MAP_FAILED)
+    {
+        std::cout << "ERROR: Unable to map admission state " << name << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (map != nullptr)
+    {
+        munmap(map, mapSize);
+    }
+    map = newMap;
+    mapSize = size;
+    filename = name;
+    if (limit > 0)
+    {
+        header(map)->limit.store(limit, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// Returns true if a file of a higher priority is waiting. Entries of processes that have died
+// are removed.
+bool AdmissionControl::higherPriorityWaiting(int priority)
+{
+    AdmissionTables *table = tables(map);
+    uint32_t count = std::min<uint32_t>(header(map)->waiterHighWater.load(std::memory_order_acquire), ADMISSION_MAX_WAITERS);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t entry = table->waiters[i].load(std::memory_order_acquire);
+        if (entry == 0 || (int)(entry & 0xff) - 1 >= priority)
+        {
+            continue;
+        }
+        if (processAlive((pid_t)(entry >> 8)))
+        {
+            return true;
+        }
+        table->waiters[i].compare_exchange_strong(entry, 0, std::memory_order_acq_rel);
+    }
+    return false;
+}
+
+// Takes a free slot or the slot of a process that has died. Returns -1 if all slots are used.
+int AdmissionControl::claimSlot()
+{
+    AdmissionTables *table = tables(map);
+    int32_t pid = (int32_t)getpid();
+    uint32_t limit = std::min<uint32_t>(header(map)->limit.load(std::memory_order_relaxed), ADMISSION_MAX_SLOTS);
+    for (uint32_t i = 0; i < limit; i++)
+    {
+        int32_t holder = table->slots[i].load(std::memory_order_acquire);
+        if ((holder == 0 || !processAlive(holder))
+            && table->slots[i].compare_exchange_strong(holder, pid, std::memory_order_acq_rel))
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Returns the waiter entry, or -1 if too many files are waiting (the file then waits without
+// being considered by the other waiters)
+int AdmissionControl::registerWaiter(int priority)
+{
+    AdmissionTables *table = tables(map);
+    uint64_t value = ((uint64_t)getpid() << 8) | (uint64_t)(priority + 1);
+    for (uint32_t i = 0; i < ADMISSION_MAX_WAITERS; i++)
+    {
+        uint64_t expected = table->waiters[i].load(std::memory_order_relaxed);
+        if ((expected == 0 || !processAlive((pid_t)(expected >> 8)))
+            && table->waiters[i].compare_exchange_strong(expected, value, std::memory_order_acq_rel))
+        {
+            uint32_t highWater = header(map)->waiterHighWater.load(std::memory_order_relaxed);
+            while (highWater < i + 1
+                   && !header(map)->waiterHighWater.compare_exchange_weak(highWater, i + 1, std::memory_order_acq_rel))
+            {
+            }
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+int AdmissionControl::acquire(int priority, int timeoutMilliseconds)
+{
+    if (map == nullptr)
+    {
+        return -1;
+    }
+    priority = std::min(std::max(priority, 0), ADMISSION_PRIORITIES - 1);
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(timeoutMilliseconds);
+
+    // Files are admitted right away if nobody is waiting
+    int slot = higherPriorityWaiting(priority) ? -1 : claimSlot();
+    if (slot < 0)
+    {
+        int waiter = registerWaiter(priority);
+        int pollMicroseconds = ADMISSION_POLL_MIN_US;
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            usleep(pollMicroseconds);
+            pollMicroseconds = std::min(pollMicroseconds * 2, ADMISSION_POLL_MAX_US);
+            if (!higherPriorityWaiting(priority) && (slot = claimSlot()) >= 0)
+            {
+                break;
+            }
+        }
+        if (waiter >= 0)
+        {
+            tables(map)->waiters[waiter].store(0, std::memory_order_release);
+        }
+    }
+
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    header(map)->waitMicroseconds[priority].fetch_add(waited.count(), std::memory_order_relaxed);
+    if (slot >= 0)
+    {
+        header(map)->admitted[priority].fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        header(map)->timeouts[priority].fetch_add(1, std::memory_order_relaxed);
+    }
+    return slot;
+}
+
+void AdmissionControl::release(int slot)
+{
+    if (map != nullptr && slot >= 0 && slot < ADMISSION_MAX_SLOTS)
+    {
+        tables(map)->slots[slot].store(0, std::memory_order_release);
+    }
+}
+
+void AdmissionControl::countRefused(int priority)
+{
+    if (map != nullptr)
+    {
+        priority = std::min(std::max(priority, 0), ADMISSION_PRIORITIES - 1);
+        header(map)->refused[priority].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool AdmissionControl::snapshot(Snapshot &result)
+{
+    if (map == nullptr)
+    {
+        return false;
+    }
+    AdmissionHeader *state = header(map);
+    AdmissionTables *table = tables(map);
+    result.limit = std::min<uint32_t>(state->limit.load(std::memory_order_relaxed), ADMISSION_MAX_SLOTS);
+    for (uint32_t i = 0; i < result.limit; i++)
+    {
+        int32_t holder = table->slots[i].load(std::memory_order_relaxed);
+        if (holder != 0 && processAlive(holder))
+        {
+            result.active++;
+        }
+    }
+    uint32_t count = std::min<uint32_t>(state->waiterHighWater.load(std::memory_order_relaxed), ADMISSION_MAX_WAITERS);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t entry = table->waiters[i].load(std::memory_order_relaxed);
+        int priority = (int)(entry & 0xff) - 1;
+        if (entry != 0 && priority >= 0 && priority < ADMISSION_PRIORITIES && processAlive((pid_t)(entry >> 8)))
+        {
+            result.waiting[priority]++;
+        }
+    }
+    for (int i = 0; i < ADMISSION_PRIORITIES; i++)
+    {
+        result.admitted[i] = state->admitted[i].load(std::memory_order_relaxed);
+        result.timeouts[i] = state->timeouts[i].load(std::memory_order_relaxed);
+        result.refused[i] = state->refused[i].load(std::memory_order_relaxed);
+        result.waitMicroseconds[i] = state->waitMicroseconds[i].load(std::memory_order_relaxed);
+    }
+    return true;
+}
+
+static void appendPerPriority(std::ostringstream &out, const char *name, const uint64_t *values, double scale)
+{
+    for (int i = 0; i < ADMISSION_PRIORITIES; i++)
+    {
+        out << name << "{priority=\"" << i << "\"} " << values[i] * scale << "\n";
+    }
+}
+
+std::string AdmissionControl::prometheus()
+{
+    Snapshot state;
+    if (!snapshot(state))
+    {
+        return "";
+    }
+    uint64_t waiting[ADMISSION_PRIORITIES];
+    std::copy(state.waiting, state.waiting + ADMISSION_PRIORITIES, waiting);
+    std::ostringstream out;
+    out << "# HELP getdcmtags_admission_slots Files that all receiver processes may place concurrently.\n"
+        << "# TYPE getdcmtags_admission_slots gauge\n"
+        << "getdcmtags_admission_slots " << state.limit << "\n"
+        << "# HELP getdcmtags_admission_active Slots currently in use.\n"
+        << "# TYPE getdcmtags_admission_active gauge\n"
+        << "getdcmtags_admission_active " << state.active << "\n"
+        << "# HELP getdcmtags_admission_queue_depth Files waiting for a slot.\n"
+        << "# TYPE getdcmtags_admission_queue_depth gauge\n";
+    appendPerPriority(out, "getdcmtags_admission_queue_depth", waiting, 1);
+    out << "# HELP getdcmtags_admission_admitted_total Files that have been admitted.\n"
+        << "# TYPE getdcmtags_admission_admitted_total counter\n";
+    appendPerPriority(out, "getdcmtags_admission_admitted_total", state.admitted, 1);
+    out << "# HELP getdcmtags_admission_timeouts_total Files that have not been admitted within the timeout.\n"
+        << "# TYPE getdcmtags_admission_timeouts_total counter\n";
+    appendPerPriority(out, "getdcmtags_admission_timeouts_total", state.timeouts, 1);
+    out << "# HELP getdcmtags_admission_refused_total Instances refused to the sender after the timeout.\n"
+        << "# TYPE getdcmtags_admission_refused_total counter\n";
+    appendPerPriority(out, "getdcmtags_admission_refused_total", state.refused, 1);
+    out << "# HELP getdcmtags_admission_wait_seconds_total Time spent waiting for a slot.\n"
+        << "# TYPE getdcmtags_admission_wait_seconds_total counter\n";
+    appendPerPriority(out, "getdcmtags_admission_wait_seconds_total", state.waitMicroseconds, 1e-6);
+    return out.str();
+}
+
+std::string AdmissionControl::json()
+{
+    Snapshot state;
+    if (!snapshot(state))
+    {
+        return "{}";
+    }
+    uint64_t waiting = 0, admitted = 0, timeouts = 0, refused = 0, waitMicroseconds = 0;
+    for (int i = 0; i < ADMISSION_PRIORITIES; i++)
+    {
+        waiting += state.waiting[i];
+        admitted += state.admitted[i];
+        timeouts += state.timeouts[i];
+        refused += state.refused[i];
+        waitMicroseconds += state.waitMicroseconds[i];
+    }
+    std::ostringstream out;
+    out << "{\"admission.slots\": " << state.limit << ", \"admission.active\": " << state.active
+        << ", \"admission.queue_depth\": " << waiting << ", \"admission.admitted\": " << admitted
+        << ", \"admission.timeouts\": " << timeouts << ", \"admission.refused\": " << refused
+        << ", \"admission.wait_us\": " << waitMicroseconds << "}";
+    return out.str();
+}
+
+bool AdmissionSlot::acquire(AdmissionControl &admissionControl, int priority, int timeoutMilliseconds)
+{
+    release();
+    slot = admissionControl.acquire(priority, timeoutMilliseconds);
+    control = (slot >= 0) ? &admissionControl : nullptr;
+    return slot >= 0;
+}
+
+void AdmissionSlot::release()
+{
+    if (control != nullptr)
+    {
+        control->release(slot);
+    }
+    control = nullptr;
+    slot = -1;
+}
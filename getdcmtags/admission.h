@@ -0,0 +1,93 @@
+#ifndef GETDCMTAGS_ADMISSION_H
+#define GETDCMTAGS_ADMISSION_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Name of the shared state in the incoming folder
+#define ADMISSION_FILE ".admission"
+
+// Priorities of waiting files, 0 is admitted first. Files that match no rule get the default.
+#define ADMISSION_PRIORITIES 4
+#define ADMISSION_DEFAULT_PRIORITY 2
+
+// Upper limits for the number of slots and for the number of files waiting at the same time
+#define ADMISSION_MAX_SLOTS 256
+#define ADMISSION_MAX_WAITERS 4096
+
+// Assigns a priority to the files that have the given value of a tag, e.g. "Modality=CT:1", or
+// of a receiver argument ("ReceiverAET", "SenderAET" or "SenderAddress")
+struct AdmissionRule
+{
+    std::string name;
+    std::string value;
+    int priority = ADMISSION_DEFAULT_PRIORITY;
+};
+
+bool parseAdmissionRule(const char *text, AdmissionRule &rule);
+
+// Caps the number of files that all receiver processes of an incoming folder place into the
+// series folders and report to the bookkeeper at the same time. The state is a memory-mapped
+// file in the incoming folder, which works as a system-wide counting semaphore: each slot holds
+// the PID of the process that uses it, and slots of processes that have died are taken over.
+// Waiting files are registered in the same file, and a file is only admitted if no file of a
+// higher priority is waiting. Files that do not get a slot within the timeout are not admitted,
+// so that low priorities cannot be starved indefinitely.
+class AdmissionControl
+{
+public:
+    AdmissionControl() = default;
+    AdmissionControl(const AdmissionControl &) = delete;
+    AdmissionControl &operator=(const AdmissionControl &) = delete;
+    ~AdmissionControl();
+
+    // Opens the shared state in the folder. The number of slots applies to all processes. With 0
+    // slots, the configured number is kept (used for reading the status).
+    bool open(const std::string &folder, int slots);
+
+    // Waits until a slot is free and no file of a higher priority is waiting. Returns the slot,
+    // or -1 if the timeout has expired.
+    int acquire(int priority, int timeoutMilliseconds);
+    void release(int slot);
+
+    // Counts a file that has been refused after the timeout, so that the sender retries it later
+    void countRefused(int priority);
+
+    // Prometheus text exposition format. Empty if the shared state has not been opened.
+    std::string prometheus();
+
+    // One-line JSON summary
+    std::string json();
+
+private:
+    struct Snapshot;
+    bool snapshot(Snapshot &result);
+    bool higherPriorityWaiting(int priority);
+    int claimSlot();
+    int registerWaiter(int priority);
+
+    std::mutex mutex;
+    std::string filename;
+    void *map = nullptr;
+    size_t mapSize = 0;
+};
+
+// Slot of the admission control that is released when the object is destroyed
+class AdmissionSlot
+{
+public:
+    AdmissionSlot() = default;
+    AdmissionSlot(const AdmissionSlot &) = delete;
+    AdmissionSlot &operator=(const AdmissionSlot &) = delete;
+    ~AdmissionSlot() { release(); }
+
+    bool acquire(AdmissionControl &control, int priority, int timeoutMilliseconds);
+    void release();
+
+private:
+    AdmissionControl *control = nullptr;
+    int slot = -1;
+};
+
+#endif
@@ -0,0 +1,653 @@
+#include "archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Size of the buffers for the raw and the decompressed bytes
+#define ARCHIVE_BUFFER_SIZE (256 * 1024)
+
+#define TAR_BLOCK_SIZE 512
+
+#define ZIP_LOCAL_HEADER 0x04034b50u
+#define ZIP_DATA_DESCRIPTOR 0x08074b50u
+#define ZIP_CENTRAL_HEADER 0x02014b50u
+#define ZIP_END_OF_CENTRAL_DIRECTORY 0x06054b50u
+#define ZIP64_END_OF_CENTRAL_DIRECTORY 0x06064b50u
+
+static inline uint16_t le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t le64(const unsigned char *p)
+{
+    return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    if (gzipActive)
+    {
+        inflateEnd(&gzip);
+    }
+    if (inflaterActive)
+    {
+        inflateEnd(&inflater);
+    }
+#ifdef HAVE_ZSTD
+    if (zstd != nullptr)
+    {
+        ZSTD_freeDStream((ZSTD_DStream *)zstd);
+    }
+#endif
+    if (fd > STDERR_FILENO)
+    {
+        close(fd);
+    }
+}
+
+bool ArchiveReader::fail(const std::string &text)
+{
+    if (errorText.empty())
+    {
+        errorText = text;
+    }
+    streamEof = true;
+    return false;
+}
+
+std::string ArchiveReader::format() const
+{
+    std::string result = zip ? "zip" : "tar";
+    if (compression == COMPRESSION_GZIP)
+    {
+        result += ".gz";
+    }
+    else if (compression == COMPRESSION_ZSTD)
+    {
+        result += ".zst";
+    }
+    return result;
+}
+
+bool ArchiveReader::open(const std::string &path)
+{
+    fd = (path == "-") ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return fail("Unable to open " + path + ". " + strerror(errno));
+    }
+    if (fd != STDIN_FILENO)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    input.resize(ARCHIVE_BUFFER_SIZE);
+    output.resize(ARCHIVE_BUFFER_SIZE);
+    if (!fillInput() && !errorText.empty())
+    {
+        return false;
+    }
+
+    const unsigned char *magic = input.data() + inputPos;
+    size_t available = inputEnd - inputPos;
+    if (available >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+        compression = COMPRESSION_GZIP;
+        memset(&gzip, 0, sizeof(gzip));
+        // Automatic header detection would also accept zlib streams, so gzip is requested explicitly
+        if (inflateInit2(&gzip, 16 + MAX_WBITS) != Z_OK)
+        {
+            return fail("Unable to initialize gzip decompression");
+        }
+        gzipActive = true;
+    }
+    else if (available >= 4 && le32(magic) == 0xfd2fb528u)
+    {
+        compression = COMPRESSION_ZSTD;
+#ifdef HAVE_ZSTD
+        zstd = ZSTD_createDStream();
+        if (zstd == nullptr || ZSTD_isError(ZSTD_initDStream((ZSTD_DStream *)zstd)))
+        {
+            return fail("Unable to initialize zstd decompression");
+        }
+#else
+        return fail("zstd compressed archives are not supported by this build");
+#endif
+    }
+
+    // An empty stream is a valid (empty) tar archive
+    const unsigned char *header = peek(4);
+    zip = (header != nullptr && (le32(header) == ZIP_LOCAL_HEADER || le32(header) == ZIP_END_OF_CENTRAL_DIRECTORY));
+    return errorText.empty();
+}
+
+// Reads more raw bytes if the input buffer has been consumed. Returns false at the end of the file.
+bool ArchiveReader::fillInput()
+{
+    if (inputPos < inputEnd)
+    {
+        return true;
+    }
+    if (inputEof)
+    {
+        return false;
+    }
+    ssize_t count;
+    do
+    {
+        count = ::read(fd, input.data(), input.size());
+    } while (count < 0 && errno == EINTR);
+    if (count < 0)
+    {
+        return fail(std::string("Unable to read archive. ") + strerror(errno));
+    }
+    inputPos = 0;
+    inputEnd = count;
+    inputEof = (count == 0);
+    return count > 0;
+}
+
+// Appends decompressed bytes to the output buffer. Returns false if the stream has ended.
+bool ArchiveReader::fillOutput()
+{
+    if (outputPos > 0 && outputPos == outputEnd)
+    {
+        outputPos = outputEnd = 0;
+    }
+    else if (outputPos > 0 && output.size() - outputEnd < TAR_BLOCK_SIZE)
+    {
+        memmove(output.data(), output.data() + outputPos, outputEnd - outputPos);
+        outputEnd -= outputPos;
+        outputPos = 0;
+    }
+    size_t before = outputEnd;
+    while (outputEnd == before && !streamEof)
+    {
+        if (!fillInput())
+        {
+            streamEof = true;
+            break;
+        }
+        unsigned char *in = input.data() + inputPos;
+        size_t inSize = inputEnd - inputPos;
+        unsigned char *out = output.data() + outputEnd;
+        size_t outSize = output.size() - outputEnd;
+        if (compression == COMPRESSION_NONE)
+        {
+            size_t count = std::min(inSize, outSize);
+            memcpy(out, in, count);
+            inputPos += count;
+            outputEnd += count;
+        }
+        else if (compression == COMPRESSION_GZIP)
+        {
+            gzip.next_in = in;
+            gzip.avail_in = inSize;
+            gzip.next_out = out;
+            gzip.avail_out = outSize;
+            int status = inflate(&gzip, Z_NO_FLUSH);
+            inputPos += inSize - gzip.avail_in;
+            outputEnd += outSize - gzip.avail_out;
+            if (status == Z_STREAM_END)
+            {
+                // Concatenated gzip members (e.g., from pigz or appended archives) form one stream
+                inflateReset(&gzip);
+            }
+            else if (status != Z_OK && status != Z_BUF_ERROR)
+            {
+                return fail("Damaged gzip stream");
+            }
+        }
+#ifdef HAVE_ZSTD
+        else
+        {
+            ZSTD_inBuffer zin = {in, inSize, 0};
+            ZSTD_outBuffer zout = {out, outSize, 0};
+            size_t status = ZSTD_decompressStream((ZSTD_DStream *)zstd, &zout, &zin);
+            if (ZSTD_isError(status))
+            {
+                return fail(std::string("Damaged zstd stream. ") + ZSTD_getErrorName(status));
+            }
+            inputPos += zin.pos;
+            outputEnd += zout.pos;
+        }
+#endif
+    }
+    return outputEnd > before;
+}
+
+// Returns a pointer to the next bytes of the stream without consuming them, or nullptr if the
+// stream ends before
+const unsigned char *ArchiveReader::peek(size_t size)
+{
+    while (outputEnd - outputPos < size)
+    {
+        if (!fillOutput())
+        {
+            return nullptr;
+        }
+    }
+    return output.data() + outputPos;
+}
+
+size_t ArchiveReader::readStream(void *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        if (outputPos == outputEnd && !fillOutput())
+        {
+            break;
+        }
+        size_t count = std::min(size - done, outputEnd - outputPos);
+        memcpy((char *)buffer + done, output.data() + outputPos, count);
+        outputPos += count;
+        done += count;
+    }
+    return done;
+}
+
+bool ArchiveReader::skipStream(uint64_t size)
+{
+    while (size > 0)
+    {
+        if (outputPos == outputEnd && !fillOutput())
+        {
+            return fail("Unexpected end of archive");
+        }
+        size_t count = (size_t)std::min<uint64_t>(size, outputEnd - outputPos);
+        outputPos += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool ArchiveReader::next(ArchiveMember &member)
+{
+    if (!errorText.empty() || !finishMember())
+    {
+        return false;
+    }
+    return zip ? nextZip(member) : nextTar(member);
+}
+
+bool ArchiveReader::finishMember()
+{
+    if (!inMember)
+    {
+        return true;
+    }
+    bool success = zip ? finishZipMember() : skipStream(remaining + padding);
+    inMember = false;
+    return success;
+}
+
+// Parses a numeric tar field, which is octal or, for large values, base-256 (GNU)
+static uint64_t parseTarNumber(const unsigned char *field, size_t size)
+{
+    uint64_t value = 0;
+    if (field[0] & 0x80)
+    {
+        for (size_t i = 1; i < size; i++)
+        {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < size && field[i] != 0; i++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+        {
+            value = (value << 3) | (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+static std::string tarString(const unsigned char *field, size_t size)
+{
+    return std::string((const char *)field, strnlen((const char *)field, size));
+}
+
+// Extracts the path and size records of a pax extended header ("length key=value\n")
+static void parsePaxHeader(const std::string &records, std::string &path, int64_t &size)
+{
+    size_t pos = 0;
+    while (pos < records.size())
+    {
+        size_t space = records.find(' ', pos);
+        size_t length = (size_t)atol(records.c_str() + pos);
+        if (space == std::string::npos || length == 0 || pos + length > records.size())
+        {
+            return;
+        }
+        std::string record = records.substr(space + 1, pos + length - space - 2);
+        size_t equals = record.find('=');
+        if (equals != std::string::npos)
+        {
+            std::string key = record.substr(0, equals);
+            if (key == "path")
+            {
+                path = record.substr(equals + 1);
+            }
+            else if (key == "size")
+            {
+                size = atoll(record.c_str() + equals + 1);
+            }
+        }
+        pos += length;
+    }
+}
+
+bool ArchiveReader::nextTar(ArchiveMember &member)
+{
+    std::string longName;
+    int64_t paxSize = -1;
+    unsigned char header[TAR_BLOCK_SIZE];
+    while (true)
+    {
+        size_t count = readStream(header, sizeof(header));
+        if (count == 0 && errorText.empty())
+        {
+            // Archives that are cut after the last member are accepted as well
+            return false;
+        }
+        if (count < sizeof(header))
+        {
+            return fail("Unexpected end of archive");
+        }
+        if (std::all_of(header, header + sizeof(header), [](unsigned char c) { return c == 0; }))
+        {
+            // End-of-archive marker
+            return false;
+        }
+        unsigned int checksum = 0;
+        for (size_t i = 0; i < sizeof(header); i++)
+        {
+            checksum += (i >= 148 && i < 156) ? ' ' : header[i];
+        }
+        if (checksum != parseTarNumber(header + 148, 8))
+        {
+            return fail("Invalid tar header checksum");
+        }
+
+        uint64_t size = parseTarNumber(header + 124, 12);
+        if (paxSize >= 0)
+        {
+            size = paxSize;
+        }
+        char type = header[156];
+        if (type == 'L' || type == 'x')
+        {
+            // The extended header applies to the next member
+            if (size > 1024 * 1024)
+            {
+                return fail("Extended tar header too large");
+            }
+            std::string content(size, '\0');
+            if (readStream(&content[0], size) < size || !skipStream((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE))
+            {
+                return fail("Unexpected end of archive");
+            }
+            if (type == 'L')
+            {
+                longName = tarString((const unsigned char *)content.data(), content.size());
+            }
+            else
+            {
+                parsePaxHeader(content, longName, paxSize);
+            }
+            continue;
+        }
+
+        std::string name = longName;
+        if (name.empty())
+        {
+            name = tarString(header, 100);
+            if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0)
+            {
+                name = tarString(header + 345, 155) + "/" + name;
+            }
+        }
+        longName.clear();
+        paxSize = -1;
+
+        remaining = size;
+        padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        inMember = true;
+        if (type == '0' || type == '\0' || type == '7')
+        {
+            member.name = name;
+            member.size = (int64_t)size;
+            return true;
+        }
+        // Directories, links and other special members
+        if (!finishMember())
+        {
+            return false;
+        }
+    }
+}
+
+bool ArchiveReader::nextZip(ArchiveMember &member)
+{
+    while (true)
+    {
+        const unsigned char *signature = peek(4);
+        if (signature == nullptr)
+        {
+            return fail("Unexpected end of archive");
+        }
+        uint32_t tag = le32(signature);
+        if (tag == ZIP_CENTRAL_HEADER || tag == ZIP_END_OF_CENTRAL_DIRECTORY || tag == ZIP64_END_OF_CENTRAL_DIRECTORY)
+        {
+            // The central directory only repeats the local headers
+            return false;
+        }
+        unsigned char header[30];
+        if (tag != ZIP_LOCAL_HEADER || readStream(header, sizeof(header)) < sizeof(header))
+        {
+            return fail("Invalid zip header");
+        }
+        uint16_t flags = le16(header + 6);
+        uint16_t method = le16(header + 8);
+        expectedCrc = le32(header + 14);
+        uint64_t compressedSize = le32(header + 18);
+        uint64_t size = le32(header + 22);
+        std::string name(le16(header + 26), '\0');
+        std::string extra(le16(header + 28), '\0');
+        if (readStream(&name[0], name.size()) < name.size() || readStream(&extra[0], extra.size()) < extra.size())
+        {
+            return fail("Unexpected end of archive");
+        }
+
+        // Sizes of 4 GB and more are stored in the zip64 extra field
+        zip64 = false;
+        const unsigned char *field = (const unsigned char *)extra.data();
+        for (size_t pos = 0; pos + 4 <= extra.size();)
+        {
+            uint16_t id = le16(field + pos);
+            uint16_t length = le16(field + pos + 2);
+            if (id == 0x0001 && pos + 4 + length <= extra.size())
+            {
+                zip64 = true;
+                size_t value = pos + 4;
+                if (size == 0xffffffffu && value + 8 <= pos + 4 + length)
+                {
+                    size = le64(field + value);
+                    value += 8;
+                }
+                if (compressedSize == 0xffffffffu && value + 8 <= pos + 4 + length)
+                {
+                    compressedSize = le64(field + value);
+                }
+            }
+            pos += 4 + length;
+        }
+
+        dataDescriptor = (flags & 0x0008) != 0;
+        bool encrypted = (flags & 0x0001) != 0;
+        bool supported = !encrypted && (method == 0 || method == 8);
+        if (dataDescriptor && (method != 8 || encrypted))
+        {
+            // The end of the member could only be found with the central directory
+            return fail("Zip member " + name + " cannot be read from a stream (data descriptor)");
+        }
+        if (!supported || (!name.empty() && name.back() == '/'))
+        {
+            if (!supported)
+            {
+                std::cout << "WARNING: Skipping zip member " << name << (encrypted ? " (encrypted)" : " (unsupported compression method)") << std::endl;
+            }
+            if (!skipStream(compressedSize))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        deflated = (method == 8);
+        if (deflated)
+        {
+            if (!inflaterActive)
+            {
+                memset(&inflater, 0, sizeof(inflater));
+                if (inflateInit2(&inflater, -MAX_WBITS) != Z_OK)
+                {
+                    return fail("Unable to initialize deflate decompression");
+                }
+                inflaterActive = true;
+            }
+            else
+            {
+                inflateReset(&inflater);
+            }
+        }
+        remaining = deflated ? 0 : compressedSize;
+        crc = crc32(0L, Z_NULL, 0);
+        memberEnd = false;
+        inMember = true;
+        member.name = name;
+        member.size = dataDescriptor ? -1 : (int64_t)size;
+        return true;
+    }
+}
+
+// Reads the rest of the member, so that the checksum is verified and the stream is positioned
+// behind the data descriptor
+bool ArchiveReader::finishZipMember()
+{
+    char scratch[16384];
+    ssize_t count;
+    while ((count = read(scratch, sizeof(scratch))) > 0)
+    {
+    }
+    return count == 0;
+}
+
+ssize_t ArchiveReader::read(char *buffer, size_t size)
+{
+    if (!inMember || !errorText.empty())
+    {
+        return errorText.empty() ? 0 : -1;
+    }
+    if (!zip || !deflated)
+    {
+        if (remaining == 0)
+        {
+            if (zip && !memberEnd)
+            {
+                memberEnd = true;
+                if (crc != expectedCrc)
+                {
+                    fail("Checksum mismatch in zip member");
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        size_t count = readStream(buffer, (size_t)std::min<uint64_t>(size, remaining));
+        if (count == 0)
+        {
+            fail("Unexpected end of archive");
+            return -1;
+        }
+        remaining -= count;
+        if (zip)
+        {
+            crc = crc32(crc, (const Bytef *)buffer, count);
+        }
+        return count;
+    }
+
+    if (memberEnd)
+    {
+        return 0;
+    }
+    inflater.next_out = (Bytef *)buffer;
+    inflater.avail_out = size;
+    while (inflater.avail_out == size)
+    {
+        if (outputPos == outputEnd && !fillOutput())
+        {
+            fail("Unexpected end of archive");
+            return -1;
+        }
+        inflater.next_in = output.data() + outputPos;
+        inflater.avail_in = outputEnd - outputPos;
+        int status = inflate(&inflater, Z_NO_FLUSH);
+        outputPos = outputEnd - inflater.avail_in;
+        if (status == Z_STREAM_END)
+        {
+            memberEnd = true;
+            break;
+        }
+        if (status != Z_OK && status != Z_BUF_ERROR)
+        {
+            fail("Damaged zip member");
+            return -1;
+        }
+    }
+    size_t count = size - inflater.avail_out;
+    crc = crc32(crc, (const Bytef *)buffer, count);
+    if (memberEnd)
+    {
+        if (dataDescriptor)
+        {
+            // Optional signature, checksum and the sizes (64 bit if the local header has a zip64 field)
+            const unsigned char *descriptor = peek(4);
+            if (descriptor != nullptr && le32(descriptor) == ZIP_DATA_DESCRIPTOR)
+            {
+                skipStream(4);
+            }
+            unsigned char fields[20];
+            size_t fieldsSize = zip64 ? 20 : 12;
+            if (readStream(fields, fieldsSize) < fieldsSize)
+            {
+                fail("Unexpected end of archive");
+                return -1;
+            }
+            expectedCrc = le32(fields);
+        }
+        if (crc != expectedCrc)
+        {
+            fail("Checksum mismatch in zip member");
+            return -1;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,108 @@
+#ifndef GETDCMTAGS_ARCHIVE_H
+#define GETDCMTAGS_ARCHIVE_H
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+// Members up to this size are processed in memory. Larger members are streamed into the error
+// folder, as they cannot be handed to the workers.
+#define ARCHIVE_MAX_MEMBER_SIZE (1ULL << 30)
+
+// Regular file of an archive
+struct ArchiveMember
+{
+    // Path inside the archive
+    std::string name;
+    // -1 if the size is only known once the member has been read (zip with data descriptor)
+    int64_t size = -1;
+};
+
+// Reads the members of a tar or zip archive sequentially from a file or from stdin, without
+// seeking and without writing the members to disk. Tar archives may be compressed with gzip or,
+// if built with zstd support (HAVE_ZSTD), with zstd; the compression is detected from the magic
+// number. Zip members must be stored or deflated. Directories, links and other special members
+// are skipped.
+class ArchiveReader
+{
+public:
+    ArchiveReader() = default;
+    ArchiveReader(const ArchiveReader &) = delete;
+    ArchiveReader &operator=(const ArchiveReader &) = delete;
+    ~ArchiveReader();
+
+    // Opens the archive. "-" reads from stdin.
+    bool open(const std::string &path);
+
+    // Skips the rest of the current member and advances to the next regular file. Returns false
+    // at the end of the archive or if the archive is damaged, which error() tells apart.
+    bool next(ArchiveMember &member);
+
+    // Reads the content of the current member. Returns 0 at the end of the member and -1 if the
+    // archive is damaged.
+    ssize_t read(char *buffer, size_t size);
+
+    // Description of the last error, empty if the archive has been read completely
+    const std::string &error() const { return errorText; }
+
+    // "tar", "tar.gz", "tar.zst" or "zip" (with ".gz"/".zst" if the stream is compressed)
+    std::string format() const;
+
+private:
+    enum Compression
+    {
+        COMPRESSION_NONE,
+        COMPRESSION_GZIP,
+        COMPRESSION_ZSTD
+    };
+
+    bool fail(const std::string &text);
+    bool fillInput();
+    bool fillOutput();
+    const unsigned char *peek(size_t size);
+    size_t readStream(void *buffer, size_t size);
+    bool skipStream(uint64_t size);
+
+    bool nextTar(ArchiveMember &member);
+    bool nextZip(ArchiveMember &member);
+    bool finishMember();
+    bool finishZipMember();
+
+    int fd = -1;
+    Compression compression = COMPRESSION_NONE;
+    bool zip = false;
+    std::string errorText;
+
+    // Raw bytes from the file, and the decompressed stream with room for peeking
+    std::vector<unsigned char> input;
+    size_t inputPos = 0;
+    size_t inputEnd = 0;
+    bool inputEof = false;
+    std::vector<unsigned char> output;
+    size_t outputPos = 0;
+    size_t outputEnd = 0;
+    bool streamEof = false;
+    z_stream gzip;
+    bool gzipActive = false;
+    void *zstd = nullptr;
+
+    // State of the current member
+    bool inMember = false;
+    uint64_t remaining = 0;
+    uint64_t padding = 0;
+    // Zip members
+    bool deflated = false;
+    bool dataDescriptor = false;
+    bool zip64 = false;
+    bool memberEnd = false;
+    uint32_t expectedCrc = 0;
+    uint32_t crc = 0;
+    z_stream inflater;
+    bool inflaterActive = false;
+};
+
+#endif
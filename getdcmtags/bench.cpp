@@ -0,0 +1,403 @@
+// getdcmtags-bench
+// ================
+// Benchmarks and self-tests of the getdcmtags modules. Built as a separate executable, so that
+// the drivers are neither linked into the receiver nor listed in its usage text. Reads the extra
+// tags from ./dcm_extra_tags like getdcmtags, so that the same elements are parsed.
+//
+// Usage: getdcmtags-bench --benchmark-load [iterations] [dcm files...]
+//                         --benchmark-fingerprint [dcm files...]
+//                         --test-json-writer [iterations]
+//                         --benchmark-json-writer [iterations]
+//                         --benchmark-placement [files] [folder]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dcmtk/dcmdata/dctk.h"
+
+#include "tags_list.h"
+#include "fingerprint.h"
+#include "headerreader.h"
+#include "nativescanner.h"
+#include "placement.h"
+#include "tagplan.h"
+#include "tagswriter.h"
+
+static TagPlan extraTagPlan;
+
+static std::string jsonString(const char* value)
+{
+    std::string result;
+    appendEscapedJSONScalar(result, value, strlen(value));
+    return result;
+}
+
+// Previous escaping of the .tags values, kept as the reference for the JSON writer
+// (see https://stackoverflow.com/questions/7724448/simple-json-string-escape-for-c)
+static std::string escapeJSONValue(const OFString &s)
+{
+    std::ostringstream o;
+    for (auto c = s.begin(); c != s.end(); c++)
+    {
+        // Convert control characters into UTF8 coded version
+        if (*c == '"' || *c == '\\' || ('\x00' <= *c && *c <= '\x1f'))
+        {
+            o << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)*c;
+        }
+        else
+        {
+            o << *c;
+        }
+    }
+    return o.str();
+}
+
+// Returns the element at which getdcmtags stops parsing in the headers-only mode
+static DcmTagKey headerStopTag()
+{
+    Uint32 stopKey = scanKey(HEADER_STOP_TAG);
+    if (extraTagPlan.tags().size() > 0 && extraTagPlan.lastKey() >= stopKey) {
+        return DCM_UndefinedTagKey;
+    }
+    return HEADER_STOP_TAG;
+}
+
+// Returns the sorted keys of all top-level elements that getdcmtags reads from the dataset
+static std::vector<Uint32> nativeScanKeys()
+{
+    std::vector<Uint32> keys;
+    keys.push_back(scanKey(DCM_SpecificCharacterSet));
+    keys.push_back(scanKey(DCM_SOPInstanceUID));
+    keys.push_back(scanKey(DCM_SeriesInstanceUID));
+    for (auto tag: main_tags_list) {
+        keys.push_back(tag.sortKey());
+    }
+    keys.insert(keys.end(), extraTagPlan.sortedKeys(), extraTagPlan.sortedKeys() + extraTagPlan.tags().size());
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+// Compares the time for loading the given files with the full DCMTK file stream, with the
+// memory-mapped headers-only reader, and with the native scanner. Prints one JSON line per file.
+static int benchmarkLoad(int iterations, int fileCount, char *files[])
+{
+    if (access("./dcm_extra_tags", F_OK) == 0 && !extraTagPlan.load("./dcm_extra_tags")) {
+        std::cout << "ERROR: Unable to load ./dcm_extra_tags" << std::endl;
+        return 1;
+    }
+    DcmTagKey stopTag = headerStopTag();
+    std::vector<Uint32> scanKeys = nativeScanKeys();
+    for (int i = 0; i < fileCount; i++) {
+        OFString filename = OFString(files[i]);
+        struct stat fileInfo;
+        if (stat(files[i], &fileInfo) != 0) {
+            fileInfo.st_size = 0;
+        }
+        OFCondition status;
+        double fullTime = 0;
+        double headerTime = 0;
+        double nativeTime = 0;
+        bool nativeSupported = true;
+
+        // Warm up the page cache, so that both variants read the file from memory
+        DcmFileFormat warmup;
+        status = warmup.loadFile(filename);
+        if (!status.good()) {
+            std::cout << "ERROR: Unable to read DICOM file " << filename << std::endl;
+            return 1;
+        }
+
+        for (int j = 0; j < iterations; j++) {
+            DcmFileFormat fullFile;
+            auto start = std::chrono::steady_clock::now();
+            status = fullFile.loadFileUntilTag(filename, EXS_Unknown, EGL_noChange, 4096U, ERM_autoDetect, DCM_UndefinedTagKey);
+            fullTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+            DcmFileFormat headerFile;
+            start = std::chrono::steady_clock::now();
+            if (!loadFileHeader(headerFile, filename, stopTag, 4096U, status)) {
+                std::cout << "ERROR: Unable to map file " << filename << std::endl;
+                return 1;
+            }
+            headerTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+            DcmFileFormat nativeFile;
+            start = std::chrono::steady_clock::now();
+            nativeSupported = loadFileNative(nativeFile, filename, scanKeys, stopTag, status) && nativeSupported;
+            nativeTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        std::cout << "{\"file\": \"" << jsonString(files[i]) << "\", \"size\": " << fileInfo.st_size
+                  << ", \"iterations\": " << iterations
+                  << ", \"full_parse_us\": " << fullTime / iterations
+                  << ", \"headers_only_us\": " << headerTime / iterations;
+        if (nativeSupported) {
+            std::cout << ", \"native_scan_us\": " << nativeTime / iterations;
+        } else {
+            std::cout << ", \"native_scan_us\": null";
+        }
+        std::cout << "}" << std::endl;
+    }
+    return 0;
+}
+
+// Evicts the file from the page cache, so that the next pass reads it from disk
+static void dropPageCache(const char* filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Compares reading the pixel data of the given files from disk with reading and hashing it, and
+// measures the hashes on data from the page cache. Prints one JSON line per file with MB/s.
+static int benchmarkFingerprint(int fileCount, char *files[])
+{
+    std::vector<uint8_t> buffer;
+    for (int i = 0; i < fileCount; i++) {
+        struct Pass { const char* name; FingerprintMode mode; bool cached; };
+        const Pass passes[] = { {"read", FINGERPRINT_OFF, false}, {"xxh64", FINGERPRINT_FAST, false},
+                                {"sha256", FINGERPRINT_SHA256, false}, {"xxh64_cached", FINGERPRINT_FAST, true},
+                                {"sha256_cached", FINGERPRINT_SHA256, true} };
+        PixelFingerprint fingerprint;
+        std::cout << "{\"file\": \"" << jsonString(files[i]) << "\"";
+        for (const auto& pass : passes) {
+            if (!pass.cached) {
+                dropPageCache(files[i]);
+            }
+            auto start = std::chrono::steady_clock::now();
+            if (!fingerprintPixelData(files[i], pass.mode, buffer, fingerprint)) {
+                std::cout << "}" << std::endl << "ERROR: Unable to read pixel data of " << files[i] << std::endl;
+                return 1;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (pass.mode == FINGERPRINT_OFF) {
+                std::cout << ", \"pixel_bytes\": " << fingerprint.bytes;
+            }
+            std::cout << ", \"" << pass.name << "_mb_s\": " << (seconds > 0 ? fingerprint.bytes / seconds / 1e6 : 0);
+        }
+        std::cout << "}" << std::endl;
+    }
+    return 0;
+}
+
+// Measures how many received files per second can be placed into a series folder (including a
+// small .tags file) with each durability policy, committing after every file or in groups
+static int benchmarkPlacement(int count, const char* folder)
+{
+    std::string incoming = std::string(folder) + "/placement_incoming/";
+    std::string series = std::string(folder) + "/placement_series/";
+    if ((mkdir(incoming.c_str(), 0755) != 0 && errno != EEXIST) || (mkdir(series.c_str(), 0755) != 0 && errno != EEXIST)) {
+        std::cout << "ERROR: Unable to create benchmark folders in " << folder << std::endl;
+        return 1;
+    }
+    std::string content(512 * 1024, 'x');
+    std::string tags(2048, 't');
+    struct Variant { DurabilityPolicy policy; int groupSize; };
+    const Variant variants[] = { {DURABILITY_NONE, 1}, {DURABILITY_FILE, 1}, {DURABILITY_DIRECTORY, 1}, {DURABILITY_DIRECTORY, 32} };
+
+    std::cout << "{";
+    for (const auto& variant : variants) {
+        for (int i = 0; i < count; i++) {
+            FILE* fp = fopen((incoming + std::to_string(i)).c_str(), "w");
+            if (fp == nullptr || fwrite(content.data(), 1, content.size(), fp) != content.size() || fclose(fp) != 0) {
+                std::cout << "ERROR: Unable to create benchmark file" << std::endl;
+                return 1;
+            }
+        }
+        sync();
+
+        DurabilityJournal journal;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            std::string target = series + std::to_string(i) + ".dcm";
+            FILE* fp = fopen((series + std::to_string(i) + ".tags").c_str(), "w");
+            bool success = fp != nullptr && fwrite(tags.data(), 1, tags.size(), fp) == tags.size() && fclose(fp) == 0
+                           && placeFile(incoming + std::to_string(i), target, variant.policy, journal);
+            journal.add(series + std::to_string(i) + ".tags", variant.policy);
+            if (!success || ((i + 1) % variant.groupSize == 0 && !journal.commit())) {
+                std::cout << "ERROR: Unable to place benchmark file" << std::endl;
+                return 1;
+            }
+        }
+        journal.commit();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << (variant.policy == DURABILITY_NONE ? "" : ", ") << "\"" << durabilityPolicyName(variant.policy)
+                  << (variant.groupSize > 1 ? "_group" : "") << "_files_s\": " << count / seconds;
+
+        for (int i = 0; i < count; i++) {
+            remove((series + std::to_string(i) + ".dcm").c_str());
+            remove((series + std::to_string(i) + ".tags").c_str());
+        }
+    }
+    std::cout << "}" << std::endl;
+    rmdir(incoming.c_str());
+    rmdir(series.c_str());
+    return 0;
+}
+
+// Generates a random value for testing the JSON writer. Mostly printable characters, with
+// quotes, backslashes, control characters and non-ASCII bytes mixed in.
+static OFString randomTagValue(std::mt19937& rng, size_t maxLength)
+{
+    static const char specialChars[] = {'"', '\\', '\0', '\t', '\n', '\r', '\x1f', '\x7f', '\x80', '\xc3', '\xff'};
+    size_t length = rng() % (maxLength + 1);
+    std::string value;
+    for (size_t i = 0; i < length; i++) {
+        if (rng() % 8 == 0) {
+            value.push_back(specialChars[rng() % sizeof(specialChars)]);
+        } else {
+            value.push_back((char)(' ' + rng() % 95));
+        }
+    }
+    return OFString(value.data(), value.size());
+}
+
+// Serializes the values in the same way as the fprintf-based writer used previously
+static std::string serializeTagsLegacy(const std::vector<OFString>& values)
+{
+    char* data = nullptr;
+    size_t size = 0;
+    FILE* fp = open_memstream(&data, &size);
+    fprintf(fp, "{\n");
+    for (const auto& value: values) {
+        fprintf(fp, "\"%s\": \"%s\",\n", "Tag", escapeJSONValue(value).c_str());
+    }
+    fprintf(fp, "\"Filename\": \"%s\"\n", "file");
+    fprintf(fp, "}\n");
+    fclose(fp);
+    std::string result(data, size);
+    free(data);
+    return result;
+}
+
+static void serializeTags(TagsWriter& writer, const std::vector<OFString>& values)
+{
+    writer.begin();
+    for (const auto& value: values) {
+        writer.addValue("Tag", value.c_str(), value.length());
+    }
+    writer.end("Filename", "file");
+}
+
+// Compares the output of the JSON writer with the previous implementation for random documents
+static int testTagsWriter(int iterations)
+{
+    std::mt19937 rng(4711);
+    TagsWriter writer;
+    for (int i = 0; i < iterations; i++) {
+        std::vector<OFString> values;
+        size_t count = 1 + rng() % 60;
+        for (size_t j = 0; j < count; j++) {
+            // Long values cover the SIMD loops, short values the scalar tail
+            values.push_back(randomTagValue(rng, (j % 4 == 0) ? 300 : 40));
+        }
+        serializeTags(writer, values);
+        if (writer.data() != serializeTagsLegacy(values)) {
+            std::cout << "ERROR: JSON writer output differs from reference in document " << i << std::endl;
+            return 1;
+        }
+        for (const auto& value: values) {
+            std::string scalar;
+            appendEscapedJSONScalar(scalar, value.c_str(), value.length());
+            if (scalar != escapeJSONValue(value)) {
+                std::cout << "ERROR: Scalar JSON escaping differs from reference in document " << i << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::cout << "JSON writer matches reference for " << iterations << " documents" << std::endl;
+    return 0;
+}
+
+// Measures the throughput of escaping and serializing a typical .tags file (including writing
+// it to /dev/null) for the previous implementation and the JSON writer
+static int benchmarkTagsWriter(int iterations)
+{
+    std::mt19937 rng(4711);
+    std::vector<OFString> values;
+    size_t inputBytes = 0;
+    for (int i = 0; i < 60; i++) {
+        values.push_back((i % 10 == 0) ? randomTagValue(rng, 64) : OFString("1.2.840.113619.2.55.3.604688119.969.1268071029.320"));
+        inputBytes += values.back().length();
+    }
+
+    double legacyTime = 0;
+    double writerTime = 0;
+    TagsWriter writer;
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        FILE* fp = fopen("/dev/null", "w+");
+        if (fp == nullptr) {
+            std::cout << "ERROR: Unable to open /dev/null" << std::endl;
+            return 1;
+        }
+        fprintf(fp, "{\n");
+        for (const auto& value: values) {
+            fprintf(fp, "\"%s\": \"%s\",\n", "Tag", escapeJSONValue(value).c_str());
+        }
+        fprintf(fp, "\"Filename\": \"%s\"\n", "file");
+        fprintf(fp, "}\n");
+        fclose(fp);
+        legacyTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        serializeTags(writer, values);
+        writer.writeFile("/dev/null");
+        writerTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double megabytes = (double)inputBytes * iterations / (1024 * 1024);
+    std::cout << "{\"value_bytes\": " << inputBytes << ", \"iterations\": " << iterations
+              << ", \"legacy_mb_s\": " << megabytes / legacyTime
+              << ", \"writer_mb_s\": " << megabytes / writerTime << "}" << std::endl;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    dcmDataDict.isDictionaryLoaded();
+
+    if (argc >= 4 && strcmp(argv[1], "--benchmark-load") == 0) {
+        return benchmarkLoad(atoi(argv[2]), argc - 3, argv + 3);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--test-json-writer") == 0) {
+        return testTagsWriter(atoi(argv[2]));
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--benchmark-json-writer") == 0) {
+        return benchmarkTagsWriter(atoi(argv[2]));
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--benchmark-fingerprint") == 0) {
+        return benchmarkFingerprint(argc - 2, argv + 2);
+    }
+
+    if (argc == 4 && strcmp(argv[1], "--benchmark-placement") == 0) {
+        return benchmarkPlacement(atoi(argv[2]), argv[3]);
+    }
+
+    std::cout << "Usage: --benchmark-load [iterations] [dcm files...]" << std::endl
+              << "       --benchmark-fingerprint [dcm files...]" << std::endl
+              << "       --test-json-writer [iterations]" << std::endl
+              << "       --benchmark-json-writer [iterations]" << std::endl
+              << "       --benchmark-placement [files] [folder]" << std::endl;
+    return 1;
+}
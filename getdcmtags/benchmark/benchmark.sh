@@ -0,0 +1,14 @@
+#!/bin/bash
+set -euo pipefail
+
+# Generates the default corpus (only once, as it is reproducible) and benchmarks the getdcmtags
+# binary of the parent folder in all modes.
+# Usage: ./benchmark/benchmark.sh [arguments for run_benchmark.py, e.g. --compare benchmark-abc1234.json]
+
+folder="$(dirname "$(realpath "$0")")"
+corpus="$folder/corpus"
+
+if [ ! -e "$corpus/corpus.json" ]; then
+    python3 "$folder/generate_corpus.py" "$corpus"
+fi
+python3 "$folder/run_benchmark.py" "$corpus" --binary "$folder/../getdcmtags" "$@"
@@ -0,0 +1,42 @@
+#!/bin/bash
+set -euo pipefail
+
+# Builds getdcmtags with qmake (getdcmtags.pro) and with CMake (shared and static DCMTK, no Qt),
+# runs test.sh for each build and compares the startup time, per-file latency and peak RSS of the
+# CMake builds with the qmake build.
+# Usage: ./benchmark/compare_builds.sh [additional cmake arguments for the static build]
+
+folder="$(dirname "$(realpath "$0")")"
+source_folder="$(realpath "$folder/..")"
+builds="$folder/builds"
+corpus="$folder/corpus"
+modes="startup per_file stop_early"
+
+if [ ! -e "$corpus/corpus.json" ]; then
+    python3 "$folder/generate_corpus.py" "$corpus"
+fi
+
+rm -rf "$builds"
+mkdir -p "$builds/qmake"
+(cd "$builds/qmake" && qmake "$source_folder/getdcmtags.pro" && make -j"$(nproc)")
+cmake -S "$source_folder" -B "$builds/cmake" && cmake --build "$builds/cmake" -j"$(nproc)"
+cmake -S "$source_folder" -B "$builds/static" -DGETDCMTAGS_STATIC=ON "$@" && cmake --build "$builds/static" -j"$(nproc)"
+# getdcmtags.pro only builds the receiver, test.sh also needs the benchmark binary
+cp "$builds/cmake/getdcmtags-bench" "$builds/qmake/"
+
+# All builds have to pass the same tests
+for build in qmake cmake static; do
+    for file in test.sh test_engines.sh test_dcm; do
+        cp "$source_folder/$file" "$builds/$build/"
+    done
+    (cd "$builds/$build" && ./test.sh > test.log) || { cat "$builds/$build/test.log"; echo "test.sh failed for the $build build"; exit 1; }
+done
+
+python3 "$folder/run_benchmark.py" "$corpus" --binary "$builds/qmake/getdcmtags" --modes $modes --output "$builds/qmake.json"
+for build in cmake static; do
+    echo ""
+    echo "$build build:"
+    ls -l "$builds/$build/getdcmtags"
+    python3 "$folder/run_benchmark.py" "$corpus" --binary "$builds/$build/getdcmtags" --modes $modes \
+        --output "$builds/$build.json" --compare "$builds/qmake.json"
+done
@@ -0,0 +1,200 @@
+#!/usr/bin/python3
+"""
+generate_corpus.py
+==================
+Generates a reproducible synthetic corpus for benchmarking getdcmtags. The corpus covers different modalities,
+transfer syntaxes (including encapsulated pixel data), character sets (including ISO 2022 code extensions), large
+multi-frame files and deeply nested sequences. The same seed always produces the same files, so that benchmark
+results of different commits can be compared. Requires pydicom (pip install -r benchmark/requirements.txt).
+
+Usage: generate_corpus.py [output folder] [--files n] [--large n] [--seed n]
+"""
+
+import argparse
+import hashlib
+import json
+import random
+import sys
+from pathlib import Path
+from typing import Any, Dict, List
+
+import pydicom
+from pydicom.dataset import Dataset
+from pydicom.encaps import encapsulate
+from pydicom.uid import UID
+
+# The base dataset is the same as the one of the test series used by the Python tests
+sys.path.insert(0, str(Path(__file__).resolve().parents[2] / "app"))
+from common.generate_test_series import generate_file  # noqa: E402
+
+GENERATOR_VERSION = 1
+
+EXPLICIT_LITTLE = "1.2.840.10008.1.2.1"
+IMPLICIT_LITTLE = "1.2.840.10008.1.2"
+EXPLICIT_BIG = "1.2.840.10008.1.2.2"
+DEFLATED = "1.2.840.10008.1.2.1.99"
+JPEG_BASELINE = "1.2.840.10008.1.2.4.50"
+RLE_LOSSLESS = "1.2.840.10008.1.2.5"
+
+ENCAPSULATED = [JPEG_BASELINE, RLE_LOSSLESS]
+
+# Patient names in the respective character set. Multiple values select ISO 2022 code extensions.
+CHARSETS: Dict[str, Dict[str, Any]] = {
+    "latin1": {"value": "ISO_IR 100", "name": "Müller^Jürgen", "description": "Kopf/Hals nativ"},
+    "utf8": {"value": "ISO_IR 192", "name": "Ωmega^Jürgen=山田^太郎", "description": "Schädel ∅ KM"},
+    "cyrillic": {"value": "ISO_IR 144", "name": "Иванов^Пётр", "description": "Голова"},
+    "gb18030": {"value": "GB18030", "name": "王^小东", "description": "头部平扫"},
+    "japanese": {
+        "value": ["", "ISO 2022 IR 87"],
+        "name": "Yamada^Tarou=山田^太郎=やまだ^たろう",
+        "description": "Head",
+    },
+    "korean": {"value": ["", "ISO 2022 IR 149"], "name": "Hong^Gildong=洪^吉洞=홍^길동", "description": "Head"},
+}
+
+# Each profile describes one kind of file. Large multi-frame files are generated separately, as they dominate the
+# size of the corpus.
+PROFILES: List[Dict[str, Any]] = [
+    {"name": "mr", "modality": "MR", "sop_class": "1.2.840.10008.5.1.4.1.1.4", "syntax": EXPLICIT_LITTLE,
+     "charset": "latin1", "size": 256},
+    {"name": "ct_implicit", "modality": "CT", "sop_class": "1.2.840.10008.5.1.4.1.1.2", "syntax": IMPLICIT_LITTLE,
+     "charset": "utf8", "size": 512},
+    {"name": "cr_big_endian", "modality": "CR", "sop_class": "1.2.840.10008.5.1.4.1.1.1", "syntax": EXPLICIT_BIG,
+     "charset": "cyrillic", "size": 256},
+    {"name": "ct_deflated", "modality": "CT", "sop_class": "1.2.840.10008.5.1.4.1.1.2", "syntax": DEFLATED,
+     "charset": "gb18030", "size": 256},
+    {"name": "mr_jpeg", "modality": "MR", "sop_class": "1.2.840.10008.5.1.4.1.1.4", "syntax": JPEG_BASELINE,
+     "charset": "japanese", "size": 256},
+    {"name": "us_rle", "modality": "US", "sop_class": "1.2.840.10008.5.1.4.1.1.3.1", "syntax": RLE_LOSSLESS,
+     "charset": "korean", "size": 128, "frames": 10},
+    {"name": "sr_nested", "modality": "SR", "sop_class": "1.2.840.10008.5.1.4.1.1.88.33", "syntax": EXPLICIT_LITTLE,
+     "charset": "utf8", "sequence_depth": 6},
+]
+
+LARGE_PROFILE: Dict[str, Any] = {
+    "name": "mr_multiframe", "modality": "MR", "sop_class": "1.2.840.10008.5.1.4.1.1.4.1", "syntax": EXPLICIT_LITTLE,
+    "charset": "latin1", "size": 256, "frames": 200,
+}
+
+SERIES_SIZE = 10
+
+
+def make_uid(*sources: Any) -> str:
+    return pydicom.uid.generate_uid(prefix="1.2.826.0.1.3680043.10.543.", entropy_srcs=[str(s) for s in sources])
+
+
+def nested_sequence(depth: int, rng: random.Random) -> Dataset:
+    """Builds a content tree with two children per level, as found in structured reports."""
+    item = Dataset()
+    item.RelationshipType = "CONTAINS"
+    item.ValueType = "CONTAINER" if depth > 1 else "TEXT"
+    code = Dataset()
+    code.CodeValue = str(rng.randint(10000, 99999))
+    code.CodingSchemeDesignator = "DCM"
+    code.CodeMeaning = f"Finding {code.CodeValue}"
+    item.ConceptNameCodeSequence = [code]
+    if depth > 1:
+        item.ContinuityOfContent = "SEPARATE"
+        item.ContentSequence = [nested_sequence(depth - 1, rng) for _ in range(2)]
+    else:
+        item.TextValue = "No abnormality detected " * rng.randint(1, 4)
+    return item
+
+
+def generate_dataset(profile: Dict[str, Any], index: int, seed: int, rng: random.Random) -> Dataset:
+    series_index = index // SERIES_SIZE
+    study = f"{seed}{series_index // 3:05d}"
+    charset = CHARSETS[profile["charset"]]
+    ds = generate_file(
+        study,
+        make_uid(seed, profile["name"], "series", series_index),
+        index % SERIES_SIZE,
+        f"ACC{seed}{series_index:04d}",
+        make_uid(seed, "study", study),
+        f"{profile['name']} {charset['description']}",
+        None,
+        patient_name=charset["name"],
+        patient_id=f"PID{seed}{series_index // 3:04d}",
+        series_number=series_index + 1,
+    )
+    # Fixed values instead of the current time and random UIDs, so that the corpus is reproducible
+    ds.StudyDate = "20240102"
+    ds.StudyTime = "1030"
+    ds.SpecificCharacterSet = charset["value"]
+    ds.StudyDescription = charset["description"]
+    ds.Modality = profile["modality"]
+    ds.SOPClassUID = profile["sop_class"]
+    ds.SOPInstanceUID = make_uid(seed, profile["name"], index)
+    ds.file_meta.MediaStorageSOPClassUID = UID(profile["sop_class"])
+    ds.file_meta.MediaStorageSOPInstanceUID = UID(ds.SOPInstanceUID)
+    ds.file_meta.TransferSyntaxUID = UID(profile["syntax"])
+    ds.is_implicit_VR = profile["syntax"] == IMPLICIT_LITTLE
+    ds.is_little_endian = profile["syntax"] != EXPLICIT_BIG
+
+    if profile.get("sequence_depth"):
+        # Structured report without pixel data
+        for keyword in ["PixelData", "NumberOfFrames", "Rows", "Columns", "PixelSpacing", "BitsAllocated",
+                        "BitsStored", "HighBit", "PixelRepresentation", "SamplesPerPixel",
+                        "PhotometricInterpretation"]:
+            if keyword in ds:
+                delattr(ds, keyword)
+        ds.ValueType = "CONTAINER"
+        ds.ContentSequence = [nested_sequence(profile["sequence_depth"], rng) for _ in range(2)]
+        return ds
+
+    size = profile["size"]
+    frames = profile.get("frames", 1)
+    ds.Rows = size
+    ds.Columns = size
+    ds.NumberOfFrames = str(frames)
+    frame_length = size * size * 2
+    if profile["syntax"] in ENCAPSULATED:
+        # getdcmtags does not decode the pixel data, so the fragments only need a plausible size
+        ds.PixelData = encapsulate([rng.randbytes(frame_length // 4) for _ in range(frames)])
+        ds["PixelData"].VR = "OB"
+        ds["PixelData"].is_undefined_length = True
+    else:
+        ds.PixelData = rng.randbytes(frame_length * frames)
+        ds["PixelData"].VR = "OW"
+    return ds
+
+
+def generate_corpus(folder: Path, files: int, large: int, seed: int) -> Dict[str, Any]:
+    folder.mkdir(parents=True, exist_ok=True)
+    rng = random.Random(seed)
+    plan = [(PROFILES[i % len(PROFILES)], i // len(PROFILES)) for i in range(files)]
+    plan += [(LARGE_PROFILE, i) for i in range(large)]
+    entries = []
+    digest = hashlib.sha256()
+    for profile, index in plan:
+        ds = generate_dataset(profile, index, seed, rng)
+        name = f"{profile['name']}.{index:05d}"
+        ds.save_as(folder / name, write_like_original=False)
+        content = (folder / name).read_bytes()
+        digest.update(content)
+        entries.append({"file": name, "profile": profile["name"], "size": len(content)})
+    manifest = {
+        "generator_version": GENERATOR_VERSION,
+        "seed": seed,
+        "files": len(entries),
+        "bytes": sum(e["size"] for e in entries),
+        "sha256": digest.hexdigest(),
+        "entries": entries,
+    }
+    (folder / "corpus.json").write_text(json.dumps(manifest, indent=2))
+    return manifest
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Generate a synthetic DICOM corpus for benchmarking getdcmtags")
+    parser.add_argument("folder", help="Output folder")
+    parser.add_argument("--files", type=int, default=700, help="Number of regular files")
+    parser.add_argument("--large", type=int, default=4, help="Number of large multi-frame files (about 26 MB each)")
+    parser.add_argument("--seed", type=int, default=1, help="Seed of the generated content")
+    args = parser.parse_args()
+    manifest = generate_corpus(Path(args.folder), args.files, args.large, args.seed)
+    print(f"Generated {manifest['files']} files ({manifest['bytes'] / 1e6:.1f} MB), sha256 {manifest['sha256']}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,360 @@
+#!/usr/bin/python3
+"""
+run_benchmark.py
+================
+Measures the throughput, latency and memory use of getdcmtags on a corpus created with generate_corpus.py, for
+each way in which the receiver can run getdcmtags. The results are stored as JSON, so that they can be compared
+with the results of another commit (--compare). Runs offline and only needs the Python standard library.
+
+Modes:
+  startup      process start without a file (usage output), i.e., loading the libraries and static initialization
+  per_file     one getdcmtags process per file, as started by storescp
+  stop_early   same with --tags-stop-early
+  native       same with --engine native
+  fingerprint  same with --fingerprint sha256, plus the pixel data throughput of getdcmtags-bench
+               --benchmark-fingerprint (if built): reading from disk (page cache dropped) against reading and hashing
+               with XXH64 and SHA-256
+  batch        all files with --batch
+  archive      all files as tar.gz with --archive, compared with unpacking the archive with tar and using --batch
+  daemon       one getdcmtags-client process per file, handled by getdcmtags --daemon
+  scp          all files sent with storescu to getdcmtags --scp (if storescu is installed)
+
+The files are copied into the work folder before each mode, which also warms up the page cache, so that the
+results do not depend on the disk.
+
+The peak RSS of a process started from Python includes the memory of the Python process before the exec, so the
+short-lived processes are measured with GNU time (/usr/bin/time, if installed) and the long-running ones with
+VmHWM. Without GNU time, the peak RSS of the short-lived processes is not reported.
+
+Usage: run_benchmark.py [corpus folder] [--binary path] [--modes ...] [--output file] [--compare baseline.json]
+"""
+
+import argparse
+import datetime
+import json
+import math
+import os
+import platform
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tarfile
+import tempfile
+import time
+from pathlib import Path
+from typing import Any, Dict, List, Optional, Tuple
+
+BENCHMARK_VERSION = 1
+ALL_MODES = ["startup", "per_file", "stop_early", "native", "fingerprint", "batch", "archive", "daemon", "scp"]
+SCP_PORT = 18140
+STARTUP_RUNS = 200
+GNU_TIME = "/usr/bin/time"
+
+
+def run_timed(args: List[str], measure_rss: bool = True) -> Tuple[float, int, int]:
+    """Runs the command and returns the elapsed seconds, the peak RSS of the process in KB (0 if unknown) and the
+    exit code."""
+    rss_file = None
+    if measure_rss and os.path.exists(GNU_TIME):
+        rss_file = tempfile.NamedTemporaryFile(prefix="getdcmtags_rss_", mode="r")
+        args = [GNU_TIME, "-f", "%M", "-o", rss_file.name] + args
+    start = time.perf_counter()
+    process = subprocess.run(args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    elapsed = time.perf_counter() - start
+    peak_rss = 0
+    if rss_file is not None:
+        with rss_file:
+            lines = rss_file.read().split()
+            peak_rss = int(lines[-1]) if lines and lines[-1].isdigit() else 0
+    return elapsed, peak_rss, process.returncode
+
+
+def running_peak_rss(pid: int) -> int:
+    """Returns the peak RSS of a running process in KB."""
+    try:
+        with open(f"/proc/{pid}/status") as status:
+            for line in status:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+def stop_process(process: subprocess.Popen) -> int:
+    """Terminates a background process and returns its peak RSS in KB."""
+    peak_rss = running_peak_rss(process.pid)
+    process.send_signal(signal.SIGTERM)
+    process.wait()
+    return peak_rss
+
+
+def percentile(values: List[float], fraction: float) -> Optional[float]:
+    if not values:
+        return None
+    ordered = sorted(values)
+    return ordered[max(0, min(len(ordered) - 1, math.ceil(fraction * len(ordered)) - 1))]
+
+
+def prepare_incoming(corpus: List[Path], work: Path) -> Tuple[Path, List[Path]]:
+    incoming = work / "incoming"
+    shutil.rmtree(incoming, ignore_errors=True)
+    incoming.mkdir(parents=True)
+    files = []
+    for source in corpus:
+        shutil.copy(source, incoming / source.name)
+        files.append(incoming / source.name)
+    return incoming, files
+
+
+def summarize(files: int, size: int, seconds: float, latencies: List[float], peak_rss: int, errors: int) -> Dict[str, Any]:
+    p50 = percentile(latencies, 0.5)
+    p99 = percentile(latencies, 0.99)
+    return {
+        "files": files,
+        "bytes": size,
+        "seconds": round(seconds, 4),
+        "files_per_s": round(files / seconds, 2) if seconds > 0 else None,
+        "mb_per_s": round(size / 1e6 / seconds, 2) if seconds > 0 else None,
+        "p50_ms": round(p50 * 1000, 3) if p50 is not None else None,
+        "p99_ms": round(p99 * 1000, 3) if p99 is not None else None,
+        "peak_rss_kb": peak_rss,
+        "errors": errors,
+    }
+
+
+def fingerprint_throughput(binary: str, corpus: List[Path]) -> Dict[str, Any]:
+    """Runs --benchmark-fingerprint on the files and returns the MB/s of each pass over all pixel data."""
+    bench = str(Path(binary).parent / "getdcmtags-bench")
+    if not os.path.exists(bench):
+        print(f"Skipping pixel data throughput, {bench} not found")
+        return {}
+    output = subprocess.run([bench, "--benchmark-fingerprint"] + [str(f) for f in corpus], stdout=subprocess.PIPE, text=True)
+    pixel_bytes = 0
+    seconds: Dict[str, float] = {}
+    for line in output.stdout.splitlines():
+        if not line.startswith("{"):
+            continue
+        result = json.loads(line)
+        pixel_bytes += result["pixel_bytes"]
+        for key, value in result.items():
+            if key.endswith("_mb_s") and value:
+                seconds[key] = seconds.get(key, 0) + result["pixel_bytes"] / 1e6 / value
+    return {"pixel_bytes": pixel_bytes, **{key: round(pixel_bytes / 1e6 / value, 1) for key, value in seconds.items() if value > 0}}
+
+
+def wait_for(condition, timeout: float = 10) -> bool:
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if condition():
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def port_open(port: int) -> bool:
+    try:
+        with socket.create_connection(("127.0.0.1", port), timeout=0.2):
+            return True
+    except OSError:
+        return False
+
+
+def run_mode(mode: str, binary: str, corpus: List[Path], work: Path, threads: int) -> Optional[Dict[str, Any]]:
+    size = sum(f.stat().st_size for f in corpus)
+    incoming, files = prepare_incoming(corpus, work)
+    receiver_args = ["sender_address", "sender_aet", "receiver_aet", "", ""]
+
+    if mode == "startup":
+        latencies = []
+        peak_rss = 0
+        errors = 0
+        for _ in range(STARTUP_RUNS):
+            elapsed, rss, code = run_timed([binary])
+            latencies.append(elapsed)
+            peak_rss = max(peak_rss, rss)
+            errors += 1 if code != 0 else 0
+        return summarize(STARTUP_RUNS, 0, sum(latencies), latencies, peak_rss, errors)
+
+    if mode in ("per_file", "stop_early", "native", "fingerprint"):
+        options = {
+            "per_file": [],
+            "stop_early": ["--tags-stop-early"],
+            "native": ["--engine", "native"],
+            "fingerprint": ["--fingerprint", "sha256"],
+        }[mode]
+        # The files are moved into the series folders, so the throughput is measured on the corpus
+        throughput = fingerprint_throughput(binary, corpus) if mode == "fingerprint" else {}
+        latencies = []
+        peak_rss = 0
+        errors = 0
+        for file in files:
+            elapsed, rss, code = run_timed([binary, str(file)] + receiver_args + options)
+            latencies.append(elapsed)
+            peak_rss = max(peak_rss, rss)
+            errors += 1 if code != 0 else 0
+        return {**summarize(len(files), size, sum(latencies), latencies, peak_rss, errors), **throughput}
+
+    if mode == "batch":
+        elapsed, rss, code = run_timed([binary, "--batch", str(incoming)] + receiver_args + ["--threads", str(threads)])
+        return summarize(len(files), size, elapsed, [], rss, 0 if code == 0 else len(list((incoming / "error").glob("*.dcm"))))
+
+    if mode == "archive":
+        archive = work / "corpus.tar.gz"
+        with tarfile.open(archive, "w:gz") as bundle:
+            for file in corpus:
+                bundle.add(str(file), arcname=file.name)
+        batch_args = receiver_args + ["--threads", str(threads)]
+        shutil.rmtree(incoming)
+        incoming.mkdir()
+        unpack_elapsed, _, unpack_code = run_timed(["tar", "-xzf", str(archive), "-C", str(incoming)], measure_rss=False)
+        batch_elapsed, _, _ = run_timed([binary, "--batch", str(incoming)] + batch_args, measure_rss=False)
+        shutil.rmtree(incoming)
+        incoming.mkdir()
+        elapsed, rss, code = run_timed([binary, "--archive", str(archive), str(incoming)] + batch_args)
+        archive.unlink()
+        baseline_seconds = unpack_elapsed + batch_elapsed
+        return {
+            **summarize(len(files), size, elapsed, [], rss, 0 if code == 0 else len(list((incoming / "error").glob("*.dcm")))),
+            "unpack_then_batch_s": round(baseline_seconds, 4) if unpack_code == 0 else None,
+            "unpack_then_batch_files_per_s": round(len(files) / baseline_seconds, 2) if unpack_code == 0 and baseline_seconds > 0 else None,
+        }
+
+    if mode == "daemon":
+        client = str(Path(binary).parent / "getdcmtags-client")
+        if not os.path.exists(client):
+            print(f"Skipping daemon mode, {client} not found")
+            return None
+        socket_path = str(work / "getdcmtags.sock")
+        daemon = subprocess.Popen([binary, "--daemon", socket_path], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        if not wait_for(lambda: os.path.exists(socket_path)):
+            stop_process(daemon)
+            print("Skipping daemon mode, daemon did not start")
+            return None
+        latencies = []
+        errors = 0
+        for file in files:
+            elapsed, _, code = run_timed([client, socket_path, binary, str(file)] + receiver_args, measure_rss=False)
+            latencies.append(elapsed)
+            errors += 1 if code != 0 else 0
+        peak_rss = stop_process(daemon)
+        return summarize(len(files), size, sum(latencies), latencies, peak_rss, errors)
+
+    if mode == "scp":
+        storescu = shutil.which("storescu")
+        if storescu is None:
+            print("Skipping scp mode, storescu not found")
+            return None
+        # The files are sent from the corpus folder, the SCP writes into the empty incoming folder
+        for file in files:
+            file.unlink()
+        scp = subprocess.Popen(
+            [binary, "--scp", str(SCP_PORT), str(incoming), "", "", "--threads", str(threads), "--accept-compressed"],
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+        )
+        if not wait_for(lambda: port_open(SCP_PORT)):
+            stop_process(scp)
+            print("Skipping scp mode, getdcmtags --scp did not start")
+            return None
+        elapsed, _, code = run_timed([storescu, "-aec", "BENCHMARK", "localhost", str(SCP_PORT)] + [str(f) for f in corpus], measure_rss=False)
+        peak_rss = stop_process(scp)
+        errors = len(list((incoming / "error").glob("*.dcm"))) + (1 if code != 0 else 0)
+        return summarize(len(files), size, elapsed, [], peak_rss, errors)
+
+    raise ValueError(f"Unknown mode {mode}")
+
+
+def git_commit() -> Tuple[str, bool]:
+    try:
+        folder = Path(__file__).resolve().parent.parent
+        commit = subprocess.check_output(
+            ["git", "rev-parse", "--short", "HEAD"], cwd=folder, text=True, stderr=subprocess.DEVNULL
+        ).strip()
+        dirty = subprocess.call(["git", "diff", "--quiet", "HEAD", "--", "."], cwd=folder, stderr=subprocess.DEVNULL) != 0
+        return commit, dirty
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown", False
+
+
+def binary_version(binary: str) -> str:
+    try:
+        output = subprocess.run([binary], capture_output=True, text=True, timeout=10).stdout
+    except (OSError, subprocess.TimeoutExpired):
+        return "unknown"
+    for line in output.splitlines():
+        if "Version" in line:
+            return line.strip()
+    return "unknown"
+
+
+def compare(results: Dict[str, Any], baseline: Dict[str, Any], max_regression: Optional[float]) -> bool:
+    """Prints the changes against the baseline. Returns False if a mode has regressed more than allowed."""
+    if results["corpus"].get("sha256") != baseline["corpus"].get("sha256"):
+        print("WARNING: The baseline has been measured on a different corpus")
+    print(f"Comparison with {baseline.get('commit')} ({baseline.get('timestamp')}):")
+    success = True
+    for mode, current in results["modes"].items():
+        previous = baseline["modes"].get(mode)
+        if not previous or not previous.get("files_per_s") or not current.get("files_per_s"):
+            continue
+        change = current["files_per_s"] / previous["files_per_s"] - 1
+        line = f"  {mode:12} {previous['files_per_s']:10.1f} -> {current['files_per_s']:10.1f} files/s ({change:+.1%})"
+        if previous.get("p99_ms") and current.get("p99_ms"):
+            line += f", p99 {previous['p99_ms']:.2f} -> {current['p99_ms']:.2f} ms"
+        line += f", peak RSS {previous['peak_rss_kb']} -> {current['peak_rss_kb']} KB"
+        if max_regression is not None and change < -max_regression:
+            line += "  REGRESSION"
+            success = False
+        print(line)
+    return success
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Benchmark getdcmtags on a synthetic corpus")
+    parser.add_argument("corpus", help="Folder created with generate_corpus.py")
+    parser.add_argument("--binary", default="./getdcmtags", help="getdcmtags binary")
+    parser.add_argument("--modes", nargs="+", default=ALL_MODES, choices=ALL_MODES)
+    parser.add_argument("--threads", type=int, default=os.cpu_count() or 1, help="Threads for batch and scp mode")
+    parser.add_argument("--output", help="Result file (default: benchmark-<commit>.json)")
+    parser.add_argument("--compare", help="Result file of an earlier run to compare with")
+    parser.add_argument("--max-regression", type=float, help="Fail if the throughput drops by more than this fraction")
+    args = parser.parse_args()
+
+    corpus_folder = Path(args.corpus)
+    manifest = json.loads((corpus_folder / "corpus.json").read_text())
+    corpus = [corpus_folder / entry["file"] for entry in manifest["entries"]]
+    binary = str(Path(args.binary).resolve())
+    commit, dirty = git_commit()
+
+    results: Dict[str, Any] = {
+        "benchmark_version": BENCHMARK_VERSION,
+        "commit": commit,
+        "dirty": dirty,
+        "timestamp": datetime.datetime.now().isoformat(timespec="seconds"),
+        "binary_version": binary_version(binary),
+        "host": {"platform": platform.platform(), "cpus": os.cpu_count()},
+        "corpus": {key: manifest[key] for key in ["generator_version", "seed", "files", "bytes", "sha256"]},
+        "modes": {},
+    }
+    with tempfile.TemporaryDirectory(prefix="getdcmtags_benchmark_") as work:
+        for mode in args.modes:
+            print(f"Running {mode} on {len(corpus)} files")
+            summary = run_mode(mode, binary, corpus, Path(work), args.threads)
+            if summary is not None:
+                results["modes"][mode] = summary
+                print(f"  {json.dumps(summary)}")
+
+    output = args.output or f"benchmark-{commit}{'-dirty' if dirty else ''}.json"
+    Path(output).write_text(json.dumps(results, indent=2))
+    print(f"Results written to {output}")
+
+    if args.compare:
+        if not compare(results, json.loads(Path(args.compare).read_text()), args.max_regression):
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,491 @@
+#include "binaryindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#define BINARY_INDEX_VERSION 1
+#define RECORD_HEADER 1
+#define RECORD_INSTANCE 2
+
+#define FILE_MODE_COMPLETE 0
+#define FILE_MODE_SUFFIX 1
+#define FILE_MODE_FILENAME_TAG 2
+
+// Upper limit for the number of series headers kept in memory (daemon and batch mode)
+#define MAX_CACHED_HEADERS 64
+
+static const char MAGIC[8] = {'M', 'T', 'A', 'G', 'I', 'D', 'X', BINARY_INDEX_VERSION};
+
+struct SeriesHeader
+{
+    TagValues tags;
+    std::unordered_map<std::string, size_t> positions;
+};
+
+// The header of an index never changes after it has been created, so it can be cached
+static std::mutex headerCacheMutex;
+static std::map<std::string, std::shared_ptr<const SeriesHeader>> headerCache;
+
+static void putVarint(std::string &out, size_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)(0x80 | (value & 0x7F)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static void putString(std::string &out, const char *value, size_t length)
+{
+    putVarint(out, length);
+    out.append(value, length);
+}
+
+static void putString(std::string &out, const std::string &value)
+{
+    putString(out, value.data(), value.size());
+}
+
+static void putRecord(std::string &out, int type, const std::string &payload)
+{
+    out.push_back((char)type);
+    putVarint(out, payload.size());
+    out.append(payload);
+}
+
+// Sequential reader over a memory buffer. All functions return false if the data ends early.
+struct Reader
+{
+    const char *pos;
+    const char *end;
+
+    bool getVarint(size_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && pos < end; shift += 7)
+        {
+            unsigned char c = (unsigned char)*pos++;
+            value |= (size_t)(c & 0x7F) << shift;
+            if (!(c & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool getString(std::string &value)
+    {
+        size_t length;
+        if (!getVarint(length) || length > (size_t)(end - pos))
+        {
+            return false;
+        }
+        value.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+static bool parseHeader(Reader &reader, std::string &seriesUID, TagValues &tags)
+{
+    size_t count;
+    if (!reader.getString(seriesUID) || !reader.getVarint(count))
+    {
+        return false;
+    }
+    tags.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string name, value;
+        if (!reader.getString(name) || !reader.getString(value))
+        {
+            return false;
+        }
+        tags.emplace_back(name, value);
+    }
+    return true;
+}
+
+static bool parseInstance(Reader &reader, const std::string &seriesUID, const TagValues &seriesTags,
+                          BinaryIndexInstance &instance)
+{
+    size_t fileMode, count;
+    std::string file;
+    if (!reader.getVarint(fileMode) || (fileMode != FILE_MODE_FILENAME_TAG && !reader.getString(file))
+        || !reader.getVarint(count))
+    {
+        return false;
+    }
+    std::vector<bool> absent(seriesTags.size(), false);
+    instance.tags = seriesTags;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t reference, valueLength;
+        std::string name;
+        if (!reader.getVarint(reference) || reference > seriesTags.size()
+            || (reference == 0 && !reader.getString(name)) || !reader.getVarint(valueLength)
+            || (valueLength > 0 && valueLength - 1 > (size_t)(reader.end - reader.pos)))
+        {
+            return false;
+        }
+        if (valueLength == 0)
+        {
+            if (reference > 0)
+            {
+                absent[reference - 1] = true;
+            }
+            continue;
+        }
+        std::string value(reader.pos, valueLength - 1);
+        reader.pos += valueLength - 1;
+        if (reference > 0)
+        {
+            instance.tags[reference - 1].second = value;
+        }
+        else
+        {
+            instance.tags.emplace_back(name, value);
+        }
+    }
+    for (size_t i = absent.size(); i-- > 0;)
+    {
+        if (absent[i])
+        {
+            instance.tags.erase(instance.tags.begin() + i);
+        }
+    }
+
+    switch (fileMode)
+    {
+    case FILE_MODE_COMPLETE:
+        instance.file = file;
+        break;
+    case FILE_MODE_SUFFIX:
+        instance.file = seriesUID + "#" + file;
+        break;
+    case FILE_MODE_FILENAME_TAG:
+        instance.file = seriesUID + "#";
+        for (const auto &tag : instance.tags)
+        {
+            if (tag.first == "Filename")
+            {
+                instance.file += tag.second;
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static bool readAt(int fd, off_t offset, size_t size, std::string &out)
+{
+    out.resize(size);
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t result = pread(fd, &out[done], size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            out.resize(done);
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+// Reads only the header record of an existing index
+static std::shared_ptr<const SeriesHeader> readHeader(const std::string &indexFile)
+{
+    int fd = open(indexFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    std::string data;
+    readAt(fd, 0, 4096, data);
+    Reader reader{data.data(), data.data() + data.size()};
+    size_t payloadLength = 0;
+    bool valid = data.size() > sizeof(MAGIC) && memcmp(data.data(), MAGIC, sizeof(MAGIC)) == 0
+                 && data[sizeof(MAGIC)] == RECORD_HEADER;
+    if (valid)
+    {
+        reader.pos += sizeof(MAGIC) + 1;
+        valid = reader.getVarint(payloadLength);
+    }
+    if (valid && payloadLength > (size_t)(reader.end - reader.pos))
+    {
+        // Header larger than the first block
+        size_t offset = reader.pos - data.data();
+        valid = readAt(fd, 0, offset + payloadLength, data);
+        reader = Reader{data.data() + offset, data.data() + data.size()};
+    }
+    close(fd);
+
+    std::shared_ptr<SeriesHeader> header(new SeriesHeader());
+    std::string seriesUID;
+    if (!valid || !parseHeader(reader, seriesUID, header->tags))
+    {
+        return nullptr;
+    }
+    for (size_t i = 0; i < header->tags.size(); i++)
+    {
+        header->positions.emplace(header->tags[i].first, i);
+    }
+    return header;
+}
+
+static bool writeAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t result = write(fd, data.data() + written, data.size() - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+// Creates the index with the given tags as series header. As for the JSON index, the file is
+// prepared under a temporary name and then linked, so that the header is always complete.
+static bool createIndex(const std::string &indexFile, const std::string &seriesUID, const TagsWriter &tags)
+{
+    std::string payload;
+    putString(payload, seriesUID);
+    putVarint(payload, tags.fields().size());
+    for (const auto &field : tags.fields())
+    {
+        putString(payload, field.name, strlen(field.name));
+        putString(payload, tags.fieldValue(field));
+    }
+    std::string content(MAGIC, sizeof(MAGIC));
+    putRecord(content, RECORD_HEADER, payload);
+
+    std::string tempFile = indexFile + ".XXXXXX";
+    int fd = mkstemp(&tempFile[0]);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to create series index " << tempFile << std::endl;
+        return false;
+    }
+    fchmod(fd, 0644);
+    bool success = writeAll(fd, content);
+    success = (close(fd) == 0) && success;
+    if (success && link(tempFile.c_str(), indexFile.c_str()) != 0 && errno != EEXIST)
+    {
+        success = false;
+    }
+    unlink(tempFile.c_str());
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to create series index " << indexFile << std::endl;
+    }
+    return success;
+}
+
+static std::shared_ptr<const SeriesHeader> getHeader(const std::string &indexFile, const std::string &seriesUID,
+                                                     const TagsWriter &tags)
+{
+    {
+        std::lock_guard<std::mutex> lock(headerCacheMutex);
+        auto it = headerCache.find(indexFile);
+        if (it != headerCache.end())
+        {
+            return it->second;
+        }
+    }
+    // The series folder may have been removed and created again by now, so an index that
+    // disappeared is created again
+    std::shared_ptr<const SeriesHeader> header = readHeader(indexFile);
+    if (!header && access(indexFile.c_str(), F_OK) != 0)
+    {
+        if (!createIndex(indexFile, seriesUID, tags))
+        {
+            return nullptr;
+        }
+        header = readHeader(indexFile);
+    }
+    if (!header)
+    {
+        std::cout << "ERROR: Invalid series index " << indexFile << std::endl;
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(headerCacheMutex);
+    if (headerCache.size() >= MAX_CACHED_HEADERS)
+    {
+        headerCache.clear();
+    }
+    headerCache[indexFile] = header;
+    return header;
+}
+
+bool appendBinarySeriesIndex(const std::string &seriesFolder, const std::string &seriesUID, const std::string &fileStem,
+                             const TagsWriter &tags)
+{
+    std::string indexFile = seriesFolder + seriesUID + ".index.bin";
+    std::shared_ptr<const SeriesHeader> header = getHeader(indexFile, seriesUID, tags);
+    if (!header)
+    {
+        return false;
+    }
+
+    // Collect the values that differ from the header
+    std::string deltas;
+    size_t deltaCount = 0;
+    std::vector<bool> present(header->tags.size(), false);
+    std::string filenameTag;
+    for (const auto &field : tags.fields())
+    {
+        std::string value = tags.fieldValue(field);
+        if (strcmp(field.name, "Filename") == 0)
+        {
+            filenameTag = value;
+        }
+        auto it = header->positions.find(field.name);
+        if (it != header->positions.end())
+        {
+            present[it->second] = true;
+            if (header->tags[it->second].second == value)
+            {
+                continue;
+            }
+            putVarint(deltas, it->second + 1);
+        }
+        else
+        {
+            putVarint(deltas, 0);
+            putString(deltas, field.name, strlen(field.name));
+        }
+        putVarint(deltas, value.size() + 1);
+        deltas.append(value);
+        deltaCount++;
+    }
+    for (size_t i = 0; i < present.size(); i++)
+    {
+        if (!present[i])
+        {
+            putVarint(deltas, i + 1);
+            putVarint(deltas, 0);
+            deltaCount++;
+        }
+    }
+
+    std::string payload;
+    std::string prefix = seriesUID + "#";
+    if (fileStem.compare(0, prefix.size(), prefix) != 0)
+    {
+        putVarint(payload, FILE_MODE_COMPLETE);
+        putString(payload, fileStem);
+    }
+    else if (fileStem.compare(prefix.size(), std::string::npos, filenameTag) == 0)
+    {
+        putVarint(payload, FILE_MODE_FILENAME_TAG);
+    }
+    else
+    {
+        putVarint(payload, FILE_MODE_SUFFIX);
+        putString(payload, fileStem.substr(prefix.size()));
+    }
+    putVarint(payload, deltaCount);
+    payload.append(deltas);
+
+    std::string record;
+    putRecord(record, RECORD_INSTANCE, payload);
+
+    int fd = open(indexFile.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to open series index " << indexFile << std::endl;
+        return false;
+    }
+    ssize_t result;
+    do
+    {
+        result = write(fd, record.data(), record.size());
+    } while (result < 0 && errno == EINTR);
+    bool success = (result == (ssize_t)record.size());
+    success = (close(fd) == 0) && success;
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to append to series index " << indexFile << std::endl;
+    }
+    return success;
+}
+
+bool readBinarySeriesIndex(const std::string &filename, std::string &seriesUID, TagValues &seriesTags,
+                           std::vector<BinaryIndexInstance> &instances)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    std::string data;
+    bool success = fstat(fd, &info) == 0 && readAt(fd, 0, info.st_size, data);
+    close(fd);
+    if (!success || data.size() <= sizeof(MAGIC) || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0)
+    {
+        return false;
+    }
+
+    Reader reader{data.data() + sizeof(MAGIC), data.data() + data.size()};
+    instances.clear();
+    bool headerRead = false;
+    while (reader.pos < reader.end)
+    {
+        int type = (unsigned char)*reader.pos++;
+        size_t payloadLength;
+        if (!reader.getVarint(payloadLength) || payloadLength > (size_t)(reader.end - reader.pos))
+        {
+            // Truncated last record
+            break;
+        }
+        Reader payload{reader.pos, reader.pos + payloadLength};
+        reader.pos += payloadLength;
+        if (!headerRead)
+        {
+            if (type != RECORD_HEADER || !parseHeader(payload, seriesUID, seriesTags))
+            {
+                return false;
+            }
+            headerRead = true;
+        }
+        else if (type == RECORD_INSTANCE)
+        {
+            BinaryIndexInstance instance;
+            if (!parseInstance(payload, seriesUID, seriesTags, instance))
+            {
+                return false;
+            }
+            instances.push_back(std::move(instance));
+        }
+    }
+    return headerRead;
+}
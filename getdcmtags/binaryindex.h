@@ -0,0 +1,47 @@
+#ifndef GETDCMTAGS_BINARYINDEX_H
+#define GETDCMTAGS_BINARYINDEX_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tagswriter.h"
+
+// Compact binary variant of the series index, stored as "<series UID>.index.bin" in the series
+// folder. The tag values of the first received instance are stored once in the series header,
+// and the record of each instance only contains the values that differ from the header (e.g.,
+// SOPInstanceUID, InstanceNumber, AcquisitionTime). A series can be loaded with one sequential
+// read of the file.
+//
+// Layout (version 1), all integers are unsigned LEB128 varints and strings are stored as
+// length followed by the UTF-8 bytes:
+//   magic        "MTAGIDX" followed by the version byte
+//   records      type byte, payload length, payload
+//     header     (type 1, first record) series UID, tag count, (name, value) per tag
+//     instance   (type 2) file mode, file, delta count, (reference, [name,] value) per delta
+// The file mode is 0 if the file name is stored completely, 1 if only the part after
+// "<series UID>#" is stored, and 2 if the file name is "<series UID>#" followed by the value
+// of the Filename tag. The reference of a delta is the position of the tag in the header plus
+// one, or 0 if the tag name follows inline. The value is stored with its length plus one, where
+// 0 means that the tag of the header is absent in the instance.
+
+typedef std::vector<std::pair<std::string, std::string>> TagValues;
+
+struct BinaryIndexInstance
+{
+    std::string file;
+    TagValues tags;
+};
+
+// Appends the record of an instance to the binary index of the series, creating the index with
+// the tags of this instance as series header if needed. Records are appended with a single
+// O_APPEND write, so that concurrent receivers never interleave records.
+bool appendBinarySeriesIndex(const std::string &seriesFolder, const std::string &seriesUID, const std::string &fileStem,
+                             const TagsWriter &tags);
+
+// Reads the complete index. A truncated last record (e.g., while it is being written) is
+// ignored. Returns false if the file cannot be read or is not a valid index.
+bool readBinarySeriesIndex(const std::string &filename, std::string &seriesUID, TagValues &seriesTags,
+                           std::vector<BinaryIndexInstance> &instances);
+
+#endif
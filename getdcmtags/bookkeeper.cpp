@@ -0,0 +1,502 @@
+#include "bookkeeper.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+// Maximum number of events waiting in memory. Further events go directly into the spool file.
+#define MAX_QUEUED_EVENTS 10000
+// Maximum number of events sent with one request
+#define MAX_BATCH_SIZE 200
+// Time to wait for further events before sending a batch that is not full
+#define BATCH_DELAY_MS 50
+// Timeout for connecting, sending and receiving
+#define NETWORK_TIMEOUT_MS 1000
+// Time during which no new connection is attempted after the bookkeeper could not be reached
+#define RETRY_DELAY_MS 5000
+
+std::string escapeJSONString(const std::string &value)
+{
+    std::string result;
+    result.reserve(value.size() + 8);
+    char buffer[8];
+    for (unsigned char c : value)
+    {
+        if (c == '"' || c == '\\' || c <= 0x1f)
+        {
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            result.append(buffer);
+        }
+        else
+        {
+            result.push_back((char)c);
+        }
+    }
+    return result;
+}
+
+BookkeeperClient::BookkeeperClient(const std::string &address, const std::string &token, const std::string &spoolFile)
+    : token(token), spoolFile(spoolFile), socketFd(-1), stopping(false)
+{
+    size_t colonPos = address.rfind(':');
+    if (colonPos == std::string::npos)
+    {
+        host = address;
+        port = "80";
+    }
+    else
+    {
+        host = address.substr(0, colonPos);
+        port = address.substr(colonPos + 1);
+    }
+    sender = std::thread(&BookkeeperClient::senderLoop, this);
+}
+
+BookkeeperClient::~BookkeeperClient()
+{
+    shutdown();
+}
+
+void BookkeeperClient::registerDicom(const std::string &filename, const std::string &fileUID, const std::string &seriesUID)
+{
+    double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    char timeBuffer[32];
+    snprintf(timeBuffer, sizeof(timeBuffer), "%.3f", now);
+
+    std::string event = "{\"filename\": \"" + escapeJSONString(filename) +
+                        "\", \"file_uid\": \"" + escapeJSONString(fileUID) +
+                        "\", \"series_uid\": \"" + escapeJSONString(seriesUID) +
+                        "\", \"time\": " + timeBuffer + "}";
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (queue.size() < MAX_QUEUED_EVENTS && !stopping)
+        {
+            queue.push_back(event);
+            queueChanged.notify_one();
+            return;
+        }
+    }
+    // Queue is full, so the bookkeeper is likely not keeping up
+    appendToSpool(std::deque<std::string>(1, event));
+}
+
+void BookkeeperClient::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (stopping)
+        {
+            return;
+        }
+        stopping = true;
+    }
+    queueChanged.notify_one();
+    if (sender.joinable())
+    {
+        sender.join();
+    }
+}
+
+void BookkeeperClient::senderLoop()
+{
+    recoverStaleSpools();
+
+    auto retryAfter = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (true)
+    {
+        queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+        {
+            break;
+        }
+        // Give further events the chance to arrive, so that they can be sent together
+        if (!stopping && queue.size() < MAX_BATCH_SIZE)
+        {
+            queueChanged.wait_for(lock, std::chrono::milliseconds(BATCH_DELAY_MS),
+                                  [this] { return stopping || queue.size() >= MAX_BATCH_SIZE; });
+        }
+
+        std::deque<std::string> batch;
+        while (!queue.empty() && batch.size() < MAX_BATCH_SIZE)
+        {
+            batch.push_back(std::move(queue.front()));
+            queue.pop_front();
+        }
+        lock.unlock();
+
+        if (std::chrono::steady_clock::now() >= retryAfter && sendBatch(buildBody(batch)))
+        {
+            deliverSpool();
+        }
+        else
+        {
+            appendToSpool(batch);
+            if (std::chrono::steady_clock::now() >= retryAfter)
+            {
+                retryAfter = std::chrono::steady_clock::now() + std::chrono::milliseconds(RETRY_DELAY_MS);
+            }
+        }
+        lock.lock();
+    }
+    lock.unlock();
+    disconnect();
+}
+
+std::string BookkeeperClient::buildBody(const std::deque<std::string> &events)
+{
+    std::string body = "{\"files\": [";
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        if (i > 0)
+        {
+            body.append(", ");
+        }
+        body.append(events[i]);
+    }
+    body.append("]}");
+    return body;
+}
+
+bool BookkeeperClient::sendBatch(const std::string &body)
+{
+    std::string request = "POST /register-dicom-batch HTTP/1.1\r\n"
+                          "Host: " + host + ":" + port + "\r\n"
+                          "Authorization: Token " + token + "\r\n"
+                          "Content-Type: application/json\r\n"
+                          "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                          "Connection: keep-alive\r\n"
+                          "\r\n" + body;
+
+    int statusCode = 0;
+    bool reusedConnection = (socketFd >= 0);
+    if (!sendRequest(request, statusCode))
+    {
+        // The server might have closed the idle keep-alive connection, so retry once with a new one
+        if (!reusedConnection || !sendRequest(request, statusCode))
+        {
+            std::cout << "WARNING: Unable to reach bookkeeper at " << host << ":" << port << std::endl;
+            return false;
+        }
+    }
+    if (statusCode < 200 || statusCode >= 300)
+    {
+        std::cout << "WARNING: Bookkeeper returned status " << statusCode << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool BookkeeperClient::connectToBookkeeper()
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+        return false;
+    }
+
+    for (struct addrinfo *entry = addresses; entry != nullptr; entry = entry->ai_next)
+    {
+        int fd = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        // Connect in non-blocking mode, so that the connection attempt can time out
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int result = connect(fd, entry->ai_addr, entry->ai_addrlen);
+        if (result != 0 && errno == EINPROGRESS)
+        {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, NETWORK_TIMEOUT_MS) == 1)
+            {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                result = (error == 0) ? 0 : -1;
+            }
+        }
+        if (result != 0)
+        {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, flags);
+
+        struct timeval timeout;
+        timeout.tv_sec = NETWORK_TIMEOUT_MS / 1000;
+        timeout.tv_usec = (NETWORK_TIMEOUT_MS % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        socketFd = fd;
+        break;
+    }
+    freeaddrinfo(addresses);
+    return socketFd >= 0;
+}
+
+void BookkeeperClient::disconnect()
+{
+    if (socketFd >= 0)
+    {
+        close(socketFd);
+        socketFd = -1;
+    }
+}
+
+bool BookkeeperClient::sendRequest(const std::string &request, int &statusCode)
+{
+    if (socketFd < 0 && !connectToBookkeeper())
+    {
+        return false;
+    }
+
+    size_t sent = 0;
+    while (sent < request.size())
+    {
+        ssize_t n = send(socketFd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            disconnect();
+            return false;
+        }
+        sent += n;
+    }
+
+    // Read the response header
+    std::string response;
+    char buffer[4096];
+    size_t headerEnd = std::string::npos;
+    while (headerEnd == std::string::npos)
+    {
+        ssize_t n = recv(socketFd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            disconnect();
+            return false;
+        }
+        response.append(buffer, n);
+        headerEnd = response.find("\r\n\r\n");
+    }
+
+    if (sscanf(response.c_str(), "HTTP/%*d.%*d %d", &statusCode) != 1)
+    {
+        disconnect();
+        return false;
+    }
+
+    std::string header = response.substr(0, headerEnd);
+    for (auto &c : header)
+    {
+        c = tolower(c);
+    }
+    bool keepAlive = (header.find("connection: close") == std::string::npos);
+    size_t contentLength = 0;
+    size_t lengthPos = header.find("content-length:");
+    if (lengthPos != std::string::npos)
+    {
+        contentLength = strtoul(header.c_str() + lengthPos + 15, nullptr, 10);
+    }
+    else
+    {
+        // Without content length (e.g., chunked encoding), the end of the body cannot be
+        // determined reliably, so the connection is not reused
+        keepAlive = false;
+    }
+
+    // Consume the response body, so that the connection can be reused
+    size_t received = response.size() - headerEnd - 4;
+    while (keepAlive && received < contentLength)
+    {
+        ssize_t n = recv(socketFd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            keepAlive = false;
+            break;
+        }
+        received += n;
+    }
+
+    if (!keepAlive)
+    {
+        disconnect();
+    }
+    return true;
+}
+
+void BookkeeperClient::appendToSpool(const std::deque<std::string> &events)
+{
+    if (spoolFile.empty() || events.empty())
+    {
+        return;
+    }
+    std::string data;
+    for (auto &event : events)
+    {
+        data.append(event);
+        data.push_back('\n');
+    }
+
+    // A single write with O_APPEND keeps the records intact if multiple processes append at the same time
+    int fd = open(spoolFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || write(fd, data.data(), data.size()) != (ssize_t)data.size())
+    {
+        std::cout << "ERROR: Unable to write bookkeeper events to spool file " << spoolFile << std::endl;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+void BookkeeperClient::deliverSpool()
+{
+    if (spoolFile.empty() || access(spoolFile.c_str(), F_OK) != 0)
+    {
+        return;
+    }
+
+    // Claim the spool file by renaming it, so that only one process delivers the events
+    std::string claimedFile = spoolFile + "." + std::to_string(getpid()) + ".sending";
+    if (rename(spoolFile.c_str(), claimedFile.c_str()) != 0)
+    {
+        return;
+    }
+
+    std::ifstream input(claimedFile);
+    std::deque<std::string> batch;
+    std::deque<std::string> undelivered;
+    bool failed = false;
+    std::string line;
+    while (std::getline(input, line))
+    {
+        if (line.empty())
+        {
+            continue;
+        }
+        if (failed)
+        {
+            undelivered.push_back(line);
+            continue;
+        }
+        batch.push_back(line);
+        if (batch.size() >= MAX_BATCH_SIZE)
+        {
+            if (!sendBatch(buildBody(batch)))
+            {
+                failed = true;
+                undelivered.insert(undelivered.end(), batch.begin(), batch.end());
+            }
+            batch.clear();
+        }
+    }
+    if (!batch.empty() && (failed || !sendBatch(buildBody(batch))))
+    {
+        undelivered.insert(undelivered.end(), batch.begin(), batch.end());
+    }
+    input.close();
+
+    appendToSpool(undelivered);
+    unlink(claimedFile.c_str());
+}
+
+void BookkeeperClient::recoverStaleSpools()
+{
+    if (spoolFile.empty())
+    {
+        return;
+    }
+    size_t slashPos = spoolFile.rfind('/');
+    std::string folder = (slashPos == std::string::npos) ? "." : spoolFile.substr(0, slashPos + 1);
+    std::string prefix = spoolFile.substr(slashPos == std::string::npos ? 0 : slashPos + 1) + ".";
+
+    DIR *dir = opendir(folder.c_str());
+    if (!dir)
+    {
+        return;
+    }
+    std::deque<std::string> staleFiles;
+    while (struct dirent *entry = readdir(dir))
+    {
+        // Files of the form <spool>.<pid>.sending, or <spool>.<pid>.recovering if the recovery itself was interrupted
+        std::string name = entry->d_name;
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0)
+        {
+            continue;
+        }
+        char *end = nullptr;
+        long pid = strtol(name.c_str() + prefix.size(), &end, 10);
+        if (pid <= 0 || (strcmp(end, ".sending") != 0 && strcmp(end, ".recovering") != 0))
+        {
+            continue;
+        }
+        // The process that claimed the spool file has died before it could deliver or re-spool the events
+        if (kill((pid_t)pid, 0) != 0 && errno == ESRCH)
+        {
+            staleFiles.push_back(name);
+        }
+    }
+    closedir(dir);
+
+    for (auto &name : staleFiles)
+    {
+        // Claim the file first, so that the events are recovered by one process only
+        std::string staleFile = spoolFile.substr(0, slashPos + 1) + name;
+        std::string claimedFile = spoolFile + "." + std::to_string(getpid()) + ".recovering";
+        if (rename(staleFile.c_str(), claimedFile.c_str()) != 0)
+        {
+            continue;
+        }
+        std::ifstream input(claimedFile);
+        std::deque<std::string> events;
+        std::string line;
+        while (std::getline(input, line))
+        {
+            if (!line.empty())
+            {
+                events.push_back(line);
+            }
+        }
+        input.close();
+        appendToSpool(events);
+        unlink(claimedFile.c_str());
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef GETDCMTAGS_BOOKKEEPER_H
+#define GETDCMTAGS_BOOKKEEPER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Default folder of the spool file in the incoming folder
+#define BOOKKEEPER_SPOOL_FOLDER ".bookkeeper"
+
+// Minimal HTTP/1.1 client for notifying the bookkeeper about received files. Events are queued
+// and sent in batches to the /register-dicom-batch endpoint by a background thread over a
+// keep-alive connection, so that the processing of files never waits for the network. If the
+// bookkeeper cannot be reached (or the queue is full), events are appended to a spool file and
+// delivered with the next successful request. Spool files that a crashed process had claimed for
+// delivery are put back into the spool when the client starts. As this lists the folder of the
+// spool file, the spool should be kept in a folder of its own.
+class BookkeeperClient
+{
+public:
+    BookkeeperClient(const std::string &address, const std::string &token, const std::string &spoolFile);
+    ~BookkeeperClient();
+
+    // Queues the registration of a received file. Never blocks on the network.
+    void registerDicom(const std::string &filename, const std::string &fileUID, const std::string &seriesUID);
+
+    // Sends all queued events and stops the background thread. Events that cannot be delivered
+    // are written to the spool file.
+    void shutdown();
+
+private:
+    void senderLoop();
+    bool sendBatch(const std::string &body);
+    bool sendRequest(const std::string &request, int &statusCode);
+    bool connectToBookkeeper();
+    void disconnect();
+    void appendToSpool(const std::deque<std::string> &events);
+    void deliverSpool();
+    void recoverStaleSpools();
+    static std::string buildBody(const std::deque<std::string> &events);
+
+    std::string host;
+    std::string port;
+    std::string token;
+    std::string spoolFile;
+    int socketFd;
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::deque<std::string> queue;
+    bool stopping;
+    std::thread sender;
+};
+
+// Escapes a string for embedding into a JSON document
+std::string escapeJSONString(const std::string &value);
+
+#endif
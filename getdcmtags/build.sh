@@ -27,6 +27,7 @@ build_qt_project() {
     docker run -it mercure-getdcmtags-build:$UBUNTU_VERSION
     local last_container=$(docker ps -lq)
     docker cp $last_container:/build/getdcmtags ../app/bin/ubuntu${UBUNTU_VERSION}/getdcmtags
+    docker cp $last_container:/build/getdcmtags-client ../app/bin/ubuntu${UBUNTU_VERSION}/getdcmtags-client
     docker rm $last_container
 
     echo "Build for Ubuntu $UBUNTU_VERSION completed"
@@ -0,0 +1,138 @@
+#include "charsetcache.h"
+
+#include <chrono>
+#include <iostream>
+
+// Upper limit for the number of cached character sets, in case of unusual values
+#define MAX_CACHED_CHARSETS 64
+
+void CharsetStatistics::add(const CharsetStatistics &other)
+{
+    cacheHits += other.cacheHits;
+    cacheMisses += other.cacheMisses;
+    asciiValues += other.asciiValues;
+    convertedValues += other.convertedValues;
+    conversionMicroseconds += other.conversionMicroseconds;
+    fallbacks += other.fallbacks;
+}
+
+CharsetStatistics CharsetStatistics::since(const CharsetStatistics &earlier) const
+{
+    CharsetStatistics result;
+    result.cacheHits = cacheHits - earlier.cacheHits;
+    result.cacheMisses = cacheMisses - earlier.cacheMisses;
+    result.asciiValues = asciiValues - earlier.asciiValues;
+    result.convertedValues = convertedValues - earlier.convertedValues;
+    result.conversionMicroseconds = conversionMicroseconds - earlier.conversionMicroseconds;
+    result.fallbacks = fallbacks - earlier.fallbacks;
+    return result;
+}
+
+std::ostream &operator<<(std::ostream &stream, const CharsetStatistics &statistics)
+{
+    return stream << "charset cache " << statistics.cacheHits << " hits / " << statistics.cacheMisses << " misses, "
+                  << statistics.asciiValues << " ASCII values, " << statistics.convertedValues << " converted in "
+                  << (long)statistics.conversionMicroseconds << " us";
+}
+
+bool isPlainASCII(const char *value, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)value[i];
+        if (c >= 0x80 || c == 0x1B)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isASCIICompatible(const OFString &specificCharacterSet)
+{
+    size_t start = 0;
+    while (start <= specificCharacterSet.length())
+    {
+        size_t end = specificCharacterSet.find('\\', start);
+        if (end == OFString_npos)
+        {
+            end = specificCharacterSet.length();
+        }
+        OFString term = specificCharacterSet.substr(start, end - start);
+        // Trailing spaces are padding
+        size_t last = term.find_last_not_of(' ');
+        term = (last == OFString_npos) ? OFString() : term.substr(0, last + 1);
+        if (term == "ISO_IR 13" || term == "ISO 2022 IR 13")
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+CharsetConverter *CharsetConverterCache::select(const OFString &specificCharacterSet, OFCondition &status)
+{
+    auto it = converters.find(specificCharacterSet);
+    if (it != converters.end())
+    {
+        statistics.cacheHits++;
+        statistics.fallbacks += it->second->fallback ? 1 : 0;
+        status = it->second->status;
+        return status.good() ? it->second.get() : nullptr;
+    }
+    statistics.cacheMisses++;
+
+    if (converters.size() >= MAX_CACHED_CHARSETS)
+    {
+        converters.clear();
+    }
+    std::unique_ptr<CharsetConverter> entry(new CharsetConverter());
+    entry->converter.reset(new DcmSpecificCharacterSet());
+    entry->asciiCompatible = isASCIICompatible(specificCharacterSet);
+    entry->status = entry->converter->selectCharacterSet(specificCharacterSet);
+    if (!entry->status.good())
+    {
+        // There are two different sets of names of character sets in the DICOM standard.
+        // If Code Extensions aren't used, it expects ISO 2375 names (e.g., "ISO_IR 192").
+        // If Code Extensions are used, it expects names prefixed with ISO 2022, eg "ISO 2022 IR 100".
+        // https://dicom.innolitics.com/ciods/vl-photographic-image/sop-common/00080005
+        // Sometimes a dicom shows up that only has one character set- indicating it's not using Code Extensions-
+        // but the character set is using the ISO 2022 name.
+
+        // So, we are going to tell DCMTK to try to use Code Extensions by giving it a list, ie '\\ISO 2022 IR 100'.
+        // If the file didn't really use Code Extensions, this will probably produce garbled tags, but it's probably
+        //  better than refusing to process this file at all. The resolved converter is cached under the original value.
+
+        std::cout << "WARNING: Possible invalid DICOM encoding. Unable to select character set '" << specificCharacterSet
+                  << "'. Retrying as as if the file meant specify Code Extensions, ie '\\" << specificCharacterSet << "'" << std::endl;
+        entry->converter->clear();
+        entry->status = entry->converter->selectCharacterSet("\\" + specificCharacterSet);
+        entry->fallback = true;
+        statistics.fallbacks++;
+    }
+    status = entry->status;
+    CharsetConverter *result = entry->status.good() ? entry.get() : nullptr;
+    converters[specificCharacterSet] = std::move(entry);
+    return result;
+}
+
+bool CharsetConverterCache::isASCIIValue(const CharsetConverter &converter, const OFString &value)
+{
+    if (converter.asciiCompatible && isPlainASCII(value.c_str(), value.length()))
+    {
+        statistics.asciiValues++;
+        return true;
+    }
+    return false;
+}
+
+OFCondition CharsetConverterCache::convert(CharsetConverter &converter, const OFString &value, OFString &out)
+{
+    auto start = std::chrono::steady_clock::now();
+    out = "";
+    OFCondition result = converter.converter->convertString(value, out);
+    statistics.convertedValues++;
+    statistics.conversionMicroseconds += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
@@ -0,0 +1,72 @@
+#ifndef GETDCMTAGS_CHARSETCACHE_H
+#define GETDCMTAGS_CHARSETCACHE_H
+
+#include <map>
+#include <ostream>
+#include <memory>
+
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/dcmdata/dcspchrs.h"
+
+// Counters of the character set handling, accumulated over all files processed with one cache
+struct CharsetStatistics
+{
+    unsigned long cacheHits = 0;
+    unsigned long cacheMisses = 0;
+    // Values that were written without conversion because they only contain ASCII characters
+    unsigned long asciiValues = 0;
+    unsigned long convertedValues = 0;
+    double conversionMicroseconds = 0;
+    // Files whose character set could only be selected in the Code Extensions form
+    unsigned long fallbacks = 0;
+
+    void add(const CharsetStatistics &other);
+    CharsetStatistics since(const CharsetStatistics &earlier) const;
+};
+
+std::ostream &operator<<(std::ostream &stream, const CharsetStatistics &statistics);
+
+// Converter selected for one SpecificCharacterSet value
+struct CharsetConverter
+{
+    std::unique_ptr<DcmSpecificCharacterSet> converter;
+    // Result of selecting the character set. The converter is only usable if this is good.
+    OFCondition status;
+    // True if ASCII values can be written without conversion
+    bool asciiCompatible = false;
+    // True if the character set has been selected in the Code Extensions form
+    bool fallback = false;
+};
+
+// Keeps one ready converter per SpecificCharacterSet value, so that selecting the character
+// set (which opens iconv descriptors) happens only once per process in daemon and batch mode.
+// Not thread-safe, each worker thread uses its own cache.
+class CharsetConverterCache
+{
+public:
+    // Returns the converter for the SpecificCharacterSet value, falling back to the Code
+    // Extensions form if the value cannot be selected directly. Returns nullptr if neither
+    // works, with the reason in status. Failures are cached as well.
+    CharsetConverter *select(const OFString &specificCharacterSet, OFCondition &status);
+
+    // Returns true if the value only contains ASCII characters and the character set allows
+    // writing it without conversion, so that iconv is not needed
+    bool isASCIIValue(const CharsetConverter &converter, const OFString &value);
+
+    // Converts the value into UTF-8
+    OFCondition convert(CharsetConverter &converter, const OFString &value, OFString &out);
+
+    CharsetStatistics statistics;
+
+private:
+    std::map<OFString, std::unique_ptr<CharsetConverter>> converters;
+};
+
+// Returns true if the value contains neither bytes >= 0x80 nor ISO 2022 escape sequences
+bool isPlainASCII(const char *value, size_t length);
+
+// Returns false for character sets that map some 7-bit bytes to non-ASCII characters
+// (JIS X 0201 Romaji used by ISO_IR 13 maps '\' to the Yen sign)
+bool isASCIICompatible(const OFString &specificCharacterSet);
+
+#endif
@@ -0,0 +1,96 @@
+// getdcmtags-client
+// =================
+// Minimal shim that forwards a getdcmtags invocation to a running "getdcmtags --daemon" instance.
+// Intentionally has no dependencies besides libc, so that storescp can exec it for every received
+// file at negligible cost. If the daemon is not reachable, the full getdcmtags binary is executed
+// instead, so that received files are never left unprocessed.
+//
+// Usage: getdcmtags-client [socket path] [getdcmtags binary] [getdcmtags arguments...]
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+
+static bool writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        printf("Usage: [socket path] [getdcmtags binary] [getdcmtags arguments...]\n");
+        return 1;
+    }
+
+    const char *socketPath = argv[1];
+    const char *binary = argv[2];
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        // Daemon not available. Fall back to processing the file directly.
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        execv(binary, &argv[2]);
+        printf("ERROR: Unable to reach daemon at %s or execute %s\n", socketPath, binary);
+        return 1;
+    }
+
+    std::string request = std::to_string(argc - 3) + "\n";
+    for (int i = 3; i < argc; i++)
+    {
+        request.append(argv[i]);
+        request.push_back('\0');
+    }
+    if (!writeAll(fd, request.data(), request.size()))
+    {
+        printf("ERROR: Unable to send request to daemon\n");
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Wait for the daemon to finish processing the file. Processing is not retried if the daemon
+    // fails in between, as the file might have been moved already.
+    unsigned char status = 1;
+    ssize_t n;
+    do
+    {
+        n = read(fd, &status, 1);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+
+    if (n != 1)
+    {
+        printf("ERROR: No response received from daemon\n");
+        return 1;
+    }
+    return status;
+}
@@ -0,0 +1,239 @@
+#include "daemon.h"
+#include "threadpool.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+
+// Upper limit for the size of a single request, to protect the daemon from misbehaving clients
+#define MAX_REQUEST_SIZE 65536
+
+// Connections that may wait for a worker, per worker. Further clients wait in the listen backlog.
+#define QUEUED_REQUESTS_PER_WORKER 4
+
+// Time a client may take to send its request or to accept the reply. A client that stalls would
+// otherwise occupy a worker.
+#define CLIENT_TIMEOUT_SECONDS 5
+
+static volatile sig_atomic_t terminationRequested = 0;
+static volatile int daemonListenFd = -1;
+
+// Stops accepting further requests. The requests that have been accepted are completed before the
+// daemon returns.
+static void handleTermination(int)
+{
+    terminationRequested = 1;
+    if (daemonListenFd >= 0)
+    {
+        // Wakes up accept(), which then fails with EINVAL
+        shutdown(daemonListenFd, SHUT_RDWR);
+    }
+}
+
+bool readDaemonRequest(int fd, std::vector<std::string> &args)
+{
+    std::string buffer;
+    char chunk[4096];
+    size_t expectedCount = 0;
+    size_t headerEnd = std::string::npos;
+
+    while (true)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        buffer.append(chunk, n);
+        if (buffer.size() > MAX_REQUEST_SIZE)
+        {
+            return false;
+        }
+        if (headerEnd == std::string::npos)
+        {
+            headerEnd = buffer.find('\n');
+            if (headerEnd == std::string::npos)
+            {
+                continue;
+            }
+            expectedCount = strtoul(buffer.substr(0, headerEnd).c_str(), nullptr, 10);
+        }
+        size_t terminators = 0;
+        for (size_t i = headerEnd + 1; i < buffer.size(); i++)
+        {
+            if (buffer[i] == '\0')
+            {
+                terminators++;
+            }
+        }
+        if (terminators >= expectedCount)
+        {
+            break;
+        }
+    }
+
+    if (headerEnd == std::string::npos || expectedCount == 0)
+    {
+        return false;
+    }
+
+    args.clear();
+    size_t pos = headerEnd + 1;
+    while (args.size() < expectedCount)
+    {
+        size_t end = buffer.find('\0', pos);
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+        args.push_back(buffer.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return true;
+}
+
+// Reads the request from the client connection, processes it and sends the status
+static void serveClient(int clientFd, int worker, RequestHandler handler)
+{
+    std::vector<std::string> args;
+    unsigned char status = 1;
+    if (readDaemonRequest(clientFd, args))
+    {
+        // Prepend the program name, so that the handler receives the arguments in the same
+        // positions as for a direct invocation
+        std::vector<char *> argv;
+        std::string programName = "getdcmtags";
+        argv.push_back(&programName[0]);
+        for (auto &arg : args)
+        {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(nullptr);
+        status = (unsigned char)handler(worker, (int)args.size() + 1, argv.data());
+    }
+    else
+    {
+        std::cout << "ERROR: Invalid or incomplete request received" << std::endl;
+    }
+    if (write(clientFd, &status, 1) != 1)
+    {
+        std::cout << "WARNING: Unable to send status to client" << std::endl;
+    }
+    close(clientFd);
+}
+
+int runDaemon(const char *socketPath, RequestHandler handler, int threadCount)
+{
+    struct sockaddr_un address;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        std::cout << "ERROR: Socket path too long " << socketPath << std::endl;
+        return 1;
+    }
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        std::cout << "ERROR: Unable to create socket. " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    // Remove a stale socket left behind by a previous instance
+    unlink(socketPath);
+    if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        std::cout << "ERROR: Unable to bind socket " << socketPath << ". " << strerror(errno) << std::endl;
+        close(listenFd);
+        return 1;
+    }
+    chmod(socketPath, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+    if (listen(listenFd, SOMAXCONN) != 0)
+    {
+        std::cout << "ERROR: Unable to listen on socket " << socketPath << ". " << strerror(errno) << std::endl;
+        close(listenFd);
+        unlink(socketPath);
+        return 1;
+    }
+
+    daemonListenFd = listenFd;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, handleTermination);
+    signal(SIGINT, handleTermination);
+
+    std::cout << "Listening for requests on " << socketPath << " with " << threadCount << " workers" << std::endl;
+
+    WorkStealingPool pool(threadCount);
+    std::mutex queuedMutex;
+    std::condition_variable queuedChanged;
+    int queued = 0;
+
+    while (!terminationRequested)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queuedMutex);
+            queuedChanged.wait(lock, [&] { return queued < threadCount * QUEUED_REQUESTS_PER_WORKER; });
+        }
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0)
+        {
+            if (terminationRequested)
+            {
+                break;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            std::cout << "ERROR: Unable to accept connection. " << strerror(errno) << std::endl;
+            break;
+        }
+        struct timeval timeout = {CLIENT_TIMEOUT_SECONDS, 0};
+        setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        {
+            std::lock_guard<std::mutex> lock(queuedMutex);
+            queued++;
+        }
+        pool.submit([&, clientFd](int worker) {
+            serveClient(clientFd, worker, handler);
+            std::lock_guard<std::mutex> lock(queuedMutex);
+            queued--;
+            queuedChanged.notify_one();
+        });
+    }
+
+    pool.wait();
+    daemonListenFd = -1;
+    close(listenFd);
+    unlink(socketPath);
+    if (terminationRequested)
+    {
+        std::cout << "Terminating daemon" << std::endl;
+        return 0;
+    }
+    return 1;
+}
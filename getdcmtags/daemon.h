@@ -0,0 +1,25 @@
+#ifndef GETDCMTAGS_DAEMON_H
+#define GETDCMTAGS_DAEMON_H
+
+#include <string>
+#include <vector>
+
+// Handler that processes one request. Receives the index of the executing worker and the
+// arguments in the same form as main(). Called concurrently from the worker threads.
+typedef int (*RequestHandler)(int worker, int argc, char *argv[]);
+
+// Listens on the given Unix domain socket and executes the handler for every request sent by
+// getdcmtags-client. Only returns if the socket cannot be opened or the daemon is terminated.
+//
+// The accepted connections are processed on a pool with the given number of worker threads, so
+// that the getdcmtags-client calls of the associations that storescp --fork receives concurrently
+// are also processed concurrently. The reply is sent once the handler has returned, so the handler
+// has to make the files durable before. A client that does not send its request or accept the
+// reply within a few seconds is dropped.
+int runDaemon(const char *socketPath, RequestHandler handler, int threadCount);
+
+// Reads a request from the client connection. Requests consist of the argument count, followed
+// by a newline and the arguments, each terminated by a zero byte.
+bool readDaemonRequest(int fd, std::vector<std::string> &args);
+
+#endif
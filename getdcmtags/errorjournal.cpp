@@ -0,0 +1,67 @@
+#include "errorjournal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+struct ErrorRecordLayout
+{
+    char magic[8];
+    uint64_t time;
+    uint32_t pid;
+    uint32_t flags;
+    char file[256];
+    char senderAET[24];
+    char senderAddress[64];
+    char message[656];
+};
+
+static_assert(sizeof(ErrorRecordLayout) == ERROR_JOURNAL_RECORD_SIZE, "Unexpected error record size");
+
+// Copies the value and keeps at least one terminating NUL
+template <size_t N>
+static void copyField(char (&field)[N], const std::string &value)
+{
+    memcpy(field, value.data(), std::min(value.size(), N - 1));
+}
+
+bool appendErrorRecord(const std::string &incomingFolder, const ErrorRecord &record)
+{
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    ErrorRecordLayout layout;
+    memset(&layout, 0, sizeof(layout));
+    memcpy(layout.magic, "MERRJNL1", sizeof(layout.magic));
+    layout.time = now.count();
+    layout.pid = (uint32_t)getpid();
+    layout.flags = record.moved ? ERROR_RECORD_MOVED : 0;
+    copyField(layout.file, record.file);
+    copyField(layout.senderAET, record.senderAET);
+    copyField(layout.senderAddress, record.senderAddress);
+    copyField(layout.message, record.message);
+
+    std::string filename = incomingFolder + ERROR_JOURNAL_FILE;
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to open error journal " << filename << std::endl;
+        return false;
+    }
+    ssize_t result;
+    do
+    {
+        result = write(fd, &layout, sizeof(layout));
+    } while (result < 0 && errno == EINTR);
+    bool success = (result == (ssize_t)sizeof(layout));
+    success = (close(fd) == 0) && success;
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to write error journal " << filename << std::endl;
+    }
+    return success;
+}
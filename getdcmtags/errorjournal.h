@@ -0,0 +1,39 @@
+#ifndef GETDCMTAGS_ERRORJOURNAL_H
+#define GETDCMTAGS_ERRORJOURNAL_H
+
+#include <string>
+
+// Journal of the received files that could not be processed, in the incoming folder. Each failure
+// is one record of ERROR_JOURNAL_RECORD_SIZE bytes, appended with a single O_APPEND write so that
+// concurrent receivers never interleave records and no lock files are needed. The router reads
+// the new records, moves the referenced files to the error folder and rotates the journal by
+// renaming it, so it is opened again for every record. The layout is read by
+// app/routing/error_journal.py:
+//
+//   char     magic[8]            "MERRJNL1"
+//   uint64_t time                unix time in ms
+//   uint32_t pid                 process that recorded the failure
+//   uint32_t flags               ERROR_RECORD_MOVED if the file has been moved into error/
+//   char     file[256]           name of the file relative to the incoming folder
+//   char     senderAET[24]
+//   char     senderAddress[64]
+//   char     message[656]
+//
+// Strings are NUL-padded and truncated if they do not fit.
+#define ERROR_JOURNAL_FILE ".error_journal"
+#define ERROR_JOURNAL_RECORD_SIZE 1024
+
+#define ERROR_RECORD_MOVED 1
+
+struct ErrorRecord
+{
+    std::string file;
+    std::string senderAET;
+    std::string senderAddress;
+    std::string message;
+    bool moved = false;
+};
+
+bool appendErrorRecord(const std::string &incomingFolder, const ErrorRecord &record);
+
+#endif
@@ -0,0 +1,356 @@
+#include "fingerprint.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "headerreader.h"
+#include "nativescanner.h"
+
+bool parseFingerprintMode(const char *value, FingerprintMode &mode)
+{
+    if (strcmp(value, "off") == 0)
+    {
+        mode = FINGERPRINT_OFF;
+    }
+    else if (strcmp(value, "fast") == 0)
+    {
+        mode = FINGERPRINT_FAST;
+    }
+    else if (strcmp(value, "sha256") == 0)
+    {
+        mode = FINGERPRINT_SHA256;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// The hashes are defined on little endian input, which is the byte order of all supported hosts
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint32_t rotr32(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t xxhRound(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH_PRIME2;
+    return rotl64(accumulator, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t accumulator, uint64_t lane)
+{
+    accumulator ^= xxhRound(0, lane);
+    return accumulator * XXH_PRIME1 + XXH_PRIME4;
+}
+
+void XXH64Hash::reset()
+{
+    lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    lanes[1] = XXH_PRIME2;
+    lanes[2] = 0;
+    lanes[3] = -XXH_PRIME1;
+    totalSize = 0;
+    pendingSize = 0;
+}
+
+void XXH64Hash::update(const uint8_t *data, size_t size)
+{
+    totalSize += size;
+    if (pendingSize > 0)
+    {
+        size_t count = std::min(size, sizeof(pending) - pendingSize);
+        memcpy(pending + pendingSize, data, count);
+        pendingSize += count;
+        data += count;
+        size -= count;
+        if (pendingSize < sizeof(pending))
+        {
+            return;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            lanes[i] = xxhRound(lanes[i], load64(pending + i * 8));
+        }
+        pendingSize = 0;
+    }
+    // The four lanes are independent, so the compiler keeps them in registers and the CPU
+    // executes the rounds in parallel
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    while (size >= 32)
+    {
+        v1 = xxhRound(v1, load64(data));
+        v2 = xxhRound(v2, load64(data + 8));
+        v3 = xxhRound(v3, load64(data + 16));
+        v4 = xxhRound(v4, load64(data + 24));
+        data += 32;
+        size -= 32;
+    }
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+    memcpy(pending, data, size);
+    pendingSize = size;
+}
+
+uint64_t XXH64Hash::digest() const
+{
+    uint64_t hash;
+    if (totalSize >= 32)
+    {
+        hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            hash = xxhMergeRound(hash, lanes[i]);
+        }
+    }
+    else
+    {
+        hash = XXH_PRIME5;
+    }
+    hash += totalSize;
+
+    const uint8_t *p = pending;
+    size_t remaining = pendingSize;
+    while (remaining >= 8)
+    {
+        hash ^= xxhRound(0, load64(p));
+        hash = rotl64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+        remaining -= 8;
+    }
+    if (remaining >= 4)
+    {
+        hash ^= (uint64_t)load32(p) * XXH_PRIME1;
+        hash = rotl64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        remaining -= 4;
+    }
+    while (remaining > 0)
+    {
+        hash ^= *p * XXH_PRIME5;
+        hash = rotl64(hash, 11) * XXH_PRIME1;
+        p++;
+        remaining--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void SHA256Hash::reset()
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(state, initial, sizeof(state));
+    totalSize = 0;
+    pendingSize = 0;
+}
+
+void SHA256Hash::compress(const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8)
+               | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void SHA256Hash::update(const uint8_t *data, size_t size)
+{
+    totalSize += size;
+    if (pendingSize > 0)
+    {
+        size_t count = std::min(size, sizeof(pending) - pendingSize);
+        memcpy(pending + pendingSize, data, count);
+        pendingSize += count;
+        data += count;
+        size -= count;
+        if (pendingSize < sizeof(pending))
+        {
+            return;
+        }
+        compress(pending);
+        pendingSize = 0;
+    }
+    while (size >= 64)
+    {
+        compress(data);
+        data += 64;
+        size -= 64;
+    }
+    memcpy(pending, data, size);
+    pendingSize = size;
+}
+
+std::string SHA256Hash::digest()
+{
+    uint64_t bits = totalSize * 8;
+    uint8_t padding[72] = {0x80};
+    size_t paddingSize = (pendingSize < 56 ? 56 : 120) - pendingSize;
+    for (int i = 0; i < 8; i++)
+    {
+        padding[paddingSize + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    update(padding, paddingSize + 8);
+
+    std::string result(64, '0');
+    for (int i = 0; i < 32; i++)
+    {
+        uint8_t byte = (uint8_t)(state[i / 4] >> (24 - (i % 4) * 8));
+        result[i * 2] = HEX_DIGITS[byte >> 4];
+        result[i * 2 + 1] = HEX_DIGITS[byte & 15];
+    }
+    return result;
+}
+
+static std::string hex64(uint64_t value)
+{
+    std::string result(16, '0');
+    for (int i = 15; i >= 0; i--)
+    {
+        result[i] = HEX_DIGITS[value & 15];
+        value >>= 4;
+    }
+    return result;
+}
+
+bool fingerprintPixelData(const char *filename, FingerprintMode mode, std::vector<uint8_t> &buffer,
+                          PixelFingerprint &result)
+{
+    result = PixelFingerprint();
+    size_t offset;
+    size_t length;
+    {
+        // Only the pages of the header and of the item headers are touched to locate the value
+        std::shared_ptr<MappedFile> file = MappedFile::open(filename);
+        if (!file || !findPixelData(file->data, file->size, offset, length))
+        {
+            return false;
+        }
+    }
+    if (length == 0)
+    {
+        return true;
+    }
+
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    buffer.resize(FINGERPRINT_CHUNK_SIZE);
+    XXH64Hash fast;
+    SHA256Hash sha256;
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t count = pread(fd, buffer.data(), std::min(length - done, buffer.size()), offset + done);
+        if (count <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        if (mode != FINGERPRINT_OFF)
+        {
+            fast.update(buffer.data(), count);
+        }
+        if (mode == FINGERPRINT_SHA256)
+        {
+            sha256.update(buffer.data(), count);
+        }
+        done += count;
+    }
+    close(fd);
+
+    result.found = true;
+    result.bytes = length;
+    if (mode != FINGERPRINT_OFF)
+    {
+        result.fast = hex64(fast.digest());
+    }
+    if (mode == FINGERPRINT_SHA256)
+    {
+        result.sha256 = sha256.digest();
+    }
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef GETDCMTAGS_FINGERPRINT_H
+#define GETDCMTAGS_FINGERPRINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Size of the chunks in which the pixel data is read and hashed
+#define FINGERPRINT_CHUNK_SIZE (1 << 20)
+
+enum FingerprintMode
+{
+    FINGERPRINT_OFF,
+    // 64-bit XXH64 of the pixel data, written as "PixelDataXXH64"
+    FINGERPRINT_FAST,
+    // Additionally the SHA-256, written as "PixelDataSHA256"
+    FINGERPRINT_SHA256
+};
+
+bool parseFingerprintMode(const char *value, FingerprintMode &mode);
+
+// Streaming XXH64 (seed 0). Non-cryptographic, but fast enough to keep up with the page cache,
+// so that identical pixel data can be recognized without comparing the files.
+class XXH64Hash
+{
+public:
+    XXH64Hash() { reset(); }
+    void reset();
+    void update(const uint8_t *data, size_t size);
+    uint64_t digest() const;
+
+private:
+    uint64_t lanes[4];
+    uint64_t totalSize;
+    uint8_t pending[32];
+    size_t pendingSize;
+};
+
+// Streaming SHA-256 (FIPS 180-4), for integrity checks that must not be forgeable
+class SHA256Hash
+{
+public:
+    SHA256Hash() { reset(); }
+    void reset();
+    void update(const uint8_t *data, size_t size);
+    // Returns the digest as lowercase hex string
+    std::string digest();
+
+private:
+    void compress(const uint8_t *block);
+
+    uint32_t state[8];
+    uint64_t totalSize;
+    uint8_t pending[64];
+    size_t pendingSize;
+};
+
+// Hashes of the value of the pixel data element (7FE0,0010) as it is encoded in the file. The
+// same image therefore gets a different fingerprint if it is stored with another transfer syntax.
+struct PixelFingerprint
+{
+    // False if the file has no pixel data
+    bool found = false;
+    uint64_t bytes = 0;
+    std::string fast;
+    std::string sha256;
+};
+
+// Reads the pixel data of the file in chunks of FINGERPRINT_CHUNK_SIZE and hashes it, so that
+// the memory use does not depend on the size of the pixel data. The buffer is reused by the
+// caller across files. With FINGERPRINT_OFF, the pixel data is only read (for measuring the read
+// speed). Returns false if the file cannot be read or its encoding is not supported by the
+// native scanner (deflated or big endian transfer syntax).
+bool fingerprintPixelData(const char *filename, FingerprintMode mode, std::vector<uint8_t> &buffer,
+                          PixelFingerprint &result);
+
+#endif
@@ -2,6 +2,7 @@ QT -= gui
 
 CONFIG -= console
 CONFIG -= app_bundle
+CONFIG += c++17
 
 # The following define makes your compiler emit warnings if you use
 # any Qt feature that has been marked deprecated (the exact warnings
@@ -17,10 +18,21 @@ DEFINES += QT_DEPRECATED_WARNINGS
 INCLUDEPATH += /usr/local/include/dcmtk/dcmnet/
 INCLUDEPATH += /usr/local/include/dcmtk/config/
 
-LIBS += -ldcmdata -loflog -lofstd
+# JPEG and JPEG-LS decoders for --transcode, only linked with "qmake CONFIG+=transcode" so that
+# the receiver does not load the codec and image modules at startup
+transcode {
+    DEFINES += GETDCMTAGS_TRANSCODE
+    LIBS += -ldcmjpls -ldcmtkcharls -ldcmjpeg -lijg8 -lijg12 -lijg16 -ldcmimage -ldcmimgle
+}
+LIBS += -ldcmnet -ldcmtls -ldcmdata -loflog -lofstd
 LIBS += -lz -ldl -lpthread
 
-SOURCES += main.cpp tags_list.h
+# zstd compressed archives (--archive)
+LIBS += -lzstd
+DEFINES += HAVE_ZSTD
+
+SOURCES += main.cpp tags_list.h daemon.cpp threadpool.cpp bookkeeper.cpp headerreader.cpp nativescanner.cpp tagswriter.cpp charsetcache.cpp seriesindex.cpp binaryindex.cpp seriesevents.cpp placement.cpp instanceindex.cpp storagescp.cpp metrics.cpp tagplan.cpp admission.cpp fingerprint.cpp archive.cpp studyrollup.cpp transcoder.cpp errorjournal.cpp
+HEADERS += daemon.h threadpool.h bookkeeper.h headerreader.h nativescanner.h tagswriter.h charsetcache.h seriesindex.h binaryindex.h seriesevents.h placement.h instanceindex.h storagescp.h metrics.h tagplan.h admission.h fingerprint.h archive.h studyrollup.h transcoder.h errorjournal.h
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -0,0 +1,124 @@
+#include "headerreader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dcmtk/dcmdata/dcistrmb.h"
+
+std::shared_ptr<MappedFile> MappedFile::open(const OFString &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    return std::shared_ptr<MappedFile>(new MappedFile((const Uint8 *)data, info.st_size));
+}
+
+MappedFile::~MappedFile()
+{
+    munmap((void *)data, size);
+}
+
+class MappedInputStream : public DcmInputStream
+{
+public:
+    MappedInputStream(std::shared_ptr<MappedFile> file, offile_off_t offset = 0)
+        : DcmInputStream(&producer_), producer_(), file_(file)
+    {
+        producer_.setBuffer(file_->data, file_->size);
+        producer_.setEos();
+        if (offset > 0)
+        {
+            skip(offset);
+        }
+    }
+
+    // Creating a factory lets DCMTK skip values above the maximum read length instead of copying them
+    virtual DcmInputStreamFactory *newFactory() const;
+
+private:
+    DcmBufferProducer producer_;
+    std::shared_ptr<MappedFile> file_;
+};
+
+class MappedInputStreamFactory : public DcmInputStreamFactory
+{
+public:
+    MappedInputStreamFactory(std::shared_ptr<MappedFile> file, offile_off_t offset)
+        : file_(file), offset_(offset)
+    {
+    }
+
+    virtual DcmInputStream *create() const
+    {
+        return new MappedInputStream(file_, offset_);
+    }
+
+    virtual DcmInputStreamFactory *clone() const
+    {
+        return new MappedInputStreamFactory(file_, offset_);
+    }
+
+private:
+    std::shared_ptr<MappedFile> file_;
+    offile_off_t offset_;
+};
+
+DcmInputStreamFactory *MappedInputStream::newFactory() const
+{
+    return new MappedInputStreamFactory(file_, tell());
+}
+
+bool loadFileHeader(DcmFileFormat &fileFormat, const OFString &filename, const DcmTagKey &stopParsingAtElement,
+                    Uint32 maxReadLength, OFCondition &status)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    MappedInputStream stream(file);
+    status = stream.status();
+    if (status.good())
+    {
+        status = fileFormat.clear();
+    }
+    if (status.good())
+    {
+        fileFormat.transferInit();
+        status = fileFormat.readUntilTag(stream, EXS_Unknown, EGL_noChange, maxReadLength, stopParsingAtElement);
+        fileFormat.transferEnd();
+    }
+    return true;
+}
+
+OFCondition loadBufferHeader(DcmFileFormat &fileFormat, const char *data, size_t size, const DcmTagKey &stopParsingAtElement)
+{
+    DcmInputBufferStream stream;
+    stream.setBuffer(data, size);
+    stream.setEos();
+    OFCondition status = fileFormat.clear();
+    if (status.good())
+    {
+        fileFormat.transferInit();
+        status = fileFormat.readUntilTag(stream, EXS_Unknown, EGL_noChange, 4096U, stopParsingAtElement);
+        fileFormat.transferEnd();
+    }
+    return status;
+}
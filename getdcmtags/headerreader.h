@@ -0,0 +1,39 @@
+#ifndef GETDCMTAGS_HEADERREADER_H
+#define GETDCMTAGS_HEADERREADER_H
+
+#include <memory>
+
+#include "dcmtk/dcmdata/dctk.h"
+
+// First element of the pixel data group. Parsing stops here in the headers-only mode, so that
+// neither (7FE0,0010) nor the float pixel data variants are ever read.
+const DcmTagKey HEADER_STOP_TAG(0x7fe0, 0x0000);
+
+// Read-only mapping of a complete file. Shared between the stream and the factories that DCMTK
+// creates for values that have not been loaded, so that the mapping outlives the parsing.
+class MappedFile
+{
+public:
+    // Returns an empty pointer if the file cannot be mapped (e.g., if it is empty)
+    static std::shared_ptr<MappedFile> open(const OFString &filename);
+    ~MappedFile();
+
+    const Uint8 *data;
+    size_t size;
+
+private:
+    MappedFile(const Uint8 *data, size_t size) : data(data), size(size) {}
+};
+
+// Loads the DICOM file from a memory-mapped view, stopping at the given top-level element.
+// Values larger than maxReadLength are skipped by their length without being copied, so that
+// only the pages containing the header are read from disk. Returns false if the file cannot
+// be mapped, in which case the caller should fall back to DcmFileFormat::loadFileUntilTag().
+bool loadFileHeader(DcmFileFormat &fileFormat, const OFString &filename, const DcmTagKey &stopParsingAtElement,
+                    Uint32 maxReadLength, OFCondition &status);
+
+// Loads a DICOM file that is held in memory (e.g., an archive member), stopping at the given
+// top-level element. The buffer must remain valid while the file format object is used.
+OFCondition loadBufferHeader(DcmFileFormat &fileFormat, const char *data, size_t size, const DcmTagKey &stopParsingAtElement);
+
+#endif
@@ -0,0 +1,381 @@
+#include "instanceindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+// Version 1 of the layout
+static const char INDEX_MAGIC[8] = {'M', 'D', 'U', 'P', 'I', 'D', 'X', '1'};
+
+// New generation when the table is filled to 3/4, to keep the probe sequences short
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+
+// Value of the second hash while a concurrent writer has only claimed the slot
+#define SLOT_PENDING 0
+// Value of the second hash after the UID has been removed again
+#define SLOT_RELEASED UINT64_MAX
+
+struct IndexHeader
+{
+    char magic[8];
+    uint64_t capacity;
+    std::atomic<uint64_t> count;
+    char reserved[40];
+};
+
+struct IndexSlot
+{
+    // 0 while the slot is empty. Claiming a slot sets this first, the second hash follows.
+    std::atomic<uint64_t> hash1;
+    std::atomic<uint64_t> hash2;
+};
+
+static_assert(sizeof(IndexHeader) == 64, "Unexpected size of the index header");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared index requires lock-free atomics");
+
+bool parseDuplicatePolicy(const char *value, DuplicatePolicy &policy)
+{
+    if (strcmp(value, "off") == 0)
+    {
+        policy = DUPLICATES_OFF;
+    }
+    else if (strcmp(value, "drop") == 0)
+    {
+        policy = DUPLICATES_DROP;
+    }
+    else if (strcmp(value, "replace") == 0)
+    {
+        policy = DUPLICATES_REPLACE;
+    }
+    else if (strcmp(value, "flag") == 0)
+    {
+        policy = DUPLICATES_FLAG;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// FNV-1a with a seed, followed by the splitmix64 finalizer to spread the bits
+static uint64_t hashUID(const std::string &value, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (unsigned char c : value)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static void hashPair(const std::string &value, uint64_t &hash1, uint64_t &hash2)
+{
+    hash1 = hashUID(value, 0);
+    hash2 = hashUID(value, 0x9e3779b97f4a7c15ULL);
+    if (hash1 == 0)
+    {
+        hash1 = 1;
+    }
+    if (hash2 == SLOT_PENDING || hash2 == SLOT_RELEASED)
+    {
+        hash2 = 1;
+    }
+}
+
+static IndexHeader *header(void *map)
+{
+    return (IndexHeader *)map;
+}
+
+static IndexSlot *slots(void *map)
+{
+    return (IndexSlot *)((char *)map + sizeof(IndexHeader));
+}
+
+// Waits until a concurrent writer has stored the second hash of a claimed slot
+static uint64_t waitForHash2(IndexSlot &slot)
+{
+    uint64_t hash2 = slot.hash2.load(std::memory_order_acquire);
+    for (int i = 0; hash2 == SLOT_PENDING && i < 1000; i++)
+    {
+        std::this_thread::yield();
+        hash2 = slot.hash2.load(std::memory_order_acquire);
+    }
+    return hash2;
+}
+
+// Returns true if the UID is found. If claim is set and the UID is not found, it is inserted.
+// Returns false without inserting if the table is full.
+static bool probe(void *map, uint64_t hash1, uint64_t hash2, bool claim, bool &inserted)
+{
+    inserted = false;
+    if (map == nullptr)
+    {
+        return false;
+    }
+    uint64_t capacity = header(map)->capacity;
+    IndexSlot *table = slots(map);
+    for (uint64_t i = 0; i < capacity; i++)
+    {
+        IndexSlot &slot = table[(hash1 + i) % capacity];
+        uint64_t current = slot.hash1.load(std::memory_order_acquire);
+        if (current == 0)
+        {
+            if (!claim)
+            {
+                return false;
+            }
+            uint64_t expected = 0;
+            if (slot.hash1.compare_exchange_strong(expected, hash1, std::memory_order_acq_rel))
+            {
+                slot.hash2.store(hash2, std::memory_order_release);
+                header(map)->count.fetch_add(1, std::memory_order_relaxed);
+                inserted = true;
+                return false;
+            }
+            current = expected;
+        }
+        if (current == hash1 && waitForHash2(slot) == hash2)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Turns the slot of the UID into a tombstone. Returns false if the UID is not found.
+static bool releaseSlot(void *map, uint64_t hash1, uint64_t hash2)
+{
+    if (map == nullptr)
+    {
+        return false;
+    }
+    uint64_t capacity = header(map)->capacity;
+    IndexSlot *table = slots(map);
+    for (uint64_t i = 0; i < capacity; i++)
+    {
+        IndexSlot &slot = table[(hash1 + i) % capacity];
+        uint64_t current = slot.hash1.load(std::memory_order_acquire);
+        if (current == 0)
+        {
+            return false;
+        }
+        uint64_t expected = hash2;
+        if (current == hash1 && waitForHash2(slot) == hash2
+            && slot.hash2.compare_exchange_strong(expected, SLOT_RELEASED, std::memory_order_acq_rel))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+InstanceIndex::~InstanceIndex()
+{
+    unmapTable(current);
+    unmapTable(previous);
+}
+
+bool InstanceIndex::open(const std::string &folder, size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string newFilename = folder + INSTANCE_INDEX_FILE;
+    if (newFilename == filename && current.map != nullptr)
+    {
+        return refresh();
+    }
+    unmapTable(current);
+    unmapTable(previous);
+    filename = newFilename;
+    this->capacity = capacity;
+    return refresh();
+}
+
+void InstanceIndex::unmapTable(Table &table)
+{
+    if (table.map != nullptr)
+    {
+        munmap(table.map, table.mapSize);
+    }
+    table = Table();
+}
+
+bool InstanceIndex::mapTable(const std::string &name, Table &table, bool create)
+{
+    int fd = ::open(name.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+    {
+        if (create)
+        {
+            std::cout << "ERROR: Unable to open instance index " << name << ". " << strerror(errno) << std::endl;
+        }
+        return false;
+    }
+    // The lock is only needed while a new file is initialized
+    flock(fd, LOCK_EX);
+    struct stat info;
+    bool success = fstat(fd, &info) == 0;
+    if (success && info.st_size == 0 && create)
+    {
+        size_t size = sizeof(IndexHeader) + capacity * sizeof(IndexSlot);
+        IndexHeader initial = {};
+        memcpy(initial.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        initial.capacity = capacity;
+        // The file is sparse, so only the used slots occupy disk space
+        success = ftruncate(fd, size) == 0 && pwrite(fd, &initial, sizeof(initial), 0) == (ssize_t)sizeof(initial)
+                  && fstat(fd, &info) == 0;
+    }
+    IndexHeader existing;
+    success = success && pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing)
+              && memcmp(existing.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && existing.capacity > 0
+              && (uint64_t)info.st_size == sizeof(IndexHeader) + existing.capacity * sizeof(IndexSlot);
+    flock(fd, LOCK_UN);
+    if (!success)
+    {
+        std::cout << "ERROR: Invalid instance index " << name << std::endl;
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        std::cout << "ERROR: Unable to map instance index " << name << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    table.map = map;
+    table.mapSize = info.st_size;
+    table.inode = info.st_ino;
+    return true;
+}
+
+// Maps the tables again if another process has started a new generation since they were mapped
+bool InstanceIndex::refresh()
+{
+    struct stat info;
+    if (current.map != nullptr && stat(filename.c_str(), &info) == 0 && info.st_ino == current.inode)
+    {
+        return true;
+    }
+    unmapTable(current);
+    unmapTable(previous);
+    mapTable(filename + ".old", previous, false);
+    return mapTable(filename, current, true);
+}
+
+// Starts a new generation. The lock file serializes processes that find the table full at the
+// same time, so that only one of them renames it.
+bool InstanceIndex::rotate()
+{
+    std::string lockName = filename + ".lock";
+    int lockFd = ::open(lockName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lockFd < 0)
+    {
+        std::cout << "ERROR: Unable to lock instance index " << lockName << std::endl;
+        return false;
+    }
+    flock(lockFd, LOCK_EX);
+    struct stat info;
+    if (stat(filename.c_str(), &info) == 0 && info.st_ino == current.inode)
+    {
+        rename(filename.c_str(), (filename + ".old").c_str());
+    }
+    bool success = refresh();
+    flock(lockFd, LOCK_UN);
+    close(lockFd);
+    return success;
+}
+
+bool InstanceIndex::contains(const std::string &sopInstanceUID)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!refresh())
+    {
+        return false;
+    }
+    uint64_t hash1, hash2;
+    hashPair(sopInstanceUID, hash1, hash2);
+    bool inserted;
+    return probe(current.map, hash1, hash2, false, inserted) || probe(previous.map, hash1, hash2, false, inserted);
+}
+
+InstanceInsertResult InstanceIndex::insert(const std::string &sopInstanceUID)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!refresh())
+    {
+        return INSTANCE_INSERT_FAILED;
+    }
+    uint64_t hash1, hash2;
+    hashPair(sopInstanceUID, hash1, hash2);
+    bool inserted;
+    if (probe(previous.map, hash1, hash2, false, inserted))
+    {
+        return INSTANCE_PRESENT;
+    }
+    if (header(current.map)->count.load(std::memory_order_relaxed) * MAX_LOAD_DENOMINATOR
+            >= header(current.map)->capacity * MAX_LOAD_NUMERATOR
+        && !rotate())
+    {
+        return INSTANCE_INSERT_FAILED;
+    }
+    if (probe(current.map, hash1, hash2, true, inserted))
+    {
+        return INSTANCE_PRESENT;
+    }
+    if (inserted)
+    {
+        return INSTANCE_INSERTED;
+    }
+    std::cout << "ERROR: Instance index " << filename << " is full" << std::endl;
+    return INSTANCE_INSERT_FAILED;
+}
+
+void InstanceIndex::remove(const std::string &sopInstanceUID)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!refresh())
+    {
+        return;
+    }
+    uint64_t hash1, hash2;
+    hashPair(sopInstanceUID, hash1, hash2);
+    // The table may have become the previous generation since the UID has been inserted
+    if (!releaseSlot(current.map, hash1, hash2) && !releaseSlot(previous.map, hash1, hash2))
+    {
+        std::cout << "WARNING: Unable to remove " << sopInstanceUID << " from instance index " << filename << std::endl;
+    }
+}
+
+InstanceInsertResult InstanceClaim::claim(InstanceIndex &index, const std::string &sopInstanceUID)
+{
+    release();
+    InstanceInsertResult result = index.insert(sopInstanceUID);
+    if (result == INSTANCE_INSERTED)
+    {
+        this->index = &index;
+        this->sopInstanceUID = sopInstanceUID;
+    }
+    return result;
+}
+
+void InstanceClaim::release()
+{
+    if (index != nullptr)
+    {
+        index->remove(sopInstanceUID);
+        index = nullptr;
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef GETDCMTAGS_INSTANCEINDEX_H
+#define GETDCMTAGS_INSTANCEINDEX_H
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Name of the index in the incoming folder. The previous generation is kept with the suffix ".old".
+#define INSTANCE_INDEX_FILE ".instance_index"
+
+enum DuplicatePolicy
+{
+    DUPLICATES_OFF,
+    // Duplicates are deleted without further processing
+    DUPLICATES_DROP,
+    // Duplicates are accepted and replace a copy that is still waiting in the series folder
+    DUPLICATES_REPLACE,
+    // Duplicates are accepted, and the tag "Duplicate" is added to the .tags file
+    DUPLICATES_FLAG
+};
+
+bool parseDuplicatePolicy(const char *value, DuplicatePolicy &policy);
+
+enum InstanceInsertResult
+{
+    INSTANCE_INSERTED,
+    // The UID has been inserted before, possibly by a concurrent process that is still placing it
+    INSTANCE_PRESENT,
+    INSTANCE_INSERT_FAILED
+};
+
+// Persistent set of the SOPInstanceUIDs that have been accepted, shared by all receiver
+// processes through a memory-mapped file. The file is an open-addressing hash table that stores
+// a 128-bit hash of each UID. Slots are claimed with atomic compare-and-swap operations on the
+// shared mapping, so concurrent processes (storescp --fork) need no locks. If the table becomes
+// full, it is renamed to ".old" and a new generation is started, so that the UIDs of the
+// previous generation are still found but older ones are forgotten.
+class InstanceIndex
+{
+public:
+    InstanceIndex() = default;
+    InstanceIndex(const InstanceIndex &) = delete;
+    InstanceIndex &operator=(const InstanceIndex &) = delete;
+    ~InstanceIndex();
+
+    // Opens the index in the folder, creating it with the given number of slots if needed
+    bool open(const std::string &folder, size_t capacity);
+
+    bool contains(const std::string &sopInstanceUID);
+
+    // Adds the UID unless it is found in either generation. If several processes insert the same
+    // UID concurrently, exactly one of them gets INSTANCE_INSERTED.
+    InstanceInsertResult insert(const std::string &sopInstanceUID);
+
+    // Withdraws an inserted UID, so that the instance is accepted again when it is retransmitted.
+    // The slot is kept as a tombstone, as it can be part of the probe sequence of other UIDs.
+    void remove(const std::string &sopInstanceUID);
+
+private:
+    struct Table
+    {
+        void *map = nullptr;
+        size_t mapSize = 0;
+        ino_t inode = 0;
+    };
+
+    bool refresh();
+    bool mapTable(const std::string &filename, Table &table, bool create);
+    void unmapTable(Table &table);
+    bool rotate();
+
+    std::mutex mutex;
+    std::string filename;
+    size_t capacity = 0;
+    Table current;
+    Table previous;
+};
+
+// UID inserted into the instance index that is removed again when the object is destroyed,
+// unless the instance has been accepted
+class InstanceClaim
+{
+public:
+    InstanceClaim() = default;
+    InstanceClaim(const InstanceClaim &) = delete;
+    InstanceClaim &operator=(const InstanceClaim &) = delete;
+    ~InstanceClaim() { release(); }
+
+    InstanceInsertResult claim(InstanceIndex &index, const std::string &sopInstanceUID);
+    // Keeps the UID in the index
+    void accept() { index = nullptr; }
+    void release();
+
+private:
+    InstanceIndex *index = nullptr;
+    std::string sopInstanceUID;
+};
+
+#endif
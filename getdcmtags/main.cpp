@@ -1,7 +1,22 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sstream>
-#include <iomanip>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "dcmtk/dcmdata/dcpath.h"
 #include "dcmtk/dcmdata/dcerror.h"
@@ -9,81 +24,208 @@
 #include "dcmtk/ofstd/ofstd.h"
 #include "dcmtk/dcmdata/dcspchrs.h"
 #include "dcmtk/dcmdata/dctypes.h"
-#include <QPair> 
-#include <QString> 
-#include <QFile>
-#include <QVariant>
-#include <QDir>
-
-#include <QFileInfo>
-#include <QTextStream>
-#include <QVector> 
-#include <QVectorIterator>
-#include <QCoreApplication>
 
 #include "tags_list.h"
+#include "daemon.h"
+#include "threadpool.h"
+#include "bookkeeper.h"
+#include "headerreader.h"
+#include "nativescanner.h"
+#include "tagswriter.h"
+#include "charsetcache.h"
+#include "seriesindex.h"
+#include "binaryindex.h"
+#include "seriesevents.h"
+#include "errorjournal.h"
+#include "placement.h"
+#include "instanceindex.h"
+#include "storagescp.h"
+#include "metrics.h"
+#include "tagplan.h"
+#include "admission.h"
+#include "fingerprint.h"
+#include "archive.h"
+#include "studyrollup.h"
+#include "transcoder.h"
 
 #define VERSION "getdcmtags Version 0.74"
 
-static OFString tagSpecificCharacterSet = "";
-static OFString tagSeriesInstanceUID = "";
-static OFString tagSOPInstanceUID = "";
+// Number of files after which the deferred durability journal is committed in batch mode
+#define GROUP_COMMIT_FILES 256
 
-static OFString helperSenderAddress = "";
-static OFString helperSenderAET = "";
-static OFString helperReceiverAET = "";
+// Number of slots of a new generation of the instance index (16 bytes each, sparse file)
+#define INSTANCE_INDEX_CAPACITY (1 << 22)
 
-static std::string bookkeeperAddress = "";
-static std::string bookkeeperToken = "";
+// Settings passed on the command line that apply to all files of one invocation
+struct ProcessingOptions
+{
+    OFString helperSenderAddress = "";
+    OFString helperSenderAET = "";
+    OFString helperReceiverAET = "";
 
-static QVector<QPair<DcmTagKey, OFString>> additional_tags;
-static QVector<QPair<DcmTagKey, OFString>> main_tags;
-static QVector<QPair<OFString, OFString>> force_tags;
+    std::string bookkeeperAddress = "";
+    std::string bookkeeperToken = "";
+    std::string bookkeeperSpool = "";
 
-// Escape the JSON values properly to avoid problems if DICOM tags contains invalid characters
-// (see https://stackoverflow.com/questions/7724448/simple-json-string-escape-for-c)
-std::string escapeJSONValue(const OFString &s)
+    std::vector<std::pair<OFString, OFString>> force_tags;
+    bool tagsStopEarly = false;
+    bool fullParse = false;
+    bool nativeEngine = false;
+    SeriesIndexMode seriesIndex = SERIES_INDEX_OFF;
+    bool binarySeriesIndex = false;
+    bool seriesEvents = false;
+    bool studyRollup = false;
+    DurabilityPolicy durability = DURABILITY_NONE;
+    DuplicatePolicy duplicates = DUPLICATES_OFF;
+    FingerprintMode fingerprint = FINGERPRINT_OFF;
+    int testInjectError = 0;
+    // Admission control is off if no slots are configured
+    int admissionSlots = 0;
+    int admissionTimeout = 30000;
+    std::vector<AdmissionRule> admissionRules;
+    // Transfer syntax normalization is off unless a target is given
+    bool transcode = false;
+    E_TransferSyntax transcodeTarget = EXS_LittleEndianExplicit;
+    std::vector<TranscodeRule> transcodeRules;
+    // Size of the transcode pool in batch, archive and SCP mode, 0 for half of the cores
+    int transcodeThreads = 0;
+    // Writes a .error file next to each failed file instead of a record into the error journal
+    bool legacyErrorFiles = false;
+};
+
+// State of the file that is currently processed. Each worker thread owns one context, so that
+// files can be processed concurrently and the charset converter is reused across files.
+struct FileContext
 {
-    std::ostringstream o;
-    for (auto c = s.begin(); c != s.end(); c++)
+    OFString tagSpecificCharacterSet = "";
+    OFString tagSeriesInstanceUID = "";
+    OFString tagSOPInstanceUID = "";
+
+    // Values together with the name that is written into the .tags file
+    std::vector<std::pair<const char*, OFString>> additional_tags;
+    std::vector<std::pair<const char*, OFString>> main_tags;
+
+    // Converters are cached across the files processed by the worker
+    CharsetConverterCache charsetCache;
+    CharsetConverter* charsetConverter = nullptr;
+    bool isConversionNeeded = false;
+
+    // Set if the instance has been received before and the duplicate policy is "flag"
+    bool duplicate = false;
+
+    // Journal generation at the start of the file, the commit result covers the flushes from there on
+    uint64_t durableSince = 0;
+
+    // Instance received by the embedded storage SCP that has not been written to disk yet
+    DcmFileFormat* receivedFile = nullptr;
+    // Content of an archive member that has not been written to disk yet
+    const std::string* receivedData = nullptr;
+
+    // Hashes of the pixel data if fingerprinting is enabled, and the chunk buffer for reading it
+    PixelFingerprint fingerprint;
+    std::vector<uint8_t> fingerprintBuffer;
+
+    // Reused across files, so that writing the .tags file does not allocate once warmed up
+    TagsWriter tagsWriter;
+    OFString conversionBuffer;
+
+    FileMetrics metrics;
+
+    // Reason why a tag could not be read, added to the error information of the file
+    OFString errorDetail;
+
+    void reset()
     {
-        // Convert control characters into UTF8 coded version
-        if (*c == '"' || *c == '\\' || ('\x00' <= *c && *c <= '\x1f'))
-        {
-            o << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)*c;
-        }
-        else
+        tagSpecificCharacterSet = "";
+        tagSeriesInstanceUID = "";
+        tagSOPInstanceUID = "";
+        additional_tags.clear();
+        main_tags.clear();
+        charsetConverter = nullptr;
+        isConversionNeeded = false;
+        duplicate = false;
+        fingerprint = PixelFingerprint();
+        receivedFile = nullptr;
+        receivedData = nullptr;
+        errorDetail = "";
+    }
+};
+
+// The extra tags are loaded once from the compiled tag plan and then shared read-only between
+// all worker threads. The plan owns the names referenced by the descriptors.
+static TagPlan extraTagPlan;
+static std::once_flag extraTagKeysOnce;
+static bool extraTagKeysLoaded = false;
+
+// One client is shared by all files processed by this process, so that events of multiple
+// files can be sent with one request (in daemon and batch mode)
+static std::unique_ptr<BookkeeperClient> bookkeeperClient;
+static std::mutex bookkeeperClientMutex;
+
+// Series event and bookkeeper post of a placed file. The settings are copied, as the notification
+// can be sent after the request that placed the file has finished.
+struct FileNotification
+{
+    std::string folder;
+    std::string filename;
+    std::string fileUID;
+    std::string seriesUID;
+    bool seriesEvent = false;
+    std::string bookkeeperAddress;
+    std::string bookkeeperToken;
+    std::string bookkeeperSpool;
+    // Journal generations that hold the files of the notification
+    uint64_t firstGeneration = 0;
+    uint64_t lastGeneration = 0;
+};
+
+void sendBookkeeperPost(const FileNotification& notification)
+{
+    if (notification.bookkeeperAddress.empty())
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(bookkeeperClientMutex);
+    if (!bookkeeperClient)
+    {
+        // Undeliverable events are kept by default in a hidden folder of the incoming folder, so that
+        // the client only has to list that folder for the spools of crashed processes, not the series
+        std::string spoolFile = notification.bookkeeperSpool;
+        if (spoolFile.empty())
         {
-            o << *c;
+            std::string spoolFolder = notification.folder + BOOKKEEPER_SPOOL_FOLDER;
+            if (mkdir(spoolFolder.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                std::cout << "WARNING: Unable to create bookkeeper spool folder " << spoolFolder << ". " << strerror(errno) << std::endl;
+            }
+            spoolFile = spoolFolder + "/spool";
         }
+        bookkeeperClient.reset(new BookkeeperClient(notification.bookkeeperAddress, notification.bookkeeperToken, spoolFile));
     }
-    return o.str();
+    bookkeeperClient->registerDicom(notification.filename, notification.fileUID, notification.seriesUID);
 }
 
-
-void sendBookkeeperPost(OFString filename, OFString fileUID, OFString seriesUID)
+void sendFileNotification(const FileNotification& notification)
 {
-    if (bookkeeperAddress.empty())
+    // The file is complete in the series folder, so the router can be notified. If the event cannot be
+    // written, the router still finds the series with its periodic scan of the incoming folder.
+    if (notification.seriesEvent)
     {
-        return;
+        appendSeriesEvent(notification.folder, SERIES_EVENT_INSTANCE, notification.seriesUID);
     }
+    sendBookkeeperPost(notification);
+}
 
-    // Send REST call to bookkeeper instance as forked process, so that the
-    // current process can proceed and terminate
-    std::string cmd = "wget -q -T 1 -t 3 --post-data=\"filename=";
-    cmd.append(filename.c_str());
-    cmd.append("&file_uid=");
-    cmd.append(fileUID.c_str());
-    cmd.append("&series_uid=");
-    cmd.append(seriesUID.c_str());
-    cmd.append("\"");
-    cmd.append(" --header=\"Authorization: Token ");
-    cmd.append(bookkeeperToken);
-    cmd.append("\" http://");
-    cmd.append(bookkeeperAddress);
-    cmd.append("/register-dicom -O /dev/null");
-
-    system(cmd.data());
+// Delivers the pending bookkeeper events before the process terminates
+void shutdownBookkeeperClient()
+{
+    std::lock_guard<std::mutex> lock(bookkeeperClientMutex);
+    if (bookkeeperClient)
+    {
+        bookkeeperClient->shutdown();
+        bookkeeperClient.reset();
+    }
 }
 
 
@@ -120,56 +262,28 @@ void writeErrorInformation(OFString dcmFile, OFString errorString)
 }
 
 
-static DcmSpecificCharacterSet charsetConverter;
-static bool isConversionNeeded = false;
-static int testInjectError = 0;
-
 #define DO_ERROR(n) \
-    (testInjectError == n)
+    (options.testInjectError == n)
 
 #define INSERTTAG(A, B, C)                                                              \
-    conversionBuffer = "";                                                              \
-    if (isConversionNeeded)                                                             \
+    if (ctx.isConversionNeeded && !ctx.charsetCache.isASCIIValue(*ctx.charsetConverter, B)) \
     {                                                                                   \
-        if (!charsetConverter.convertString(B, conversionBuffer).good())                \
+        if (!ctx.charsetCache.convert(*ctx.charsetConverter, B, ctx.conversionBuffer).good()) \
         {                                                                               \
             std::cout << "ERROR: Unable to convert charset for tag " << A << std::endl; \
             std::cout << "ERROR: Unable to process file " << dcmFile << std::endl;      \
             conversionFailed = true;                                                    \
         }                                                                               \
+        ctx.tagsWriter.addValue(A, ctx.conversionBuffer.c_str(),                        \
+                                ctx.conversionBuffer.length());                         \
     }                                                                                   \
     else                                                                                \
     {                                                                                   \
-        conversionBuffer = B;                                                           \
-    }                                                                                   \
-    fprintf(fp, "\"%s\": \"%s\",\n", A, escapeJSONValue(conversionBuffer).c_str())
-
-
-static DcmTagKey parseTagKey(const char *tagName)
-{
-    unsigned int group = 0xffff;
-    unsigned int elem = 0xffff;
-    if (sscanf(tagName, "%x,%x", &group, &elem) != 2)
-    {
-        DcmTagKey tagKey;
-        /* it is a name */
-        const DcmDataDictionary &globalDataDict = dcmDataDict.rdlock();
-        const DcmDictEntry *dicent = globalDataDict.findEntry(tagName);
-        if (dicent == NULL) {
-            tagKey = DCM_UndefinedTagKey;
-        } else {
-            tagKey = dicent->getKey();
-        }
-        dcmDataDict.rdunlock();
-        return tagKey;
-    } else     /* tag name has format "gggg,eeee" */
-    {
-        return DcmTagKey(OFstatic_cast(Uint16, group),OFstatic_cast(Uint16, elem));
+        ctx.tagsWriter.addValue(A, (B).c_str(), (B).length());                          \
     }
-}
 
 
-bool readTag(DcmTagKey tag, DcmItem* dataset, OFString& out, OFString path_info) {
+bool readTag(DcmTagKey tag, DcmItem* dataset, OFString& out, FileContext& ctx) {
     if (!dataset->tagExistsWithValue(tag)) {
         return true;
     }
@@ -180,7 +294,8 @@ bool readTag(DcmTagKey tag, DcmItem* dataset, OFString& out, OFString path_info)
         errorStr.append(tag.toString());
         errorStr.append("\nReason: ");                                           
         errorStr.append(result.text());
-        writeErrorInformation(path_info, errorStr);
+        std::cout << "ERROR: " << errorStr << std::endl;
+        ctx.errorDetail = errorStr;
         return false;
     }
     for (size_t i = 0; i < out.length(); i++)                                                                                 
@@ -204,110 +319,188 @@ bool readTag(DcmTagKey tag, DcmItem* dataset, OFString& out, OFString path_info)
 }
 
 
-bool readExtraTags(DcmDataset* dataset, OFString path_info) {
-    QString filePath = "./dcm_extra_tags";
-    if (!QFileInfo::exists(filePath)) {
-        filePath = QCoreApplication::applicationDirPath() + "/dcm_extra_tags";
+// Returns the folder that contains the getdcmtags binary
+static std::string applicationDirPath() {
+    char path[4096];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length <= 0) {
+        return ".";
     }
-    if (QFileInfo::exists(filePath)) {
-        QFile inputFile(filePath);
-        inputFile.open(QIODevice::ReadOnly);
-        if (!inputFile.isOpen()) {
-            std::cout << "Unable to read extra_tags file." << std::endl;
+    path[length] = 0;
+    char* slash = strrchr(path, '/');
+    if (slash != nullptr) {
+        *slash = 0;
+    }
+    return path;
+}
+
+// Creates the folder including all missing parent folders
+static bool makePath(const std::string& path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        if (mkdir(path.substr(0, pos).c_str(), 0777) != 0 && errno != EEXIST) {
             return false;
         }
+    }
+    struct stat info;
+    return (mkdir(path.c_str(), 0777) == 0 || errno == EEXIST) && stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
 
-        QTextStream stream(&inputFile);
-        for (QString line = stream.readLine();
-            !line.isNull();
-            line = stream.readLine()) {
+static bool endsWith(const std::string& value, const char* suffix) {
+    size_t length = strlen(suffix);
+    return value.size() >= length && value.compare(value.size() - length, length, suffix) == 0;
+}
 
-            OFString out;
-            DcmTagKey the_tag = parseTagKey(qPrintable(line));
-            if (the_tag == DCM_UndefinedTagKey) {
-                std::cout << "Unknown tag " << qPrintable(line) << std::endl;
-                return false;
-            }
-            if (!readTag(the_tag, dataset, out, path_info))
-                return false;
-            additional_tags.append(QPair<DcmTagKey, OFString>(the_tag, out));
-        };
+// Loads the tag plan of the dcm_extra_tags file only once per process, so that the tags remain
+// cached when running in daemon mode. The plan has been compiled by receiver.sh (or by the first
+// invocation after the file has changed), so that neither the text file needs to be parsed nor
+// the dictionary needs to be accessed for every received file. The plan is never loaded again
+// while the workers read it, so a failure is kept as well and each file fails with it.
+bool loadExtraTagKeys() {
+    std::call_once(extraTagKeysOnce, [] {
+        std::string filePath = "./dcm_extra_tags";
+        if (access(filePath.c_str(), F_OK) != 0) {
+            filePath = applicationDirPath() + "/dcm_extra_tags";
+        }
+        extraTagKeysLoaded = access(filePath.c_str(), F_OK) != 0 || extraTagPlan.load(filePath);
+    });
+    return extraTagKeysLoaded;
+}
+
+
+bool readExtraTags(FileContext& ctx, DcmDataset* dataset) {
+    if (!loadExtraTagKeys()) {
+        return false;
+    }
+    for (auto& the_tag: extraTagPlan.tags()) {
+        OFString out;
+        if (!readTag(the_tag.key(), dataset, out, ctx))
+            return false;
+        ctx.additional_tags.emplace_back(the_tag.name, out);
     }
     return true;
 }
 
 
-bool writeTagsList(QVector<QPair<DcmTagKey, OFString>>& tags, FILE* fp, OFString& dcmFile, OFString& conversionBuffer) {
+bool writeTagsList(FileContext& ctx, std::vector<std::pair<const char*, OFString>>& tags, OFString& dcmFile) {
     
-    QVectorIterator<QPair<DcmTagKey, OFString>> iter(tags);
     bool conversionFailed = false;
-    const DcmDataDictionary &globalDataDict = dcmDataDict.rdlock();
-    while(iter.hasNext())
+    for (auto& pair : tags)
     {
-        auto pair = iter.next();
-        const DcmDictEntry *dicent = globalDataDict.findEntry(pair.first, NULL);
-        if (dicent == NULL) { // If it's not in the dictionary
-            INSERTTAG(pair.first.toString().c_str(), pair.second,"");
-        } else {
-            INSERTTAG(dicent->getTagName(), pair.second,"");
-        }
+        INSERTTAG(pair.first, pair.second,"");
     }
     return !conversionFailed;
-    dcmDataDict.rdunlock();
 }
 
 
-bool writeForceTagsList(QVector<QPair<OFString, OFString>>& tags, FILE* fp) {
+bool writeForceTagsList(const std::vector<std::pair<OFString, OFString>>& tags, TagsWriter& writer) {
     
-    QVectorIterator<QPair<OFString, OFString>> iter(tags);
-    while(iter.hasNext())
+    for (const auto& pair : tags)
     {
-        auto pair = iter.next();
-        fprintf(fp, "\"%s\": \"%s\",\n", pair.first.c_str(), escapeJSONValue(pair.second).c_str());
+        writer.addValue(pair.first.c_str(), pair.second.c_str(), pair.second.length());
     }
     return true;
 }
 
 
-bool writeTagsFile(OFString dcmFile, OFString originalFile)
-{
-    OFString filename = dcmFile + ".tags";
-    FILE *fp = fopen(filename.c_str(), "w+");
+// Files that need to be flushed according to the durability policy. In batch and archive mode, the
+// files of several workers are committed together. In daemon and SCP mode, each worker commits its
+// file, and workers that commit at the same time share the flush.
+static DurabilityJournal durabilityJournal;
 
-    if (fp == nullptr)
+// Notifications of files whose group commit is still outstanding (in batch and archive mode)
+static std::vector<FileNotification> pendingNotifications;
+static std::mutex pendingNotificationsMutex;
+
+// SOPInstanceUIDs of the accepted instances, shared with all other receiver processes
+static InstanceIndex instanceIndex;
+
+// Converts the placed files into the target transfer syntax, with a separate pool in batch,
+// archive and SCP mode
+static Transcoder transcoder;
+
+// Series and arrival times of the received studies, shared with all other receiver processes
+static StudyRollupIndex studyRollup;
+
+// Limits the files that all receiver processes of the incoming folder place at the same time
+static AdmissionControl admissionControl;
+
+// Metrics of all files processed by this process. When a single file is processed, a summary
+// of the file is printed instead.
+static ReceiverMetrics receiverMetrics;
+static bool printFileMetrics = false;
+
+// Commits the journal and sends the notifications of the files that are durable now. Returns
+// false if the flush of a generation from the given one on has failed.
+bool commitNotifications(uint64_t since)
+{
+    // All files of the queued notifications have been registered before, so the commit covers them
+    std::vector<FileNotification> notifications;
     {
-        std::cout << "ERROR: Unable to write tag file " << filename << std::endl;
-        return false;
+        std::lock_guard<std::mutex> lock(pendingNotificationsMutex);
+        notifications.swap(pendingNotifications);
+    }
+    bool success = durabilityJournal.commit(since);
+    for (const auto& notification : notifications)
+    {
+        if (durabilityJournal.failed(notification.firstGeneration, notification.lastGeneration))
+        {
+            std::cout << "WARNING: Not notifying about " << notification.filename << ", the file could not be flushed" << std::endl;
+            continue;
+        }
+        sendFileNotification(notification);
     }
+    return success;
+}
 
-    fprintf(fp, "{\n");
-    OFString conversionBuffer = "";
+bool writeTagsFile(const ProcessingOptions& options, FileContext& ctx, OFString dcmFile, OFString originalFile)
+{
+    OFString filename = dcmFile + ".tags";
+
+    // The binary series index needs the unescaped values
+    ctx.tagsWriter.begin(options.seriesIndex != SERIES_INDEX_OFF && options.binarySeriesIndex);
     bool conversionFailed = false;
-    INSERTTAG("SpecificCharacterSet", tagSpecificCharacterSet, "ISO_IR 100");
-    INSERTTAG("SeriesInstanceUID", tagSeriesInstanceUID, "1.2.256.0.7230020.3.1.3.531431169.31.1254476944.91508");
-    INSERTTAG("SOPInstanceUID", tagSOPInstanceUID, "1.2.256.0.7220020.3.1.3.541411159.31.1254476944.91518");
+    INSERTTAG("SpecificCharacterSet", ctx.tagSpecificCharacterSet, "ISO_IR 100");
+    INSERTTAG("SeriesInstanceUID", ctx.tagSeriesInstanceUID, "1.2.256.0.7230020.3.1.3.531431169.31.1254476944.91508");
+    INSERTTAG("SOPInstanceUID", ctx.tagSOPInstanceUID, "1.2.256.0.7220020.3.1.3.541411159.31.1254476944.91518");
     
-    INSERTTAG("SenderAddress", helperSenderAddress, "");
-    INSERTTAG("SenderAET", helperSenderAET, "STORESCU");
-    INSERTTAG("ReceiverAET", helperReceiverAET, "ANY-SCP");
+    INSERTTAG("SenderAddress", options.helperSenderAddress, "");
+    INSERTTAG("SenderAET", options.helperSenderAET, "STORESCU");
+    INSERTTAG("ReceiverAET", options.helperReceiverAET, "ANY-SCP");
 
-    writeTagsList(main_tags, fp, dcmFile, conversionBuffer);
-    writeTagsList(additional_tags, fp, dcmFile, conversionBuffer);
+    writeTagsList(ctx, ctx.main_tags, dcmFile);
+    writeTagsList(ctx, ctx.additional_tags, dcmFile);
 
-    writeForceTagsList(force_tags, fp);
+    writeForceTagsList(options.force_tags, ctx.tagsWriter);
+    if (ctx.duplicate) {
+        ctx.tagsWriter.addValue("Duplicate", "true");
+    }
+    if (!ctx.fingerprint.fast.empty()) {
+        ctx.tagsWriter.addValue("PixelDataXXH64", ctx.fingerprint.fast.c_str());
+    }
+    if (!ctx.fingerprint.sha256.empty()) {
+        ctx.tagsWriter.addValue("PixelDataSHA256", ctx.fingerprint.sha256.c_str());
+    }
 
-    fprintf(fp, "\"Filename\": \"%s\"\n", originalFile.c_str());
-    fprintf(fp, "}\n");
+    ctx.tagsWriter.end("Filename", originalFile.c_str());
 
-    fclose(fp);
+    // In the exclusive series index mode, the tags are only stored in the index
+    if (options.seriesIndex == SERIES_INDEX_EXCLUSIVE) {
+        return true;
+    }
+    if (!ctx.tagsWriter.writeFile(filename.c_str()))
+    {
+        std::cout << "ERROR: Unable to write tag file " << filename << std::endl;
+        return false;
+    }
+    durabilityJournal.add(filename.c_str(), options.durability);
     return true;
 }
 
 bool createSeriesFolder(const OFString& path, const OFString& seriesUID) {
     OFString fullPath = path + seriesUID;
-    QDir dir(QString::fromStdString(fullPath.c_str()));
-    if (!dir.exists()) {
-        if (!dir.mkpath(".")) {
+    struct stat info;
+    if (stat(fullPath.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+        if (!makePath(fullPath.c_str())) {
             std::cout << "ERROR: Unable to create directory " << fullPath << std::endl;
             return false;
         }
@@ -315,81 +508,127 @@ bool createSeriesFolder(const OFString& path, const OFString& seriesUID) {
     return true;
 }
 
-void writeErrorInformationAndMove(const OFString& path, const OFString& filename, const OFString& errorString) {
-        if (!createSeriesFolder(path, "error")) {
-            writeErrorInformation(path+filename, errorString);
+// Writes the instance received by the embedded storage SCP or read from an archive, which only
+// exists in memory so far. Does nothing for files that are already on disk.
+bool storeReceivedFile(FileContext& ctx, const OFString& filename) {
+    if (ctx.receivedData != nullptr) {
+        const std::string* data = ctx.receivedData;
+        ctx.receivedData = nullptr;
+        return writeFileContent(data->data(), data->size(), filename.c_str());
+    }
+    if (ctx.receivedFile == nullptr) {
+        return true;
+    }
+    DcmFileFormat* file = ctx.receivedFile;
+    ctx.receivedFile = nullptr;
+    return saveReceivedFile(*file, filename.c_str());
+}
+
+// Records the failure of a file, which is given relative to the incoming folder. By default, one
+// record is appended to the error journal, so that a burst of failures does not create lock and
+// error files in the incoming folder. The .error file is written if the journal cannot be written.
+void recordError(const ProcessingOptions& options, const OFString& path, const OFString& file, bool moved, const OFString& errorString) {
+    if (!options.legacyErrorFiles) {
+        std::cout << errorString << std::endl;
+        ErrorRecord record;
+        record.file = file.c_str();
+        record.senderAET = options.helperSenderAET.c_str();
+        record.senderAddress = options.helperSenderAddress.c_str();
+        record.message = errorString.c_str();
+        record.moved = moved;
+        if (appendErrorRecord(path.c_str(), record)) {
             return;
         }
-        if (rename((path+filename).c_str(), (path + "error/" + filename + ".dcm").c_str()) != 0) {
-            writeErrorInformation(path+filename, errorString);
-            return;
+    }
+    writeErrorInformation(path + file, errorString);
+}
+
+void writeErrorInformationAndMove(const ProcessingOptions& options, FileContext& ctx, const OFString& path, const OFString& filename, OFString errorString) {
+        storeReceivedFile(ctx, path + filename);
+        if (options.seriesEvents) {
+            appendSeriesEvent(path.c_str(), SERIES_EVENT_ERROR, "");
         }
-        if (QFileInfo::exists((path+filename+".error").c_str())) {
-            rename((path+filename+".error").c_str(), (path+"error/"+filename+".dcm.error").c_str());
+        if (!ctx.errorDetail.empty()) {
+            errorString.append(ctx.errorDetail);
+            errorString.append("\n");
         }
-        writeErrorInformation(path + "error/" + filename+".dcm", errorString);
+        // The file is moved before it is recorded, so that the router finds it in the error folder
+        if (!createSeriesFolder(path, "error")
+            || rename((path+filename).c_str(), (path + "error/" + filename + ".dcm").c_str()) != 0) {
+            recordError(options, path, filename, false, errorString);
+            return;
+        }
+        recordError(options, path, "error/" + filename + ".dcm", true, errorString);
 }
 
 DcmTagKey calculateUntilTag() {
-    const DcmTagKey* last_tag = std::max_element(main_tags_list.begin(), main_tags_list.end());
-    if (additional_tags.size() > 0) {
-        DcmTagKey last_tag_additional = std::max_element(additional_tags.begin(), additional_tags.end())->first;
+    DcmTagKey last_tag = std::end(main_tags_list)[-1].key();
+    if (loadExtraTagKeys() && extraTagPlan.tags().size() > 0) {
+        DcmTagKey last_tag_additional(extraTagPlan.lastKey() >> 16, extraTagPlan.lastKey() & 0xffff);
         std::cout << "Last additional tag: " << last_tag_additional.toString() << std::endl;
-        if (*last_tag < last_tag_additional) {
-            last_tag = &last_tag_additional;
+        if (last_tag < last_tag_additional) {
+            last_tag = last_tag_additional;
         }
     }
-    std::cout << "Last tag: " << last_tag->toString() << std::endl;
+    std::cout << "Last tag: " << last_tag.toString() << std::endl;
     DcmTagKey next_tag = DCM_UndefinedTagKey;
 
-    if (last_tag->getElement() == 0xFFFF) {
-        next_tag = DcmTagKey(last_tag->getGroup()+1, 0x0000);
+    if (last_tag.getElement() == 0xFFFF) {
+        next_tag = DcmTagKey(last_tag.getGroup()+1, 0x0000);
     } else {
-        next_tag = DcmTagKey(last_tag->getGroup(), last_tag->getElement()+1);
+        next_tag = DcmTagKey(last_tag.getGroup(), last_tag.getElement()+1);
     }
     return next_tag;
 }
 
-int main(int argc, char *argv[])
-{
-    QCoreApplication app( argc, argv );
-        
-    if (!charsetConverter.isConversionAvailable())
-    {
-        std::cout << std::endl;
-        std::cout << "ERROR: Characterset converter not available" << std::endl
-                  << std::endl;
-        std::cout << "ERROR: Check installed libraries" << std::endl
-                  << std::endl;
-
-        return 1;
+// Returns the element at which parsing stops in the headers-only mode. If an extra tag is
+// located behind the pixel data, the complete file needs to be parsed.
+DcmTagKey headerStopTag() {
+    Uint32 stopKey = ((Uint32)HEADER_STOP_TAG.getGroup() << 16) | HEADER_STOP_TAG.getElement();
+    if (loadExtraTagKeys() && extraTagPlan.tags().size() > 0 && extraTagPlan.lastKey() >= stopKey) {
+        return DCM_UndefinedTagKey;
     }
+    return HEADER_STOP_TAG;
+}
 
-    if (argc < 5)
-    {
-        std::cout << std::endl;
-        std::cout << VERSION << std::endl;
-        std::cout << "------------------------" << std::endl
-                  << std::endl;
-        std::cout << "Usage: [dcm file to analyze] [sender address] [sender AET] [receiver AET] [ip:port of bookkeeper] [api key for bookkeeper]" << std::endl
-                  << std::endl;
-        return 0;
-    }
+// Returns the sorted keys of all top-level elements that are read from the dataset, for use by
+// the native scanner. Built on first use, after the extra tags have been loaded.
+const std::vector<Uint32>& nativeScanKeys() {
+    static const std::vector<Uint32> keys = [] {
+        std::vector<Uint32> result;
+        result.push_back(scanKey(DCM_SpecificCharacterSet));
+        result.push_back(scanKey(DCM_SOPInstanceUID));
+        result.push_back(scanKey(DCM_SeriesInstanceUID));
+        for (auto tag: main_tags_list) {
+            result.push_back(tag.sortKey());
+        }
+        if (loadExtraTagKeys()) {
+            result.insert(result.end(), extraTagPlan.sortedKeys(), extraTagPlan.sortedKeys() + extraTagPlan.tags().size());
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }();
+    return keys;
+}
 
-    helperSenderAddress = OFString(argv[2]);
-    helperSenderAET = OFString(argv[3]);
-    helperReceiverAET = OFString(argv[4]);
+// Parses the command-line arguments that follow the file name. argv[1] holds the file name (or
+// the batch source), so that the positions match the direct invocation.
+void parseArguments(int argc, char *argv[], ProcessingOptions& options)
+{
+    options.helperSenderAddress = OFString(argv[2]);
+    options.helperSenderAET = OFString(argv[3]);
+    options.helperReceiverAET = OFString(argv[4]);
 
     bool injectErrors = false;
-    bool tagsStopEarly = false;
     if (argc > 5)
     {
-        bookkeeperAddress = std::string(argv[5]);
+        options.bookkeeperAddress = std::string(argv[5]);
     }
 
     if (argc > 6)
     {
-        bookkeeperToken = std::string(argv[6]);
+        options.bookkeeperToken = std::string(argv[6]);
     }
     if (argc > 7)
     {
@@ -398,27 +637,165 @@ int main(int argc, char *argv[])
             if (strcmp(argv[i],"--inject-errors") == 0 ) {
                 injectErrors = true;
             } else if (strcmp(argv[i], "--tags-stop-early") == 0) {
-                tagsStopEarly = true;
+                options.tagsStopEarly = true;
+            } else if (strcmp(argv[i], "--full-parse") == 0) {
+                options.fullParse = true;
+            } else if (strcmp(argv[i], "--series-index") == 0 && i + 1 < argc) {
+                ++i;
+                if (strcmp(argv[i], "additional") == 0) {
+                    options.seriesIndex = SERIES_INDEX_ADDITIONAL;
+                } else if (strcmp(argv[i], "exclusive") == 0) {
+                    options.seriesIndex = SERIES_INDEX_EXCLUSIVE;
+                }
+            } else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+                if (!parseDurabilityPolicy(argv[++i], options.durability)) {
+                    std::cout << "WARNING: Unknown durability policy " << argv[i] << std::endl;
+                }
+            } else if (strcmp(argv[i], "--duplicates") == 0 && i + 1 < argc) {
+                if (!parseDuplicatePolicy(argv[++i], options.duplicates)) {
+                    std::cout << "WARNING: Unknown duplicate policy " << argv[i] << std::endl;
+                }
+            } else if (strcmp(argv[i], "--fingerprint") == 0 && i + 1 < argc) {
+                if (!parseFingerprintMode(argv[++i], options.fingerprint)) {
+                    std::cout << "WARNING: Unknown fingerprint mode " << argv[i] << std::endl;
+                }
+            } else if (strcmp(argv[i], "--series-events") == 0) {
+                options.seriesEvents = true;
+            } else if (strcmp(argv[i], "--legacy-error-files") == 0) {
+                options.legacyErrorFiles = true;
+            } else if (strcmp(argv[i], "--study-rollup") == 0) {
+                options.studyRollup = true;
+            } else if (strcmp(argv[i], "--series-index-format") == 0 && i + 1 < argc) {
+                options.binarySeriesIndex = (strcmp(argv[++i], "binary") == 0);
+            } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+                options.nativeEngine = (strcmp(argv[++i], "native") == 0);
             } else if (strcmp(argv[i], "--set-tag") == 0 && i + 1 < argc) {
                 std::string tag = std::string(argv[++i]);
                 size_t pos = tag.find('=');
                 if (pos != std::string::npos) {
                     auto name = OFString(tag.substr(0, pos).c_str());
                     auto value = OFString(tag.substr(pos + 1).c_str());
-                    force_tags.append(QPair<OFString, OFString>(name, value));
+                    options.force_tags.emplace_back(name, value);
                 }
+            } else if (strcmp(argv[i], "--admission-slots") == 0 && i + 1 < argc) {
+                options.admissionSlots = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--admission-timeout") == 0 && i + 1 < argc) {
+                options.admissionTimeout = (int)(atof(argv[++i]) * 1000);
+            } else if (strcmp(argv[i], "--admission-rule") == 0 && i + 1 < argc) {
+                AdmissionRule rule;
+                if (parseAdmissionRule(argv[++i], rule)) {
+                    options.admissionRules.push_back(rule);
+                } else {
+                    std::cout << "WARNING: Invalid admission rule " << argv[i] << std::endl;
+                }
+            } else if (strcmp(argv[i], "--transcode") == 0 && i + 1 < argc) {
+                options.transcode = parseTranscodeTarget(argv[++i], options.transcodeTarget);
+                if (!options.transcode) {
+                    std::cout << "WARNING: Unknown transcode target " << argv[i] << std::endl;
+                }
+            } else if (strcmp(argv[i], "--transcode-rule") == 0 && i + 1 < argc) {
+                TranscodeRule rule;
+                if (parseTranscodeRule(argv[++i], rule)) {
+                    options.transcodeRules.push_back(rule);
+                } else {
+                    std::cout << "WARNING: Invalid transcode rule " << argv[i] << std::endl;
+                }
+            } else if (strcmp(argv[i], "--transcode-threads") == 0 && i + 1 < argc) {
+                options.transcodeThreads = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--bookkeeper-spool") == 0 && i + 1 < argc) {
+                options.bookkeeperSpool = std::string(argv[++i]);
+            } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                // Only used in batch and SCP mode, evaluated in processBatch() and runReceiver()
+                ++i;
+            } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+                // Only used in daemon and SCP mode
+                ++i;
+            } else if (strcmp(argv[i], "--tls") == 0 && i + 3 < argc) {
+                // Only used in SCP mode, evaluated in runReceiver()
+                i += 3;
             }
         }
     }
     if (injectErrors) {
-        QFile file("./dcm_inject_error");
-        if (file.exists() && file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-            testInjectError = QTextStream(&file).readAll().simplified().toInt();
-            file.close();
+        std::ifstream file("./dcm_inject_error");
+        if (file.is_open() && !(file >> options.testInjectError)) {
+            options.testInjectError = 0;
+        }
+    }
+}
+
+// Returns the value of one of the main tags that has been read from the file
+static std::string mainTagValue(const FileContext& ctx, const char* name) {
+    for (const auto& tag : ctx.main_tags) {
+        if (strcmp(tag.first, name) == 0) {
+            return tag.second.c_str();
+        }
+    }
+    return "";
+}
+
+// Returns the value of a receiver argument (ReceiverAET, SenderAET, SenderAddress) or of a tag of
+// the file, which the admission and transcode rules are matched against. Returns nullptr if the
+// name is unknown.
+static const char* ruleValue(const ProcessingOptions& options, const FileContext& ctx, const std::string& name) {
+    if (name == "ReceiverAET") {
+        return options.helperReceiverAET.c_str();
+    } else if (name == "SenderAET") {
+        return options.helperSenderAET.c_str();
+    } else if (name == "SenderAddress") {
+        return options.helperSenderAddress.c_str();
+    }
+    const char* value = nullptr;
+    for (const auto& tags : { &ctx.main_tags, &ctx.additional_tags }) {
+        for (const auto& tag : *tags) {
+            if (name == tag.first) {
+                value = tag.second.c_str();
+            }
+        }
+    }
+    return value;
+}
+
+// Returns the priority of the first admission rule that matches the receiver arguments or the
+// tags of the file
+static int admissionPriority(const ProcessingOptions& options, const FileContext& ctx) {
+    for (const auto& rule : options.admissionRules) {
+        const char* value = ruleValue(options, ctx, rule.name);
+        if (value != nullptr && rule.value == value) {
+            return rule.priority;
+        }
+    }
+    return ADMISSION_DEFAULT_PRIORITY;
+}
+
+// Returns true if the file is to be converted into the target transfer syntax, i.e., if no
+// transcode rule has been given or one of them matches
+static bool isTranscodeRequested(const ProcessingOptions& options, const FileContext& ctx) {
+    if (!options.transcode) {
+        return false;
+    }
+    for (const auto& rule : options.transcodeRules) {
+        const char* value = ruleValue(options, ctx, rule.name);
+        if (value != nullptr && rule.value == value) {
+            return true;
         }
     }
+    return options.transcodeRules.empty();
+}
+
+// Processes a single received DICOM file using the state of the given context. Instances received
+// by the embedded storage SCP are passed in memory and written straight into the series folder.
+static int processReceivedFile(const ProcessingOptions& options, FileContext& ctx, OFString origFilename, DcmFileFormat* receivedFile,
+                               const std::string* receivedData)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    ctx.reset();
+    ctx.receivedFile = receivedFile;
+    ctx.receivedData = receivedData;
+    ctx.durableSince = durabilityJournal.generation();
+    bool inMemory = (receivedFile != nullptr || receivedData != nullptr);
+    CharsetStatistics charsetStatistics = ctx.charsetCache.statistics;
 
-    OFString origFilename = OFString(argv[1]);
     OFString path = "";
 
     size_t slashPos = origFilename.rfind("/");
@@ -428,15 +805,35 @@ int main(int argc, char *argv[])
         origFilename.erase(0, slashPos + 1);
     }
     OFString full_path = path + origFilename;
-    DcmFileFormat dcmFile;
-    
+    DcmFileFormat loadedFile;
+    DcmFileFormat& dcmFile = (receivedFile != nullptr) ? *receivedFile : loadedFile;
+
     DcmTagKey untilTag;
-    if (tagsStopEarly) {
+    if (options.tagsStopEarly) {
         untilTag = calculateUntilTag();
-    } else {
+    } else if (options.fullParse) {
         untilTag = DCM_UndefinedTagKey;
+    } else {
+        untilTag = headerStopTag();
+    }
+    // By default, only the header is read from a memory-mapped view of the file. Fall back to
+    // DCMTK's file stream if requested or if the file cannot be mapped. The native engine only
+    // hands the needed elements to DCMTK and falls back if it cannot handle the encoding.
+    OFCondition status;
+    bool loaded = (receivedFile != nullptr);
+    if (!loaded && receivedData != nullptr) {
+        status = loadBufferHeader(dcmFile, receivedData->data(), receivedData->size(), untilTag);
+        loaded = true;
+    }
+    if (!loaded && options.nativeEngine && !options.fullParse) {
+        loaded = loadFileNative(dcmFile, full_path, nativeScanKeys(), untilTag, status);
+    }
+    if (!loaded && !options.fullParse) {
+        loaded = loadFileHeader(dcmFile, full_path, untilTag, 4096U, status);
+    }
+    if (!loaded) {
+        status = dcmFile.loadFileUntilTag(full_path, EXS_Unknown, EGL_noChange, 4096U, ERM_autoDetect, untilTag);
     }
-    OFCondition status = dcmFile.loadFileUntilTag(full_path, EXS_Unknown, EGL_noChange, 4096U, ERM_autoDetect, untilTag);
 
     if (DO_ERROR(1) || !status.good())
     {
@@ -445,128 +842,857 @@ int main(int argc, char *argv[])
         errorString.append("\nError: ");
         errorString.append(status.text());
         errorString.append("\n");
-        writeErrorInformationAndMove(path, origFilename, errorString);
-        // if (createSeriesFolder(path, "error")) {
-        //     writeErrorInformation(path + "error/" + origFilename, errorString);
-        //     rename(full_path.c_str(), (path + "error/" + origFilename+".dcm").c_str());
-        // } else {
-        //     writeErrorInformation(full_path, errorString);
-        // }
+        writeErrorInformationAndMove(options, ctx, path, origFilename, errorString);
         return 1;
     }
     DcmDataset* dataset = dcmFile.getDataset();
 
-    readTag(DCM_SpecificCharacterSet, dataset, tagSpecificCharacterSet, full_path);
-    readTag(DCM_SOPInstanceUID, dataset, tagSOPInstanceUID, full_path);
-    readTag(DCM_SeriesInstanceUID, dataset, tagSeriesInstanceUID, full_path);
+    ctx.metrics.begin(STAGE_READ_TAGS);
+    readTag(DCM_SpecificCharacterSet, dataset, ctx.tagSpecificCharacterSet, ctx);
+    readTag(DCM_SOPInstanceUID, dataset, ctx.tagSOPInstanceUID, ctx);
+    readTag(DCM_SeriesInstanceUID, dataset, ctx.tagSeriesInstanceUID, ctx);
 
     OFString tag_read_out = "";
     bool read_success = true;
     for (auto tag: main_tags_list ) {
         tag_read_out = "";
-        if (!readTag(tag, dataset, tag_read_out, full_path)) {
+        if (!readTag(tag.key(), dataset, tag_read_out, ctx)) {
             read_success = false;
             break;
         }
-        main_tags.append(QPair<DcmTagKey, OFString>(tag, tag_read_out));
+        ctx.main_tags.emplace_back(tag.name, tag_read_out);
     }
     if (DO_ERROR(2) || !read_success) {
-        writeErrorInformationAndMove(path, origFilename, "Unable to read some DICOM tags\n");
-        // if (createSeriesFolder(path, "error")) {
-        //     rename((full_path+".error").c_str(), (path + "error/" + origFilename+".dcm.error").c_str());
-        //     rename(full_path.c_str(), (path + "error/" + origFilename+".dcm").c_str());
-        // } else {
-        //     writeErrorInformation(full_path, "Unable to read some DICOM tags\n");
-        // }
+        writeErrorInformationAndMove(options, ctx, path, origFilename, "Unable to read some DICOM tags\n");
         return 1;
     }
     tag_read_out = "";
-    readTag(DCM_MediaStorageSOPClassUID, dcmFile.getMetaInfo(), tag_read_out, full_path);
-    main_tags.append(QPair<DcmTagKey, OFString>(DCM_MediaStorageSOPClassUID, tag_read_out));
+    readTag(media_storage_sop_class_tag.key(), dcmFile.getMetaInfo(), tag_read_out, ctx);
+    ctx.main_tags.emplace_back(media_storage_sop_class_tag.name, tag_read_out);
 
-    if (DO_ERROR(3) || !readExtraTags(dcmFile.getDataset(), full_path)) {
+    if (DO_ERROR(3) || !readExtraTags(ctx, dcmFile.getDataset())) {
         OFString errorString = "Unable to read extra_tags file.\n";
-        writeErrorInformationAndMove(path, origFilename, errorString);
-        // if (createSeriesFolder(path, "error")) {
-        //     writeErrorInformation(path + "error/" + origFilename+".dcm", errorString);
-        //     rename(full_path.c_str(), (path + "error/" + origFilename+".dcm").c_str());
-        // } else {
-        //     writeErrorInformation(full_path, errorString);
-        // }
+        writeErrorInformationAndMove(options, ctx, path, origFilename, errorString);
         return 1;
     }
 
-    isConversionNeeded = true;
-    if (tagSpecificCharacterSet.compare("ISO_IR 192") == 0)
+    ctx.metrics.begin(STAGE_CHARSET_SELECT);
+    ctx.isConversionNeeded = true;
+    if (ctx.tagSpecificCharacterSet.compare("ISO_IR 192") == 0)
     {
         // Incoming DICOM image already has UTF-8 format, conversion is not needed.
-        isConversionNeeded = false;
+        ctx.isConversionNeeded = false;
     }
 
-    auto couldSelectCharacterSet = charsetConverter.selectCharacterSet(tagSpecificCharacterSet);
-    if (DO_ERROR(4) || !couldSelectCharacterSet.good()) {
-        // There are two different sets of names of character sets in the DICOM standard.
-        // If Code Extensions aren't used, it expects ISO 2375 names (e.g., "ISO_IR 192").
-        // If Code Extensions are used, it expects names prefixed with ISO 2022, eg "ISO 2022 IR 100".
-        // https://dicom.innolitics.com/ciods/vl-photographic-image/sop-common/00080005
-        // Sometimes a dicom shows up that only has one character set- indicating it's not using Code Extensions-
-        // but the character set is using the ISO 2022 name. 
-
-        // So, we are going to tell DCMTK to try to use Code Extensions by giving it a list, ie '\\ISO 2022 IR 100'.
-        // If the file didn't really use Code Extensions, this will probably produce garbled tags, but it's probably
-        //  better than refusing to process this file at all.
+    // The converter is looked up in the cache of the worker, including the fallback to the
+    // Code Extensions form for invalid values (see CharsetConverterCache::select)
+    OFCondition couldSelectCharacterSet;
+    ctx.charsetConverter = ctx.charsetCache.select(ctx.tagSpecificCharacterSet, couldSelectCharacterSet);
+    if (DO_ERROR(4) || ctx.charsetConverter == nullptr) {
+        OFString errorString = "ERROR: Unable to perform character set conversion!\n";
+        errorString += couldSelectCharacterSet.text();
+        writeErrorInformationAndMove(options, ctx, path, origFilename, errorString);
+        return 1;
+    }
+    OFString newFilename = ctx.tagSeriesInstanceUID + "#" + origFilename;
+    OFString seriesFolder = path + ctx.tagSeriesInstanceUID + "/";
+
+    // The remaining stages move the file and notify the bookkeeper, which saturate the disk and
+    // the bookkeeper if too many files are placed at once. The slot is held until the file is done.
+    ctx.metrics.begin(STAGE_ADMISSION);
+    AdmissionSlot admissionSlot;
+    if (options.admissionSlots > 0 && admissionControl.open(path.c_str(), options.admissionSlots)) {
+        int priority = admissionPriority(options, ctx);
+        if (!admissionSlot.acquire(admissionControl, priority, options.admissionTimeout)) {
+            if (receivedFile != nullptr) {
+                // The instance has not been written yet, so the sender is asked to send it again later
+                std::cout << "WARNING: Refusing " << origFilename << ", no admission slot available" << std::endl;
+                admissionControl.countRefused(priority);
+                return RECEIVED_FILE_REFUSED;
+            }
+            // The file has already been received, so it is processed anyway
+            std::cout << "WARNING: No admission slot for " << origFilename << " within " << options.admissionTimeout / 1000.0
+                      << " s, processing without slot" << std::endl;
+        }
+    }
 
-        std::cout << "WARNING: Possible invalid DICOM encoding. Unable to select character set '" << tagSpecificCharacterSet \
-            << "'. Retrying as as if the file meant specify Code Extensions, ie '\\"<<tagSpecificCharacterSet<<"'"<<std::endl;
-        couldSelectCharacterSet = charsetConverter.selectCharacterSet("\\"+tagSpecificCharacterSet);
-        if (DO_ERROR(4) || !couldSelectCharacterSet.good()) {
-                OFString errorString = "ERROR: Unable to perform character set conversion!\n";
-                errorString += couldSelectCharacterSet.text();
-                writeErrorInformationAndMove(path, origFilename, errorString);
-                return 1;
+    ctx.metrics.begin(STAGE_CREATE_FOLDER);
+    // The UID is claimed before the file is placed, so that of two concurrent copies only one is
+    // accepted as new. The claim is withdrawn if the file fails. If the index cannot be opened or
+    // updated, the instance is accepted without checking for duplicates.
+    InstanceClaim instanceClaim;
+    InstanceInsertResult claimed = INSTANCE_INSERT_FAILED;
+    if (options.duplicates != DUPLICATES_OFF && instanceIndex.open(path.c_str(), INSTANCE_INDEX_CAPACITY)) {
+        claimed = instanceClaim.claim(instanceIndex, ctx.tagSOPInstanceUID.c_str());
+        if (claimed == INSTANCE_INSERT_FAILED) {
+            std::cout << "WARNING: Unable to add " << ctx.tagSOPInstanceUID << " to the instance index" << std::endl;
+        }
+    }
+    bool replacing = false;
+    if (claimed == INSTANCE_PRESENT) {
+        switch (options.duplicates) {
+        case DUPLICATES_DROP:
+            std::cout << "Dropping duplicate instance " << ctx.tagSOPInstanceUID << std::endl;
+            if (!inMemory) {
+                remove(full_path.c_str());
+            }
+            return 0;
+        case DUPLICATES_REPLACE:
+            // storescp names the files after the SOPInstanceUID, so a copy that is still waiting in
+            // the series folder is overwritten when the file is placed
+            std::cout << "Replacing duplicate instance " << ctx.tagSOPInstanceUID << std::endl;
+            replacing = true;
+            break;
+        default:
+            std::cout << "Flagging duplicate instance " << ctx.tagSOPInstanceUID << std::endl;
+            ctx.duplicate = true;
+            break;
         }
     }
-    OFString newFilename = tagSeriesInstanceUID + "#" + origFilename;
-    OFString seriesFolder = path + tagSeriesInstanceUID + "/";
 
-    if (DO_ERROR(5) || !createSeriesFolder(path, tagSeriesInstanceUID)) {
+    if (DO_ERROR(5) || !createSeriesFolder(path, ctx.tagSeriesInstanceUID)) {
         OFString errorString = "Unable to create series folder for ";
-        errorString.append(tagSeriesInstanceUID);
+        errorString.append(ctx.tagSeriesInstanceUID);
         errorString.append("\n");
-        writeErrorInformationAndMove(path, origFilename, errorString);
-        // if (createSeriesFolder(path, "error")) {
-        //     writeErrorInformation(path +"error/"+ origFilename+".dcm", errorString);
-        //     rename(full_path.c_str(), (path + "error/" + origFilename+".dcm").c_str());
-        // } else {
-        //     writeErrorInformation(full_path, errorString);
-        // }
+        writeErrorInformationAndMove(options, ctx, path, origFilename, errorString);
         return 1;
     }
 
-    if (DO_ERROR(6) || rename(full_path.c_str(), (seriesFolder + newFilename + ".dcm").c_str()) != 0)
+    // Falls back to copying if the series folder is located on another file system
+    ctx.metrics.begin(STAGE_PLACE);
+    OFString targetFile = seriesFolder + newFilename + ".dcm";
+    // A copy that is still waiting has its record in the series index already
+    struct stat fileInfo;
+    bool replacesWaitingCopy = replacing && stat(targetFile.c_str(), &fileInfo) == 0;
+    bool placed;
+    if (inMemory) {
+        placed = !DO_ERROR(6) && storeReceivedFile(ctx, targetFile);
+        if (placed) {
+            durabilityJournal.add(targetFile.c_str(), options.durability);
+        }
+    } else {
+        placed = !DO_ERROR(6) && placeFile(full_path.c_str(), targetFile.c_str(), options.durability, durabilityJournal);
+    }
+    if (!placed)
     {
         OFString errorString = "Unable to move DICOM file to ";
         errorString.append(seriesFolder + newFilename);
         errorString.append("\n");
-        writeErrorInformation(full_path, errorString);
+        storeReceivedFile(ctx, full_path);
+        recordError(options, path, origFilename, false, errorString);
         return 1;
     }
+    if (stat(targetFile.c_str(), &fileInfo) == 0) {
+        ctx.metrics.bytes = fileInfo.st_size;
+    }
+
+    // Files that cannot be decoded are kept in their original transfer syntax. The converted file
+    // has the name of the placed file, which is already registered in the durability journal.
+    ctx.metrics.begin(STAGE_TRANSCODE);
+    if (isTranscodeRequested(options, ctx)) {
+        bool converted = false;
+        std::string transcodeError;
+        if (!transcoder.transcode(targetFile.c_str(), options.transcodeTarget, converted, transcodeError)) {
+            std::cout << "WARNING: Unable to transcode " << newFilename << ". " << transcodeError << std::endl;
+        }
+    }
+
+    // The file has just been written or moved, so the pixel data is usually read from the page cache.
+    // Files that the scanner cannot handle are accepted without fingerprint.
+    ctx.metrics.begin(STAGE_FINGERPRINT);
+    if (options.fingerprint != FINGERPRINT_OFF
+        && !fingerprintPixelData(targetFile.c_str(), options.fingerprint, ctx.fingerprintBuffer, ctx.fingerprint)) {
+        std::cout << "WARNING: Unable to compute pixel data fingerprint of " << newFilename << std::endl;
+        ctx.fingerprint = PixelFingerprint();
+    }
 
-    if (DO_ERROR(7) || !writeTagsFile(seriesFolder + newFilename, origFilename))
+    ctx.metrics.begin(STAGE_WRITE_TAGS);
+    if (DO_ERROR(7) || !writeTagsFile(options, ctx, seriesFolder + newFilename, origFilename))
     {
         OFString errorString = "Unable to write tagsfile file for ";
         errorString.append(newFilename);
         errorString.append("\n");
         rename((seriesFolder + newFilename + ".dcm").c_str(), (path + origFilename).c_str());
-        writeErrorInformationAndMove(path, origFilename, errorString);
-        // if (createSeriesFolder(path, "error")) {
-        //     writeErrorInformation(path + "error/" + origFilename + ".dcm", errorString);
-        //     rename((seriesFolder + newFilename + ".dcm").c_str(), (path + "error/" + origFilename + ".dcm").c_str());
-        // } else {
-        //     writeErrorInformation(seriesFolder + newFilename + ".dcm", errorString);
-        // }
+        writeErrorInformationAndMove(options, ctx, path, origFilename, errorString);
+        return 1;
+    }
+
+    ctx.metrics.begin(STAGE_SERIES_INDEX);
+    bool appendToSeriesIndex = (options.seriesIndex != SERIES_INDEX_OFF) && !replacesWaitingCopy;
+    if (appendToSeriesIndex
+        && (DO_ERROR(8) || !(options.binarySeriesIndex
+                ? appendBinarySeriesIndex(seriesFolder.c_str(), ctx.tagSeriesInstanceUID.c_str(), newFilename.c_str(), ctx.tagsWriter)
+                : appendSeriesIndex(seriesFolder.c_str(), ctx.tagSeriesInstanceUID.c_str(), newFilename.c_str(), ctx.tagsWriter.data()))))
+    {
+        // The router relies on the index, so the file must not remain in the series folder without a record
+        OFString errorString = "Unable to append to series index for ";
+        errorString.append(newFilename);
+        errorString.append("\n");
+        remove((seriesFolder + newFilename + ".tags").c_str());
+        rename((seriesFolder + newFilename + ".dcm").c_str(), (path + origFilename).c_str());
+        writeErrorInformationAndMove(options, ctx, path, origFilename, errorString);
         return 1;
     }
+    if (appendToSeriesIndex) {
+        durabilityJournal.add((seriesFolder + ctx.tagSeriesInstanceUID + (options.binarySeriesIndex ? ".index.bin" : ".index")).c_str(),
+                              options.durability);
+    }
+
+    // The router falls back to reading the .tags files for studies that are missing in the rollup. A
+    // replaced instance has been added with its first copy.
+    ctx.metrics.begin(STAGE_STUDY_ROLLUP);
+    if (options.studyRollup && !replacing) {
+        uint64_t arrival = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!studyRollup.open(path.c_str())
+            || !studyRollup.add(mainTagValue(ctx, "StudyInstanceUID"), ctx.tagSeriesInstanceUID.c_str(),
+                                mainTagValue(ctx, "Modality"), arrival)) {
+            std::cout << "WARNING: Unable to add " << newFilename << " to the study rollup" << std::endl;
+        }
+    }
+
+    FileNotification notification;
+    notification.folder = path.c_str();
+    notification.filename = newFilename.c_str();
+    notification.fileUID = ctx.tagSOPInstanceUID.c_str();
+    notification.seriesUID = ctx.tagSeriesInstanceUID.c_str();
+    notification.seriesEvent = options.seriesEvents;
+    notification.bookkeeperAddress = options.bookkeeperAddress;
+    notification.bookkeeperToken = options.bookkeeperToken;
+    notification.bookkeeperSpool = options.bookkeeperSpool;
+
+    // In batch and archive mode, the journal is committed for a group of files. Concurrent workers
+    // wait for the flush that covers their files instead of taking each other's entries.
+    // The router and the bookkeeper must not learn about a file before it is durable, so in the
+    // deferred modes the notification is sent with the group commit.
+    ctx.metrics.begin(STAGE_COMMIT);
+    if (!durabilityJournal.deferred || options.durability == DURABILITY_NONE) {
+        if (!durabilityJournal.commit(ctx.durableSince)) {
+            std::cout << "ERROR: Unable to flush the files of " << newFilename << std::endl;
+            return RECEIVED_FILE_NOT_DURABLE;
+        }
+        ctx.metrics.begin(STAGE_BOOKKEEPER);
+        sendFileNotification(notification);
+    } else {
+        notification.firstGeneration = ctx.durableSince;
+        notification.lastGeneration = durabilityJournal.generation();
+        {
+            std::lock_guard<std::mutex> lock(pendingNotificationsMutex);
+            pendingNotifications.push_back(std::move(notification));
+        }
+        if (durabilityJournal.pending() >= GROUP_COMMIT_FILES && !commitNotifications(ctx.durableSince)) {
+            std::cout << "ERROR: Unable to flush the files of " << newFilename << std::endl;
+            return RECEIVED_FILE_NOT_DURABLE;
+        }
+    }
+
+    instanceClaim.accept();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+    std::cout << "Processed " << origFilename << " in " << elapsed.count() << " us ("
+              << ctx.charsetCache.statistics.since(charsetStatistics) << ")" << std::endl;
+    return 0;
+}
+
+// Processes a file and records the time spent in each stage
+int processFile(const ProcessingOptions& options, FileContext& ctx, OFString origFilename, DcmFileFormat* receivedFile = nullptr,
+                const std::string* receivedData = nullptr)
+{
+    CharsetStatistics charsetStatistics = ctx.charsetCache.statistics;
+    ctx.metrics.start();
+    int result = processReceivedFile(options, ctx, origFilename, receivedFile, receivedData);
+    ctx.metrics.finish(result == 0);
+    CharsetStatistics charset = ctx.charsetCache.statistics.since(charsetStatistics);
+    receiverMetrics.record(ctx.metrics, charset);
+    if (printFileMetrics) {
+        std::cout << "METRICS " << fileMetricsJSON(origFilename.c_str(), ctx.metrics, charset) << std::endl;
+    }
+    return result;
+}
+
+// Hands the conversions of the following files to the transcode pool. Single files and the requests
+// of the daemon, which already runs a worker per request, are converted by the processing thread.
+static void startTranscodePool(const ProcessingOptions& options)
+{
+    if (options.transcode) {
+        int threads = options.transcodeThreads;
+        if (threads < 1) {
+            threads = std::max(1, (int)std::thread::hardware_concurrency() / 2);
+        }
+        transcoder.usePool(threads);
+    }
+}
+
+// Contexts of the workers that process requests, one for a direct invocation
+static std::vector<std::unique_ptr<FileContext>> requestContexts;
+
+// Processes a single file with the arguments of a direct invocation. Also serves as request
+// handler of the daemon mode, which calls it concurrently from its workers.
+int processRequest(int worker, int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        std::cout << "ERROR: Missing arguments for processing file" << std::endl;
+        return 1;
+    }
+    ProcessingOptions options;
+    parseArguments(argc, argv, options);
+    return processFile(options, *requestContexts[worker], OFString(argv[1]));
+}
+
+// Collects the files for batch processing. The source can either be a folder (all received files
+// in the folder are processed) or a text file that lists one file path per line.
+bool collectBatchFiles(const std::string& source, std::vector<std::string>& files)
+{
+    struct stat info;
+    if (stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+        DIR* dir = opendir(source.c_str());
+        if (dir == nullptr) {
+            std::cout << "ERROR: Unable to read batch source " << source << std::endl;
+            return false;
+        }
+        std::string folder = source;
+        if (folder[0] != '/') {
+            char cwd[4096];
+            if (getcwd(cwd, sizeof(cwd)) != nullptr) {
+                folder = std::string(cwd) + "/" + folder;
+            }
+        }
+        if (folder[folder.size() - 1] != '/') {
+            folder += "/";
+        }
+        std::vector<std::string> names;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            // Skip hidden files (indices and journals of the receiver) and files written by
+            // getdcmtags or storescp itself
+            if (name[0] == '.' || endsWith(name, ".error") || endsWith(name, ".lock") || endsWith(name, ".tags")) {
+                continue;
+            }
+            struct stat entryInfo;
+            if (stat((folder + name).c_str(), &entryInfo) == 0 && S_ISREG(entryInfo.st_mode)) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names) {
+            files.push_back(folder + name);
+        }
+        return true;
+    }
+
+    std::ifstream inputFile(source);
+    if (!inputFile.is_open()) {
+        std::cout << "ERROR: Unable to read batch source " << source << std::endl;
+        return false;
+    }
+    for (std::string line; std::getline(inputFile, line); ) {
+        size_t first = line.find_first_not_of(" \t\r\n\f\v");
+        if (first != std::string::npos) {
+            size_t last = line.find_last_not_of(" \t\r\n\f\v");
+            files.push_back(line.substr(first, last - first + 1));
+        }
+    }
+    return true;
+}
+
+// Processes all files of a folder or file list concurrently. Returns 0 if all files have been
+// processed, 1 if some files failed, and 2 if no file could be processed.
+int processBatch(int argc, char *argv[])
+{
+    ProcessingOptions options;
+    parseArguments(argc, argv, options);
+    startTranscodePool(options);
+    // The files processed by all workers are flushed together
+    durabilityJournal.deferred = true;
+    uint64_t firstGeneration = durabilityJournal.generation();
+
+    int threadCount = (int)std::thread::hardware_concurrency();
+    for (int i = 7; i < argc - 1; ++i) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            threadCount = atoi(argv[i + 1]);
+        }
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    std::vector<std::string> files;
+    if (!collectBatchFiles(argv[1], files)) {
+        return 2;
+    }
+    std::cout << "Processing " << files.size() << " files using " << threadCount << " threads" << std::endl;
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::atomic<int> succeeded(0);
+    std::atomic<int> failed(0);
+    CharsetStatistics charsetStatistics;
+    {
+        std::vector<std::unique_ptr<FileContext>> contexts;
+        for (int i = 0; i < threadCount; i++) {
+            contexts.emplace_back(new FileContext());
+        }
+        WorkStealingPool pool(threadCount);
+        for (const std::string& file : files) {
+            OFString filename = OFString(file.c_str());
+            pool.submit([&, filename](int worker) {
+                if (processFile(options, *contexts[worker], filename) == 0) {
+                    succeeded++;
+                } else {
+                    failed++;
+                }
+            });
+        }
+        pool.wait();
+        // Also reports the group commits of the workers that have failed in the meantime
+        if (!commitNotifications(firstGeneration)) {
+            std::cout << "ERROR: Unable to flush the processed files" << std::endl;
+            failed++;
+        }
+        for (const auto& context : contexts) {
+            charsetStatistics.add(context->charsetCache.statistics);
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+
+    std::cout << "Batch complete: " << succeeded << " succeeded, " << failed << " failed in "
+              << elapsed.count() << " ms" << std::endl;
+    std::cout << "Charset conversion: " << charsetStatistics << std::endl;
+    if (options.transcode) {
+        std::cout << "Transcoding: " << transcoder.summary(elapsed.count() / 1000.0) << std::endl;
+    }
+    std::cout << "METRICS " << receiverMetrics.json() << std::endl;
+    if (failed == 0) {
+        return 0;
+    }
+    return (succeeded > 0) ? 1 : 2;
+}
+
+// Archive members are named after their path, as all files are received into a flat folder
+static std::string archiveMemberFilename(const std::string& name)
+{
+    std::string result = name;
+    while (result.compare(0, 2, "./") == 0) {
+        result.erase(0, 2);
+    }
+    std::replace(result.begin(), result.end(), '/', '_');
+    return result;
+}
+
+// DICOMDIR files and the resource forks that macOS adds to zip files are not instances
+static bool isArchiveMemberIgnored(const std::string& name)
+{
+    size_t slashPos = name.rfind('/');
+    std::string basename = (slashPos == std::string::npos) ? name : name.substr(slashPos + 1);
+    return basename.empty() || basename[0] == '.' || basename == "DICOMDIR" || name.compare(0, 9, "__MACOSX/") == 0;
+}
+
+// Members that are too large to be processed in memory are written into the error folder, with
+// the part that has already been read
+static void moveOversizedMember(const ProcessingOptions& options, ArchiveReader& reader, const std::string& head, const OFString& path, const std::string& filename)
+{
+    OFString errorFile = path + "error/" + filename.c_str() + ".dcm";
+    FILE* fp = createSeriesFolder(path, "error") ? fopen(errorFile.c_str(), "w") : nullptr;
+    bool success = fp != nullptr && fwrite(head.data(), 1, head.size(), fp) == head.size();
+    char chunk[65536];
+    ssize_t count;
+    while ((count = reader.read(chunk, sizeof(chunk))) > 0) {
+        success = success && fwrite(chunk, 1, count, fp) == (size_t)count;
+    }
+    success = (fp != nullptr && fclose(fp) == 0) && success && count == 0;
+    if (!success) {
+        std::cout << "ERROR: Unable to write " << errorFile << std::endl;
+        return;
+    }
+    recordError(options, path, OFString("error/") + filename.c_str() + ".dcm", true, "Archive member exceeds the size limit for processing in memory\n");
+}
+
+// Processes the DICOM files of a tar or zip archive (read from a file or from stdin) without
+// unpacking it. The members are read sequentially and handed to the workers in memory, so that
+// only the .dcm and .tags files of the series folders are written. The number of members held
+// in memory is bounded. Returns the same codes as processBatch().
+int processArchive(int argc, char *argv[])
+{
+    // The arguments are [archive] [incoming folder] followed by those of the batch mode
+    std::vector<char*> args = { argv[0] };
+    args.insert(args.end(), argv + 2, argv + argc);
+    ProcessingOptions options;
+    parseArguments((int)args.size(), args.data(), options);
+    startTranscodePool(options);
+    durabilityJournal.deferred = true;
+    uint64_t firstGeneration = durabilityJournal.generation();
+
+    int threadCount = (int)std::thread::hardware_concurrency();
+    for (size_t i = 7; i + 1 < args.size(); ++i) {
+        if (strcmp(args[i], "--threads") == 0) {
+            threadCount = atoi(args[i + 1]);
+        }
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    OFString folder = OFString(argv[2]);
+    if (folder.empty() || folder[folder.length() - 1] != '/') {
+        folder += "/";
+    }
+
+    ArchiveReader reader;
+    if (!reader.open(argv[1])) {
+        std::cout << "ERROR: " << reader.error() << std::endl;
+        return 2;
+    }
+    std::cout << "Processing " << reader.format() << " archive using " << threadCount << " threads" << std::endl;
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::atomic<int> succeeded(0);
+    std::atomic<int> failed(0);
+    CharsetStatistics charsetStatistics;
+    {
+        std::vector<std::unique_ptr<FileContext>> contexts;
+        for (int i = 0; i < threadCount; i++) {
+            contexts.emplace_back(new FileContext());
+        }
+        // Reading continues while the workers process the previous members, up to this limit
+        const int maxInFlight = threadCount * 2;
+        int inFlight = 0;
+        std::mutex inFlightMutex;
+        std::condition_variable memberDone;
+
+        WorkStealingPool pool(threadCount);
+        ArchiveMember member;
+        char chunk[65536];
+        while (reader.next(member)) {
+            if (isArchiveMemberIgnored(member.name)) {
+                continue;
+            }
+            std::string filename = archiveMemberFilename(member.name);
+            auto content = std::make_shared<std::string>();
+            if (member.size > 0 && (uint64_t)member.size <= ARCHIVE_MAX_MEMBER_SIZE) {
+                content->reserve(member.size);
+            }
+            ssize_t count = 0;
+            bool oversized = false;
+            while (!oversized && (count = reader.read(chunk, sizeof(chunk))) > 0) {
+                oversized = (content->size() + count > ARCHIVE_MAX_MEMBER_SIZE);
+                content->append(chunk, count);
+            }
+            if (oversized) {
+                moveOversizedMember(options, reader, *content, folder, filename);
+                failed++;
+                continue;
+            }
+            if (count < 0) {
+                break;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(inFlightMutex);
+                memberDone.wait(lock, [&] { return inFlight < maxInFlight; });
+                inFlight++;
+            }
+            OFString memberFile = folder + filename.c_str();
+            pool.submit([&, content, memberFile](int worker) {
+                if (processFile(options, *contexts[worker], memberFile, nullptr, content.get()) == 0) {
+                    succeeded++;
+                } else {
+                    failed++;
+                }
+                std::lock_guard<std::mutex> lock(inFlightMutex);
+                inFlight--;
+                memberDone.notify_one();
+            });
+        }
+        if (!reader.error().empty()) {
+            std::cout << "ERROR: Archive damaged after " << succeeded + failed << " files. " << reader.error() << std::endl;
+            failed++;
+        }
+        pool.wait();
+        // Also reports the group commits of the workers that have failed in the meantime
+        if (!commitNotifications(firstGeneration)) {
+            std::cout << "ERROR: Unable to flush the processed files" << std::endl;
+            failed++;
+        }
+        for (const auto& context : contexts) {
+            charsetStatistics.add(context->charsetCache.statistics);
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+
+    std::cout << "Archive complete: " << succeeded << " succeeded, " << failed << " failed in "
+              << elapsed.count() << " ms" << std::endl;
+    std::cout << "Charset conversion: " << charsetStatistics << std::endl;
+    if (options.transcode) {
+        std::cout << "Transcoding: " << transcoder.summary(elapsed.count() / 1000.0) << std::endl;
+    }
+    std::cout << "METRICS " << receiverMetrics.json() << std::endl;
+    if (failed == 0) {
+        return 0;
+    }
+    return (succeeded > 0) ? 1 : 2;
+}
+
+// Receives DICOM instances with the embedded storage SCP instead of storescp. The arguments are
+// [port] [incoming folder] [bookkeeper] [api key] followed by the options. Every instance is
+// processed by the worker that serves the association while it is still in memory.
+int runReceiver(int argc, char *argv[])
+{
+    StorageSCPOptions scpOptions;
+    scpOptions.port = atoi(argv[1]);
+    scpOptions.threads = (int)std::thread::hardware_concurrency();
+    for (int i = 5; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            scpOptions.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--accept-compressed") == 0) {
+            scpOptions.acceptCompressed = true;
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            receiverMetrics.addSource([] { return admissionControl.prometheus(); });
+            receiverMetrics.addSource([] { return transcoder.prometheus(); });
+            startMetricsServer(atoi(argv[++i]), receiverMetrics);
+        } else if (strcmp(argv[i], "--tls") == 0 && i + 3 < argc) {
+            scpOptions.tlsKeyFile = argv[++i];
+            scpOptions.tlsCertificateFile = argv[++i];
+            scpOptions.tlsCACertificateFile = argv[++i];
+        }
+    }
+    if (scpOptions.threads < 1) {
+        scpOptions.threads = 1;
+    }
+
+    // The sender and receiver are set per association
+    char empty[] = "";
+    std::vector<char*> args = { argv[0], argv[2], empty, empty, empty, argv[3], argv[4] };
+    args.insert(args.end(), argv + 5, argv + argc);
+    ProcessingOptions options;
+    parseArguments((int)args.size(), args.data(), options);
+    startTranscodePool(options);
+
+    OFString folder = OFString(argv[2]);
+    if (folder.empty() || folder[folder.length() - 1] != '/') {
+        folder += "/";
+    }
+    std::vector<std::unique_ptr<FileContext>> contexts;
+    for (int i = 0; i < scpOptions.threads; i++) {
+        contexts.emplace_back(new FileContext());
+    }
+    return runStorageSCP(scpOptions, [&](int worker, DcmFileFormat& file, const std::string& filename, const AssociationInfo& info) {
+        ProcessingOptions associationOptions = options;
+        associationOptions.helperSenderAddress = OFString(info.peerAddress.c_str());
+        associationOptions.helperSenderAET = OFString(info.callingAET.c_str());
+        associationOptions.helperReceiverAET = OFString(info.calledAET.c_str());
+        return processFile(associationOptions, *contexts[worker], folder + filename.c_str(), &file);
+    });
+}
+
+static void appendTagsObject(std::string& out, const TagValues& tags)
+{
+    out.append("{");
+    for (size_t i = 0; i < tags.size(); i++) {
+        out.append(i > 0 ? ", \"" : "\"");
+        appendEscapedJSON(out, tags[i].first.data(), tags[i].first.size());
+        out.append("\": \"");
+        appendEscapedJSON(out, tags[i].second.data(), tags[i].second.size());
+        out.append("\"");
+    }
+    out.append("}");
+}
+
+// Prints a binary series index in the line format of the JSON series index, for debugging and tests
+int dumpSeriesIndex(const char* filename)
+{
+    std::string seriesUID;
+    TagValues seriesTags;
+    std::vector<BinaryIndexInstance> instances;
+    if (!readBinarySeriesIndex(filename, seriesUID, seriesTags, instances)) {
+        std::cout << "ERROR: Unable to read series index " << filename << std::endl;
+        return 1;
+    }
+    std::string out = "{\"series_index\": 1, \"series_uid\": \"";
+    appendEscapedJSON(out, seriesUID.data(), seriesUID.size());
+    out.append("\", \"tags\": ");
+    appendTagsObject(out, seriesTags);
+    out.append("}\n");
+    for (const auto& instance: instances) {
+        out.append("{\"file\": \"");
+        appendEscapedJSON(out, instance.file.data(), instance.file.size());
+        out.append("\", \"tags\": ");
+        appendTagsObject(out, instance.tags);
+        out.append("}\n");
+    }
+    std::cout << out;
+    return 0;
+}
+
+// Prints the rollup of the given study, or of all studies, as one JSON object per line
+int dumpStudyRollup(const char* folder, const char* studyUID)
+{
+    std::string path = folder;
+    if (path.empty() || path[path.size() - 1] != '/') {
+        path += "/";
+    }
+    if (access((path + STUDY_ROLLUP_FILE).c_str(), F_OK) != 0 || !studyRollup.open(path)) {
+        std::cout << "ERROR: No study rollup in " << folder << std::endl;
+        return 1;
+    }
+    std::vector<StudyRollup> studies;
+    if (studyUID != nullptr) {
+        StudyRollup study;
+        if (!studyRollup.read(studyUID, study)) {
+            std::cout << "ERROR: Study " << studyUID << " not found in the study rollup" << std::endl;
+            return 1;
+        }
+        studies.push_back(study);
+    } else {
+        studies = studyRollup.readAll();
+    }
+    std::string out;
+    for (const auto& study : studies) {
+        out.append("{\"study_uid\": \"");
+        appendEscapedJSON(out, study.studyUID.data(), study.studyUID.size());
+        out.append("\", \"instances\": " + std::to_string(study.instances) + ", \"first_arrival\": "
+                   + std::to_string(study.firstArrival) + ", \"last_arrival\": " + std::to_string(study.lastArrival)
+                   + ", \"series\": [");
+        for (size_t i = 0; i < study.series.size(); i++) {
+            const SeriesRollup& series = study.series[i];
+            out.append(i > 0 ? ", {\"series_uid\": \"" : "{\"series_uid\": \"");
+            appendEscapedJSON(out, series.seriesUID.data(), series.seriesUID.size());
+            out.append("\", \"modality\": \"");
+            appendEscapedJSON(out, series.modality.data(), series.modality.size());
+            out.append("\", \"instances\": " + std::to_string(series.instances) + ", \"first_arrival\": "
+                       + std::to_string(series.firstArrival) + ", \"last_arrival\": "
+                       + std::to_string(series.lastArrival) + "}");
+        }
+        out.append("]}\n");
+    }
+    std::cout << out;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        
+    DcmSpecificCharacterSet charsetCheck;
+    if (!charsetCheck.isConversionAvailable())
+    {
+        std::cout << std::endl;
+        std::cout << "ERROR: Characterset converter not available" << std::endl
+                  << std::endl;
+        std::cout << "ERROR: Check installed libraries" << std::endl
+                  << std::endl;
+
+        return 1;
+    }
+
+    if (argc >= 3 && argc % 2 == 1 && strcmp(argv[1], "--daemon") == 0)
+    {
+        // Load the DICOM dictionary and the extra tags upfront, so that the first request does not pay for it
+        dcmDataDict.isDictionaryLoaded();
+        loadExtraTagKeys();
+        int threadCount = (int)std::thread::hardware_concurrency();
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--metrics-port") == 0) {
+                receiverMetrics.addSource([] { return admissionControl.prometheus(); });
+                receiverMetrics.addSource([] { return transcoder.prometheus(); });
+                startMetricsServer(atoi(argv[i + 1]), receiverMetrics);
+            } else if (strcmp(argv[i], "--threads") == 0) {
+                threadCount = atoi(argv[i + 1]);
+            }
+        }
+        threadCount = std::max(1, threadCount);
+        for (int i = 0; i < threadCount; i++) {
+            requestContexts.emplace_back(new FileContext());
+        }
+        // No transcode pool is started, --transcode converts on the worker of the request. On
+        // SIGTERM, the daemon completes the accepted requests and returns, so that the queued
+        // bookkeeper events can still be delivered or spooled.
+        int result = runDaemon(argv[2], processRequest, threadCount);
+        shutdownBookkeeperClient();
+        return result;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--admission-status") == 0)
+    {
+        std::string folder = argv[2];
+        if (folder.empty() || folder[folder.size() - 1] != '/') {
+            folder += "/";
+        }
+        if (access((folder + ADMISSION_FILE).c_str(), F_OK) != 0 || !admissionControl.open(folder, 0)) {
+            std::cout << "ERROR: No admission state in " << argv[2] << std::endl;
+            return 1;
+        }
+        std::cout << admissionControl.json() << std::endl;
+        return 0;
+    }
+
+    if ((argc == 2 || argc == 3 || argc == 4) && strcmp(argv[1], "--compile-tag-plan") == 0)
+    {
+        dcmDataDict.isDictionaryLoaded();
+        std::string source = argc >= 3 ? argv[2] : "./dcm_extra_tags";
+        std::string plan = argc == 4 ? argv[3] : source + TAG_PLAN_SUFFIX;
+        return writeTagPlan(source, plan) ? 0 : 1;
+    }
+
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--dump-study-rollup") == 0)
+    {
+        return dumpStudyRollup(argv[2], argc == 4 ? argv[3] : nullptr);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--dump-series-index") == 0)
+    {
+        return dumpSeriesIndex(argv[2]);
+    }
+
+    if (argc >= 6 && strcmp(argv[1], "--batch") == 0)
+    {
+        // Load the shared state before starting the worker threads, so that it is only read afterwards
+        dcmDataDict.isDictionaryLoaded();
+        loadExtraTagKeys();
+        int result = processBatch(argc - 1, argv + 1);
+        shutdownBookkeeperClient();
+        return result;
+    }
+
+    if (argc >= 7 && strcmp(argv[1], "--archive") == 0)
+    {
+        dcmDataDict.isDictionaryLoaded();
+        loadExtraTagKeys();
+        int result = processArchive(argc - 1, argv + 1);
+        shutdownBookkeeperClient();
+        return result;
+    }
+
+    if (argc >= 6 && strcmp(argv[1], "--scp") == 0)
+    {
+        dcmDataDict.isDictionaryLoaded();
+        loadExtraTagKeys();
+        int result = runReceiver(argc - 1, argv + 1);
+        shutdownBookkeeperClient();
+        return result;
+    }
+
+    if (argc < 5)
+    {
+        std::cout << std::endl;
+        std::cout << VERSION << std::endl;
+        std::cout << "------------------------" << std::endl
+                  << std::endl;
+        std::cout << "Usage: [dcm file to analyze] [sender address] [sender AET] [receiver AET] [ip:port of bookkeeper] [api key for bookkeeper]" << std::endl
+                  << "       --daemon [socket path] [--metrics-port port] [--threads n]" << std::endl
+                  << "       --batch [folder or file list] [sender address] [sender AET] [receiver AET] [ip:port of bookkeeper] [api key for bookkeeper] [--threads n]" << std::endl
+                  << "       --archive [tar/zip file or - for stdin] [incoming folder] [sender address] [sender AET] [receiver AET] [ip:port of bookkeeper] [api key for bookkeeper] [--threads n]" << std::endl
+                  << "       --scp [port] [incoming folder] [ip:port of bookkeeper] [api key for bookkeeper] [--threads n] [--accept-compressed] [--tls key cert ca] [--metrics-port port]" << std::endl
+                  << "       --dump-series-index [binary index file]" << std::endl
+                  << "       --compile-tag-plan [dcm_extra_tags file] [plan file]" << std::endl
+                  << "       --admission-status [incoming folder]" << std::endl
+                  << "       --dump-study-rollup [incoming folder] [StudyInstanceUID]" << std::endl
+                  << std::endl
+                  << "Options: --full-parse, --engine [dcmtk|native], --series-index [additional|exclusive], --series-index-format [json|binary], --series-events, --study-rollup, --durability [none|file|directory], --duplicates [drop|replace|flag], --tags-stop-early, --set-tag [tag=value], --bookkeeper-spool [file], --admission-slots [n], --admission-timeout [seconds], --admission-rule [tag=value:priority], --fingerprint [off|fast|sha256], --transcode [explicit-little|implicit-little|deflated], --transcode-rule [tag=value], --transcode-threads [n], --legacy-error-files" << std::endl
+                  << std::endl;
+        return 0;
+    }
 
-    sendBookkeeperPost(newFilename, tagSOPInstanceUID, tagSeriesInstanceUID);
+    printFileMetrics = true;
+    requestContexts.emplace_back(new FileContext());
+    int result = processRequest(0, argc, argv);
+    shutdownBookkeeperClient();
+    return result;
 }
@@ -0,0 +1,312 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "tagswriter.h"
+
+static const char *STAGE_NAMES[STAGE_COUNT] = {
+    "load",
+    "read_tags",
+    "charset_select",
+    "admission",
+    "create_folder",
+    "place",
+    "transcode",
+    "fingerprint",
+    "write_tags",
+    "series_index",
+    "study_rollup",
+    "commit",
+    "bookkeeper",
+};
+
+// From 100 us (header of a small file from the page cache) to 2.5 s (large multi-frame files or
+// a slow bookkeeper)
+const double ReceiverMetrics::BUCKETS[ReceiverMetrics::BUCKET_COUNT] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.5, 2.5,
+};
+
+// Time to wait for the request of a scraper before the connection is closed
+#define METRICS_REQUEST_TIMEOUT_MS 2000
+
+const char *metricsStageName(MetricsStage stage)
+{
+    return (stage >= 0 && stage < STAGE_COUNT) ? STAGE_NAMES[stage] : "unknown";
+}
+
+void FileMetrics::start()
+{
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        stageMicroseconds[i] = 0;
+    }
+    totalMicroseconds = 0;
+    bytes = 0;
+    failed = false;
+    stage = STAGE_LOAD;
+    fileStart = std::chrono::steady_clock::now();
+    stageStart = fileStart;
+}
+
+void FileMetrics::begin(MetricsStage next)
+{
+    auto now = std::chrono::steady_clock::now();
+    stageMicroseconds[stage] += std::chrono::duration<double, std::micro>(now - stageStart).count();
+    stage = next;
+    stageStart = now;
+}
+
+void FileMetrics::finish(bool success)
+{
+    MetricsStage last = stage;
+    begin(last);
+    totalMicroseconds = std::chrono::duration<double, std::micro>(stageStart - fileStart).count();
+    failed = !success;
+}
+
+ReceiverMetrics::ReceiverMetrics() : files(0), bytes(0)
+{
+    memset(errors, 0, sizeof(errors));
+    memset(stages, 0, sizeof(stages));
+    memset(&total, 0, sizeof(total));
+}
+
+void ReceiverMetrics::observe(Histogram &histogram, double microseconds)
+{
+    double seconds = microseconds / 1000000.0;
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT && seconds > BUCKETS[bucket])
+    {
+        bucket++;
+    }
+    histogram.counts[bucket]++;
+    histogram.sum += seconds;
+}
+
+void ReceiverMetrics::record(const FileMetrics &file, const CharsetStatistics &charsetStatistics)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    files++;
+    bytes += file.bytes;
+    if (file.failed)
+    {
+        errors[file.stage]++;
+    }
+    // Stages that have not been reached are not observed, so that the counts of the histograms
+    // tell how many files have passed through each stage
+    for (int i = 0; i <= file.stage; i++)
+    {
+        observe(stages[i], file.stageMicroseconds[i]);
+    }
+    observe(total, file.totalMicroseconds);
+    charset.add(charsetStatistics);
+}
+
+void ReceiverMetrics::addSource(std::function<std::string()> source)
+{
+    sources.push_back(source);
+}
+
+static void appendHistogram(std::ostringstream &out, const char *name, const char *labels, const uint64_t *counts,
+                            const double *buckets, int bucketCount, double sum)
+{
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= bucketCount; i++)
+    {
+        cumulative += counts[i];
+        out << name << "_bucket{" << labels << (labels[0] ? "," : "") << "le=\"";
+        if (i < bucketCount)
+        {
+            out << buckets[i];
+        }
+        else
+        {
+            out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    const char *open = labels[0] ? "{" : "";
+    const char *close = labels[0] ? "}" : "";
+    out << name << "_sum" << open << labels << close << " " << sum << "\n";
+    out << name << "_count" << open << labels << close << " " << cumulative << "\n";
+}
+
+std::string ReceiverMetrics::prometheus()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream out;
+    out << "# HELP getdcmtags_files_total Received files processed.\n"
+        << "# TYPE getdcmtags_files_total counter\n"
+        << "getdcmtags_files_total " << files << "\n"
+        << "# HELP getdcmtags_bytes_total Size of the placed DICOM files.\n"
+        << "# TYPE getdcmtags_bytes_total counter\n"
+        << "getdcmtags_bytes_total " << bytes << "\n"
+        << "# HELP getdcmtags_errors_total Files moved to the error folder, by failed stage.\n"
+        << "# TYPE getdcmtags_errors_total counter\n";
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        out << "getdcmtags_errors_total{stage=\"" << STAGE_NAMES[i] << "\"} " << errors[i] << "\n";
+    }
+    out << "# HELP getdcmtags_charset_fallbacks_total Files whose character set was selected in the Code Extensions form.\n"
+        << "# TYPE getdcmtags_charset_fallbacks_total counter\n"
+        << "getdcmtags_charset_fallbacks_total " << charset.fallbacks << "\n"
+        << "# HELP getdcmtags_charset_converted_values_total Tag values converted to UTF-8.\n"
+        << "# TYPE getdcmtags_charset_converted_values_total counter\n"
+        << "getdcmtags_charset_converted_values_total " << charset.convertedValues << "\n"
+        << "# HELP getdcmtags_charset_convert_seconds_total Time spent converting tag values.\n"
+        << "# TYPE getdcmtags_charset_convert_seconds_total counter\n"
+        << "getdcmtags_charset_convert_seconds_total " << charset.conversionMicroseconds / 1000000.0 << "\n"
+        << "# HELP getdcmtags_stage_duration_seconds Time spent in each processing stage per file.\n"
+        << "# TYPE getdcmtags_stage_duration_seconds histogram\n";
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        std::string labels = std::string("stage=\"") + STAGE_NAMES[i] + "\"";
+        appendHistogram(out, "getdcmtags_stage_duration_seconds", labels.c_str(), stages[i].counts, BUCKETS, BUCKET_COUNT, stages[i].sum);
+    }
+    out << "# HELP getdcmtags_file_duration_seconds Total processing time per file.\n"
+        << "# TYPE getdcmtags_file_duration_seconds histogram\n";
+    appendHistogram(out, "getdcmtags_file_duration_seconds", "", total.counts, BUCKETS, BUCKET_COUNT, total.sum);
+    for (auto &source : sources)
+    {
+        out << source();
+    }
+    return out.str();
+}
+
+std::string ReceiverMetrics::json()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream out;
+    uint64_t errorCount = 0;
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        errorCount += errors[i];
+    }
+    // The stage times are averages over the files that have reached the stage
+    out << "{\"receiver.files\": " << files << ", \"receiver.bytes\": " << bytes << ", \"receiver.errors\": " << errorCount;
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        if (errors[i] > 0)
+        {
+            out << ", \"receiver.errors." << STAGE_NAMES[i] << "\": " << errors[i];
+        }
+    }
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        uint64_t count = 0;
+        for (int j = 0; j <= BUCKET_COUNT; j++)
+        {
+            count += stages[i].counts[j];
+        }
+        out << ", \"receiver." << STAGE_NAMES[i] << "_us\": " << (count > 0 ? (long)(stages[i].sum * 1000000.0 / count) : 0);
+    }
+    out << ", \"receiver.total_us\": " << (files > 0 ? (long)(total.sum * 1000000.0 / files) : 0)
+        << ", \"receiver.charset_convert_us\": " << (long)charset.conversionMicroseconds
+        << ", \"receiver.charset_fallbacks\": " << charset.fallbacks << "}";
+    return out.str();
+}
+
+std::string fileMetricsJSON(const std::string &filename, const FileMetrics &file, const CharsetStatistics &charset)
+{
+    std::ostringstream out;
+    std::string escaped;
+    appendEscapedJSON(escaped, filename.data(), filename.size());
+    out << "{\"file\": \"" << escaped << "\", \"receiver.files\": 1, \"receiver.bytes\": " << file.bytes
+        << ", \"receiver.errors\": " << (file.failed ? 1 : 0);
+    if (file.failed)
+    {
+        out << ", \"receiver.errors." << STAGE_NAMES[file.stage] << "\": 1";
+    }
+    for (int i = 0; i <= file.stage; i++)
+    {
+        out << ", \"receiver." << STAGE_NAMES[i] << "_us\": " << (long)file.stageMicroseconds[i];
+    }
+    out << ", \"receiver.total_us\": " << (long)file.totalMicroseconds
+        << ", \"receiver.charset_convert_us\": " << (long)charset.conversionMicroseconds
+        << ", \"receiver.charset_fallbacks\": " << charset.fallbacks << "}";
+    return out.str();
+}
+
+static void serveMetrics(int listenFd, ReceiverMetrics &metrics)
+{
+    while (true)
+    {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno != EINTR)
+            {
+                std::cout << "ERROR: Unable to accept metrics connection. " << strerror(errno) << std::endl;
+                sleep(1);
+            }
+            continue;
+        }
+        // Only the end of the request headers is awaited, the request itself does not matter
+        char request[2048];
+        size_t received = 0;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        while (received < sizeof(request) - 1 && poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0)
+        {
+            ssize_t count = recv(fd, request + received, sizeof(request) - 1 - received, 0);
+            if (count <= 0)
+            {
+                break;
+            }
+            received += count;
+            request[received] = 0;
+            if (strstr(request, "\r\n\r\n") != nullptr)
+            {
+                break;
+            }
+        }
+        std::string body = metrics.prometheus();
+        std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                               + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t count = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+            {
+                break;
+            }
+            sent += count;
+        }
+        close(fd);
+    }
+}
+
+bool startMetricsServer(int port, ReceiverMetrics &metrics)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to create metrics socket. " << strerror(errno) << std::endl;
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0)
+    {
+        std::cout << "ERROR: Unable to listen for metrics on port " << port << ". " << strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+    std::cout << "Serving metrics on port " << port << std::endl;
+    std::thread(serveMetrics, fd, std::ref(metrics)).detach();
+    return true;
+}
@@ -0,0 +1,103 @@
+#ifndef GETDCMTAGS_METRICS_H
+#define GETDCMTAGS_METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "charsetcache.h"
+
+// Stages of processing a received file, in the order in which they are executed. Failures are
+// counted for the stage that was running, which matches the error injection points (DO_ERROR).
+enum MetricsStage
+{
+    STAGE_LOAD,
+    STAGE_READ_TAGS,
+    STAGE_CHARSET_SELECT,
+    STAGE_ADMISSION,
+    STAGE_CREATE_FOLDER,
+    STAGE_PLACE,
+    STAGE_TRANSCODE,
+    STAGE_FINGERPRINT,
+    STAGE_WRITE_TAGS,
+    STAGE_SERIES_INDEX,
+    STAGE_STUDY_ROLLUP,
+    STAGE_COMMIT,
+    STAGE_BOOKKEEPER,
+    STAGE_COUNT
+};
+
+const char *metricsStageName(MetricsStage stage);
+
+// Timings of the file that is currently processed by a worker
+struct FileMetrics
+{
+    double stageMicroseconds[STAGE_COUNT];
+    double totalMicroseconds = 0;
+    uint64_t bytes = 0;
+    bool failed = false;
+    MetricsStage stage = STAGE_LOAD;
+
+    void start();
+    // Ends the running stage and starts the next one
+    void begin(MetricsStage next);
+    void finish(bool success);
+
+private:
+    std::chrono::steady_clock::time_point fileStart;
+    std::chrono::steady_clock::time_point stageStart;
+};
+
+// Counters and histograms of all files processed by the process. Thread-safe.
+class ReceiverMetrics
+{
+public:
+    ReceiverMetrics();
+
+    void record(const FileMetrics &file, const CharsetStatistics &charset);
+
+    // Adds metrics that are kept elsewhere (e.g., the shared admission state) to the exposition.
+    // Must be called before the metrics server is started.
+    void addSource(std::function<std::string()> source);
+
+    // Prometheus text exposition format
+    std::string prometheus();
+
+    // One-line JSON summary, using the same names as the per-file summary
+    std::string json();
+
+private:
+    // Upper bounds of the histogram buckets in seconds. The last bucket (+Inf) is implicit.
+    static const int BUCKET_COUNT = 12;
+    static const double BUCKETS[BUCKET_COUNT];
+
+    struct Histogram
+    {
+        uint64_t counts[BUCKET_COUNT + 1];
+        double sum;
+    };
+
+    void observe(Histogram &histogram, double microseconds);
+
+    std::mutex mutex;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t errors[STAGE_COUNT];
+    CharsetStatistics charset;
+    Histogram stages[STAGE_COUNT];
+    Histogram total;
+    std::vector<std::function<std::string()>> sources;
+};
+
+// One-line JSON summary of a file. The keys are the metric names that the Python services send
+// with helper.g_log (e.g., "receiver.load_us"), so that log shippers can forward them unchanged.
+std::string fileMetricsJSON(const std::string &filename, const FileMetrics &file, const CharsetStatistics &charset);
+
+// Serves the metrics on the TCP port for Prometheus (any path returns the metrics). Runs in a
+// background thread and returns false if the port cannot be opened.
+bool startMetricsServer(int port, ReceiverMetrics &metrics);
+
+#endif
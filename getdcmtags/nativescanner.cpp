@@ -0,0 +1,350 @@
+#include "nativescanner.h"
+
+#include <algorithm>
+
+#include "dcmtk/dcmdata/dcistrmb.h"
+#include "headerreader.h"
+
+#define ITEM_TAG 0xFFFEE000u
+#define ITEM_DELIMITATION_TAG 0xFFFEE00Du
+#define SEQUENCE_DELIMITATION_TAG 0xFFFEE0DDu
+#define UNDEFINED_LENGTH 0xFFFFFFFFu
+#define PIXEL_DATA_TAG 0x7FE00010u
+
+// Limit for nested sequences, to protect against malicious files
+#define MAX_NESTING_DEPTH 32
+
+static const char *UNSUPPORTED_TRANSFER_SYNTAXES[] = {
+    "1.2.840.10008.1.2.1.99", // Deflated Explicit VR Little Endian
+    "1.2.840.10008.1.2.4.95", // JPIP Referenced Deflate
+    "1.2.840.10008.1.2.2",    // Explicit VR Big Endian
+};
+
+static const char *IMPLICIT_VR_LITTLE_ENDIAN = "1.2.840.10008.1.2";
+
+static inline Uint16 read16(const Uint8 *p)
+{
+    return (Uint16)(p[0] | (p[1] << 8));
+}
+
+static inline Uint32 read32(const Uint8 *p)
+{
+    return (Uint32)p[0] | ((Uint32)p[1] << 8) | ((Uint32)p[2] << 16) | ((Uint32)p[3] << 24);
+}
+
+static inline Uint32 readTag(const Uint8 *p)
+{
+    return ((Uint32)read16(p) << 16) | read16(p + 2);
+}
+
+// VRs that are encoded with two reserved bytes and a 32-bit length in explicit VR encoding
+static bool hasLongLength(Uint8 a, Uint8 b)
+{
+    switch (a)
+    {
+    case 'O':
+        return b == 'B' || b == 'D' || b == 'F' || b == 'L' || b == 'V' || b == 'W';
+    case 'S':
+        return b == 'Q' || b == 'V';
+    case 'U':
+        return b == 'C' || b == 'N' || b == 'R' || b == 'T' || b == 'V';
+    default:
+        return false;
+    }
+}
+
+struct ElementHeader
+{
+    Uint32 tag;
+    Uint32 length;
+    size_t valuePos;
+    // True if the content of an undefined-length value is encoded with implicit VR
+    bool implicitContent;
+};
+
+// Reads the header of the element at pos. Returns false if the header exceeds the data.
+static bool readElementHeader(const Uint8 *data, size_t size, size_t pos, bool explicitVR, ElementHeader &header)
+{
+    if (pos + 8 > size)
+    {
+        return false;
+    }
+    header.tag = readTag(data + pos);
+    header.implicitContent = !explicitVR;
+
+    // Items and delimiters never have a VR
+    if (!explicitVR || (header.tag >> 16) == 0xFFFE)
+    {
+        header.length = read32(data + pos + 4);
+        header.valuePos = pos + 8;
+        return true;
+    }
+
+    Uint8 a = data[pos + 4];
+    Uint8 b = data[pos + 5];
+    if (a < 'A' || a > 'Z' || b < 'A' || b > 'Z')
+    {
+        return false;
+    }
+    if (hasLongLength(a, b))
+    {
+        if (pos + 12 > size)
+        {
+            return false;
+        }
+        header.length = read32(data + pos + 8);
+        header.valuePos = pos + 12;
+        // Undefined-length UN values contain implicit VR encoded sequences
+        header.implicitContent = (a == 'U' && b == 'N');
+    }
+    else
+    {
+        header.length = read16(data + pos + 6);
+        header.valuePos = pos + 8;
+    }
+    return true;
+}
+
+static bool skipElement(const Uint8 *data, size_t size, size_t pos, bool explicitVR, int depth, size_t &end);
+
+// Skips the items of an undefined-length value starting at pos, up to and including the
+// sequence delimitation item
+static bool skipUndefinedLength(const Uint8 *data, size_t size, size_t pos, bool explicitVR, int depth, size_t &end)
+{
+    if (depth > MAX_NESTING_DEPTH)
+    {
+        return false;
+    }
+    while (pos + 8 <= size)
+    {
+        Uint32 tag = readTag(data + pos);
+        Uint32 length = read32(data + pos + 4);
+        if (tag == SEQUENCE_DELIMITATION_TAG)
+        {
+            end = pos + 8;
+            return true;
+        }
+        if (tag != ITEM_TAG)
+        {
+            return false;
+        }
+        pos += 8;
+        if (length != UNDEFINED_LENGTH)
+        {
+            if (length > size - pos)
+            {
+                return false;
+            }
+            pos += length;
+            continue;
+        }
+        // Undefined-length item: skip the contained elements up to the item delimiter
+        while (true)
+        {
+            if (pos + 8 > size)
+            {
+                return false;
+            }
+            if (readTag(data + pos) == ITEM_DELIMITATION_TAG)
+            {
+                pos += 8;
+                break;
+            }
+            if (!skipElement(data, size, pos, explicitVR, depth + 1, pos))
+            {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+// Determines the end of the element at pos
+static bool skipElement(const Uint8 *data, size_t size, size_t pos, bool explicitVR, int depth, size_t &end)
+{
+    ElementHeader header;
+    if (!readElementHeader(data, size, pos, explicitVR, header))
+    {
+        return false;
+    }
+    if (header.length == UNDEFINED_LENGTH)
+    {
+        return skipUndefinedLength(data, size, header.valuePos, !header.implicitContent, depth, end);
+    }
+    if (header.length > size - header.valuePos)
+    {
+        return false;
+    }
+    end = header.valuePos + header.length;
+    return true;
+}
+
+// Skips the preamble and the meta header. Returns the position of the first dataset element and
+// the encoding of the dataset, or false if the encoding is not supported.
+static bool scanMetaHeader(const Uint8 *data, size_t size, size_t &pos, bool &explicitVR)
+{
+    // Only files with preamble and meta header are handled, because the transfer syntax of
+    // other files would need to be guessed
+    if (size < 132 || data[128] != 'D' || data[129] != 'I' || data[130] != 'C' || data[131] != 'M')
+    {
+        return false;
+    }
+
+    // The meta header is always encoded as explicit VR little endian
+    pos = 132;
+    std::string transferSyntax;
+    while (pos + 8 <= size && read16(data + pos) == 0x0002)
+    {
+        ElementHeader header;
+        size_t end;
+        if (!readElementHeader(data, size, pos, true, header) || !skipElement(data, size, pos, true, 0, end))
+        {
+            return false;
+        }
+        if (header.tag == 0x00020010 && header.length != UNDEFINED_LENGTH)
+        {
+            transferSyntax.assign((const char *)data + header.valuePos, header.length);
+            while (!transferSyntax.empty() && (transferSyntax.back() == '\0' || transferSyntax.back() == ' '))
+            {
+                transferSyntax.pop_back();
+            }
+        }
+        pos = end;
+    }
+    if (transferSyntax.empty())
+    {
+        return false;
+    }
+    for (const char *unsupported : UNSUPPORTED_TRANSFER_SYNTAXES)
+    {
+        if (transferSyntax == unsupported)
+        {
+            return false;
+        }
+    }
+    explicitVR = (transferSyntax != IMPLICIT_VR_LITTLE_ENDIAN);
+    return true;
+}
+
+bool scanDicomElements(const Uint8 *data, size_t size, const std::vector<Uint32> &keys, Uint32 stopKey,
+                       std::string &image)
+{
+    size_t pos;
+    bool explicitVR;
+    if (!scanMetaHeader(data, size, pos, explicitVR))
+    {
+        return false;
+    }
+
+    image.clear();
+    image.append((const char *)data, pos);
+
+    Uint32 lastKey = keys.empty() ? 0 : keys.back();
+    Uint32 previousTag = 0;
+    while (pos < size)
+    {
+        if (pos + 8 > size)
+        {
+            return false;
+        }
+        Uint32 tag = readTag(data + pos);
+        if (tag < previousTag)
+        {
+            // DCMTK sorts elements that are out of order, so the scan cannot stop early
+            return false;
+        }
+        previousTag = tag;
+        if (tag >= stopKey || tag > lastKey)
+        {
+            break;
+        }
+
+        size_t end;
+        if (!skipElement(data, size, pos, explicitVR, 0, end))
+        {
+            return false;
+        }
+
+        // Private creator elements are kept as well, as DCMTK needs them to look up the VR of
+        // private tags in implicit VR encoding
+        Uint16 group = (Uint16)(tag >> 16);
+        Uint16 element = (Uint16)(tag & 0xFFFF);
+        bool isPrivateCreator = (group & 1) && element >= 0x0010 && element <= 0x00FF;
+        if (isPrivateCreator || std::binary_search(keys.begin(), keys.end(), tag))
+        {
+            image.append((const char *)data + pos, end - pos);
+        }
+        pos = end;
+    }
+    return true;
+}
+
+bool findPixelData(const Uint8 *data, size_t size, size_t &offset, size_t &length)
+{
+    size_t pos;
+    bool explicitVR;
+    if (!scanMetaHeader(data, size, pos, explicitVR))
+    {
+        return false;
+    }
+    Uint32 previousTag = 0;
+    while (pos + 8 <= size)
+    {
+        Uint32 tag = readTag(data + pos);
+        if (tag < previousTag)
+        {
+            return false;
+        }
+        if (tag > PIXEL_DATA_TAG)
+        {
+            break;
+        }
+        previousTag = tag;
+        ElementHeader header;
+        size_t end;
+        if (!readElementHeader(data, size, pos, explicitVR, header) || !skipElement(data, size, pos, explicitVR, 0, end))
+        {
+            return false;
+        }
+        if (tag == PIXEL_DATA_TAG)
+        {
+            offset = header.valuePos;
+            length = end - header.valuePos;
+            return true;
+        }
+        pos = end;
+    }
+    // No pixel data
+    offset = 0;
+    length = 0;
+    return true;
+}
+
+bool loadFileNative(DcmFileFormat &fileFormat, const OFString &filename, const std::vector<Uint32> &keys,
+                    const DcmTagKey &stopParsingAtElement, OFCondition &status)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    Uint32 stopKey = (stopParsingAtElement == DCM_UndefinedTagKey) ? 0xFFFFFFFFu : scanKey(stopParsingAtElement);
+    std::string image;
+    if (!scanDicomElements(file->data, file->size, keys, stopKey, image))
+    {
+        return false;
+    }
+
+    DcmInputBufferStream stream;
+    stream.setBuffer(image.data(), image.size());
+    stream.setEos();
+    status = fileFormat.clear();
+    if (status.good())
+    {
+        fileFormat.transferInit();
+        status = fileFormat.readUntilTag(stream, EXS_Unknown, EGL_noChange, 4096U, DCM_UndefinedTagKey);
+        fileFormat.transferEnd();
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef GETDCMTAGS_NATIVESCANNER_H
+#define GETDCMTAGS_NATIVESCANNER_H
+
+#include <string>
+#include <vector>
+
+#include "dcmtk/dcmdata/dctk.h"
+
+// Lightweight alternative to building the complete DcmDataset object tree. The file is scanned
+// once from front to back, and only the requested top-level elements are copied verbatim (along
+// with the meta header and the private creator elements) into a small in-memory file image.
+// DCMTK then parses this image, so that the extracted values are identical to a full parse.
+
+// Returns the tag key as single number, as used by the scanner (group in the upper 16 bits)
+inline Uint32 scanKey(const DcmTagKey &tag)
+{
+    return ((Uint32)tag.getGroup() << 16) | tag.getElement();
+}
+
+// Scans the file content and builds the reduced file image. Keys must be sorted. Scanning ends
+// at the first top-level element with key >= stopKey or behind the last requested key. Returns
+// false if the encoding is not supported by the scanner (no DICM preamble, deflated or big endian
+// transfer syntax, elements out of order, or malformed lengths).
+bool scanDicomElements(const Uint8 *data, size_t size, const std::vector<Uint32> &keys, Uint32 stopKey,
+                       std::string &image);
+
+// Locates the value of the top-level pixel data element (7FE0,0010). For encapsulated pixel data,
+// the value includes the items and the sequence delimitation item. Sets the length to 0 if the
+// file has no pixel data. Returns false if the encoding is not supported by the scanner.
+bool findPixelData(const Uint8 *data, size_t size, size_t &offset, size_t &length);
+
+// Loads the requested elements of the file into the file format object. Returns false if the
+// file cannot be handled by the scanner, in which case the caller should fall back to DCMTK.
+bool loadFileNative(DcmFileFormat &fileFormat, const OFString &filename, const std::vector<Uint32> &keys,
+                    const DcmTagKey &stopParsingAtElement, OFCondition &status);
+
+#endif
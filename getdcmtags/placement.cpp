@@ -0,0 +1,320 @@
+#include "placement.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+bool parseDurabilityPolicy(const char *value, DurabilityPolicy &policy)
+{
+    if (strcmp(value, "none") == 0)
+    {
+        policy = DURABILITY_NONE;
+    }
+    else if (strcmp(value, "file") == 0)
+    {
+        policy = DURABILITY_FILE;
+    }
+    else if (strcmp(value, "directory") == 0)
+    {
+        policy = DURABILITY_DIRECTORY;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char *durabilityPolicyName(DurabilityPolicy policy)
+{
+    switch (policy)
+    {
+    case DURABILITY_FILE:
+        return "file";
+    case DURABILITY_DIRECTORY:
+        return "directory";
+    default:
+        return "none";
+    }
+}
+
+// Number of failed generations that are remembered for the committers that wait for them
+#define MAX_FAILED_GENERATIONS 1024
+
+static std::string parentFolder(const std::string &filename)
+{
+    size_t slashPos = filename.rfind('/');
+    if (slashPos == std::string::npos)
+    {
+        return ".";
+    }
+    return slashPos == 0 ? "/" : filename.substr(0, slashPos);
+}
+
+void DurabilityJournal::add(const std::string &filename, DurabilityPolicy policy)
+{
+    if (policy == DURABILITY_NONE)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    files.push_back(filename);
+    if (policy == DURABILITY_DIRECTORY)
+    {
+        directories.insert(parentFolder(filename));
+    }
+}
+
+uint64_t DurabilityJournal::generation()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return openGeneration;
+}
+
+size_t DurabilityJournal::pending()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.size();
+}
+
+// Flushes a file or folder. fsync() applies to the file and not to the descriptor, so the file
+// can be opened again for this.
+static bool syncPath(const std::string &path, bool directory)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | (directory ? O_DIRECTORY : 0));
+    if (fd < 0 && errno == ENOENT)
+    {
+        // Removed again since it was registered (e.g., moved to the error folder)
+        return true;
+    }
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to open " << path << " for flushing. " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool success = (directory ? fsync(fd) : fdatasync(fd)) == 0;
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to flush " << path << ". " << strerror(errno) << std::endl;
+    }
+    close(fd);
+    return success;
+}
+
+bool DurabilityJournal::commit(uint64_t since)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // The entries of the caller are in the open generation, unless it is empty
+    uint64_t target = (files.empty() && directories.empty()) ? openGeneration - 1 : openGeneration;
+    if (since == 0)
+    {
+        since = target;
+    }
+    while (completedGeneration < target)
+    {
+        if (flushing)
+        {
+            flushed.wait(lock);
+            continue;
+        }
+        flushing = true;
+        uint64_t flushGeneration = openGeneration++;
+        std::vector<std::string> commitFiles;
+        std::set<std::string> commitDirectories;
+        commitFiles.swap(files);
+        commitDirectories.swap(directories);
+        lock.unlock();
+
+        bool success = true;
+        // The content has to be on disk before the names that point to it
+        for (const auto &file : commitFiles)
+        {
+            success = syncPath(file, false) && success;
+        }
+        for (const auto &directory : commitDirectories)
+        {
+            success = syncPath(directory, true) && success;
+        }
+
+        lock.lock();
+        if (!success)
+        {
+            failedGenerations.insert(flushGeneration);
+            while (failedGenerations.size() > MAX_FAILED_GENERATIONS)
+            {
+                failedGenerations.erase(failedGenerations.begin());
+            }
+        }
+        completedGeneration = flushGeneration;
+        flushing = false;
+        flushed.notify_all();
+    }
+    return failedGenerations.lower_bound(since) == failedGenerations.end();
+}
+
+bool DurabilityJournal::failed(uint64_t first, uint64_t last)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto failure = failedGenerations.lower_bound(first);
+    return failure != failedGenerations.end() && *failure <= last;
+}
+
+// Copies the content with the fastest method supported by the file systems: a reflink shares
+// the blocks (btrfs, XFS), copy_file_range() copies in the kernel (and on NFS/CIFS on the
+// server), sendfile() avoids the user space copy on older kernels.
+static bool copyFileContent(int sourceFd, int targetFd, size_t size)
+{
+#ifdef FICLONE
+    if (ioctl(targetFd, FICLONE, sourceFd) == 0)
+    {
+        return true;
+    }
+#endif
+    size_t copied = 0;
+    bool useCopyFileRange = true;
+    while (copied < size)
+    {
+        ssize_t result = -1;
+        if (useCopyFileRange)
+        {
+            result = copy_file_range(sourceFd, nullptr, targetFd, nullptr, size - copied, 0);
+            if (result < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                // Not supported between these file systems. Nothing has been copied by this call,
+                // and sendfile() continues at the current offsets.
+                useCopyFileRange = false;
+                continue;
+            }
+        }
+        else
+        {
+            result = sendfile(targetFd, sourceFd, nullptr, size - copied);
+        }
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return false;
+        }
+        copied += result;
+    }
+    return true;
+}
+
+static bool copyFileAtomically(const std::string &source, const std::string &target, DurabilityPolicy policy)
+{
+    int sourceFd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat sourceInfo;
+    if (sourceFd < 0 || fstat(sourceFd, &sourceInfo) != 0)
+    {
+        std::cout << "ERROR: Unable to open " << source << ". " << strerror(errno) << std::endl;
+        if (sourceFd >= 0)
+        {
+            close(sourceFd);
+        }
+        return false;
+    }
+
+    std::string tempFile = parentFolder(target) + "/.placing.XXXXXX";
+    int targetFd = mkstemp(&tempFile[0]);
+    if (targetFd < 0)
+    {
+        std::cout << "ERROR: Unable to create temporary file in " << parentFolder(target) << ". " << strerror(errno) << std::endl;
+        close(sourceFd);
+        return false;
+    }
+    fchmod(targetFd, sourceInfo.st_mode & 0777);
+
+    bool success = copyFileContent(sourceFd, targetFd, sourceInfo.st_size);
+    if (success && policy != DURABILITY_NONE)
+    {
+        // The content must be on disk before the file becomes visible under its final name
+        success = (fdatasync(targetFd) == 0);
+    }
+    success = (close(targetFd) == 0) && success;
+    close(sourceFd);
+    if (!success || rename(tempFile.c_str(), target.c_str()) != 0)
+    {
+        std::cout << "ERROR: Unable to copy " << source << " to " << target << ". " << strerror(errno) << std::endl;
+        unlink(tempFile.c_str());
+        return false;
+    }
+    if (unlink(source.c_str()) != 0)
+    {
+        std::cout << "WARNING: Unable to remove " << source << " after copying. " << strerror(errno) << std::endl;
+    }
+    return true;
+}
+
+bool placeFile(const std::string &source, const std::string &target, DurabilityPolicy policy,
+               DurabilityJournal &journal)
+{
+    if (rename(source.c_str(), target.c_str()) == 0)
+    {
+        // The content has been written by the receiver without flushing
+        journal.add(target, policy);
+        return true;
+    }
+    if (errno != EXDEV)
+    {
+        return false;
+    }
+    if (!copyFileAtomically(source, target, policy))
+    {
+        return false;
+    }
+    if (policy == DURABILITY_DIRECTORY)
+    {
+        // The content has been flushed already (so flushing it again is cheap), but not the folder
+        journal.add(target, policy);
+    }
+    return true;
+}
+
+bool writeFileContent(const char *data, size_t size, const std::string &target)
+{
+    std::string tempFile = parentFolder(target) + "/.placing.XXXXXX";
+    int fd = mkstemp(&tempFile[0]);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to create temporary file in " << parentFolder(target) << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    fchmod(fd, 0644);
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t result = write(fd, data + written, size - written);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            break;
+        }
+        written += result;
+    }
+    bool success = (close(fd) == 0) && written == size;
+    if (!success || rename(tempFile.c_str(), target.c_str()) != 0)
+    {
+        std::cout << "ERROR: Unable to write " << target << ". " << strerror(errno) << std::endl;
+        unlink(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
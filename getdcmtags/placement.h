@@ -0,0 +1,83 @@
+#ifndef GETDCMTAGS_PLACEMENT_H
+#define GETDCMTAGS_PLACEMENT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+enum DurabilityPolicy
+{
+    // Rely on the kernel writing back the data (previous behavior)
+    DURABILITY_NONE,
+    // The content of the placed files is flushed with fdatasync()
+    DURABILITY_FILE,
+    // Additionally, the series folder is flushed with fsync(), so that the new names survive a crash
+    DURABILITY_DIRECTORY
+};
+
+// Parses "none", "file" or "directory". Returns false for other values.
+bool parseDurabilityPolicy(const char *value, DurabilityPolicy &policy);
+const char *durabilityPolicyName(DurabilityPolicy policy);
+
+// Collects the files and folders that need to be flushed, so that several received files can be
+// committed together. Each folder is flushed only once per commit, which is where most of the
+// gain of the group commit comes from. Thread-safe.
+//
+// The entries are flushed in generations. A generation collects the entries that are added
+// while the previous one is flushed, and only one generation is flushed at a time, so that
+// threads that commit concurrently share one flush instead of taking each other's entries.
+class DurabilityJournal
+{
+public:
+    // Registers a file (and with DURABILITY_DIRECTORY its folder) according to the policy
+    void add(const std::string &filename, DurabilityPolicy policy);
+
+    // Generation that entries added now belong to. Passed to commit() by callers that need the
+    // result for their own entries.
+    uint64_t generation();
+
+    // Returns once all entries added before the call have been flushed, by this call or by a
+    // concurrent one. Returns false if a flush failed for a generation from the given one on (by
+    // default the last one that the call waits for). As a generation is flushed as a whole, a
+    // failure is reported to all of its committers.
+    bool commit(uint64_t since = 0);
+
+    // True if the flush of a generation in the given range has failed
+    bool failed(uint64_t first, uint64_t last);
+
+    size_t pending();
+
+    // If set, commits are triggered by the caller for a group of files (daemon and batch mode)
+    // instead of after every file
+    bool deferred = false;
+
+private:
+    std::mutex mutex;
+    std::condition_variable flushed;
+    std::vector<std::string> files;
+    std::set<std::string> directories;
+    uint64_t openGeneration = 1;
+    uint64_t completedGeneration = 0;
+    bool flushing = false;
+    // Generations whose flush has failed, only the recent ones are kept
+    std::set<uint64_t> failedGenerations;
+};
+
+// Moves the file to the target name. If rename() is not possible because the target is located
+// on another file system, the content is cloned (reflink) or copied in the kernel with
+// copy_file_range()/sendfile() into a temporary file next to the target, which is then renamed
+// to the target name, so that the target never exists with partial content. The source is only
+// removed after that. With a durability policy, the temporary file is flushed before it is
+// renamed, and the target is registered in the journal.
+bool placeFile(const std::string &source, const std::string &target, DurabilityPolicy policy,
+               DurabilityJournal &journal);
+
+// Writes the content into a temporary file next to the target, which is then renamed to the
+// target name. Used for files that are received in memory (e.g., archive members). The caller
+// registers the target in the journal.
+bool writeFileContent(const char *data, size_t size, const std::string &target);
+
+#endif
@@ -0,0 +1,40 @@
+#include "seriesevents.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+bool appendSeriesEvent(const std::string &incomingFolder, SeriesEventType type, const std::string &seriesUID)
+{
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    std::string event;
+    event.push_back((char)type);
+    event.push_back(' ');
+    event.append(std::to_string(now.count()));
+    event.push_back(' ');
+    event.append(seriesUID.empty() ? "-" : seriesUID);
+    event.push_back('\n');
+
+    std::string filename = incomingFolder + SERIES_EVENTS_FILE;
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to open series event log " << filename << std::endl;
+        return false;
+    }
+    ssize_t result;
+    do
+    {
+        result = write(fd, event.data(), event.size());
+    } while (result < 0 && errno == EINTR);
+    bool success = (result == (ssize_t)event.size());
+    success = (close(fd) == 0) && success;
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to write series event log " << filename << std::endl;
+    }
+    return success;
+}
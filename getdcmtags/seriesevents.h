@@ -0,0 +1,23 @@
+#ifndef GETDCMTAGS_SERIESEVENTS_H
+#define GETDCMTAGS_SERIESEVENTS_H
+
+#include <string>
+
+// Event log in the incoming folder, which allows the router to track the received series
+// incrementally instead of scanning the incoming folder every second. Each event is one line
+// "<type> <unix time in ms> <series UID>", appended with a single O_APPEND write so that
+// concurrent receivers never interleave events. The router rotates the log by renaming it,
+// so it is opened again for every event.
+#define SERIES_EVENTS_FILE ".series_events"
+
+enum SeriesEventType
+{
+    // An instance has been added to the series folder
+    SERIES_EVENT_INSTANCE = 'I',
+    // A received file has been moved to the error folder (the series UID is "-")
+    SERIES_EVENT_ERROR = 'E'
+};
+
+bool appendSeriesEvent(const std::string &incomingFolder, SeriesEventType type, const std::string &seriesUID);
+
+#endif
@@ -0,0 +1,115 @@
+#include "seriesindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "tagswriter.h"
+
+#define SERIES_INDEX_VERSION "1"
+
+// Removes the line breaks from the .tags document. The values are escaped, so that line breaks
+// only occur between the entries.
+static void appendCompact(std::string &out, const std::string &tagsJson)
+{
+    for (char c : tagsJson)
+    {
+        if (c != '\n')
+        {
+            out.push_back(c);
+        }
+    }
+}
+
+static bool writeAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t result = write(fd, data.data() + written, data.size() - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+// Creates the index with its header. The header is written into a temporary file that is then
+// linked to the final name, so that other receivers never see an index without header.
+static bool createIndex(const std::string &indexFile, const std::string &seriesUID, const std::string &tagsJson)
+{
+    std::string header = "{\"series_index\": " SERIES_INDEX_VERSION ", \"series_uid\": \"";
+    appendEscapedJSON(header, seriesUID.data(), seriesUID.size());
+    header += "\", \"tags\": ";
+    appendCompact(header, tagsJson);
+    header += "}\n";
+
+    std::string tempFile = indexFile + ".XXXXXX";
+    int fd = mkstemp(&tempFile[0]);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to create series index " << tempFile << std::endl;
+        return false;
+    }
+    fchmod(fd, 0644);
+    bool success = writeAll(fd, header);
+    success = (close(fd) == 0) && success;
+    // If another receiver has created the index in the meantime, its header is kept
+    if (success && link(tempFile.c_str(), indexFile.c_str()) != 0 && errno != EEXIST)
+    {
+        success = false;
+    }
+    unlink(tempFile.c_str());
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to create series index " << indexFile << std::endl;
+    }
+    return success;
+}
+
+bool appendSeriesIndex(const std::string &seriesFolder, const std::string &seriesUID, const std::string &fileStem,
+                       const std::string &tagsJson)
+{
+    std::string indexFile = seriesFolder + seriesUID + ".index";
+    if (access(indexFile.c_str(), F_OK) != 0 && !createIndex(indexFile, seriesUID, tagsJson))
+    {
+        return false;
+    }
+
+    std::string record = "{\"file\": \"";
+    appendEscapedJSON(record, fileStem.data(), fileStem.size());
+    record += "\", \"tags\": ";
+    appendCompact(record, tagsJson);
+    record += "}\n";
+
+    int fd = open(indexFile.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cout << "ERROR: Unable to open series index " << indexFile << std::endl;
+        return false;
+    }
+    // A single write, so that the record is appended atomically. A partial write (e.g., if the
+    // disk is full) leaves a truncated last line, which is ignored by the reader.
+    ssize_t result;
+    do
+    {
+        result = write(fd, record.data(), record.size());
+    } while (result < 0 && errno == EINTR);
+    bool success = (result == (ssize_t)record.size());
+    success = (close(fd) == 0) && success;
+    if (!success)
+    {
+        std::cout << "ERROR: Unable to append to series index " << indexFile << std::endl;
+    }
+    return success;
+}
@@ -0,0 +1,25 @@
+#ifndef GETDCMTAGS_SERIESINDEX_H
+#define GETDCMTAGS_SERIESINDEX_H
+
+#include <string>
+
+// Per-series index file, so that the router does not need to open one .tags file per instance.
+// The index is stored as "<series UID>.index" in the series folder and contains one JSON
+// document per line: a header with the tags of the first received instance, followed by one
+// record per instance with the file name and the tags of the instance.
+enum SeriesIndexMode
+{
+    SERIES_INDEX_OFF,
+    // Index is written in addition to the .tags files
+    SERIES_INDEX_ADDITIONAL,
+    // Only the index is written, no .tags files
+    SERIES_INDEX_EXCLUSIVE
+};
+
+// Appends the record of an instance to the index of the series, creating the index with its
+// header if needed. tagsJson is the content of the instance's .tags file. Each record is
+// appended with a single O_APPEND write, so that concurrent receivers never interleave records.
+bool appendSeriesIndex(const std::string &seriesFolder, const std::string &seriesUID, const std::string &fileStem,
+                       const std::string &tagsJson);
+
+#endif
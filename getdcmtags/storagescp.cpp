@@ -0,0 +1,333 @@
+#include "storagescp.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "dcmtk/config/osconfig.h"
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/dcmnet/assoc.h"
+#include "dcmtk/dcmnet/dimse.h"
+#include "dcmtk/dcmnet/diutil.h"
+#ifdef WITH_OPENSSL
+#include "dcmtk/dcmtls/tlslayer.h"
+#endif
+
+#include "threadpool.h"
+
+// Timeout for the association negotiation and for waiting on the next message of an idle
+// association, so that a vanished peer does not occupy a worker forever
+#define ACSE_TIMEOUT 30
+#define DIMSE_TIMEOUT 300
+
+// Transfer syntaxes in the order of preference, matching the defaults of storescp. The explicit
+// little endian syntax is preferred, as the files are written in the received transfer syntax.
+static const char *uncompressedTransferSyntaxes[] = {
+    UID_LittleEndianExplicitTransferSyntax,
+    UID_BigEndianExplicitTransferSyntax,
+    UID_LittleEndianImplicitTransferSyntax,
+};
+
+// Same as storescp +xa
+static const char *allTransferSyntaxes[] = {
+    UID_JPEG2000LosslessOnlyTransferSyntax,
+    UID_JPEG2000TransferSyntax,
+    UID_JPEGProcess14SV1TransferSyntax,
+    UID_JPEGProcess14TransferSyntax,
+    UID_JPEGProcess1TransferSyntax,
+    UID_JPEGProcess2_4TransferSyntax,
+    UID_JPEGLSLosslessTransferSyntax,
+    UID_JPEGLSLossyTransferSyntax,
+    UID_MPEG2MainProfileAtMainLevelTransferSyntax,
+    UID_MPEG2MainProfileAtHighLevelTransferSyntax,
+    UID_MPEG4HighProfileLevel4_1TransferSyntax,
+    UID_MPEG4BDcompatibleHighProfileLevel4_1TransferSyntax,
+    UID_RLELosslessTransferSyntax,
+    UID_DeflatedExplicitVRLittleEndianTransferSyntax,
+    UID_LittleEndianExplicitTransferSyntax,
+    UID_BigEndianExplicitTransferSyntax,
+    UID_LittleEndianImplicitTransferSyntax,
+};
+
+struct StoreCallbackData
+{
+    const ReceivedFileHandler *handler;
+    int worker;
+    const AssociationInfo *info;
+    DcmFileFormat *file;
+    int result;
+};
+
+#ifdef WITH_OPENSSL
+static DcmTLSTransportLayer *createTLSLayer(const StorageSCPOptions &options)
+{
+    DcmTLSTransportLayer *layer = new DcmTLSTransportLayer(NET_ACCEPTOR, nullptr, OFTrue);
+    if (layer->setPrivateKeyFile(options.tlsKeyFile.c_str(), DCF_Filetype_PEM).bad()
+        || layer->setCertificateFile(options.tlsCertificateFile.c_str(), DCF_Filetype_PEM).bad()
+        || !layer->checkPrivateKeyMatchesCertificate())
+    {
+        std::cout << "ERROR: Unable to load TLS key " << options.tlsKeyFile << " or certificate " << options.tlsCertificateFile << std::endl;
+        delete layer;
+        return nullptr;
+    }
+    if (!options.tlsCACertificateFile.empty()
+        && layer->addTrustedCertificateFile(options.tlsCACertificateFile.c_str(), DCF_Filetype_PEM).bad())
+    {
+        std::cout << "ERROR: Unable to load TLS CA certificate " << options.tlsCACertificateFile << std::endl;
+        delete layer;
+        return nullptr;
+    }
+    // Same as the defaults of storescp: peers have to present a certificate signed by the CA
+    layer->setCertificateVerification(DCV_requireCertificate);
+    if (layer->setTLSProfile(TSP_Profile_BCP195).bad() || layer->activateCipherSuites().bad())
+    {
+        std::cout << "ERROR: Unable to activate the TLS cipher suites" << std::endl;
+        delete layer;
+        return nullptr;
+    }
+    return layer;
+}
+#endif
+
+// Accepts the presentation contexts that are not covered by the known storage SOP classes (same
+// as storescp --promiscuous), using the first proposed transfer syntax in the order of preference
+static void acceptUnknownContexts(T_ASC_Parameters *params, const char *transferSyntaxes[], int transferSyntaxCount)
+{
+    int count = ASC_countPresentationContexts(params);
+    for (int i = 0; i < count; i++)
+    {
+        T_ASC_PresentationContext pc;
+        if (ASC_getPresentationContext(params, i, &pc).bad() || pc.resultReason == ASC_P_ACCEPTANCE)
+        {
+            continue;
+        }
+        for (int j = 0; j < transferSyntaxCount; j++)
+        {
+            bool proposed = false;
+            for (int k = 0; k < (int)pc.transferSyntaxCount && !proposed; k++)
+            {
+                proposed = (strcmp(pc.proposedTransferSyntaxes[k], transferSyntaxes[j]) == 0);
+            }
+            if (proposed)
+            {
+                ASC_acceptPresentationContext(params, pc.presentationContextID, transferSyntaxes[j]);
+                break;
+            }
+        }
+    }
+}
+
+static bool negotiateAssociation(T_ASC_Association *assoc, const StorageSCPOptions &options)
+{
+    const char **transferSyntaxes = options.acceptCompressed ? allTransferSyntaxes : uncompressedTransferSyntaxes;
+    int transferSyntaxCount = options.acceptCompressed ? (int)(sizeof(allTransferSyntaxes) / sizeof(allTransferSyntaxes[0]))
+                                                       : (int)(sizeof(uncompressedTransferSyntaxes) / sizeof(uncompressedTransferSyntaxes[0]));
+    const char *verification[] = {UID_VerificationSOPClass};
+
+    OFCondition status = ASC_acceptContextsWithPreferredTransferSyntaxes(assoc->params, verification, 1, transferSyntaxes, transferSyntaxCount);
+    if (status.good())
+    {
+        status = ASC_acceptContextsWithPreferredTransferSyntaxes(assoc->params, dcmAllStorageSOPClassUIDs, numberOfDcmAllStorageSOPClassUIDs,
+                                                                 transferSyntaxes, transferSyntaxCount);
+    }
+    if (status.good())
+    {
+        acceptUnknownContexts(assoc->params, transferSyntaxes, transferSyntaxCount);
+    }
+    if (status.bad() || ASC_countAcceptedPresentationContexts(assoc->params) == 0)
+    {
+        T_ASC_RejectParameters reject = {ASC_RESULT_REJECTEDPERMANENT, ASC_SOURCE_SERVICEUSER, ASC_REASON_SU_NOREASON};
+        ASC_rejectAssociation(assoc, &reject);
+        return false;
+    }
+    return ASC_acknowledgeAssociation(assoc).good();
+}
+
+static void storeCallback(void *callbackData, T_DIMSE_StoreProgress *progress, T_DIMSE_C_StoreRQ *request, char * /*imageFileName*/,
+                          DcmDataset **imageDataSet, T_DIMSE_C_StoreRSP *response, DcmDataset ** /*statusDetail*/)
+{
+    if (progress->state != DIMSE_StoreEnd)
+    {
+        return;
+    }
+    StoreCallbackData *data = (StoreCallbackData *)callbackData;
+    if (imageDataSet == nullptr || *imageDataSet == nullptr || response->DimseStatus != STATUS_Success)
+    {
+        return;
+    }
+    char sopClass[128];
+    char sopInstance[128];
+    if (!DU_findSOPClassAndInstanceInDataSet(*imageDataSet, sopClass, sizeof(sopClass), sopInstance, sizeof(sopInstance))
+        || strcmp(sopClass, request->AffectedSOPClassUID) != 0 || strcmp(sopInstance, request->AffectedSOPInstanceUID) != 0)
+    {
+        response->DimseStatus = STATUS_STORE_Error_DataSetDoesNotMatchSOPClass;
+        return;
+    }
+
+    // Same meta information that storescp writes into the received files
+    E_TransferSyntax xfer = (*imageDataSet)->getOriginalXfer();
+    data->file->getMetaInfo()->putAndInsertString(DCM_SourceApplicationEntityTitle, data->info->callingAET.c_str());
+    data->file->validateMetaInfo(xfer);
+
+    std::string filename = std::string(dcmSOPClassUIDToModality(request->AffectedSOPClassUID, "UNKNOWN")) + "." + request->AffectedSOPInstanceUID;
+    // The response is only sent after the handler has returned, so the sender gets the success
+    // status only once the file and its .tags file are in place. Files that cannot be processed
+    // are kept in the error folder, as with storescp.
+    data->result = (*data->handler)(data->worker, *data->file, filename, *data->info);
+    if (data->result == RECEIVED_FILE_REFUSED || data->result == RECEIVED_FILE_NOT_DURABLE)
+    {
+        // Tells the sender to retry the instance later. The status depends only on the flush of the
+        // instance's own files, as concurrent workers wait for the group commit that covers them.
+        response->DimseStatus = STATUS_STORE_Refused_OutOfResources;
+    }
+}
+
+static OFCondition storeInstance(T_ASC_Association *assoc, T_DIMSE_Message &message, T_ASC_PresentationContextID presentationID,
+                                 StoreCallbackData &callbackData)
+{
+    DcmFileFormat file;
+    DcmDataset *dataset = file.getDataset();
+    callbackData.file = &file;
+    callbackData.result = 0;
+    OFCondition status = DIMSE_storeProvider(assoc, presentationID, &message.msg.CStoreRQ, nullptr, OFTrue, &dataset,
+                                             storeCallback, &callbackData, DIMSE_NONBLOCKING, DIMSE_TIMEOUT);
+    callbackData.file = nullptr;
+    return status;
+}
+
+static void serveAssociation(T_ASC_Association *assoc, int worker, const ReceivedFileHandler &handler)
+{
+    char callingAET[64] = "";
+    char calledAET[64] = "";
+    char callingAddress[128] = "";
+    char calledAddress[128] = "";
+    ASC_getAPTitles(assoc->params, callingAET, sizeof(callingAET), calledAET, sizeof(calledAET), nullptr, 0);
+    ASC_getPresentationAddresses(assoc->params, callingAddress, sizeof(callingAddress), calledAddress, sizeof(calledAddress));
+    AssociationInfo info;
+    info.peerAddress = callingAddress;
+    info.callingAET = callingAET;
+    info.calledAET = calledAET;
+
+    StoreCallbackData callbackData = {&handler, worker, &info, nullptr, 0};
+    int received = 0;
+    int failed = 0;
+    while (true)
+    {
+        T_ASC_PresentationContextID presentationID;
+        T_DIMSE_Message message;
+        OFCondition status = DIMSE_receiveCommand(assoc, DIMSE_NONBLOCKING, DIMSE_TIMEOUT, &presentationID, &message, nullptr);
+        if (status == DUL_PEERREQUESTEDRELEASE)
+        {
+            ASC_acknowledgeRelease(assoc);
+            break;
+        }
+        if (status == DUL_PEERABORTEDASSOCIATION)
+        {
+            break;
+        }
+        if (status.good() && message.CommandField == DIMSE_C_ECHO_RQ)
+        {
+            status = DIMSE_sendEchoResponse(assoc, presentationID, &message.msg.CEchoRQ, STATUS_Success, nullptr);
+        }
+        else if (status.good() && message.CommandField == DIMSE_C_STORE_RQ)
+        {
+            status = storeInstance(assoc, message, presentationID, callbackData);
+            received++;
+            failed += (callbackData.result != 0) ? 1 : 0;
+        }
+        else if (status.good())
+        {
+            std::cout << "ERROR: Unsupported DIMSE command " << message.CommandField << " from " << info.callingAET << std::endl;
+            status = DIMSE_BADCOMMANDTYPE;
+        }
+        if (status.bad())
+        {
+            std::cout << "ERROR: Aborting association from " << info.callingAET << " (" << info.peerAddress << "). " << status.text() << std::endl;
+            ASC_abortAssociation(assoc);
+            break;
+        }
+    }
+    std::cout << "Association from " << info.callingAET << " (" << info.peerAddress << ") closed after " << received
+              << " instances, " << failed << " failed" << std::endl;
+    ASC_dropSCPAssociation(assoc);
+    ASC_destroyAssociation(&assoc);
+}
+
+int runStorageSCP(const StorageSCPOptions &options, ReceivedFileHandler handler)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    T_ASC_Network *network = nullptr;
+    OFCondition status = ASC_initializeNetwork(NET_ACCEPTOR, options.port, ACSE_TIMEOUT, &network);
+    if (status.bad())
+    {
+        std::cout << "ERROR: Unable to listen on port " << options.port << ". " << status.text() << std::endl;
+        return 1;
+    }
+
+    bool useTLS = !options.tlsKeyFile.empty();
+    if (useTLS)
+    {
+#ifdef WITH_OPENSSL
+        DcmTLSTransportLayer *layer = createTLSLayer(options);
+        if (layer == nullptr || ASC_setTransportLayer(network, layer, 1).bad())
+        {
+            ASC_dropNetwork(&network);
+            return 1;
+        }
+#else
+        std::cout << "ERROR: DCMTK has been built without TLS support" << std::endl;
+        ASC_dropNetwork(&network);
+        return 1;
+#endif
+    }
+
+    int threads = (options.threads < 1) ? 1 : options.threads;
+    std::cout << "Listening on port " << options.port << (useTLS ? " with TLS" : "") << " using " << threads << " threads" << std::endl;
+    WorkStealingPool pool(threads);
+    while (true)
+    {
+        T_ASC_Association *assoc = nullptr;
+        status = ASC_receiveAssociation(network, &assoc, ASC_DEFAULTMAXPDU, nullptr, nullptr, useTLS ? OFTrue : OFFalse);
+        if (status.bad())
+        {
+            // E.g., a TLS handshake failure or a port scan. The next peer is not affected.
+            std::cout << "WARNING: Unable to receive association. " << status.text() << std::endl;
+            if (assoc != nullptr)
+            {
+                ASC_dropAssociation(assoc);
+                ASC_destroyAssociation(&assoc);
+            }
+            continue;
+        }
+        if (!negotiateAssociation(assoc, options))
+        {
+            ASC_dropAssociation(assoc);
+            ASC_destroyAssociation(&assoc);
+            continue;
+        }
+        pool.submit([assoc, &handler](int worker) {
+            serveAssociation(assoc, worker, handler);
+        });
+    }
+}
+
+bool saveReceivedFile(DcmFileFormat &file, const std::string &target)
+{
+    size_t slashPos = target.rfind('/');
+    std::string tempFile = (slashPos == std::string::npos) ? ".receiving." + target
+                                                           : target.substr(0, slashPos + 1) + ".receiving." + target.substr(slashPos + 1);
+    E_TransferSyntax xfer = file.getDataset()->getOriginalXfer();
+    OFCondition status = file.saveFile(tempFile.c_str(), xfer, EET_ExplicitLength, EGL_recalcGL, EPD_noChange, 0, 0, EWM_fileformat);
+    if (status.bad() || rename(tempFile.c_str(), target.c_str()) != 0)
+    {
+        std::cout << "ERROR: Unable to write received file " << target << ". " << status.text() << std::endl;
+        remove(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
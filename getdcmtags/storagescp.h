@@ -0,0 +1,52 @@
+#ifndef GETDCMTAGS_STORAGESCP_H
+#define GETDCMTAGS_STORAGESCP_H
+
+#include <functional>
+#include <string>
+
+class DcmFileFormat;
+
+struct StorageSCPOptions
+{
+    int port = 11112;
+    // Accept the compressed transfer syntaxes as well (storescp +xa)
+    bool acceptCompressed = false;
+    // Number of associations that are served concurrently
+    int threads = 1;
+    // TLS is used if the key file is set (storescp +tls key cert +cf ca)
+    std::string tlsKeyFile;
+    std::string tlsCertificateFile;
+    std::string tlsCACertificateFile;
+};
+
+struct AssociationInfo
+{
+    std::string peerAddress;
+    std::string callingAET;
+    std::string calledAET;
+};
+
+// Result of the handler if the instance has not been stored because the receiver is saturated
+#define RECEIVED_FILE_REFUSED 2
+// Result of the handler if the files of the instance could not be flushed to disk
+#define RECEIVED_FILE_NOT_DURABLE 3
+
+// Processes one received instance. The file name has the form that storescp +uf uses
+// (modality prefix and SOPInstanceUID). Returns 0 if the instance has been processed, 1 if it
+// has been moved to the error folder, RECEIVED_FILE_REFUSED or RECEIVED_FILE_NOT_DURABLE.
+// Called concurrently from the worker threads.
+typedef std::function<int(int worker, DcmFileFormat &file, const std::string &filename, const AssociationInfo &info)>
+    ReceivedFileHandler;
+
+// Accepts DICOM associations on the port and hands every instance received with C-STORE to the
+// handler while it is still in memory, so that no temporary file has to be written and read
+// again. Associations are negotiated on the calling thread and then served by a pool of worker
+// threads. Only returns if the network cannot be initialized.
+int runStorageSCP(const StorageSCPOptions &options, ReceivedFileHandler handler);
+
+// Writes a received instance with the transfer syntax it has been received in. The content is
+// written to a temporary file in the target folder first, so that the target never exists with
+// partial content.
+bool saveReceivedFile(DcmFileFormat &file, const std::string &target);
+
+#endif
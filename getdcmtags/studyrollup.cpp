@@ -0,0 +1,477 @@
+#include "studyrollup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <set>
+#include <thread>
+
+// Version 1 of the layout
+static const char ROLLUP_MAGIC[8] = {'M', 'S', 'T', 'U', 'D', 'Y', 'R', '1'};
+
+// New generation when one of the tables is filled to 3/4, to keep the probe sequences short
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+
+struct RollupHeader
+{
+    char magic[8];
+    uint64_t studyCapacity;
+    uint64_t seriesCapacity;
+    std::atomic<uint64_t> studyCount;
+    std::atomic<uint64_t> seriesCount;
+    char reserved[24];
+};
+
+struct StudySlot
+{
+    // 0 while the slot is empty
+    std::atomic<uint64_t> hash;
+    // Set once the UID has been written
+    std::atomic<uint32_t> ready;
+    // Index + 1 of the most recently added series of the study, 0 if none
+    std::atomic<uint32_t> seriesHead;
+    std::atomic<uint32_t> seriesCount;
+    uint32_t reserved0;
+    std::atomic<uint64_t> instances;
+    std::atomic<uint64_t> firstArrival;
+    std::atomic<uint64_t> lastArrival;
+    char uid[STUDY_ROLLUP_UID_SIZE];
+    char reserved[8];
+};
+
+struct SeriesSlot
+{
+    std::atomic<uint64_t> hash;
+    std::atomic<uint32_t> ready;
+    // Index + 1 of the next series of the same study, 0 at the end of the list
+    std::atomic<uint32_t> next;
+    // Index of the study slot
+    uint32_t study;
+    uint32_t reserved0;
+    std::atomic<uint64_t> instances;
+    std::atomic<uint64_t> firstArrival;
+    std::atomic<uint64_t> lastArrival;
+    char uid[STUDY_ROLLUP_UID_SIZE];
+    char modality[STUDY_ROLLUP_MODALITY_SIZE];
+    char reserved[16];
+};
+
+static_assert(sizeof(RollupHeader) == 64, "Unexpected size of the rollup header");
+static_assert(sizeof(StudySlot) == 128, "Unexpected size of the study slot");
+static_assert(sizeof(SeriesSlot) == 160, "Unexpected size of the series slot");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared rollup requires lock-free atomics");
+
+// FNV-1a followed by the splitmix64 finalizer, as in the instance index. Never returns 0.
+static uint64_t hashUID(const std::string &value)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : value)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash == 0 ? 1 : hash;
+}
+
+static RollupHeader *header(void *map)
+{
+    return (RollupHeader *)map;
+}
+
+static StudySlot *studySlots(void *map)
+{
+    return (StudySlot *)((char *)map + sizeof(RollupHeader));
+}
+
+static SeriesSlot *seriesSlots(void *map)
+{
+    return (SeriesSlot *)((char *)map + sizeof(RollupHeader) + header(map)->studyCapacity * sizeof(StudySlot));
+}
+
+static size_t tableSize(uint64_t studyCapacity, uint64_t seriesCapacity)
+{
+    return sizeof(RollupHeader) + studyCapacity * sizeof(StudySlot) + seriesCapacity * sizeof(SeriesSlot);
+}
+
+// Waits until a concurrent writer has published a claimed slot
+template <typename Slot> static bool waitForReady(Slot &slot)
+{
+    bool ready = slot.ready.load(std::memory_order_acquire) != 0;
+    for (int i = 0; !ready && i < 1000; i++)
+    {
+        std::this_thread::yield();
+        ready = slot.ready.load(std::memory_order_acquire) != 0;
+    }
+    return ready;
+}
+
+// Returns the index of the slot with the UID, or -1 if it is not found. If claim is set and the
+// UID is not found, a slot is claimed for it and returned with inserted set; the caller fills it
+// and sets the ready flag. Returns -1 if the table is full.
+template <typename Slot>
+static int64_t probe(Slot *table, uint64_t capacity, const std::string &uid, bool claim, bool &inserted)
+{
+    inserted = false;
+    uint64_t hash = hashUID(uid);
+    for (uint64_t i = 0; i < capacity; i++)
+    {
+        uint64_t index = (hash + i) % capacity;
+        Slot &slot = table[index];
+        uint64_t current = slot.hash.load(std::memory_order_acquire);
+        if (current == 0)
+        {
+            if (!claim)
+            {
+                return -1;
+            }
+            uint64_t expected = 0;
+            if (slot.hash.compare_exchange_strong(expected, hash, std::memory_order_acq_rel))
+            {
+                inserted = true;
+                return index;
+            }
+            current = expected;
+        }
+        if (current == hash && waitForReady(slot) && strncmp(slot.uid, uid.c_str(), STUDY_ROLLUP_UID_SIZE) == 0)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static void updateMinimum(std::atomic<uint64_t> &value, uint64_t candidate)
+{
+    uint64_t current = value.load(std::memory_order_relaxed);
+    while ((current == 0 || candidate < current)
+           && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed))
+    {
+    }
+}
+
+static void updateMaximum(std::atomic<uint64_t> &value, uint64_t candidate)
+{
+    uint64_t current = value.load(std::memory_order_relaxed);
+    while (candidate > current && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed))
+    {
+    }
+}
+
+static void copyField(char *target, size_t size, const std::string &value)
+{
+    memset(target, 0, size);
+    memcpy(target, value.data(), std::min(value.size(), size - 1));
+}
+
+static std::string readField(const char *value, size_t size)
+{
+    return std::string(value, strnlen(value, size));
+}
+
+// Adds the series of the study in the mapped table to the rollup, merging series that are also
+// listed in the other generation
+static bool readStudy(void *map, const std::string &studyUID, StudyRollup &study)
+{
+    if (map == nullptr)
+    {
+        return false;
+    }
+    bool inserted;
+    int64_t studyIndex = probe(studySlots(map), header(map)->studyCapacity, studyUID, false, inserted);
+    if (studyIndex < 0)
+    {
+        return false;
+    }
+    StudySlot &slot = studySlots(map)[studyIndex];
+    study.instances += slot.instances.load(std::memory_order_relaxed);
+    uint64_t first = slot.firstArrival.load(std::memory_order_relaxed);
+    if (first != 0 && (study.firstArrival == 0 || first < study.firstArrival))
+    {
+        study.firstArrival = first;
+    }
+    study.lastArrival = std::max(study.lastArrival, slot.lastArrival.load(std::memory_order_relaxed));
+
+    SeriesSlot *series = seriesSlots(map);
+    uint64_t seriesCapacity = header(map)->seriesCapacity;
+    uint32_t next = slot.seriesHead.load(std::memory_order_acquire);
+    // The capacity bounds the walk in case the file has been damaged
+    for (uint64_t i = 0; next != 0 && next <= seriesCapacity && i < seriesCapacity; i++)
+    {
+        SeriesSlot &entry = series[next - 1];
+        next = entry.next.load(std::memory_order_acquire);
+        std::string seriesUID = readField(entry.uid, sizeof(entry.uid));
+        auto existing = std::find_if(study.series.begin(), study.series.end(),
+                                     [&](const SeriesRollup &value) { return value.seriesUID == seriesUID; });
+        if (existing == study.series.end())
+        {
+            SeriesRollup added;
+            added.seriesUID = seriesUID;
+            added.modality = readField(entry.modality, sizeof(entry.modality));
+            study.series.push_back(added);
+            existing = study.series.end() - 1;
+        }
+        existing->instances += entry.instances.load(std::memory_order_relaxed);
+        first = entry.firstArrival.load(std::memory_order_relaxed);
+        if (first != 0 && (existing->firstArrival == 0 || first < existing->firstArrival))
+        {
+            existing->firstArrival = first;
+        }
+        existing->lastArrival = std::max(existing->lastArrival, entry.lastArrival.load(std::memory_order_relaxed));
+    }
+    return true;
+}
+
+StudyRollupIndex::~StudyRollupIndex()
+{
+    unmapTable(current);
+    unmapTable(previous);
+}
+
+bool StudyRollupIndex::open(const std::string &folder)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string newFilename = folder + STUDY_ROLLUP_FILE;
+    if (newFilename == filename && current.map != nullptr)
+    {
+        return refresh();
+    }
+    unmapTable(current);
+    unmapTable(previous);
+    filename = newFilename;
+    return refresh();
+}
+
+void StudyRollupIndex::unmapTable(Table &table)
+{
+    if (table.map != nullptr)
+    {
+        munmap(table.map, table.mapSize);
+    }
+    table = Table();
+}
+
+bool StudyRollupIndex::mapTable(const std::string &name, Table &table, bool create)
+{
+    int fd = ::open(name.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0)
+    {
+        if (create)
+        {
+            std::cout << "ERROR: Unable to open study rollup " << name << ". " << strerror(errno) << std::endl;
+        }
+        return false;
+    }
+    // The lock is only needed while a new file is initialized
+    flock(fd, LOCK_EX);
+    struct stat info;
+    bool success = fstat(fd, &info) == 0;
+    if (success && info.st_size == 0 && create)
+    {
+        RollupHeader initial = {};
+        memcpy(initial.magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC));
+        initial.studyCapacity = STUDY_ROLLUP_STUDIES;
+        initial.seriesCapacity = STUDY_ROLLUP_SERIES;
+        // The file is sparse, so only the used slots occupy disk space
+        success = ftruncate(fd, tableSize(STUDY_ROLLUP_STUDIES, STUDY_ROLLUP_SERIES)) == 0
+                  && pwrite(fd, &initial, sizeof(initial), 0) == (ssize_t)sizeof(initial) && fstat(fd, &info) == 0;
+    }
+    RollupHeader existing;
+    success = success && pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing)
+              && memcmp(existing.magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC)) == 0 && existing.studyCapacity > 0
+              && existing.seriesCapacity > 0 && existing.seriesCapacity < UINT32_MAX
+              && (uint64_t)info.st_size == tableSize(existing.studyCapacity, existing.seriesCapacity);
+    flock(fd, LOCK_UN);
+    if (!success)
+    {
+        std::cout << "ERROR: Invalid study rollup " << name << std::endl;
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        std::cout << "ERROR: Unable to map study rollup " << name << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    table.map = map;
+    table.mapSize = info.st_size;
+    table.inode = info.st_ino;
+    return true;
+}
+
+// Maps the tables again if another process has started a new generation since they were mapped
+bool StudyRollupIndex::refresh()
+{
+    struct stat info;
+    if (current.map != nullptr && stat(filename.c_str(), &info) == 0 && info.st_ino == current.inode)
+    {
+        return true;
+    }
+    unmapTable(current);
+    unmapTable(previous);
+    mapTable(filename + ".old", previous, false);
+    return mapTable(filename, current, true);
+}
+
+// Starts a new generation. The lock file serializes processes that find a table full at the
+// same time, so that only one of them renames it.
+bool StudyRollupIndex::rotate()
+{
+    std::string lockName = filename + ".lock";
+    int lockFd = ::open(lockName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lockFd < 0)
+    {
+        std::cout << "ERROR: Unable to lock study rollup " << lockName << std::endl;
+        return false;
+    }
+    flock(lockFd, LOCK_EX);
+    struct stat info;
+    if (stat(filename.c_str(), &info) == 0 && info.st_ino == current.inode)
+    {
+        rename(filename.c_str(), (filename + ".old").c_str());
+    }
+    bool success = refresh();
+    flock(lockFd, LOCK_UN);
+    close(lockFd);
+    return success;
+}
+
+bool StudyRollupIndex::add(const std::string &studyUID, const std::string &seriesUID, const std::string &modality,
+                           uint64_t arrival)
+{
+    if (studyUID.empty() || seriesUID.empty() || studyUID.size() >= STUDY_ROLLUP_UID_SIZE
+        || seriesUID.size() >= STUDY_ROLLUP_UID_SIZE)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!refresh())
+    {
+        return false;
+    }
+    RollupHeader *tableHeader = header(current.map);
+    if ((tableHeader->studyCount.load(std::memory_order_relaxed) * MAX_LOAD_DENOMINATOR
+             >= tableHeader->studyCapacity * MAX_LOAD_NUMERATOR
+         || tableHeader->seriesCount.load(std::memory_order_relaxed) * MAX_LOAD_DENOMINATOR
+                >= tableHeader->seriesCapacity * MAX_LOAD_NUMERATOR)
+        && !rotate())
+    {
+        return false;
+    }
+    tableHeader = header(current.map);
+
+    bool inserted;
+    StudySlot *studies = studySlots(current.map);
+    int64_t studyIndex = probe(studies, tableHeader->studyCapacity, studyUID, true, inserted);
+    if (studyIndex < 0)
+    {
+        std::cout << "ERROR: Study rollup " << filename << " is full" << std::endl;
+        return false;
+    }
+    StudySlot &study = studies[studyIndex];
+    if (inserted)
+    {
+        copyField(study.uid, sizeof(study.uid), studyUID);
+        study.ready.store(1, std::memory_order_release);
+        tableHeader->studyCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    SeriesSlot *series = seriesSlots(current.map);
+    int64_t seriesIndex = probe(series, tableHeader->seriesCapacity, seriesUID, true, inserted);
+    if (seriesIndex < 0)
+    {
+        std::cout << "ERROR: Study rollup " << filename << " is full" << std::endl;
+        return false;
+    }
+    SeriesSlot &entry = series[seriesIndex];
+    if (inserted)
+    {
+        entry.study = (uint32_t)studyIndex;
+        copyField(entry.uid, sizeof(entry.uid), seriesUID);
+        copyField(entry.modality, sizeof(entry.modality), modality);
+        entry.ready.store(1, std::memory_order_release);
+        tableHeader->seriesCount.fetch_add(1, std::memory_order_relaxed);
+        // Pushes the series onto the list of the study
+        uint32_t head = study.seriesHead.load(std::memory_order_acquire);
+        do
+        {
+            entry.next.store(head, std::memory_order_relaxed);
+        } while (!study.seriesHead.compare_exchange_weak(head, (uint32_t)seriesIndex + 1, std::memory_order_acq_rel));
+        study.seriesCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    entry.instances.fetch_add(1, std::memory_order_relaxed);
+    updateMinimum(entry.firstArrival, arrival);
+    updateMaximum(entry.lastArrival, arrival);
+    study.instances.fetch_add(1, std::memory_order_relaxed);
+    updateMinimum(study.firstArrival, arrival);
+    updateMaximum(study.lastArrival, arrival);
+    return true;
+}
+
+bool StudyRollupIndex::read(const std::string &studyUID, StudyRollup &study)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    study = StudyRollup();
+    study.studyUID = studyUID;
+    if (!refresh())
+    {
+        return false;
+    }
+    bool found = readStudy(previous.map, studyUID, study);
+    found = readStudy(current.map, studyUID, study) || found;
+    // The lists of the studies start with the most recently added series
+    std::stable_sort(study.series.begin(), study.series.end(), [](const SeriesRollup &a, const SeriesRollup &b) {
+        return a.firstArrival < b.firstArrival;
+    });
+    return found;
+}
+
+std::vector<StudyRollup> StudyRollupIndex::readAll()
+{
+    std::set<std::string> studyUIDs;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!refresh())
+        {
+            return {};
+        }
+        for (void *map : {previous.map, current.map})
+        {
+            if (map == nullptr)
+            {
+                continue;
+            }
+            StudySlot *studies = studySlots(map);
+            for (uint64_t i = 0; i < header(map)->studyCapacity; i++)
+            {
+                if (studies[i].ready.load(std::memory_order_acquire) != 0)
+                {
+                    studyUIDs.insert(readField(studies[i].uid, sizeof(studies[i].uid)));
+                }
+            }
+        }
+    }
+    std::vector<StudyRollup> result;
+    for (const std::string &studyUID : studyUIDs)
+    {
+        StudyRollup study;
+        if (read(studyUID, study))
+        {
+            result.push_back(study);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,90 @@
+#ifndef GETDCMTAGS_STUDYROLLUP_H
+#define GETDCMTAGS_STUDYROLLUP_H
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Name of the rollup in the incoming folder. The previous generation is kept with the suffix ".old".
+#define STUDY_ROLLUP_FILE ".study_rollup"
+
+// Number of slots of a new generation (128 bytes per study and 160 bytes per series, sparse file)
+#define STUDY_ROLLUP_STUDIES (1 << 16)
+#define STUDY_ROLLUP_SERIES (1 << 18)
+
+// UIDs are at most 64 characters long, longer values are not recorded
+#define STUDY_ROLLUP_UID_SIZE 72
+#define STUDY_ROLLUP_MODALITY_SIZE 24
+
+struct SeriesRollup
+{
+    std::string seriesUID;
+    std::string modality;
+    // Number of received instances, including instances that have been received more than once
+    uint64_t instances = 0;
+    // Unix time in ms
+    uint64_t firstArrival = 0;
+    uint64_t lastArrival = 0;
+};
+
+struct StudyRollup
+{
+    std::string studyUID;
+    uint64_t instances = 0;
+    uint64_t firstArrival = 0;
+    uint64_t lastArrival = 0;
+    std::vector<SeriesRollup> series;
+};
+
+// Composition of the studies received into the incoming folder, updated by all receiver processes
+// for every placed instance, so that the router can tell which series belong to a study and when
+// they arrived without opening the .tags files of every series folder. The memory-mapped file
+// holds two open-addressing hash tables: one slot per study, and one slot per series that links to
+// its study and to the next series of the same study. Slots are claimed with compare-and-swap and
+// published with a ready flag once their UIDs have been written, and the counters and arrival
+// times are updated atomically, so concurrent processes need no locks. Like the instance index,
+// a full table is renamed to ".old" and a new generation is started; readers merge both.
+// The layout is read by app/routing/study_rollup.py.
+class StudyRollupIndex
+{
+public:
+    StudyRollupIndex() = default;
+    StudyRollupIndex(const StudyRollupIndex &) = delete;
+    StudyRollupIndex &operator=(const StudyRollupIndex &) = delete;
+    ~StudyRollupIndex();
+
+    // Opens the rollup in the folder, creating it if needed
+    bool open(const std::string &folder);
+
+    // Records an instance of the series that has arrived at the given time (unix time in ms)
+    bool add(const std::string &studyUID, const std::string &seriesUID, const std::string &modality, uint64_t arrival);
+
+    // Reads the rollup of the study from both generations. Returns false if the study is unknown.
+    bool read(const std::string &studyUID, StudyRollup &study);
+
+    // Reads the rollups of all studies from both generations
+    std::vector<StudyRollup> readAll();
+
+private:
+    struct Table
+    {
+        void *map = nullptr;
+        size_t mapSize = 0;
+        ino_t inode = 0;
+    };
+
+    bool refresh();
+    bool mapTable(const std::string &filename, Table &table, bool create);
+    void unmapTable(Table &table);
+    bool rotate();
+
+    std::mutex mutex;
+    std::string filename;
+    Table current;
+    Table previous;
+};
+
+#endif
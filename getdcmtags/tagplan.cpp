@@ -0,0 +1,358 @@
+#include "tagplan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "dcmtk/dcmdata/dcdict.h"
+#include "dcmtk/dcmdata/dcuid.h"
+
+// Version 1 of the layout
+static const char PLAN_MAGIC[8] = {'M', 'T', 'A', 'G', 'P', 'L', 'N', '1'};
+
+// The plan consists of the header, the entries, the sorted keys and the zero-terminated names.
+// It is only read by the machine that has written it, so the native byte order is used.
+struct PlanHeader
+{
+    char magic[8];
+    // The names and VRs come from the dictionary of the DCMTK version that compiled the plan
+    uint32_t dcmtkVersion;
+    uint32_t count;
+    uint64_t sourceSize;
+    uint64_t sourceChecksum;
+    uint64_t bodyChecksum;
+    uint32_t lastKey;
+    uint32_t size;
+};
+
+struct PlanEntry
+{
+    uint16_t group;
+    uint16_t element;
+    // Offset of the name in the name table
+    uint32_t name;
+    char vr[4];
+};
+
+static_assert(sizeof(PlanHeader) == 48, "Unexpected size of the plan header");
+static_assert(sizeof(PlanEntry) == 12, "Unexpected size of the plan entry");
+
+// FNV-1a
+static uint64_t checksum(const char *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool readTextFile(const std::string &filename, std::string &text)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    text.clear();
+    char chunk[4096];
+    ssize_t count;
+    while ((count = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        text.append(chunk, count);
+    }
+    close(fd);
+    return count == 0;
+}
+
+static DcmTagKey parseTagKey(const char *tagName)
+{
+    unsigned int group = 0xffff;
+    unsigned int elem = 0xffff;
+    if (sscanf(tagName, "%x,%x", &group, &elem) != 2)
+    {
+        DcmTagKey tagKey;
+        /* it is a name */
+        const DcmDataDictionary &globalDataDict = dcmDataDict.rdlock();
+        const DcmDictEntry *dicent = globalDataDict.findEntry(tagName);
+        if (dicent == NULL) {
+            tagKey = DCM_UndefinedTagKey;
+        } else {
+            tagKey = dicent->getKey();
+        }
+        dcmDataDict.rdunlock();
+        return tagKey;
+    } else     /* tag name has format "gggg,eeee" */
+    {
+        return DcmTagKey(OFstatic_cast(Uint16, group),OFstatic_cast(Uint16, elem));
+    }
+}
+
+// Returns true if the tag is part of the built-in tag set or has already been added to the plan
+static bool isKnownTag(Uint32 sortKey, const std::vector<PlanEntry> &entries)
+{
+    auto it = std::lower_bound(std::begin(main_tags_list), std::end(main_tags_list), sortKey,
+        [](const TagDescriptor &tag, Uint32 value) { return tag.sortKey() < value; });
+    if (it != std::end(main_tags_list) && it->sortKey() == sortKey)
+    {
+        return true;
+    }
+    for (auto &entry : entries)
+    {
+        if ((((Uint32)entry.group << 16) | entry.element) == sortKey)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool compileTagPlan(const std::string &text, std::string &image)
+{
+    std::vector<PlanEntry> entries;
+    std::string names;
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        std::string line = text.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line[line.size() - 1] == '\r')
+        {
+            line.erase(line.size() - 1);
+        }
+
+        DcmTagKey key = parseTagKey(line.c_str());
+        if (key == DCM_UndefinedTagKey)
+        {
+            std::cout << "Unknown tag " << line << std::endl;
+            return false;
+        }
+        Uint32 sortKey = ((Uint32)key.getGroup() << 16) | key.getElement();
+        if (isKnownTag(sortKey, entries))
+        {
+            // Would otherwise result in duplicate keys in the .tags file
+            continue;
+        }
+        PlanEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.group = key.getGroup();
+        entry.element = key.getElement();
+        entry.name = names.size();
+        const char *vr = "UN";
+        const DcmDataDictionary &globalDataDict = dcmDataDict.rdlock();
+        const DcmDictEntry *dicent = globalDataDict.findEntry(key, NULL);
+        if (dicent == NULL) { // If it's not in the dictionary
+            names.append(key.toString().c_str());
+        } else {
+            names.append(dicent->getTagName());
+            vr = dicent->getVR().getVRName();
+        }
+        dcmDataDict.rdunlock();
+        names.push_back('\0');
+        strncpy(entry.vr, vr, sizeof(entry.vr) - 1);
+        entries.push_back(entry);
+    }
+
+    std::vector<uint32_t> keys;
+    for (auto &entry : entries)
+    {
+        keys.push_back(((uint32_t)entry.group << 16) | entry.element);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    PlanHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PLAN_MAGIC, sizeof(PLAN_MAGIC));
+    header.dcmtkVersion = OFFIS_DCMTK_VERSION_NUMBER;
+    header.count = entries.size();
+    header.sourceSize = text.size();
+    header.sourceChecksum = checksum(text.data(), text.size());
+    header.lastKey = keys.empty() ? 0 : keys.back();
+    header.size = sizeof(PlanHeader) + entries.size() * (sizeof(PlanEntry) + sizeof(uint32_t)) + names.size();
+
+    image.clear();
+    image.reserve(header.size);
+    image.append((const char *)&header, sizeof(header));
+    image.append((const char *)entries.data(), entries.size() * sizeof(PlanEntry));
+    image.append((const char *)keys.data(), keys.size() * sizeof(uint32_t));
+    image.append(names);
+    PlanHeader *stored = (PlanHeader *)&image[0];
+    stored->bodyChecksum = checksum(image.data() + sizeof(PlanHeader), image.size() - sizeof(PlanHeader));
+    return true;
+}
+
+static bool writePlanFile(const std::string &planFile, const std::string &image)
+{
+    // Concurrent receiver processes may rebuild the plan at the same time, so each one writes its
+    // own temporary file and the rename decides which one remains
+    std::string temp = planFile + ".tmp." + std::to_string(getpid());
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool success = write(fd, image.data(), image.size()) == (ssize_t)image.size();
+    success = (close(fd) == 0) && success;
+    if (!success || rename(temp.c_str(), planFile.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool writeTagPlan(const std::string &source, const std::string &planFile)
+{
+    std::string text;
+    if (!readTextFile(source, text))
+    {
+        std::cout << "ERROR: Unable to read " << source << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::string image;
+    if (!compileTagPlan(text, image))
+    {
+        std::cout << "ERROR: Unable to compile tag plan from " << source << std::endl;
+        return false;
+    }
+    if (!writePlanFile(planFile, image))
+    {
+        std::cout << "ERROR: Unable to write tag plan " << planFile << ". " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::cout << "Compiled " << ((const PlanHeader *)image.data())->count << " extra tags into " << planFile << std::endl;
+    return true;
+}
+
+TagPlan::~TagPlan()
+{
+    release();
+}
+
+void TagPlan::release()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, mapSize);
+    }
+    mapping = nullptr;
+    mapSize = 0;
+    buffer.clear();
+    descriptors.clear();
+    keys = nullptr;
+    last = 0;
+}
+
+// Checks the plan and sets up the descriptors. The data must remain valid while the plan is used.
+bool TagPlan::use(const char *data, size_t size, const std::string &text)
+{
+    if (size < sizeof(PlanHeader))
+    {
+        return false;
+    }
+    const PlanHeader *header = (const PlanHeader *)data;
+    if (memcmp(header->magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) != 0 || header->size != size
+        || header->dcmtkVersion != OFFIS_DCMTK_VERSION_NUMBER)
+    {
+        return false;
+    }
+    // Rebuild if the configuration has changed since the plan was compiled
+    if (header->sourceSize != text.size() || header->sourceChecksum != checksum(text.data(), text.size()))
+    {
+        return false;
+    }
+    size_t tablesSize = (size_t)header->count * (sizeof(PlanEntry) + sizeof(uint32_t));
+    if (tablesSize > size - sizeof(PlanHeader)
+        || header->bodyChecksum != checksum(data + sizeof(PlanHeader), size - sizeof(PlanHeader)))
+    {
+        return false;
+    }
+    const PlanEntry *entries = (const PlanEntry *)(data + sizeof(PlanHeader));
+    const char *names = data + sizeof(PlanHeader) + tablesSize;
+    size_t namesSize = size - sizeof(PlanHeader) - tablesSize;
+    if (header->count > 0 && (namesSize == 0 || names[namesSize - 1] != '\0'))
+    {
+        return false;
+    }
+    std::vector<TagDescriptor> result;
+    result.reserve(header->count);
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        if (entries[i].name >= namesSize || entries[i].vr[sizeof(entries[i].vr) - 1] != '\0')
+        {
+            return false;
+        }
+        result.push_back(TagDescriptor{entries[i].group, entries[i].element, names + entries[i].name, entries[i].vr});
+    }
+    descriptors.swap(result);
+    keys = (const uint32_t *)(data + sizeof(PlanHeader) + header->count * sizeof(PlanEntry));
+    last = header->lastKey;
+    return true;
+}
+
+bool TagPlan::mapFile(const std::string &planFile, const std::string &text)
+{
+    int fd = ::open(planFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(PlanHeader))
+    {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    if (!use((const char *)data, info.st_size, text))
+    {
+        munmap(data, info.st_size);
+        return false;
+    }
+    mapping = data;
+    mapSize = info.st_size;
+    return true;
+}
+
+bool TagPlan::load(const std::string &source)
+{
+    release();
+    std::string text;
+    if (!readTextFile(source, text))
+    {
+        std::cout << "Unable to read extra_tags file." << std::endl;
+        return false;
+    }
+    std::string planFile = source + TAG_PLAN_SUFFIX;
+    if (mapFile(planFile, text))
+    {
+        return true;
+    }
+    std::string image;
+    if (!compileTagPlan(text, image))
+    {
+        return false;
+    }
+    // Not an error if the plan cannot be written, the next invocation compiles it again
+    writePlanFile(planFile, image);
+    buffer.swap(image);
+    return use(buffer.data(), buffer.size(), text);
+}
@@ -0,0 +1,64 @@
+#ifndef GETDCMTAGS_TAGPLAN_H
+#define GETDCMTAGS_TAGPLAN_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tags_list.h"
+
+// Suffix of the compiled plan, which is stored next to the dcm_extra_tags file
+#define TAG_PLAN_SUFFIX ".plan"
+
+// The extra tags of a dcm_extra_tags file, resolved against the DICOM dictionary. The plan is
+// compiled once into a binary file (entries in the order of the configuration, sorted keys, name
+// table and the largest key), which later invocations map into memory instead of parsing the
+// text file and locking the dictionary. The plan stores a checksum of the source file and is
+// rebuilt automatically if the configured tags change.
+class TagPlan
+{
+public:
+    TagPlan() = default;
+    TagPlan(const TagPlan &) = delete;
+    TagPlan &operator=(const TagPlan &) = delete;
+    ~TagPlan();
+
+    // Maps the plan of the source file. If the plan is missing, damaged or has been compiled from
+    // a different source, it is compiled and written again. If the plan cannot be written (e.g.,
+    // read-only folder), the compiled plan is used from memory.
+    bool load(const std::string &source);
+
+    // Descriptors in the order of the source file. The names point into the plan.
+    const std::vector<TagDescriptor> &tags() const { return descriptors; }
+
+    // Keys of the tags in ascending order
+    const uint32_t *sortedKeys() const { return keys; }
+
+    // Largest key of the tags, or 0 if there are none
+    uint32_t lastKey() const { return last; }
+
+    // True if the plan has been mapped from the plan file instead of being compiled
+    bool mapped() const { return mapping != nullptr; }
+
+private:
+    bool mapFile(const std::string &planFile, const std::string &text);
+    bool use(const char *data, size_t size, const std::string &text);
+    void release();
+
+    void *mapping = nullptr;
+    size_t mapSize = 0;
+    std::string buffer;
+    std::vector<TagDescriptor> descriptors;
+    const uint32_t *keys = nullptr;
+    uint32_t last = 0;
+};
+
+// Compiles the content of a dcm_extra_tags file into the binary plan. Returns false if a line
+// does not name a known tag.
+bool compileTagPlan(const std::string &text, std::string &image);
+
+// Compiles the source file and replaces the plan file atomically. Used by receiver.sh after the
+// configuration has been written.
+bool writeTagPlan(const std::string &source, const std::string &planFile);
+
+#endif
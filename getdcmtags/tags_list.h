@@ -1,48 +1,75 @@
+#ifndef GETDCMTAGS_TAGS_LIST_H
+#define GETDCMTAGS_TAGS_LIST_H
+
 #include "dcmtk/dcmdata/dcdeftag.h"
 
-static auto main_tags_list = {
-    DCM_Modality,
-    DCM_BodyPartExamined,
-    DCM_ProtocolName,
-    DCM_SpecificCharacterSet,
-    DCM_Modality,
-    DCM_BodyPartExamined,
-    DCM_ProtocolName,
-    DCM_RetrieveAETitle,
-    DCM_StationAETitle,
-    DCM_Manufacturer,
-    DCM_ManufacturerModelName,
-    DCM_StudyDescription,
-    DCM_CodeValue,
-    DCM_CodeMeaning,
-    DCM_SeriesDescription,
-    DCM_PatientName,
-    DCM_PatientID,
-    DCM_PatientBirthDate,
-    DCM_PatientSex,
-    DCM_AccessionNumber,
-    DCM_ReferringPhysicianName,
-    DCM_StudyID,
-    DCM_SeriesNumber,
-    DCM_StudyInstanceUID,
-    DCM_SeriesDate,
-    DCM_SeriesTime,
-    DCM_AcquisitionDate,
-    DCM_AcquisitionTime,
-    DCM_SequenceName,
-    DCM_ScanningSequence,
-    DCM_SequenceVariant,
-    DCM_MagneticFieldStrength,
-    DCM_StationName,
-    DCM_DeviceSerialNumber,
-    DCM_DeviceUID,
-    DCM_SoftwareVersions,
-    DCM_ContrastBolusAgent,
-    DCM_ImageComments,
-    DCM_SliceThickness,
-    DCM_InstanceNumber,
-    DCM_AcquisitionNumber,
-    DCM_InstitutionName,
-    DCM_AcquisitionType,
-    DCM_ImageType,
+// Tag that is written into the .tags file. The name (DICOM keyword as used by the DCMTK
+// dictionary) and VR are known at compile time, so that no dictionary lookup is needed per file.
+struct TagDescriptor
+{
+    Uint16 group;
+    Uint16 element;
+    const char *name;
+    const char *vr;
+
+    DcmTagKey key() const { return DcmTagKey(group, element); }
+    constexpr Uint32 sortKey() const { return ((Uint32)group << 16) | element; }
+};
+
+// Built-in tags, sorted by key. SpecificCharacterSet, SeriesInstanceUID and SOPInstanceUID are
+// read and written separately.
+static constexpr TagDescriptor main_tags_list[] = {
+    {0x0008, 0x0008, "ImageType", "CS"},
+    {0x0008, 0x0021, "SeriesDate", "DA"},
+    {0x0008, 0x0022, "AcquisitionDate", "DA"},
+    {0x0008, 0x0031, "SeriesTime", "TM"},
+    {0x0008, 0x0032, "AcquisitionTime", "TM"},
+    {0x0008, 0x0050, "AccessionNumber", "SH"},
+    {0x0008, 0x0054, "RetrieveAETitle", "AE"},
+    {0x0008, 0x0055, "StationAETitle", "AE"},
+    {0x0008, 0x0060, "Modality", "CS"},
+    {0x0008, 0x0070, "Manufacturer", "LO"},
+    {0x0008, 0x0080, "InstitutionName", "LO"},
+    {0x0008, 0x0090, "ReferringPhysicianName", "PN"},
+    {0x0008, 0x0100, "CodeValue", "SH"},
+    {0x0008, 0x0104, "CodeMeaning", "LO"},
+    {0x0008, 0x1010, "StationName", "SH"},
+    {0x0008, 0x1030, "StudyDescription", "LO"},
+    {0x0008, 0x103E, "SeriesDescription", "LO"},
+    {0x0008, 0x1090, "ManufacturerModelName", "LO"},
+    {0x0010, 0x0010, "PatientName", "PN"},
+    {0x0010, 0x0020, "PatientID", "LO"},
+    {0x0010, 0x0030, "PatientBirthDate", "DA"},
+    {0x0010, 0x0040, "PatientSex", "CS"},
+    {0x0018, 0x0010, "ContrastBolusAgent", "LO"},
+    {0x0018, 0x0015, "BodyPartExamined", "CS"},
+    {0x0018, 0x0020, "ScanningSequence", "CS"},
+    {0x0018, 0x0021, "SequenceVariant", "CS"},
+    {0x0018, 0x0024, "SequenceName", "SH"},
+    {0x0018, 0x0050, "SliceThickness", "DS"},
+    {0x0018, 0x0087, "MagneticFieldStrength", "DS"},
+    {0x0018, 0x1000, "DeviceSerialNumber", "LO"},
+    {0x0018, 0x1002, "DeviceUID", "UI"},
+    {0x0018, 0x1020, "SoftwareVersions", "LO"},
+    {0x0018, 0x1030, "ProtocolName", "LO"},
+    {0x0018, 0x9302, "AcquisitionType", "CS"},
+    {0x0020, 0x000D, "StudyInstanceUID", "UI"},
+    {0x0020, 0x0010, "StudyID", "SH"},
+    {0x0020, 0x0011, "SeriesNumber", "IS"},
+    {0x0020, 0x0012, "AcquisitionNumber", "IS"},
+    {0x0020, 0x0013, "InstanceNumber", "IS"},
+    {0x0020, 0x4000, "ImageComments", "LT"},
 };
+
+// Read from the meta header instead of the dataset
+static constexpr TagDescriptor media_storage_sop_class_tag = {0x0002, 0x0002, "MediaStorageSOPClassUID", "UI"};
+
+constexpr bool isSortedAndUnique(const TagDescriptor *tags, size_t count)
+{
+    return count < 2 || (tags[0].sortKey() < tags[1].sortKey() && isSortedAndUnique(tags + 1, count - 1));
+}
+
+static_assert(isSortedAndUnique(main_tags_list, sizeof(main_tags_list) / sizeof(main_tags_list[0])),
+              "main_tags_list must be sorted by key and must not contain duplicates");
+
+#endif
@@ -0,0 +1,162 @@
+#include "tagswriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static inline bool needsEscaping(unsigned char c)
+{
+    return c == '"' || c == '\\' || c < 0x20;
+}
+
+static inline void appendEscapedChar(std::string &out, unsigned char c)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    char sequence[6] = {'\\', 'u', '0', '0', hexDigits[c >> 4], hexDigits[c & 0xF]};
+    out.append(sequence, sizeof(sequence));
+}
+
+void appendEscapedJSONScalar(std::string &out, const char *value, size_t length)
+{
+    size_t runStart = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)value[i];
+        if (needsEscaping(c))
+        {
+            out.append(value + runStart, i - runStart);
+            appendEscapedChar(out, c);
+            runStart = i + 1;
+        }
+    }
+    out.append(value + runStart, length - runStart);
+}
+
+void appendEscapedJSON(std::string &out, const char *value, size_t length)
+{
+    size_t pos = 0;
+    size_t runStart = 0;
+
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i controlMax = _mm256_set1_epi8(0x1F);
+    while (pos + 32 <= length)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(value + pos));
+        // Unsigned c <= 0x1F is equivalent to max(c, 0x1F) == 0x1F
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, controlMax), controlMax));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(special);
+        while (mask != 0)
+        {
+            size_t i = pos + __builtin_ctz(mask);
+            out.append(value + runStart, i - runStart);
+            appendEscapedChar(out, (unsigned char)value[i]);
+            runStart = i + 1;
+            mask &= mask - 1;
+        }
+        pos += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i quote16 = _mm_set1_epi8('"');
+    const __m128i backslash16 = _mm_set1_epi8('\\');
+    const __m128i controlMax16 = _mm_set1_epi8(0x1F);
+    while (pos + 16 <= length)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(value + pos));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote16), _mm_cmpeq_epi8(chunk, backslash16)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, controlMax16), controlMax16));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+        while (mask != 0)
+        {
+            size_t i = pos + __builtin_ctz(mask);
+            out.append(value + runStart, i - runStart);
+            appendEscapedChar(out, (unsigned char)value[i]);
+            runStart = i + 1;
+            mask &= mask - 1;
+        }
+        pos += 16;
+    }
+#endif
+
+    // Flush the clean run and handle the remaining bytes one by one
+    out.append(value + runStart, pos - runStart);
+    appendEscapedJSONScalar(out, value + pos, length - pos);
+}
+
+void TagsWriter::begin(bool collectFields)
+{
+    buffer.clear();
+    buffer.append("{\n");
+    this->collectFields = collectFields;
+    collectedFields.clear();
+    values.clear();
+}
+
+void TagsWriter::collectField(const char *name, const char *value, size_t length)
+{
+    collectedFields.push_back(Field{name, values.size(), length});
+    values.append(value, length);
+}
+
+void TagsWriter::addValue(const char *name, const char *value, size_t length)
+{
+    if (collectFields)
+    {
+        collectField(name, value, length);
+    }
+    buffer.push_back('"');
+    buffer.append(name);
+    buffer.append("\": \"");
+    appendEscapedJSON(buffer, value, length);
+    buffer.append("\",\n");
+}
+
+void TagsWriter::end(const char *lastName, const char *lastValue)
+{
+    if (collectFields)
+    {
+        collectField(lastName, lastValue, strlen(lastValue));
+    }
+    buffer.push_back('"');
+    buffer.append(lastName);
+    buffer.append("\": \"");
+    buffer.append(lastValue);
+    buffer.append("\"\n}\n");
+}
+
+bool TagsWriter::writeFile(const char *filename) const
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        return false;
+    }
+    const char *data = buffer.data();
+    size_t remaining = buffer.size();
+    while (remaining > 0)
+    {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        data += written;
+        remaining -= written;
+    }
+    return close(fd) == 0;
+}
@@ -0,0 +1,57 @@
+#ifndef GETDCMTAGS_TAGSWRITER_H
+#define GETDCMTAGS_TAGSWRITER_H
+
+#include <string>
+#include <vector>
+
+// Serializes the .tags file into one buffer that is reused across files, so that writing a
+// file needs neither per-value allocations nor stdio. The output matches the previous
+// fprintf-based format byte for byte.
+class TagsWriter
+{
+public:
+    // Unescaped tag value, as needed by the binary series index
+    struct Field
+    {
+        const char *name;
+        size_t valueOffset;
+        size_t valueLength;
+    };
+
+    // Starts a new document, keeping the capacity of the buffer. If collectFields is set, the
+    // unescaped values are kept as well (names must remain valid until the next call).
+    void begin(bool collectFields = false);
+
+    // Appends the line "name": "value", with the value escaped
+    void addValue(const char *name, const char *value, size_t length);
+    void addValue(const char *name, const std::string &value) { addValue(name, value.data(), value.size()); }
+
+    // Appends the last line "name": "value" without escaping the value, and closes the document
+    void end(const char *lastName, const char *lastValue);
+
+    // Writes the buffer into the file with a single write() call (repeated for partial writes)
+    bool writeFile(const char *filename) const;
+
+    const std::string &data() const { return buffer; }
+
+    const std::vector<Field> &fields() const { return collectedFields; }
+    std::string fieldValue(const Field &field) const { return values.substr(field.valueOffset, field.valueLength); }
+
+private:
+    void collectField(const char *name, const char *value, size_t length);
+
+    std::string buffer;
+    bool collectFields = false;
+    std::vector<Field> collectedFields;
+    std::string values;
+};
+
+// Appends the value to out, replacing '"', '\' and control characters with a \u00XX sequence.
+// Uses SSE2/AVX2 to skip over runs of characters that do not need escaping.
+void appendEscapedJSON(std::string &out, const char *value, size_t length);
+
+// Character-by-character version of appendEscapedJSON(), used for the tail of the value and
+// on platforms without SIMD support
+void appendEscapedJSONScalar(std::string &out, const char *value, size_t length);
+
+#endif
@@ -1,23 +1,39 @@
 #!/bin/bash
 set -euo pipefail
 
-echo "Testing"
-cp test_dcm test_dcm_copy
-./getdcmtags test_dcm_copy sender_address sender_aet receiver_aet 0.0.0.0 asdf --set-tag forceKey=forcedValue
+# SeriesInstanceUID of test_dcm
 uid="1.2.276.0.7230010.3.1.3.9022104837472469675953272569912339663578"
-if [ ! -e $uid/$uid#test_dcm_copy.tags ]; then
-    echo "Failed to create tags file"
-    exit 1
-fi
 
+# Prints the path under which getdcmtags places a received file (suffix dcm or tags)
+placed_file() {
+    local name="$1"
+    local suffix="$2"
+    echo "$uid/$uid#$name.$suffix"
+}
+
+copy_dcm=$(placed_file test_dcm_copy dcm)
+copy_tags=$(placed_file test_dcm_copy tags)
+
+# Receives a copy of test_dcm as test_dcm_copy. The arguments follow the receiver AET, i.e.,
+# bookkeeper address and token, then the options.
+run_case() {
+    cp test_dcm test_dcm_copy
+    ./getdcmtags test_dcm_copy sender_address sender_aet receiver_aet "$@"
+}
+
+# Removes the received copy, its series folder and the spool of undelivered bookkeeper events
+clean_case() {
+    rm -f test_dcm_copy
+    rm -rf $uid .bookkeeper
+}
 
 check_key() {
     local key="$1"
     local expected_value="$2"
-    local actual_value=$(jq -r ".$key // \"__NULL__\"" "$uid/$uid#test_dcm_copy.tags")
+    local actual_value=$(jq -r ".$key // \"__NULL__\"" "$copy_tags")
     
     if [ "$actual_value" == "__NULL__" ]; then
-        cat $uid/$uid#test_dcm_copy.tags
+        cat $copy_tags
         echo "Key '$key' not found in the JSON file."
         echo "Test failed"
         exit 1
@@ -25,13 +41,25 @@ check_key() {
         return
         # echo "Key '$key' matches expected value: $actual_value"
     else
-        cat $uid/$uid#test_dcm_copy.tags
+        cat $copy_tags
         echo "Key '$key' does not match. Expected: $expected_value, Actual: $actual_value"
         echo "Test failed"
         exit 1
     fi
 }
 
+echo "Testing"
+run_case 127.0.0.1 asdf --set-tag forceKey=forcedValue > single_file.log
+if ! grep "^METRICS " single_file.log | sed 's/^METRICS //' | jq -e '."receiver.files" == 1 and ."receiver.errors" == 0' > /dev/null; then
+    cat single_file.log
+    echo "Missing metrics summary of the file"
+    exit 1
+fi
+rm -f single_file.log
+if [ ! -e $copy_tags ]; then
+    echo "Failed to create tags file"
+    exit 1
+fi
 
 check_key "Filename" "test_dcm_copy"
 check_key "SenderAddress" "sender_address"
@@ -39,8 +67,354 @@ check_key "SenderAET" "sender_aet"
 check_key "ReceiverAET" "receiver_aet"
 check_key "SeriesInstanceUID" "$uid"
 check_key "forceKey" "forcedValue"
+clean_case
+
+echo "Testing headers-only parsing against full parsing"
+run_case
+mv $copy_tags headers_only.tags
+clean_case
+run_case "" "" --full-parse
+if ! diff headers_only.tags $copy_tags; then
+    echo "Tags differ between headers-only and full parsing"
+    exit 1
+fi
+rm -f headers_only.tags
+clean_case
+./getdcmtags-bench --benchmark-load 3 test_dcm
+
+echo "Testing JSON writer against reference implementation"
+./getdcmtags-bench --test-json-writer 2000
+./getdcmtags-bench --benchmark-json-writer 20000
 
-rm -f test_dcm_copy
-rm -rf $uid
+echo "Testing native engine against full parsing"
+mkdir -p engine_corpus
+cp test_dcm engine_corpus/
+./test_engines.sh engine_corpus ./getdcmtags
+rm -rf engine_corpus
+
+echo "Testing daemon mode"
+socket="$(pwd)/getdcmtags_test.sock"
+./getdcmtags --daemon "$socket" --metrics-port 18125 &
+daemon_pid=$!
+for i in $(seq 1 50); do
+    [ -S "$socket" ] && break
+    sleep 0.1
+done
+cp test_dcm test_dcm_copy
+./getdcmtags-client "$socket" ./getdcmtags test_dcm_copy sender_address sender_aet receiver_aet 127.0.0.1 asdf --set-tag forceKey=forcedValue
+python3 -c "import urllib.request; print(urllib.request.urlopen('http://127.0.0.1:18125/metrics').read().decode())" > daemon_metrics.txt
+kill $daemon_pid
+# The daemon spools the undelivered bookkeeper event before it terminates
+wait $daemon_pid
+if ! grep -q '^getdcmtags_files_total 1$' daemon_metrics.txt; then
+    cat daemon_metrics.txt
+    echo "Daemon metrics do not count the processed file"
+    exit 1
+fi
+rm -f daemon_metrics.txt
+if [ ! -e $copy_tags ]; then
+    echo "Failed to create tags file in daemon mode"
+    exit 1
+fi
+
+check_key "Filename" "test_dcm_copy"
+check_key "SenderAET" "sender_aet"
+check_key "SeriesInstanceUID" "$uid"
+check_key "forceKey" "forcedValue"
+clean_case
+
+echo "Testing batch mode"
+mkdir -p batch_test
+cp test_dcm batch_test/test_dcm_a
+cp test_dcm batch_test/test_dcm_b
+./getdcmtags --batch batch_test sender_address sender_aet receiver_aet 127.0.0.1 asdf --threads 2
+for name in test_dcm_a test_dcm_b; do
+    if [ ! -e batch_test/$(placed_file $name tags) ]; then
+        echo "Failed to create tags file for $name in batch mode"
+        exit 1
+    fi
+done
+rm -rf batch_test
+
+echo "Testing archive ingest"
+mkdir -p archive_test/study/series
+cp test_dcm archive_test/study/series/test_dcm_a
+cp test_dcm archive_test/study/series/test_dcm_b
+tar -czf archive_test.tar.gz -C archive_test study
+python3 -c "import sys, zipfile; zipfile.ZipFile(sys.argv[1], 'w', zipfile.ZIP_DEFLATED).write(sys.argv[2], 'study/test_dcm_c')" archive_test.zip test_dcm
+rm -rf archive_test
+mkdir -p archive_incoming
+./getdcmtags --archive - archive_incoming sender_address sender_aet receiver_aet "" "" --threads 2 < archive_test.tar.gz
+./getdcmtags --archive archive_test.zip archive_incoming sender_address sender_aet receiver_aet "" ""
+for name in study_series_test_dcm_a study_series_test_dcm_b study_test_dcm_c; do
+    if [ ! -e archive_incoming/$(placed_file $name tags) ] || ! cmp -s test_dcm archive_incoming/$(placed_file $name dcm); then
+        echo "Failed to process $name from archive"
+        exit 1
+    fi
+done
+rm -rf archive_incoming archive_test.tar.gz archive_test.zip
+
+echo "Testing series index"
+run_case "" "" --series-index exclusive
+if [ ! -e $uid/$uid.index ] || [ -e $copy_tags ]; then
+    echo "Failed to create series index without tags file"
+    exit 1
+fi
+if [ "$(head -n 1 $uid/$uid.index | jq -r '.tags.SeriesInstanceUID')" != "$uid" ] || \
+   [ "$(tail -n 1 $uid/$uid.index | jq -r '.file')" != "$uid#test_dcm_copy" ]; then
+    cat $uid/$uid.index
+    echo "Series index has unexpected content"
+    exit 1
+fi
+clean_case
+
+echo "Testing binary series index"
+for name in test_dcm_a test_dcm_b; do
+    cp test_dcm $name
+    ./getdcmtags $name sender_address sender_aet receiver_aet "" "" --series-index additional
+    cp test_dcm $name
+    ./getdcmtags $name sender_address sender_aet receiver_aet "" "" --series-index additional --series-index-format binary
+done
+if [ ! -e $uid/$uid.index.bin ]; then
+    echo "Failed to create binary series index"
+    exit 1
+fi
+./getdcmtags --dump-series-index $uid/$uid.index.bin > binary_index.json
+if ! diff <(jq -cS . $uid/$uid.index) <(jq -cS . binary_index.json); then
+    echo "Binary series index differs from JSON series index"
+    exit 1
+fi
+rm -rf $uid binary_index.json
+
+echo "Testing durability policy"
+run_case "" "" --durability directory
+if [ ! -e $copy_dcm ] || [ ! -e $copy_tags ] || [ -e test_dcm_copy ]; then
+    echo "Failed to place file with durability policy"
+    exit 1
+fi
+clean_case
+
+echo "Testing duplicate detection"
+rm -f .instance_index .instance_index.old
+run_case "" "" --duplicates flag
+check_key "Filename" "test_dcm_copy"
+if [ "$(jq -r '.Duplicate // "none"' $copy_tags)" != "none" ]; then
+    echo "First instance flagged as duplicate"
+    exit 1
+fi
+run_case "" "" --duplicates flag
+check_key "Duplicate" "true"
+clean_case
+run_case "" "" --duplicates drop
+if [ -e test_dcm_copy ] || [ -e $uid ]; then
+    echo "Failed to drop duplicate instance"
+    exit 1
+fi
+rm -f .instance_index .instance_index.old
+# A replaced copy that is still waiting keeps its single record in the series index
+run_case "" "" --duplicates replace --series-index additional
+run_case "" "" --duplicates replace --series-index additional
+if [ ! -e $copy_dcm ] || [ "$(wc -l < $uid/$uid.index)" != 1 ]; then
+    cat $uid/$uid.index
+    echo "Replaced duplicate has been added to the series index again"
+    exit 1
+fi
+clean_case
+rm -f .instance_index .instance_index.old
+
+echo "Testing series events"
+rm -f .series_events
+run_case "" "" --series-events
+if ! grep -qE "^I [0-9]+ $uid\$" .series_events; then
+    cat .series_events
+    echo "Failed to write series event"
+    exit 1
+fi
+rm -f .series_events
+clean_case
+
+echo "Testing tag plan"
+printf 'PatientWeight\n' > dcm_extra_tags
+./getdcmtags --compile-tag-plan
+if [ ! -s dcm_extra_tags.plan ]; then
+    echo "Failed to compile tag plan"
+    exit 1
+fi
+run_case
+if ! jq -e 'has("PatientWeight")' $copy_tags > /dev/null; then
+    cat $copy_tags
+    echo "Extra tag of the plan missing in tags file"
+    exit 1
+fi
+clean_case
+# The plan is rebuilt by getdcmtags when the configured tags change
+plan_checksum=$(md5sum < dcm_extra_tags.plan)
+printf 'PatientWeight\n0010,1020\n' > dcm_extra_tags
+run_case
+if ! jq -e 'has("PatientSize")' $copy_tags > /dev/null || [ "$(md5sum < dcm_extra_tags.plan)" == "$plan_checksum" ]; then
+    echo "Tag plan has not been rebuilt after the extra tags changed"
+    exit 1
+fi
+rm -f dcm_extra_tags dcm_extra_tags.plan
+clean_case
+
+echo "Testing pixel data fingerprint"
+run_case "" "" --fingerprint sha256
+# The pixel data of test_dcm starts at offset 1088 and has a length of 10000 bytes
+expected_sha256=$(tail -c +1089 test_dcm | head -c 10000 | sha256sum | cut -d ' ' -f 1)
+if ! jq -e --arg sha256 "$expected_sha256" '.PixelDataSHA256 == $sha256 and (.PixelDataXXH64 | test("^[0-9a-f]{16}$"))' $copy_tags > /dev/null; then
+    cat $copy_tags
+    echo "Pixel data fingerprint missing or wrong"
+    exit 1
+fi
+clean_case
+
+echo "Testing admission control"
+run_case "" "" --admission-slots 1 --admission-rule SenderAET=sender_aet:0
+if [ ! -f $copy_dcm ] || ! ./getdcmtags --admission-status . | jq -e '."admission.admitted" == 1 and ."admission.active" == 0' > /dev/null; then
+    ./getdcmtags --admission-status .
+    echo "File has not been admitted"
+    exit 1
+fi
+rm -f .admission
+clean_case
+
+echo "Testing study rollup"
+run_case "" "" --study-rollup
+run_case "" "" --study-rollup
+study_uid="1.2.276.0.7230010.3.1.2.5423824457620332023071299989331600595403"
+if ! ./getdcmtags --dump-study-rollup . "$study_uid" | jq -e --arg uid "$uid" '.instances == 2 and (.series | length) == 1 and .series[0].series_uid == $uid and .series[0].instances == 2 and .first_arrival <= .last_arrival' > /dev/null; then
+    ./getdcmtags --dump-study-rollup .
+    echo "Study rollup missing or wrong"
+    exit 1
+fi
+rm -f .study_rollup
+clean_case
+
+echo "Testing transfer syntax normalization"
+run_case "" "" --transcode implicit-little --transcode-threads 2
+# test_dcm is stored as explicit little endian, the pixel data must be unchanged by the conversion
+if ! dcmdump +P TransferSyntaxUID $copy_dcm | grep -q "=LittleEndianImplicit" || ! cmp <(tail -c 10000 test_dcm) <(tail -c 10000 $copy_dcm); then
+    dcmdump +P TransferSyntaxUID $copy_dcm
+    echo "File has not been converted"
+    exit 1
+fi
+clean_case
+run_case "" "" --transcode implicit-little --transcode-rule ReceiverAET=other_aet
+if ! cmp test_dcm $copy_dcm; then
+    echo "File has been converted although no rule matches"
+    exit 1
+fi
+clean_case
+
+echo "Testing error journal"
+rm -rf error .error_journal
+echo "not a dicom file" > bad_dcm
+if ./getdcmtags bad_dcm sender_address sender_aet receiver_aet "" "" > /dev/null; then
+    echo "Invalid file has been accepted"
+    exit 1
+fi
+if [ ! -f error/bad_dcm.dcm ] || [ "$(stat -c %s .error_journal)" != 1024 ] || ! grep -q "Unable to read DICOM file bad_dcm" .error_journal \
+    || [ -n "$(find . -maxdepth 2 -name '*.error*' -not -name .error_journal)" ]; then
+    echo "Failed file has not been recorded in the error journal"
+    exit 1
+fi
+rm -rf error .error_journal
+echo "not a dicom file" > bad_dcm
+./getdcmtags bad_dcm sender_address sender_aet receiver_aet "" "" --legacy-error-files > /dev/null || true
+if [ ! -f error/bad_dcm.dcm.error ] || [ -e .error_journal ]; then
+    echo "Legacy error file missing"
+    exit 1
+fi
+rm -rf error
+
+echo "Testing embedded storage SCP"
+mkdir -p scp_incoming
+./getdcmtags --scp 18124 scp_incoming "" "" --threads 2 --set-tag forceKey=forcedValue &
+scp_pid=$!
+sleep 1
+storescu -aet sender_aet -aec receiver_aet localhost 18124 test_dcm
+storescu -aet sender_aet -aec receiver_aet localhost 18124 test_dcm
+kill $scp_pid
+tags_file=$(ls scp_incoming/$uid/*.tags | head -n 1)
+if [ $(ls scp_incoming/$uid/*.dcm | wc -l) -ne 1 ] || [ -z "$tags_file" ]; then
+    ls -R scp_incoming
+    echo "Failed to receive file with embedded storage SCP"
+    exit 1
+fi
+if [ "$(jq -r '.SenderAET' $tags_file)" != "sender_aet" ] || [ "$(jq -r '.ReceiverAET' $tags_file)" != "receiver_aet" ] || \
+   [ "$(jq -r '.forceKey' $tags_file)" != "forcedValue" ]; then
+    cat $tags_file
+    echo "Tags file of embedded storage SCP has unexpected content"
+    exit 1
+fi
+if ! cmp <(dcmdump +P SOPInstanceUID test_dcm) <(dcmdump +P SOPInstanceUID scp_incoming/$uid/*.dcm); then
+    echo "Received file differs from sent file"
+    exit 1
+fi
+rm -rf scp_incoming
+
+echo "Testing concurrent associations with durability policy"
+mkdir -p scp_incoming scp_parallel
+for i in 1 2 3 4; do
+    cp test_dcm scp_parallel/instance_$i
+    dcmodify -nb -gin scp_parallel/instance_$i
+done
+./getdcmtags --scp 18124 scp_incoming "" "" --threads 4 --durability directory &
+scp_pid=$!
+sleep 1
+send_pids=()
+for i in 1 2 3 4; do
+    storescu -aet sender_aet -aec receiver_aet localhost 18124 scp_parallel/instance_$i &
+    send_pids+=($!)
+done
+# Every instance that has been acknowledged has to be in place with its .tags file
+for i in 1 2 3 4; do
+    if ! wait ${send_pids[$((i - 1))]}; then
+        echo "Instance $i has not been acknowledged"
+        kill $scp_pid
+        exit 1
+    fi
+    sop=$(dcmdump +P SOPInstanceUID scp_parallel/instance_$i | sed 's/.*\[\(.*\)\].*/\1/')
+    dcm_file=$(ls scp_incoming/$uid/$uid#*.$sop.dcm 2> /dev/null || true)
+    if [ -z "$dcm_file" ] || [ ! -f "${dcm_file%.dcm}.tags" ]; then
+        ls -R scp_incoming
+        echo "Acknowledged instance $sop is missing"
+        kill $scp_pid
+        exit 1
+    fi
+done
+kill $scp_pid
+rm -rf scp_incoming scp_parallel
+
+echo "Testing bookkeeper notification"
+python3 - 18123 > bookkeeper_stub.log <<'EOF_STUB' &
+import sys
+from http.server import BaseHTTPRequestHandler, HTTPServer
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers["Content-Length"]))
+        print(self.path, self.headers["Authorization"], body.decode(), flush=True)
+        self.send_response(200)
+        self.send_header("Content-Length", "2")
+        self.end_headers()
+        self.wfile.write(b"{}")
+    def log_message(self, *args):
+        pass
+HTTPServer(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
+EOF_STUB
+stub_pid=$!
+sleep 1
+run_case 127.0.0.1:18123 asdf
+kill $stub_pid
+if ! grep -q "/register-dicom-batch Token asdf .*$uid#test_dcm_copy" bookkeeper_stub.log; then
+    cat bookkeeper_stub.log
+    echo "Bookkeeper did not receive the file registration"
+    exit 1
+fi
+rm -f bookkeeper_stub.log
+rm -rf .bookkeeper
+clean_case
 
 echo "Success"
\ No newline at end of file
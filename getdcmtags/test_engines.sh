@@ -0,0 +1,60 @@
+#!/bin/bash
+set -euo pipefail
+
+# Differential test of the native scanner engine against the full DCMTK parse. Every file of the
+# given corpus is processed with both engines. Both must either place the file, in which case the
+# resulting .tags files are compared, or reject it into the error folder.
+# Usage: ./test_engines.sh [folder with DICOM files] [getdcmtags binary]
+
+corpus="${1:-.}"
+binary="$(realpath "${2:-./getdcmtags}")"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# "placed" if a .tags file has been written, "rejected" if the file has been moved into the error
+# folder (recorded in the error journal, or with a .dcm.error file in legacy mode)
+placement_outcome() {
+    local folder="$1"
+    local name="$2"
+    if [ -n "$(find "$folder" -name "*#$name.tags")" ]; then
+        echo "placed"
+    elif [ -f "$folder/error/$name.dcm" ]; then
+        echo "rejected"
+    else
+        echo "missing"
+    fi
+}
+
+failed=0
+count=0
+for file in "$corpus"/*; do
+    [ -f "$file" ] || continue
+    name="$(basename "$file")"
+    for engine in dcmtk native; do
+        mkdir -p "$work/$engine"
+        cp "$file" "$work/$engine/$name"
+        if [ "$engine" == "native" ]; then
+            args="--engine native"
+        else
+            args="--full-parse"
+        fi
+        # Rejected files are reported with a non-zero exit code
+        "$binary" "$work/$engine/$name" sender_address sender_aet receiver_aet "" "" $args > /dev/null || true
+    done
+    count=$((count+1))
+    dcmtk_outcome="$(placement_outcome "$work/dcmtk" "$name")"
+    native_outcome="$(placement_outcome "$work/native" "$name")"
+    dcmtk_tags="$(find "$work/dcmtk" -name "*#$name.tags")"
+    native_tags="$(find "$work/native" -name "*#$name.tags")"
+    if [ "$dcmtk_outcome" != "$native_outcome" ] || [ "$dcmtk_outcome" == "missing" ]; then
+        echo "Engines produced different outcomes for $name (dcmtk: $dcmtk_outcome, native: $native_outcome)"
+        failed=$((failed+1))
+    elif [ "$dcmtk_outcome" == "placed" ] && ! diff "$dcmtk_tags" "$native_tags"; then
+        echo "Tags differ between engines for $name"
+        failed=$((failed+1))
+    fi
+    rm -rf "$work/dcmtk" "$work/native"
+done
+
+echo "Compared $count files, $failed differences"
+[ $failed -eq 0 ]
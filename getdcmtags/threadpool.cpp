@@ -0,0 +1,113 @@
+#include "threadpool.h"
+
+WorkStealingPool::WorkStealingPool(int threadCount)
+    : queuedTasks(0), pendingTasks(0), nextQueue(0), stopping(false)
+{
+    if (threadCount < 1)
+    {
+        threadCount = 1;
+    }
+    for (int i = 0; i < threadCount; i++)
+    {
+        queues.emplace_back(new WorkerQueue());
+    }
+    for (int i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::submit(Task task)
+{
+    size_t target;
+    {
+        // Count the task before it becomes visible, so that workers never see a negative count
+        std::lock_guard<std::mutex> lock(stateMutex);
+        queuedTasks++;
+        pendingTasks++;
+        target = nextQueue++ % queues.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(std::move(task));
+    }
+    taskAvailable.notify_one();
+}
+
+void WorkStealingPool::wait()
+{
+    std::unique_lock<std::mutex> lock(stateMutex);
+    allDone.wait(lock, [this] { return pendingTasks == 0; });
+}
+
+bool WorkStealingPool::popTask(int worker, Task &task)
+{
+    {
+        WorkerQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        WorkerQueue &victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(int worker)
+{
+    while (true)
+    {
+        Task task;
+        if (popTask(worker, task))
+        {
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                queuedTasks--;
+            }
+            task(worker);
+            std::lock_guard<std::mutex> lock(stateMutex);
+            if (--pendingTasks == 0)
+            {
+                allDone.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(stateMutex);
+        if (stopping && queuedTasks == 0)
+        {
+            return;
+        }
+        taskAvailable.wait(lock, [this] { return queuedTasks > 0 || stopping; });
+        if (stopping && queuedTasks == 0)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef GETDCMTAGS_THREADPOOL_H
+#define GETDCMTAGS_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size thread pool with one task queue per worker. Workers take tasks from the front of
+// their own queue and steal from the back of the other queues once their own queue is empty,
+// so that slow files (e.g., large multi-frame images) do not stall the remaining work.
+class WorkStealingPool
+{
+public:
+    // Tasks receive the index of the executing worker, so that callers can keep per-worker state
+    typedef std::function<void(int worker)> Task;
+
+    explicit WorkStealingPool(int threadCount);
+    ~WorkStealingPool();
+
+    void submit(Task task);
+
+    // Blocks until all submitted tasks have been executed
+    void wait();
+
+    int size() const { return (int)threads.size(); }
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool popTask(int worker, Task &task);
+    void workerLoop(int worker);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex stateMutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allDone;
+    long queuedTasks;
+    long pendingTasks;
+    size_t nextQueue;
+    bool stopping;
+};
+
+#endif
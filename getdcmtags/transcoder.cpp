@@ -0,0 +1,311 @@
+#include "transcoder.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/dcmdata/dcrledrg.h"
+#ifdef GETDCMTAGS_TRANSCODE
+#include "dcmtk/dcmjpeg/djdecode.h"
+#include "dcmtk/dcmjpls/djdecode.h"
+#endif
+
+bool parseTranscodeTarget(const char *value, E_TransferSyntax &target)
+{
+    if (strcmp(value, "explicit-little") == 0)
+    {
+        target = EXS_LittleEndianExplicit;
+    }
+    else if (strcmp(value, "implicit-little") == 0)
+    {
+        target = EXS_LittleEndianImplicit;
+    }
+    else if (strcmp(value, "deflated") == 0)
+    {
+        target = EXS_DeflatedLittleEndianExplicit;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+bool parseTranscodeRule(const char *text, TranscodeRule &rule)
+{
+    std::string value(text);
+    size_t equals = value.find('=');
+    if (equals == std::string::npos || equals == 0)
+    {
+        return false;
+    }
+    rule.name = value.substr(0, equals);
+    rule.value = value.substr(equals + 1);
+    return true;
+}
+
+// Name under which the conversions from the transfer syntax are counted
+static const char *codecName(E_TransferSyntax xfer)
+{
+    switch (xfer)
+    {
+    case EXS_LittleEndianImplicit:
+        return "implicit-little";
+    case EXS_LittleEndianExplicit:
+        return "explicit-little";
+    case EXS_BigEndianExplicit:
+        return "explicit-big";
+    case EXS_DeflatedLittleEndianExplicit:
+        return "deflated";
+    case EXS_JPEGProcess1:
+        return "jpeg-baseline";
+    case EXS_JPEGProcess2_4:
+        return "jpeg-extended";
+    case EXS_JPEGProcess14:
+    case EXS_JPEGProcess14SV1:
+        return "jpeg-lossless";
+    case EXS_JPEGLSLossless:
+    case EXS_JPEGLSLossy:
+        return "jpeg-ls";
+    case EXS_RLELossless:
+        return "rle";
+    case EXS_JPEG2000LosslessOnly:
+    case EXS_JPEG2000:
+        return "jpeg2000";
+    default:
+        return "other";
+    }
+}
+
+static uint64_t threadCpuMicroseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// The decoders are registered once for the process. DCMTK protects the codec list with a
+// read/write lock, so the datasets of different files can be converted concurrently. The RLE
+// decoder is part of dcmdata, the JPEG and JPEG-LS decoders are only linked if enabled in the build.
+static void registerDecoders()
+{
+    static std::once_flag registered;
+    std::call_once(registered, [] {
+#ifdef GETDCMTAGS_TRANSCODE
+        DJDecoderRegistration::registerCodecs();
+        DJLSDecoderRegistration::registerCodecs();
+#endif
+        DcmRLEDecoderRegistration::registerCodecs();
+    });
+}
+
+void Transcoder::usePool(int threads)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!pool)
+    {
+        poolThreads = threads < 1 ? 1 : threads;
+    }
+}
+
+bool Transcoder::transcode(const std::string &filename, E_TransferSyntax target, bool &converted, std::string &error)
+{
+    registerDecoders();
+    WorkStealingPool *executor = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (poolThreads > 0 && !pool)
+        {
+            pool.reset(new WorkStealingPool(poolThreads));
+        }
+        executor = pool.get();
+    }
+    if (executor == nullptr)
+    {
+        return convert(filename, target, converted, error);
+    }
+    std::promise<bool> result;
+    executor->submit([&](int) { result.set_value(convert(filename, target, converted, error)); });
+    return result.get_future().get();
+}
+
+bool Transcoder::convert(const std::string &filename, E_TransferSyntax target, bool &converted, std::string &error)
+{
+    converted = false;
+    uint64_t cpuStart = threadCpuMicroseconds();
+    struct stat info;
+    uint64_t inputBytes = (stat(filename.c_str(), &info) == 0) ? info.st_size : 0;
+
+    DcmFileFormat fileFormat;
+    OFCondition status = fileFormat.loadFile(filename.c_str());
+    if (status.bad())
+    {
+        error = std::string("Unable to load file: ") + status.text();
+        return false;
+    }
+    DcmDataset *dataset = fileFormat.getDataset();
+    E_TransferSyntax source = dataset->getOriginalXfer();
+    if (source == target)
+    {
+        return true;
+    }
+
+    auto decodeStart = std::chrono::steady_clock::now();
+    status = dataset->chooseRepresentation(target, nullptr);
+    auto decodeEnd = std::chrono::steady_clock::now();
+    bool success = status.good() && dataset->canWriteXfer(target, source);
+    if (!success)
+    {
+        error = std::string("No codec for conversion from ") + DcmXfer(source).getXferName();
+        if (status.bad())
+        {
+            error += std::string(": ") + status.text();
+        }
+    }
+
+    uint64_t decodedBytes = 0;
+    DcmElement *pixelData = nullptr;
+    if (success && dataset->findAndGetElement(DCM_PixelData, pixelData).good() && pixelData != nullptr)
+    {
+        decodedBytes = pixelData->getLength(target);
+    }
+
+    // The converted file replaces the placed file in one step, so that readers see either of them
+    std::string temporary;
+    if (success)
+    {
+        std::vector<char> name(filename.begin(), filename.end());
+        const char suffix[] = ".transcoding.XXXXXX";
+        name.insert(name.end(), suffix, suffix + sizeof(suffix));
+        int fd = mkstemp(name.data());
+        if (fd < 0)
+        {
+            error = std::string("Unable to create temporary file: ") + strerror(errno);
+            success = false;
+        }
+        else
+        {
+            close(fd);
+            temporary = name.data();
+        }
+    }
+    if (success)
+    {
+        status = fileFormat.saveFile(temporary.c_str(), target, EET_ExplicitLength, EGL_recalcGL);
+        if (status.bad())
+        {
+            error = std::string("Unable to write converted file: ") + status.text();
+            success = false;
+        }
+        else if (rename(temporary.c_str(), filename.c_str()) != 0)
+        {
+            error = std::string("Unable to replace file: ") + strerror(errno);
+            success = false;
+        }
+    }
+    if (!success && !temporary.empty())
+    {
+        remove(temporary.c_str());
+    }
+    converted = success;
+
+    uint64_t cpuMicroseconds = threadCpuMicroseconds() - cpuStart;
+    std::lock_guard<std::mutex> lock(mutex);
+    CodecStatistics &codec = statistics[codecName(source)];
+    if (!success)
+    {
+        codec.failures++;
+        return false;
+    }
+    codec.files++;
+    codec.inputBytes += inputBytes;
+    codec.decodedBytes += decodedBytes;
+    codec.decodeMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(decodeEnd - decodeStart).count();
+    codec.cpuMicroseconds += cpuMicroseconds;
+    return true;
+}
+
+static double megabytesPerSecond(uint64_t bytes, uint64_t microseconds)
+{
+    return microseconds > 0 ? (double)bytes / microseconds : 0.0;
+}
+
+std::string Transcoder::prometheus()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (statistics.empty())
+    {
+        return "";
+    }
+    std::ostringstream out;
+    struct Counter
+    {
+        const char *name;
+        const char *help;
+        uint64_t CodecStatistics::*value;
+        double scale;
+    };
+    static const Counter counters[] = {
+        {"getdcmtags_transcode_files_total", "Files converted to the target transfer syntax.", &CodecStatistics::files, 1},
+        {"getdcmtags_transcode_failures_total", "Files that could not be converted.", &CodecStatistics::failures, 1},
+        {"getdcmtags_transcode_input_bytes_total", "Size of the converted files as received.", &CodecStatistics::inputBytes, 1},
+        {"getdcmtags_transcode_decoded_bytes_total", "Size of the decoded pixel data.", &CodecStatistics::decodedBytes, 1},
+        {"getdcmtags_transcode_decode_seconds_total", "Time spent decoding the pixel data.",
+         &CodecStatistics::decodeMicroseconds, 1e-6},
+        {"getdcmtags_transcode_cpu_seconds_total", "CPU time used for loading, converting and writing the files.",
+         &CodecStatistics::cpuMicroseconds, 1e-6},
+    };
+    for (const Counter &counter : counters)
+    {
+        out << "# HELP " << counter.name << " " << counter.help << "\n"
+            << "# TYPE " << counter.name << " counter\n";
+        for (const auto &codec : statistics)
+        {
+            out << counter.name << "{codec=\"" << codec.first << "\"} " << codec.second.*counter.value * counter.scale
+                << "\n";
+        }
+    }
+    out << "# HELP getdcmtags_transcode_threads Threads of the conversion pool (0 if converted by the receiving thread).\n"
+        << "# TYPE getdcmtags_transcode_threads gauge\n"
+        << "getdcmtags_transcode_threads " << poolThreads << "\n";
+    return out.str();
+}
+
+std::string Transcoder::summary(double elapsedSeconds)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    uint64_t cpuMicroseconds = 0;
+    const char *separator = "";
+    for (const auto &codec : statistics)
+    {
+        out << separator << codec.first << " " << codec.second.files << " files";
+        if (codec.second.failures > 0)
+        {
+            out << " (" << codec.second.failures << " failed)";
+        }
+        out << " " << megabytesPerSecond(codec.second.decodedBytes, codec.second.decodeMicroseconds) << " MB/s decoded";
+        cpuMicroseconds += codec.second.cpuMicroseconds;
+        separator = ", ";
+    }
+    int threads = poolThreads > 0 ? poolThreads : 1;
+    out << "; CPU " << cpuMicroseconds / 1e6 << " s";
+    if (elapsedSeconds > 0)
+    {
+        out << " = " << 100.0 * cpuMicroseconds / 1e6 / (threads * elapsedSeconds) << "% of " << threads
+            << (threads == 1 ? " thread" : " threads");
+    }
+    return out.str();
+}
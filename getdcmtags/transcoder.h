@@ -0,0 +1,83 @@
+#ifndef GETDCMTAGS_TRANSCODER_H
+#define GETDCMTAGS_TRANSCODER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "dcmtk/dcmdata/dcxfer.h"
+
+#include "threadpool.h"
+
+// Parses "explicit-little", "implicit-little" or "deflated". Returns false for other values.
+bool parseTranscodeTarget(const char *value, E_TransferSyntax &target);
+
+// Restricts transcoding to the files whose receiver argument or tag matches, e.g.
+// "ReceiverAET=AI_NODE". Files are transcoded if any of the rules matches.
+struct TranscodeRule
+{
+    std::string name;
+    std::string value;
+};
+
+// Parses "Name=Value". Returns false if the name or the "=" is missing.
+bool parseTranscodeRule(const char *value, TranscodeRule &rule);
+
+// Converts the placed files into the target transfer syntax with the DCMTK codecs (RLE decoder
+// and native encodings, plus the JPEG and JPEG-LS decoders if built with GETDCMTAGS_TRANSCODE), so
+// that the processing modules do not need to decode the images again for every rule. The converted file is written into a temporary file
+// next to the original, which is then renamed over it. Files whose transfer syntax cannot be
+// decoded are left unchanged.
+//
+// Decoding is CPU bound and takes much longer than reading the tags, so in batch, archive and SCP
+// mode the work is handed to a separate pool with a fixed number of threads. The thread that
+// processes the file waits for the result before writing the .tags file, so that the router
+// never sees a series before its files have been converted, but at most the given number of
+// files are decoded at the same time.
+class Transcoder
+{
+public:
+    Transcoder() = default;
+    Transcoder(const Transcoder &) = delete;
+    Transcoder &operator=(const Transcoder &) = delete;
+
+    // Hands the following conversions to a pool of the given size, which is started with the
+    // first conversion. Without a pool, files are converted by the calling thread.
+    void usePool(int threads);
+
+    // Converts the file if its transfer syntax differs from the target. Sets converted if the
+    // file has been replaced. Returns false and describes the problem if the file could not be
+    // converted, in which case the original file is kept.
+    bool transcode(const std::string &filename, E_TransferSyntax target, bool &converted, std::string &error);
+
+    // Counters per source transfer syntax ("codec") as Prometheus text
+    std::string prometheus();
+
+    // One line with the decode throughput per codec and the share of the CPU budget of the pool
+    // (threads x elapsed time) that has been used, for the summary of batch mode
+    std::string summary(double elapsedSeconds);
+
+private:
+    struct CodecStatistics
+    {
+        uint64_t files = 0;
+        uint64_t failures = 0;
+        // Size of the files before and of the pixel data after the conversion
+        uint64_t inputBytes = 0;
+        uint64_t decodedBytes = 0;
+        uint64_t decodeMicroseconds = 0;
+        // CPU time of the thread for loading, converting and writing the file
+        uint64_t cpuMicroseconds = 0;
+    };
+
+    bool convert(const std::string &filename, E_TransferSyntax target, bool &converted, std::string &error);
+
+    std::mutex mutex;
+    int poolThreads = 0;
+    std::unique_ptr<WorkStealingPool> pool;
+    std::map<std::string, CodecStatistics> statistics;
+};
+
+#endif